@@ -0,0 +1,24 @@
+#! /bin/bash
+# Single client put and read throughput of striped files by stripe width.
+# Run after start_bfs.sh: bash ./stripe_bench.sh [file_size_in_MB] [file_count]
+set -e
+
+size_mb=${1:-1024}
+count=${2:-4}
+
+cp -f ../mark ./
+
+echo -e "width\tput MB/s\tread MB/s"
+for width in 0 2 4 8;
+do
+    folder=stripe_bench_$width
+    start=`date +%s.%N`
+    ./mark --mode=put --thread=1 --count=$count --file_size=$((size_mb*1024)) \
+        --folder=$folder --stripe_width=$width > /dev/null
+    put_time=`echo "$(date +%s.%N) - $start" | bc`
+    start=`date +%s.%N`
+    ./mark --mode=read --thread=1 --count=$count --folder=$folder > /dev/null
+    read_time=`echo "$(date +%s.%N) - $start" | bc`
+    echo -e "$width\t`echo "$size_mb * $count / $put_time" | bc`\t`echo "$size_mb * $count / $read_time" | bc`"
+    ./bfs_client rmr /$folder > /dev/null
+done
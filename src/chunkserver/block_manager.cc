@@ -7,66 +7,184 @@
 #include "chunkserver/block_manager.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <algorithm>
+#include <functional>
 #include <boost/bind.hpp>
 
 #include <gflags/gflags.h>
 #include <leveldb/db.h>
 #include <leveldb/cache.h>
+#include <leveldb/write_batch.h>
 #include <common/counter.h>
 #include <common/logging.h>
 #include <common/string_util.h>
 
 #include "chunkserver/data_block.h"
+#include "chunkserver/disk_scheduler.h"
 #include "chunkserver/file_cache.h"
+#include "chunkserver/file_syncer.h"
+#include "chunkserver/journal.h"
+#include "chunkserver/io_throttle.h"
+#include "chunkserver/meta_committer.h"
 
 DECLARE_int32(chunkserver_file_cache_size);
 DECLARE_int32(chunkserver_use_root_partition);
 DECLARE_int32(chunkserver_io_thread_num);
+DECLARE_int32(chunkserver_disk_read_thread_num);
+DECLARE_int32(chunkserver_disk_max_pending_reads);
+DECLARE_string(chunkserver_disk_select_policy);
+DECLARE_bool(chunkserver_sync_meta);
+DECLARE_int32(chunkserver_meta_batch_ops);
+DECLARE_int32(chunkserver_sync_batch_files);
+DECLARE_string(chunkserver_journal_path);
+DECLARE_int32(chunkserver_journal_size);
+DECLARE_bool(chunkserver_background_verify);
+DECLARE_int32(chunkserver_block_compact_interval);
+DECLARE_int32(chunkserver_memory_limit);
 
 namespace baidu {
 namespace bfs {
 
 extern common::Counter g_blocks;
 extern common::Counter g_data_size;
+extern common::Counter g_memory_data;
 extern common::Counter g_find_ops;
 
+/// Meta of the block copy to remove if a move is interrupted,
+/// sorts before the version key so block iteration skips it
+static std::string MoveRecordKey() {
+    std::string key(8, '\0');
+    key.append("move");
+    return key;
+}
+
+/// Written at clean shutdown, when every block file matches its meta
+static std::string CleanShutdownKey() {
+    std::string key(8, '\0');
+    key.append("clean");
+    return key;
+}
+
+/// Namespace version, sorts before all block metas
+static std::string VersionKey() {
+    std::string key(8, '\0');
+    key.append("version");
+    return key;
+}
+
 BlockManager::BlockManager(const std::string& store_path)
-   : metadb_(NULL),
-     namespace_version_(0), disk_quota_(0) {
+   : disk_info_time_(0), journal_(NULL), trash_bytes_(0),
+     namespace_version_(0), disk_quota_(0), ssd_quota_(0) {
      CheckStorePath(store_path);
-     thread_pool_ = new ThreadPool(FLAGS_chunkserver_io_thread_num);
+     disk_selector_ = DiskSelector::Create(FLAGS_chunkserver_disk_select_policy);
+     if (disk_selector_ == NULL) {
+         LOG(WARNING, "Unknown disk select policy: %s, use hash",
+             FLAGS_chunkserver_disk_select_policy.c_str());
+         disk_selector_ = new HashDiskSelector();
+     }
+     disk_scheduler_ = new DiskScheduler(store_path_list_,
+                                         FLAGS_chunkserver_io_thread_num,
+                                         FLAGS_chunkserver_disk_read_thread_num,
+                                         FLAGS_chunkserver_disk_max_pending_reads);
      file_cache_ = new FileCache(FLAGS_chunkserver_file_cache_size);
+     background_thread_ = new ThreadPool(1);
+     stop_background_ = false;
+     unverified_.resize(store_path_list_.size());
 }
 BlockManager::~BlockManager() {
+    stop_background_ = true;
+    background_thread_->Stop(false);
+    delete background_thread_;
     MutexLock lock(&mu_);
-    for (BlockMap::iterator it = block_map_.begin(); it != block_map_.end(); ++it) {
-        Block* block = it->second;
-        if (!block->IsRecover()) {
-            CloseBlock(block);
-        } else {
-            LOG(INFO, "[~BlockManager] Do not close recovering block #%ld ", block->Id());
+    bool closed = true;
+    for (int32_t i = 0; i < kBlockMapShardNum; i++) {
+        BlockMapShard& shard = block_map_[i];
+        MutexLock shard_lock(&shard.mu);
+        for (std::map<int64_t, Block*>::iterator it = shard.blocks.begin();
+             it != shard.blocks.end(); ++it) {
+            Block* block = it->second;
+            if (!block->IsRecover()) {
+                if (!block->IsFinished() && !CloseBlock(block)) {
+                    closed = false;
+                }
+            } else {
+                LOG(INFO, "[~BlockManager] Do not close recovering block #%ld ", block->Id());
+            }
+            block->DecRef();
         }
-        block->DecRef();
+        shard.blocks.clear();
+        for (std::map<int64_t, SealedBlock>::iterator it = shard.sealed.begin();
+             it != shard.sealed.end(); ++it) {
+            g_blocks.Dec();
+            g_data_size.Sub(it->second.size);
+        }
+        shard.sealed.clear();
     }
-    thread_pool_->Stop(true);
-    delete thread_pool_;
-    block_map_.clear();
-    delete metadb_;
-    metadb_ = NULL;
+    disk_scheduler_->Stop();
+    delete disk_scheduler_;
+    delete disk_selector_;
+    if (closed) {
+        // Block files and metas agree now, the next start may skip checking files
+        sync();
+        leveldb::WriteOptions options;
+        options.sync = true;
+        for (size_t i = 0; i < metadbs_.size(); i++) {
+            if (metadbs_[i] && unverified_[i].empty()) {
+                metadbs_[i]->Put(options, CleanShutdownKey(), "");
+            }
+        }
+    }
+    for (size_t i = 0; i < meta_committers_.size(); i++) {
+        delete meta_committers_[i];
+    }
+    meta_committers_.clear();
+    for (size_t i = 0; i < file_syncers_.size(); i++) {
+        delete file_syncers_[i];
+    }
+    file_syncers_.clear();
+    if (journal_) {
+        journal_->Checkpoint();
+        delete journal_;
+        journal_ = NULL;
+    }
+    for (size_t i = 0; i < metadbs_.size(); i++) {
+        delete metadbs_[i];
+    }
+    metadbs_.clear();
     delete file_cache_;
     file_cache_ = NULL;
 }
 int64_t BlockManager::DiskQuota() const{
     return disk_quota_;
 }
+int64_t BlockManager::SsdQuota() const {
+    return ssd_quota_;
+}
+
+/// Strip the media tag in front of a store path
+static StorageMedia ParseMediaTag(std::string* path) {
+    if (strncasecmp(path->c_str(), "[ssd]", 5) == 0) {
+        path->erase(0, 5);
+        return kMediaSsd;
+    } else if (strncasecmp(path->c_str(), "[hdd]", 5) == 0) {
+        path->erase(0, 5);
+    }
+    return kMediaHdd;
+}
 
 void BlockManager::CheckStorePath(const std::string& store_path) {
     int64_t disk_quota = 0;
+    int64_t ssd_quota = 0;
     common::SplitString(store_path, ",", &store_path_list_);
     std::map<std::string, std::string> fs_map;
+    std::map<std::string, StorageMedia> media_map;
     std::string fsid_str;
     struct statfs fs_info;
     int stat_ret = statfs("/home", &fs_info);
@@ -80,6 +198,7 @@ void BlockManager::CheckStorePath(const std::string& store_path) {
     for (uint32_t i = 0; i < store_path_list_.size(); ++i) {
         std::string& disk_path = store_path_list_[i];
         disk_path = common::TrimString(disk_path, " ");
+        StorageMedia media = ParseMediaTag(&disk_path);
         if (disk_path.empty() || disk_path[disk_path.size() - 1] != '/') {
             disk_path += "/";
         }
@@ -90,12 +209,16 @@ void BlockManager::CheckStorePath(const std::string& store_path) {
             int64_t user_quota = fs_info.f_bavail * fs_info.f_bsize;
             int64_t super_quota = fs_info.f_bfree * fs_info.f_bsize;
             fs_map[fsid_str] = disk_path;
-            LOG(INFO, "Use store path: %s block: %ld disk: %s available %s quota: %s",
-                disk_path.c_str(), fs_info.f_bsize,
+            LOG(INFO, "Use %s store path: %s block: %ld disk: %s available %s quota: %s",
+                StorageMedia_Name(media).c_str(), disk_path.c_str(), fs_info.f_bsize,
                 common::HumanReadableString(disk_size).c_str(),
                 common::HumanReadableString(super_quota).c_str(),
                 common::HumanReadableString(user_quota).c_str());
             disk_quota += user_quota;
+            if (media == kMediaSsd) {
+                ssd_quota += user_quota;
+            }
+            media_map[disk_path] = media;
         } else {
             if (stat_ret != 0) {
                 LOG(WARNING, "Stat store_path %s fail, ignore it", disk_path.c_str());
@@ -112,36 +235,105 @@ void BlockManager::CheckStorePath(const std::string& store_path) {
     std::vector<std::string>::iterator it
        = std::unique(store_path_list_.begin(), store_path_list_.end());
     store_path_list_.resize(std::distance(store_path_list_.begin(), it));
+    store_media_.clear();
+    for (size_t i = 0; i < store_path_list_.size(); i++) {
+        store_media_.push_back(media_map[store_path_list_[i]]);
+    }
     LOG(INFO, "%lu store path used.", store_path_list_.size());
     assert(store_path_list_.size() > 0);
     disk_quota_ = disk_quota;
+    ssd_quota_ = ssd_quota;
 }
 const std::string& BlockManager::GetStorePath(int64_t block_id) {
     return store_path_list_[block_id % store_path_list_.size()];
 }
-/// Load meta from disk
-bool BlockManager::LoadStorage() {
-    MutexLock lock(&mu_);
-    int64_t start_load_time = common::timer::get_micros();
-    leveldb::Options options;
-    options.create_if_missing = true;
-    leveldb::Status s = leveldb::DB::Open(options, store_path_list_[0] + "meta/", &metadb_);
-    if (!s.ok()) {
-        LOG(WARNING, "Load blocks fail: %s", s.ToString().c_str());
-        return false;
+std::string BlockManager::SelectStorePath(int64_t block_id, StorageMedia media) {
+    MutexLock lock(&disk_mu_, "BlockManager::SelectStorePath", 1000);
+    if (common::timer::get_micros() - disk_info_time_ > 1000000) {
+        RefreshDiskInfo();
     }
-
-    std::string version_key(8, '\0');
-    version_key.append("version");
-    std::string version_str;
-    s = metadb_->Get(leveldb::ReadOptions(), version_key, &version_str);
-    if (s.ok() && version_str.size() == 8) {
-        namespace_version_ = *(reinterpret_cast<int64_t*>(&version_str[0]));
-        LOG(INFO, "Load namespace %ld", namespace_version_);
+    // Blocks not asked to be on ssd start on hdd, hot ones are moved to ssd later
+    if (media == kMediaAny) {
+        media = kMediaHdd;
+    }
+    if (media == kMediaHdd
+        && std::find(store_media_.begin(), store_media_.end(), kMediaSsd) == store_media_.end()) {
+        return disk_info_[disk_selector_->Select(block_id, disk_info_)].path;
+    }
+    std::vector<DiskInfo> disks;
+    for (size_t i = 0; i < disk_info_.size(); i++) {
+        if (disk_info_[i].media == media) {
+            disks.push_back(disk_info_[i]);
+        }
+    }
+    if (disks.empty()) {
+        LOG(DEBUG, "No %s store path for #%ld", StorageMedia_Name(media).c_str(), block_id);
+        return disk_info_[disk_selector_->Select(block_id, disk_info_)].path;
+    }
+    return disks[disk_selector_->Select(block_id, disks)].path;
+}
+StorageMedia BlockManager::GetDiskMedia(const std::string& store_path) {
+    std::vector<std::string>::iterator it =
+        std::find(store_path_list_.begin(), store_path_list_.end(), store_path);
+    if (it == store_path_list_.end()) {
+        return kMediaAny;
+    }
+    return store_media_[it - store_path_list_.begin()];
+}
+void BlockManager::RefreshDiskInfo() {
+    disk_mu_.AssertHeld();
+    std::vector<DiskScheduler::DiskStat> stats;
+    disk_scheduler_->GetStat(&stats);
+    assert(stats.size() == store_path_list_.size());
+    disk_info_.resize(store_path_list_.size());
+    for (size_t i = 0; i < store_path_list_.size(); i++) {
+        DiskInfo& info = disk_info_[i];
+        info.path = store_path_list_[i];
+        struct statfs fs_info;
+        if (statfs(info.path.c_str(), &fs_info) == 0) {
+            info.disk_size = fs_info.f_blocks * fs_info.f_bsize;
+            info.free_size = fs_info.f_bavail * fs_info.f_bsize;
+        } else {
+            LOG(WARNING, "Stat store_path %s fail: %s", info.path.c_str(), strerror(errno));
+            info.free_size = 0;
+        }
+        info.pending_io = stats[i].pending_reads + stats[i].pending_writes;
+        info.read_latency = stats[i].read_latency;
+        info.media = store_media_[i];
+    }
+    disk_info_time_ = common::timer::get_micros();
+}
+leveldb::DB* BlockManager::GetMetaDB(const std::string& store_path) {
+    for (size_t i = 0; i < store_path_list_.size() && i < metadbs_.size(); i++) {
+        if (store_path_list_[i] == store_path) {
+            return metadbs_[i];
+        }
     }
-    int block_num = 0;
-    leveldb::Iterator* it = metadb_->NewIterator(leveldb::ReadOptions());
-    for (it->Seek(version_key+'\0'); it->Valid(); it->Next()) {
+    return NULL;
+}
+MetaCommitter* BlockManager::GetMetaCommitter(const std::string& store_path) {
+    for (size_t i = 0; i < store_path_list_.size() && i < meta_committers_.size(); i++) {
+        if (store_path_list_[i] == store_path) {
+            return meta_committers_[i];
+        }
+    }
+    return NULL;
+}
+FileSyncer* BlockManager::GetFileSyncer(const std::string& store_path) {
+    for (size_t i = 0; i < store_path_list_.size() && i < file_syncers_.size(); i++) {
+        if (store_path_list_[i] == store_path) {
+            return file_syncers_[i];
+        }
+    }
+    return NULL;
+}
+
+bool BlockManager::MigrateMeta(size_t disk) {
+    leveldb::DB* metadb = metadbs_[disk];
+    const std::string& disk_path = store_path_list_[disk];
+    int64_t migrated = 0;
+    leveldb::Iterator* it = metadb->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(VersionKey() + '\0'); it->Valid(); it->Next()) {
         int64_t block_id = 0;
         if (1 != sscanf(it->key().data(), "%ld", &block_id)) {
             LOG(WARNING, "Unknown key: %s\n", it->key().ToString().c_str());
@@ -149,6 +341,7 @@ bool BlockManager::LoadStorage() {
             return false;
         }
         BlockMeta meta;
+        bool converted = false;
         if (!meta.ParseFromArray(it->value().data(), it->value().size())
             || meta.block_id() != block_id) {
             struct OldBlockMeta {
@@ -166,18 +359,70 @@ bool BlockManager::LoadStorage() {
             meta.set_checksum(oldmeta.checksum);
             meta.set_version(oldmeta.version);
             meta.set_store_path(GetStorePath(block_id));
-            std::string meta_buf;
-            meta.SerializeToString(&meta_buf);
-            metadb_->Put(leveldb::WriteOptions(), it->key(), meta_buf);
             LOG(INFO, "Old meta info of #%ld has been trans to new meta info", oldmeta.block_id);
+            converted = true;
+        }
+        leveldb::DB* owner = GetMetaDB(meta.store_path());
+        if (owner == NULL) {
+            // Not in current store configuration, LoadDiskMeta ignores it
+            owner = metadb;
+        }
+        if (owner == metadb && !converted) {
+            continue;
+        }
+        std::string meta_buf;
+        meta.SerializeToString(&meta_buf);
+        // Put before delete, a crash in between only repeats the migration
+        leveldb::Status s = owner->Put(leveldb::WriteOptions(), it->key(), meta_buf);
+        if (!s.ok()) {
+            LOG(WARNING, "Migrate meta of #%ld to %s fail: %s",
+                block_id, meta.store_path().c_str(), s.ToString().c_str());
+            delete it;
+            return false;
+        }
+        if (owner != metadb) {
+            metadb->Delete(leveldb::WriteOptions(), it->key());
+            ++migrated;
+        }
+    }
+    delete it;
+    if (migrated) {
+        LOG(INFO, "Migrate %ld block metas from %s to their own disks",
+            migrated, disk_path.c_str());
+    }
+    return true;
+}
+
+bool BlockManager::LoadDiskMeta(size_t disk, std::vector<int64_t>* block_nums) {
+    int64_t start = common::timer::get_micros();
+    leveldb::DB* metadb = metadbs_[disk];
+    std::string value;
+    bool clean = metadb->Get(leveldb::ReadOptions(), CleanShutdownKey(), &value).ok();
+    bool check_files = !clean && !FLAGS_chunkserver_background_verify;
+    int64_t block_num = 0;
+    leveldb::Iterator* it = metadb->NewIterator(leveldb::ReadOptions());
+    for (it->Seek(VersionKey() + '\0'); it->Valid(); it->Next()) {
+        int64_t block_id = 0;
+        BlockMeta meta;
+        if (1 != sscanf(it->key().data(), "%ld", &block_id)
+            || !meta.ParseFromArray(it->value().data(), it->value().size())) {
+            LOG(WARNING, "Unknown meta %s on %s\n",
+                it->key().ToString().c_str(), store_path_list_[disk].c_str());
+            delete it;
+            return false;
         }
         std::string file_path = meta.store_path() + Block::BuildFilePath(block_id);
         if (meta.version() < 0) {
             LOG(INFO, "Incomplete block #%ld V%ld %ld, drop it",
                 block_id, meta.version(), meta.block_size());
-            metadb_->Delete(leveldb::WriteOptions(), it->key());
+            metadb->Delete(leveldb::WriteOptions(), it->key());
             remove(file_path.c_str());
             continue;
+        } else if (meta.storage_class() == kStorageMemory) {
+            LOG(INFO, "Memory block #%ld V%ld %ld is gone with the last run, drop it",
+                block_id, meta.version(), meta.block_size());
+            metadb->Delete(leveldb::WriteOptions(), it->key());
+            continue;
         } else {
             if (std::find(store_path_list_.begin(), store_path_list_.end(), meta.store_path())
                     == store_path_list_.end()) {
@@ -185,30 +430,209 @@ bool BlockManager::LoadStorage() {
                     block_id, file_path.c_str());
                 continue;
             }
-            struct stat st;
-            if (stat(file_path.c_str(), &st) ||
-                st.st_size != meta.block_size() ||
-                access(file_path.c_str(), R_OK)) {
-                LOG(WARNING, "Corrupted block #%ld V%ld size %ld path %s can't access: %s'",
-                    block_id, meta.version(), meta.block_size(), file_path.c_str(),
-                    strerror(errno));
-                metadb_->Delete(leveldb::WriteOptions(), it->key());
+            // Lazy persist blocks may be closed before their files are written
+            if ((check_files || meta.storage_class() == kStorageLazyPersist)
+                && !CheckBlockFile(meta, true)) {
+                metadb->Delete(leveldb::WriteOptions(), it->key());
                 remove(file_path.c_str());
                 continue;
-            } else {
-                LOG(DEBUG, "Load #%ld V%ld size %ld path %s",
-                    block_id, meta.version(), meta.block_size(), file_path.c_str());
+            }
+            LOG(DEBUG, "Load #%ld V%ld size %ld path %s",
+                block_id, meta.version(), meta.block_size(), file_path.c_str());
+            if (!clean && !check_files) {
+                unverified_[disk].push_back(block_id);
             }
         }
-        Block* block = new Block(meta, thread_pool_, file_cache_);
-        block->AddRef();
-        block_map_[block_id] = block;
-        block_num ++;
+        // Loaded blocks are closed, no Block object until used
+        SealedBlock sealed;
+        sealed.size = meta.block_size();
+        sealed.version = meta.version();
+        sealed.disk = disk;
+        sealed.heat = 0;
+        sealed.pinned = meta.has_media();
+        BlockMapShard* shard = GetShard(block_id);
+        {
+            MutexLock shard_lock(&shard->mu);
+            shard->sealed[block_id] = sealed;
+        }
+        g_blocks.Inc();
+        g_data_size.Add(sealed.size);
+        ++block_num;
     }
     delete it;
+    if (clean) {
+        // Writes from now on may leave files and metas apart until the next clean shutdown
+        leveldb::WriteOptions options;
+        options.sync = true;
+        leveldb::Status s = metadb->Delete(options, CleanShutdownKey());
+        if (!s.ok()) {
+            LOG(WARNING, "Clear clean shutdown mark on %s fail: %s",
+                store_path_list_[disk].c_str(), s.ToString().c_str());
+            return false;
+        }
+    }
+    (*block_nums)[disk] = block_num;
+    LOG(INFO, "Load %ld blocks from %s in %ld ms, %s",
+        block_num, store_path_list_[disk].c_str(), (common::timer::get_micros() - start) / 1000,
+        clean ? "clean shutdown" : (check_files ? "files checked" : "files to verify"));
+    return true;
+}
+bool BlockManager::CheckBlockFile(const BlockMeta& meta, bool truncate_tail) {
+    std::string file_path = meta.store_path() + Block::BuildFilePath(meta.block_id());
+    struct stat st;
+    if (stat(file_path.c_str(), &st) ||
+        st.st_size < meta.block_size() ||
+        access(file_path.c_str(), R_OK)) {
+        LOG(WARNING, "Corrupted block #%ld V%ld size %ld path %s can't access: %s'",
+            meta.block_id(), meta.version(), meta.block_size(), file_path.c_str(),
+            strerror(errno));
+        return false;
+    }
+    if (st.st_size > meta.block_size() && truncate_tail) {
+        // Data past the sealed size is from an append never closed, the sealed part is good
+        LOG(INFO, "Block #%ld V%ld file %ld bytes past sealed size %ld, truncate it",
+            meta.block_id(), meta.version(), st.st_size, meta.block_size());
+        chmod(file_path.c_str(), S_IRUSR | S_IWUSR);
+        int ret = truncate(file_path.c_str(), meta.block_size());
+        chmod(file_path.c_str(), S_IRUSR);
+        if (ret != 0) {
+            LOG(WARNING, "Truncate block #%ld %s fail: %s",
+                meta.block_id(), file_path.c_str(), strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+void BlockManager::VerifyDiskBlocks(size_t disk) {
+    std::vector<int64_t>& blocks = unverified_[disk];
+    int64_t start = common::timer::get_micros();
+    int64_t corrupted = 0;
+    for (size_t i = 0; i < blocks.size(); i++) {
+        if (stop_background_) {
+            return;
+        }
+        Block* block = FindBlock(blocks[i]);
+        if (block == NULL) {
+            continue;
+        }
+        // Blocks moved or rewritten since loading are not the loaded file. A longer file is
+        // left as is, an append may be running on it, the next reopen truncates it anyway
+        BlockMeta meta = block->GetMeta();
+        if (block->IsFinished() && meta.store_path() == store_path_list_[disk]
+            && !CheckBlockFile(meta, false)) {
+            RemoveBlock(blocks[i]);
+            ++corrupted;
+        }
+        block->DecRef();
+    }
+    LOG(INFO, "Verify %lu blocks on %s in %ld ms, %ld corrupted",
+        blocks.size(), store_path_list_[disk].c_str(),
+        (common::timer::get_micros() - start) / 1000, corrupted);
+    blocks.clear();
+}
+
+bool BlockManager::OpenMetaDB(size_t disk) {
+    leveldb::Options options;
+    options.create_if_missing = true;
+    leveldb::Status s = leveldb::DB::Open(options, store_path_list_[disk] + "meta/",
+                                          &metadbs_[disk]);
+    if (!s.ok()) {
+        LOG(WARNING, "Open metadb on %s fail: %s",
+            store_path_list_[disk].c_str(), s.ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
+static void RunDiskTask(const boost::function<bool (size_t)>& task, size_t disk, int* ret) {
+    *ret = task(disk) ? 1 : 0;
+}
+
+bool BlockManager::ForEachDisk(const boost::function<bool (size_t)>& task) {
+    std::vector<int> rets(store_path_list_.size(), 0);
+    ThreadPool pool(store_path_list_.size());
+    for (size_t i = 0; i < store_path_list_.size(); i++) {
+        pool.AddTask(boost::bind(&RunDiskTask, task, i, &rets[i]));
+    }
+    pool.Stop(true);
+    return std::find(rets.begin(), rets.end(), 0) == rets.end();
+}
+
+/// Load meta from disk
+bool BlockManager::LoadStorage() {
+    MutexLock lock(&mu_);
+    int64_t start_load_time = common::timer::get_micros();
+    // Disks are independent, each phase runs on all disks at once
+    metadbs_.resize(store_path_list_.size(), NULL);
+    if (!ForEachDisk(boost::bind(&BlockManager::OpenMetaDB, this, _1))
+        || !ForEachDisk(boost::bind(&BlockManager::LoadTrash, this, _1))) {
+        return false;
+    }
+    for (size_t i = 0; i < metadbs_.size(); i++) {
+        meta_committers_.push_back(new MetaCommitter(metadbs_[i], FLAGS_chunkserver_sync_meta,
+                                                     FLAGS_chunkserver_meta_batch_ops));
+        file_syncers_.push_back(new FileSyncer(FLAGS_chunkserver_sync_batch_files));
+    }
+    // Block files must have their journaled data before they are checked
+    if (!FLAGS_chunkserver_journal_path.empty()) {
+        journal_ = new Journal(FLAGS_chunkserver_journal_path,
+                               static_cast<int64_t>(FLAGS_chunkserver_journal_size) << 20);
+        if (!journal_->Open()) {
+            return false;
+        }
+    }
+    int64_t open_time = common::timer::get_micros();
+
+    if (!ForEachDisk(boost::bind(&BlockManager::CleanMoveRecord, this, _1))) {
+        return false;
+    }
+    // Metas of all disks used to live in the metadb of the first disk
+    if (!ForEachDisk(boost::bind(&BlockManager::MigrateMeta, this, _1))) {
+        return false;
+    }
+    int64_t recover_time = common::timer::get_micros();
+
+    std::vector<int64_t> versions(metadbs_.size(), 0);
+    for (size_t i = 0; i < metadbs_.size(); i++) {
+        std::string version_str;
+        leveldb::Status s = metadbs_[i]->Get(leveldb::ReadOptions(), VersionKey(), &version_str);
+        if (s.ok() && version_str.size() == 8) {
+            versions[i] = *(reinterpret_cast<int64_t*>(&version_str[0]));
+            if (namespace_version_ != 0 && versions[i] != namespace_version_) {
+                LOG(WARNING, "Namespace version of %s is %ld, others %ld",
+                    store_path_list_[i].c_str(), versions[i], namespace_version_);
+            }
+            namespace_version_ = std::max(namespace_version_, versions[i]);
+        }
+    }
+    if (namespace_version_ != 0) {
+        LOG(INFO, "Load namespace %ld", namespace_version_);
+        for (size_t i = 0; i < metadbs_.size(); i++) {
+            // New or migrated disks learn the version, so each disk describes itself
+            if (versions[i] != namespace_version_ && !SetDiskVersion(i, namespace_version_)) {
+                return false;
+            }
+        }
+    }
+    std::vector<int64_t> block_nums(metadbs_.size(), 0);
+    if (!ForEachDisk(boost::bind(&BlockManager::LoadDiskMeta, this, _1, &block_nums))) {
+        return false;
+    }
+    int64_t block_num = 0;
+    for (size_t i = 0; i < block_nums.size(); i++) {
+        block_num += block_nums[i];
+        if (!unverified_[i].empty()) {
+            background_thread_->AddTask(boost::bind(&BlockManager::VerifyDiskBlocks, this, i));
+        }
+    }
+    background_thread_->DelayTask(FLAGS_chunkserver_block_compact_interval * 1000,
+                                  boost::bind(&BlockManager::BackgroundCompact, this));
     int64_t end_load_time = common::timer::get_micros();
-    LOG(INFO, "Load %ld blocks, use %ld ms, namespace version: %ld",
-        block_num, (end_load_time - start_load_time) / 1000, namespace_version_);
+    LOG(INFO, "Load %ld blocks, use %ld ms (open %ld, recover %ld, index %ld), "
+              "namespace version: %ld",
+        block_num, (end_load_time - start_load_time) / 1000,
+        (open_time - start_load_time) / 1000, (recover_time - open_time) / 1000,
+        (end_load_time - recover_time) / 1000, namespace_version_);
     if (namespace_version_ == 0 && block_num > 0) {
         LOG(WARNING, "Namespace version lost!");
     }
@@ -218,59 +642,96 @@ bool BlockManager::LoadStorage() {
 int64_t BlockManager::NameSpaceVersion() const {
     return namespace_version_;
 }
-bool BlockManager::SetNameSpaceVersion(int64_t version) {
-    MutexLock lock(&mu_);
-    std::string version_key(8, '\0');
-    version_key.append("version");
+bool BlockManager::SetDiskVersion(size_t disk, int64_t version) {
     std::string version_str(8, '\0');
     *(reinterpret_cast<int64_t*>(&version_str[0])) = version;
-    leveldb::Status s = metadb_->Put(leveldb::WriteOptions(), version_key, version_str);
+    leveldb::Status s = meta_committers_[disk]->Put(VersionKey(), version_str);
     if (!s.ok()) {
-        LOG(WARNING, "SetNameSpaceVersion fail: %s", s.ToString().c_str());
+        LOG(WARNING, "Set namespace version on %s fail: %s",
+            store_path_list_[disk].c_str(), s.ToString().c_str());
         return false;
     }
+    return true;
+}
+bool BlockManager::SetNameSpaceVersion(int64_t version) {
+    MutexLock lock(&mu_);
+    for (size_t i = 0; i < metadbs_.size(); i++) {
+        if (!SetDiskVersion(i, version)) {
+            return false;
+        }
+    }
     namespace_version_ = version;
     LOG(INFO, "Set namespace version: %ld", namespace_version_);
     return true;
 }
 
 bool BlockManager::ListBlocks(std::vector<BlockMeta>* blocks, int64_t offset, int32_t num) {
-    leveldb::Iterator* it = metadb_->NewIterator(leveldb::ReadOptions());
-    for (it->Seek(BlockId2Str(offset)); it->Valid(); it->Next()) {
-        int64_t block_id = 0;
-        if (1 != sscanf(it->key().data(), "%ld", &block_id)) {
-            LOG(WARNING, "[ListBlocks] Unknown meta key: %s\n",
-                it->key().ToString().c_str());
-            delete it;
-            return false;
-        }
-        BlockMeta meta;
-        bool ret = meta.ParseFromArray(it->value().data(), it->value().size());
-        assert(ret);
-        //skip blocks not in current configuration
-        if (find(store_path_list_.begin(), store_path_list_.end(), meta.store_path())
-                  == store_path_list_.end()) {
-            continue;
-        }
-        assert(meta.block_id() == block_id);
-        blocks->push_back(meta);
-        // LOG(DEBUG, "List block %ld", block_id);
-        if (--num <= 0) {
-            break;
+    // Merge the first num blocks of every disk
+    std::map<int64_t, BlockMeta> merged;
+    for (size_t i = 0; i < metadbs_.size(); i++) {
+        int32_t disk_num = num;
+        leveldb::Iterator* it = metadbs_[i]->NewIterator(leveldb::ReadOptions());
+        for (it->Seek(BlockId2Str(offset)); it->Valid() && disk_num > 0; it->Next()) {
+            int64_t block_id = 0;
+            if (1 != sscanf(it->key().data(), "%ld", &block_id)) {
+                LOG(WARNING, "[ListBlocks] Unknown meta key: %s\n",
+                    it->key().ToString().c_str());
+                delete it;
+                return false;
+            }
+            if (!merged.empty() && static_cast<int32_t>(merged.size()) >= num
+                && block_id > merged.rbegin()->first) {
+                break;
+            }
+            BlockMeta meta;
+            bool ret = meta.ParseFromArray(it->value().data(), it->value().size());
+            assert(ret);
+            //skip blocks not in current configuration
+            if (find(store_path_list_.begin(), store_path_list_.end(), meta.store_path())
+                      == store_path_list_.end()) {
+                continue;
+            }
+            assert(meta.block_id() == block_id);
+            merged[block_id] = meta;
+            --disk_num;
         }
+        delete it;
+    }
+    for (std::map<int64_t, BlockMeta>::iterator it = merged.begin();
+         it != merged.end() && num > 0; ++it, --num) {
+        blocks->push_back(it->second);
     }
-    delete it;
     return true;
 }
 
-Block* BlockManager::CreateBlock(int64_t block_id, int64_t* sync_time, StatusCode* status) {
+Block* BlockManager::CreateBlock(int64_t block_id, int64_t* sync_time, StatusCode* status,
+                                 StorageClass storage_class, StorageMedia media) {
+    if (storage_class == kStorageMemory && !MemoryAvailable(0)) {
+        LOG(WARNING, "No memory for memory block #%ld, %ld bytes used",
+            block_id, g_memory_data.Get());
+        *status = kNoEnoughSpace;
+        return NULL;
+    }
     BlockMeta meta;
     meta.set_block_id(block_id);
-    meta.set_store_path(GetStorePath(block_id));
-    Block* block = new Block(meta, thread_pool_, file_cache_);
-    MutexLock lock(&mu_, "BlockManger::AddBlock", 1000);
-    BlockMap::iterator it = block_map_.find(block_id);
-    if (it != block_map_.end()) {
+    // Memory blocks still keep their meta in a metadb, for block reports
+    meta.set_store_path(SelectStorePath(block_id, media));
+    if (storage_class != kStorageDisk) {
+        meta.set_storage_class(storage_class);
+    }
+    if (media != kMediaAny) {
+        meta.set_media(media);
+    }
+    Block* block = new Block(meta, disk_scheduler_->WritePool(meta.store_path()), file_cache_);
+    BlockMapShard* shard = GetShard(block_id);
+    MutexLock lock(&shard->mu, "BlockManger::AddBlock", 1000);
+    std::map<int64_t, Block*>::iterator it = shard->blocks.find(block_id);
+    if (shard->sealed.find(block_id) != shard->sealed.end()) {
+        delete block;
+        *status = kReadOnly;
+        return NULL;
+    }
+    if (it != shard->blocks.end()) {
         delete block;
         if (it->second->IsFinished()) {
             *status = kReadOnly;
@@ -281,17 +742,17 @@ Block* BlockManager::CreateBlock(int64_t block_id, int64_t* sync_time, StatusCod
     }
     // for block_map
     block->AddRef();
-    block_map_[block_id] = block;
+    shard->blocks[block_id] = block;
     // Unlock for write meta & sync
-    mu_.Unlock();
+    shard->mu.Unlock();
     if (!SyncBlockMeta(meta, sync_time)) {
         delete block;
         *status = kSyncMetaFailed;
         block = NULL;
     }
-    mu_.Lock();
+    shard->mu.Lock();
     if (!block) {
-        block_map_.erase(block_id);
+        shard->blocks.erase(block_id);
     } else {
         // for user
         block->AddRef();
@@ -300,19 +761,115 @@ Block* BlockManager::CreateBlock(int64_t block_id, int64_t* sync_time, StatusCod
     return block;
 }
 
+bool BlockManager::MemoryAvailable(int64_t len) {
+    return g_memory_data.Get() + len <= (static_cast<int64_t>(FLAGS_chunkserver_memory_limit) << 20);
+}
+
+BlockManager::BlockMapShard* BlockManager::GetShard(int64_t block_id) {
+    return &block_map_[static_cast<uint64_t>(block_id) % kBlockMapShardNum];
+}
+
 Block* BlockManager::FindBlock(int64_t block_id) {
     g_find_ops.Inc();
-    MutexLock lock(&mu_, "BlockManger::Find", 1000);
-    BlockMap::iterator it = block_map_.find(block_id);
-    if (it == block_map_.end()) {
-        // not found
-        return NULL;
+    BlockMapShard* shard = GetShard(block_id);
+    MutexLock lock(&shard->mu, "BlockManger::Find", 1000);
+    std::map<int64_t, Block*>::iterator it = shard->blocks.find(block_id);
+    Block* block = NULL;
+    if (it != shard->blocks.end()) {
+        block = it->second;
+    } else {
+        block = OpenSealedBlock(shard, block_id);
+        if (block == NULL) {
+            // not found
+            return NULL;
+        }
     }
-    Block* block = it->second;
     // for user
     block->AddRef();
     return block;
 }
+Block* BlockManager::OpenSealedBlock(BlockMapShard* shard, int64_t block_id) {
+    shard->mu.AssertHeld();
+    std::map<int64_t, SealedBlock>::iterator it = shard->sealed.find(block_id);
+    if (it == shard->sealed.end()) {
+        return NULL;
+    }
+    BlockMeta meta;
+    meta.set_block_id(block_id);
+    meta.set_block_size(it->second.size);
+    meta.set_version(it->second.version);
+    meta.set_store_path(store_path_list_[it->second.disk]);
+    if (it->second.pinned) {
+        // The writer's media, unless placement fell back to another one
+        meta.set_media(store_media_[it->second.disk]);
+    }
+    int32_t heat = it->second.heat;
+    shard->sealed.erase(it);
+    // The Block object takes over the accounting of the block
+    g_blocks.Dec();
+    g_data_size.Sub(meta.block_size());
+    Block* block = new Block(meta, disk_scheduler_->WritePool(meta.store_path()), file_cache_);
+    block->SetHeat(heat);
+    // for block_map
+    block->AddRef();
+    shard->blocks[block_id] = block;
+    return block;
+}
+int64_t BlockManager::CompactBlocks() {
+    int64_t compacted = 0;
+    for (int32_t i = 0; i < kBlockMapShardNum; i++) {
+        BlockMapShard& shard = block_map_[i];
+        MutexLock lock(&shard.mu, "BlockManager::CompactBlocks", 1000);
+        std::map<int64_t, Block*>::iterator it = shard.blocks.begin();
+        while (it != shard.blocks.end()) {
+            Block* block = it->second;
+            // Only the index holds it, and new refs are only given out under shard.mu
+            // Memory blocks have no file to be reopened from
+            if (block->GetRef() != 1 || !block->IsFinished() || block->IsDeleted()
+                || block->GetStorageClass() == kStorageMemory) {
+                ++it;
+                continue;
+            }
+            BlockMeta meta = block->GetMeta();
+            std::vector<std::string>::iterator path =
+                std::find(store_path_list_.begin(), store_path_list_.end(), meta.store_path());
+            if (path == store_path_list_.end()) {
+                ++it;
+                continue;
+            }
+            SealedBlock& sealed = shard.sealed[it->first];
+            sealed.size = meta.block_size();
+            sealed.version = meta.version();
+            sealed.disk = path - store_path_list_.begin();
+            sealed.heat = std::min(block->Heat(), 255);
+            sealed.pinned = meta.has_media();
+            g_blocks.Inc();
+            g_data_size.Add(sealed.size);
+            shard.blocks.erase(it++);
+            block->DecRef();
+            ++compacted;
+        }
+    }
+    return compacted;
+}
+void BlockManager::BackgroundCompact() {
+    if (stop_background_) {
+        return;
+    }
+    int64_t start = common::timer::get_micros();
+    int64_t compacted = CompactBlocks();
+    if (compacted) {
+        LOG(INFO, "Compact %ld idle blocks into block index, use %ld ms",
+            compacted, (common::timer::get_micros() - start) / 1000);
+    }
+    // Checkpoint at half size, before the journal fills up and stalls a writer
+    int64_t journal_limit = static_cast<int64_t>(FLAGS_chunkserver_journal_size) << 20;
+    if (journal_ && journal_->Size() > journal_limit / 2) {
+        journal_->Checkpoint();
+    }
+    background_thread_->DelayTask(FLAGS_chunkserver_block_compact_interval * 1000,
+                                  boost::bind(&BlockManager::BackgroundCompact, this));
+}
 std::string BlockManager::BlockId2Str(int64_t block_id) {
     char idstr[64];
     snprintf(idstr, sizeof(idstr), "%13ld", block_id);
@@ -320,12 +877,17 @@ std::string BlockManager::BlockId2Str(int64_t block_id) {
 }
 bool BlockManager::SyncBlockMeta(const BlockMeta& meta, int64_t* sync_time) {
     std::string idstr = BlockId2Str(meta.block_id());
-    leveldb::WriteOptions options;
-    // options.sync = true;
     int64_t time_start = common::timer::get_micros();
     std::string meta_buf;
     meta.SerializeToString(&meta_buf);
-    leveldb::Status s = metadb_->Put(options, idstr, meta_buf);
+    MetaCommitter* committer = GetMetaCommitter(meta.store_path());
+    if (committer == NULL) {
+        LOG(WARNING, "Write meta of #%ld to unknown store path %s",
+            meta.block_id(), meta.store_path().c_str());
+        return false;
+    }
+    // Shares one write, and one sync, with concurrent updates on the same disk
+    leveldb::Status s = committer->Put(idstr, meta_buf);
     int64_t time_use = common::timer::get_micros() - time_start;
     if (sync_time) *sync_time = time_use;
     if (!s.ok()) {
@@ -344,52 +906,181 @@ bool BlockManager::CloseBlock(Block* block) {
     return SyncBlockMeta(meta, NULL);
 }
 
-bool BlockManager::RemoveBlockMeta(int64_t block_id) {
-    char idstr[14];
-    snprintf(idstr, sizeof(idstr), "%13ld", block_id);
-    leveldb::Status s = metadb_->Delete(leveldb::WriteOptions(), idstr);
-    if (!s.ok()) {
-        LOG(WARNING, "Remove #%ld meta info fails: %s", block_id, s.ToString().c_str());
-        return false;
+bool BlockManager::SyncBlockData(Block* block, bool to_disk) {
+    if (to_disk && journal_) {
+        return block->Sync(NULL, journal_);
     }
-    return true;
+    FileSyncer* syncer = NULL;
+    if (to_disk) {
+        syncer = GetFileSyncer(block->GetStorePath());
+        if (syncer == NULL) {
+            LOG(WARNING, "No syncer for #%ld at %s",
+                block->Id(), block->GetStorePath().c_str());
+            return false;
+        }
+    }
+    return block->Sync(syncer);
 }
+
 bool BlockManager::RemoveBlock(int64_t block_id) {
-    bool meta_removed = RemoveBlockMeta(block_id);
-    Block* block = FindBlock(block_id);
-    if (block == NULL) {
-        LOG(INFO, "Try to remove block that does not exist: #%ld ", block_id);
-        return false;
+    return RemoveBlocks(std::vector<int64_t>(1, block_id)) == 1;
+}
+int64_t BlockManager::RemoveBlocks(const std::vector<int64_t>& block_ids) {
+    std::vector<Block*> blocks(block_ids.size(), NULL);
+    for (size_t i = 0; i < block_ids.size(); i++) {
+        blocks[i] = FindBlock(block_ids[i]);
+    }
+    // Metas are removed with one write per disk
+    std::vector<int> meta_removed(block_ids.size(), 0);
+    {
+        MutexLock lock(&move_mu_, "BlockManager::RemoveBlocks meta", 1000);
+        std::vector<std::vector<std::string> > keys(metadbs_.size());
+        std::vector<int32_t> block_disk(block_ids.size(), -1);
+        for (size_t i = 0; i < block_ids.size(); i++) {
+            std::string idstr = BlockId2Str(block_ids[i]);
+            if (blocks[i]) {
+                std::vector<std::string>::iterator path = std::find(store_path_list_.begin(),
+                    store_path_list_.end(), blocks[i]->GetStorePath());
+                if (path == store_path_list_.end()) {
+                    LOG(WARNING, "Remove #%ld meta on unknown store path %s",
+                        block_ids[i], blocks[i]->GetStorePath().c_str());
+                    continue;
+                }
+                block_disk[i] = path - store_path_list_.begin();
+                keys[block_disk[i]].push_back(idstr);
+                continue;
+            }
+            // Not loaded, drop whatever meta is left on any disk
+            for (size_t j = 0; j < metadbs_.size(); j++) {
+                std::string value;
+                if (metadbs_[j]->Get(leveldb::ReadOptions(), idstr, &value).ok()) {
+                    keys[j].push_back(idstr);
+                }
+            }
+        }
+        std::vector<int> disk_ok(metadbs_.size(), 1);
+        for (size_t j = 0; j < metadbs_.size(); j++) {
+            if (keys[j].empty()) {
+                continue;
+            }
+            leveldb::Status s = meta_committers_[j]->Delete(keys[j]);
+            if (!s.ok()) {
+                LOG(WARNING, "Remove %lu metas on %s fails: %s",
+                    keys[j].size(), store_path_list_[j].c_str(), s.ToString().c_str());
+                disk_ok[j] = 0;
+            }
+        }
+        for (size_t i = 0; i < block_ids.size(); i++) {
+            meta_removed[i] = block_disk[i] >= 0 && disk_ok[block_disk[i]];
+        }
     }
-    if (!block->SetDeleted()) {
-        LOG(INFO, "Block #%ld deleted by other thread", block_id);
+    int64_t removed = 0;
+    for (size_t i = 0; i < block_ids.size(); i++) {
+        int64_t block_id = block_ids[i];
+        Block* block = blocks[i];
+        if (block == NULL) {
+            LOG(INFO, "Try to remove block that does not exist: #%ld ", block_id);
+            continue;
+        }
+        if (!block->SetDeleted()) {
+            LOG(INFO, "Block #%ld deleted by other thread", block_id);
+            block->DecRef();
+            continue;
+        }
+        MoveToTrash(block_id, block->GetStorePath(), block->DiskUsed());
+        if (meta_removed[i]) {
+            BlockMapShard* shard = GetShard(block_id);
+            MutexLock lock(&shard->mu, "BlockManager::RemoveBlock erase", 1000);
+            shard->blocks.erase(block_id);
+            block->DecRef();
+            LOG(INFO, "Remove #%ld meta info done, ref= %ld", block_id, block->GetRef());
+            ++removed;
+        }
         block->DecRef();
-        return false;
     }
+    return removed;
+}
 
-    int64_t du = block->DiskUsed();
-    std::string file_path = block->GetFilePath();
+void BlockManager::MoveToTrash(int64_t block_id, const std::string& store_path, int64_t du) {
+    std::string file_path = store_path + Block::BuildFilePath(block_id);
     file_cache_->EraseFileCache(file_path);
-    int ret = remove(file_path.c_str());
-    if (ret != 0 && (errno !=2 || du > 0)) {
-        LOG(WARNING, "Remove #%ld disk file %s %ld bytes fails: %d (%s)",
-            block_id, file_path.c_str(), du, errno, strerror(errno));
-    } else {
-        LOG(INFO, "Remove #%ld disk file done: %s\n",
-            block_id, file_path.c_str());
+    char name[64];
+    snprintf(name, sizeof(name), "trash/%ld.%ld", block_id, common::timer::get_micros());
+    std::string trash_file = store_path + name;
+    // A rename only touches the directory, the data is freed later by PurgeTrash
+    if (rename(file_path.c_str(), trash_file.c_str()) == 0) {
+        MutexLock lock(&trash_mu_, "BlockManager::MoveToTrash", 1000);
+        trash_.push_back(std::make_pair(trash_file, du));
+        trash_bytes_ += du;
+        LOG(INFO, "Move #%ld disk file to trash: %s", block_id, trash_file.c_str());
+        return;
+    }
+    if (errno == ENOENT && du == 0) {
+        return;
     }
+    LOG(WARNING, "Move #%ld disk file %s %ld bytes to trash fails: %d (%s), remove it",
+        block_id, file_path.c_str(), du, errno, strerror(errno));
+    remove(file_path.c_str());
+}
 
-    if (meta_removed) {
-        MutexLock lock(&mu_, "BlockManager::RemoveBlock erase", 1000);
-        block_map_.erase(block_id);
-        block->DecRef();
-        LOG(INFO, "Remove #%ld meta info done, ref= %ld", block_id, block->GetRef());
-        ret = true;
-    } else {
-        ret = false;
+bool BlockManager::LoadTrash(size_t disk) {
+    std::string trash_dir = store_path_list_[disk] + "trash";
+    if (mkdir(trash_dir.c_str(), 0755) != 0 && errno != EEXIST) {
+        LOG(WARNING, "Create trash %s fail: %s", trash_dir.c_str(), strerror(errno));
+        return false;
     }
-    block->DecRef();
-    return ret;
+    DIR* dir = opendir(trash_dir.c_str());
+    if (dir == NULL) {
+        LOG(WARNING, "Open trash %s fail: %s", trash_dir.c_str(), strerror(errno));
+        return false;
+    }
+    // Deletes not purged before the last shutdown
+    int64_t files = 0;
+    struct dirent* entry = NULL;
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.') {
+            continue;
+        }
+        std::string file = trash_dir + "/" + entry->d_name;
+        struct stat st;
+        int64_t size = stat(file.c_str(), &st) == 0 ? st.st_size : 0;
+        MutexLock lock(&trash_mu_, "BlockManager::LoadTrash", 1000);
+        trash_.push_back(std::make_pair(file, size));
+        trash_bytes_ += size;
+        ++files;
+    }
+    closedir(dir);
+    if (files) {
+        LOG(INFO, "%ld files to purge in %s", files, trash_dir.c_str());
+    }
+    return true;
+}
+
+int64_t BlockManager::PurgeTrash(IoThrottle* throttle) {
+    while (true) {
+        std::pair<std::string, int64_t> file;
+        {
+            MutexLock lock(&trash_mu_, "BlockManager::PurgeTrash", 1000);
+            if (trash_.empty()) {
+                return 0;
+            }
+            file = trash_.front();
+            trash_.pop_front();
+            trash_bytes_ -= file.second;
+        }
+        if (unlink(file.first.c_str()) != 0 && errno != ENOENT) {
+            LOG(WARNING, "Purge %s fail: %s", file.first.c_str(), strerror(errno));
+        }
+        int64_t wait = throttle ? throttle->Reserve(kDeleteIo, file.second) : 0;
+        if (wait > 0) {
+            return wait;
+        }
+    }
+}
+
+int64_t BlockManager::TrashBytes() {
+    MutexLock lock(&trash_mu_, "BlockManager::TrashBytes", 1000);
+    return trash_bytes_;
 }
 
 bool BlockManager::RemoveAllBlocks() {
@@ -408,19 +1099,302 @@ bool BlockManager::RemoveAllBlocks() {
     return true;
 }
 
+DiskScheduler* BlockManager::GetDiskScheduler() {
+    return disk_scheduler_;
+}
+
+void BlockManager::GetDiskInfo(std::vector<DiskInfo>* disks) {
+    MutexLock lock(&disk_mu_, "BlockManager::GetDiskInfo", 1000);
+    RefreshDiskInfo();
+    *disks = disk_info_;
+}
+
+void BlockManager::ListMoveCandidates(const std::string& store_path, int32_t num,
+                                      std::vector<int64_t>* blocks) {
+    for (int32_t i = 0; i < kBlockMapShardNum && num > 0; i++) {
+        BlockMapShard& shard = block_map_[i];
+        MutexLock lock(&shard.mu, "BlockManager::ListMoveCandidates", 1000);
+        for (std::map<int64_t, Block*>::iterator it = shard.blocks.begin();
+             it != shard.blocks.end() && num > 0; ++it) {
+            Block* block = it->second;
+            if (block->IsFinished() && !block->IsRecover()
+                && block->GetStorageClass() != kStorageMemory
+                && block->GetStorePath() == store_path) {
+                blocks->push_back(it->first);
+                --num;
+            }
+        }
+        for (std::map<int64_t, SealedBlock>::iterator it = shard.sealed.begin();
+             it != shard.sealed.end() && num > 0; ++it) {
+            if (store_path_list_[it->second.disk] == store_path) {
+                blocks->push_back(it->first);
+                --num;
+            }
+        }
+    }
+}
+
+void BlockManager::ListTierCandidates(StorageMedia media, bool hot, int32_t heat, int32_t num,
+                                      std::vector<int64_t>* blocks) {
+    std::vector<std::pair<int32_t, int64_t> > candidates;
+    for (int32_t i = 0; i < kBlockMapShardNum; i++) {
+        BlockMapShard& shard = block_map_[i];
+        MutexLock lock(&shard.mu, "BlockManager::ListTierCandidates", 1000);
+        for (std::map<int64_t, Block*>::iterator it = shard.blocks.begin();
+             it != shard.blocks.end(); ++it) {
+            Block* block = it->second;
+            int32_t block_heat = block->Heat();
+            if (block->IsFinished() && !block->IsRecover()
+                && block->GetStorageClass() != kStorageMemory
+                && !block->GetMeta().has_media()
+                && (block_heat >= heat) == hot
+                && GetDiskMedia(block->GetStorePath()) == media) {
+                candidates.push_back(std::make_pair(block_heat, it->first));
+            }
+        }
+        for (std::map<int64_t, SealedBlock>::iterator it = shard.sealed.begin();
+             it != shard.sealed.end(); ++it) {
+            const SealedBlock& sealed = it->second;
+            if (!sealed.pinned && (sealed.heat >= heat) == hot
+                && store_media_[sealed.disk] == media) {
+                candidates.push_back(std::make_pair(sealed.heat, it->first));
+            }
+        }
+    }
+    int32_t n = std::min(num, static_cast<int32_t>(candidates.size()));
+    if (hot) {
+        std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end(),
+                          std::greater<std::pair<int32_t, int64_t> >());
+    } else {
+        std::partial_sort(candidates.begin(), candidates.begin() + n, candidates.end());
+    }
+    for (int32_t i = 0; i < n; i++) {
+        blocks->push_back(candidates[i].second);
+    }
+}
+
+void BlockManager::CoolBlocks() {
+    for (int32_t i = 0; i < kBlockMapShardNum; i++) {
+        BlockMapShard& shard = block_map_[i];
+        MutexLock lock(&shard.mu, "BlockManager::CoolBlocks", 1000);
+        for (std::map<int64_t, Block*>::iterator it = shard.blocks.begin();
+             it != shard.blocks.end(); ++it) {
+            it->second->Cool();
+        }
+        for (std::map<int64_t, SealedBlock>::iterator it = shard.sealed.begin();
+             it != shard.sealed.end(); ++it) {
+            it->second.heat >>= 1;
+        }
+    }
+}
+
+bool BlockManager::CopyBlockFile(const std::string& src_file, const std::string& dest_file,
+                                 int64_t size, IoThrottle* throttle) {
+    int src_fd = open(src_file.c_str(), O_RDONLY);
+    if (src_fd < 0) {
+        LOG(WARNING, "Open %s for move fail: %s", src_file.c_str(), strerror(errno));
+        return false;
+    }
+    std::string dir = dest_file.substr(0, dest_file.rfind('/'));
+    mkdir(dir.c_str(), 0755);
+    std::string tmp_file = dest_file + ".tmp";
+    int dest_fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR);
+    if (dest_fd < 0) {
+        LOG(WARNING, "Open %s for move fail: %s", tmp_file.c_str(), strerror(errno));
+        close(src_fd);
+        return false;
+    }
+    if (size > 0 && fallocate(dest_fd, 0, 0, size) != 0) {
+        LOG(DEBUG, "Preallocate %s fail: %s", tmp_file.c_str(), strerror(errno));
+    }
+    const int64_t buf_len = 1 << 20;
+    char* buf = new char[buf_len];
+    int64_t copied = 0;
+    bool ret = true;
+    while (copied < size) {
+        int64_t len = read(src_fd, buf, std::min(buf_len, size - copied));
+        if (len <= 0) {
+            LOG(WARNING, "Read %s at %ld for move fail: %s",
+                src_file.c_str(), copied, strerror(errno));
+            ret = false;
+            break;
+        }
+        int64_t wlen = 0;
+        while (wlen < len) {
+            int64_t w = write(dest_fd, buf + wlen, len - wlen);
+            if (w < 0) {
+                LOG(WARNING, "Write %s for move fail: %s", tmp_file.c_str(), strerror(errno));
+                ret = false;
+                break;
+            }
+            wlen += w;
+        }
+        if (!ret) {
+            break;
+        }
+        copied += len;
+        if (throttle) {
+            throttle->Acquire(kBalanceIo, len);
+        }
+    }
+    delete[] buf;
+    close(src_fd);
+    if (ret && fsync(dest_fd) != 0) {
+        LOG(WARNING, "Sync %s fail: %s", tmp_file.c_str(), strerror(errno));
+        ret = false;
+    }
+    close(dest_fd);
+    if (ret && rename(tmp_file.c_str(), dest_file.c_str()) != 0) {
+        LOG(WARNING, "Rename %s fail: %s", tmp_file.c_str(), strerror(errno));
+        ret = false;
+    }
+    if (!ret) {
+        remove(tmp_file.c_str());
+    }
+    return ret;
+}
+
+StatusCode BlockManager::MoveBlock(int64_t block_id, const std::string& dest_path,
+                                   IoThrottle* throttle, int64_t* block_size) {
+    Block* block = FindBlock(block_id);
+    if (block == NULL) {
+        return kCsNotFound;
+    }
+    std::string src_path = block->GetStorePath();
+    leveldb::DB* src_db = GetMetaDB(src_path);
+    leveldb::DB* dest_db = GetMetaDB(dest_path);
+    if (!block->IsFinished() || block->IsRecover() || src_path == dest_path
+        || src_db == NULL || dest_db == NULL) {
+        block->DecRef();
+        return kBadParameter;
+    }
+    BlockMeta meta = block->GetMeta();
+    std::string src_file = src_path + Block::BuildFilePath(block_id);
+    std::string dest_file = dest_path + Block::BuildFilePath(block_id);
+    std::string idstr = BlockId2Str(block_id);
+    std::string meta_buf;
+    // Until the switch, the copy on dest_path is the one to drop after a crash
+    meta.set_store_path(dest_path);
+    meta.SerializeToString(&meta_buf);
+    leveldb::Status s = dest_db->Put(leveldb::WriteOptions(), MoveRecordKey(), meta_buf);
+    if (!s.ok()) {
+        LOG(WARNING, "Write move record of #%ld fail: %s", block_id, s.ToString().c_str());
+        block->DecRef();
+        return kSyncMetaFailed;
+    }
+    if (!CopyBlockFile(src_file, dest_file, meta.block_size(), throttle)) {
+        remove(dest_file.c_str());
+        dest_db->Delete(leveldb::WriteOptions(), MoveRecordKey());
+        block->DecRef();
+        return kWriteError;
+    }
+    StatusCode status = kOK;
+    {
+        MutexLock lock(&move_mu_, "BlockManager::MoveBlock", 1000);
+        std::string value;
+        if (!src_db->Get(leveldb::ReadOptions(), idstr, &value).ok()
+            || !block->SetStorePath(dest_path, disk_scheduler_->WritePool(dest_path))) {
+            LOG(INFO, "#%ld removed while moving to %s", block_id, dest_path.c_str());
+            status = kCsNotFound;
+        } else {
+            BlockMeta src_meta = meta;
+            src_meta.set_store_path(src_path);
+            std::string src_buf;
+            src_meta.SerializeToString(&src_buf);
+            // The dest disk takes the block, and records the source copy as stale
+            leveldb::WriteBatch batch;
+            batch.Put(idstr, meta_buf);
+            batch.Put(MoveRecordKey(), src_buf);
+            leveldb::WriteOptions options;
+            options.sync = FLAGS_chunkserver_sync_meta;
+            s = dest_db->Write(options, &batch);
+            if (!s.ok()) {
+                LOG(WARNING, "Switch meta of #%ld fail: %s", block_id, s.ToString().c_str());
+                block->SetStorePath(src_path, disk_scheduler_->WritePool(src_path));
+                status = kSyncMetaFailed;
+            } else {
+                src_db->Delete(leveldb::WriteOptions(), idstr);
+            }
+        }
+    }
+    if (status == kOK) {
+        // Readers that took the old path before the switch find it gone and retry
+        // at dest_path, cached fds keep the trashed file until released
+        MoveToTrash(block_id, src_path, meta.block_size());
+    } else {
+        file_cache_->EraseFileCache(dest_file);
+        remove(dest_file.c_str());
+    }
+    dest_db->Delete(leveldb::WriteOptions(), MoveRecordKey());
+    if (status == kOK) {
+        LOG(INFO, "Move #%ld %ld bytes from %s to %s",
+            block_id, meta.block_size(), src_path.c_str(), dest_path.c_str());
+        if (block_size) *block_size = meta.block_size();
+    }
+    block->DecRef();
+    return status;
+}
+
+bool BlockManager::CleanMoveRecord(size_t disk) {
+    leveldb::DB* metadb = metadbs_[disk];
+    std::string value;
+    leveldb::Status s = metadb->Get(leveldb::ReadOptions(), MoveRecordKey(), &value);
+    if (!s.ok()) {
+        return true;
+    }
+    BlockMeta stale;
+    if (stale.ParseFromString(value)) {
+        std::string idstr = BlockId2Str(stale.block_id());
+        BlockMeta current;
+        std::string current_buf;
+        s = metadb->Get(leveldb::ReadOptions(), idstr, &current_buf);
+        leveldb::DB* stale_db = GetMetaDB(stale.store_path());
+        if (s.ok() && current.ParseFromString(current_buf)
+            && current.store_path() == stale.store_path()) {
+            LOG(WARNING, "Move record of #%ld points to the live copy, keep it",
+                stale.block_id());
+        } else {
+            if (stale_db != NULL && stale_db != metadb) {
+                // The move switched to this disk, the source disk may still list the block
+                BlockMeta source;
+                std::string source_buf;
+                if (stale_db->Get(leveldb::ReadOptions(), idstr, &source_buf).ok()
+                    && source.ParseFromString(source_buf)
+                    && source.store_path() == stale.store_path()) {
+                    stale_db->Delete(leveldb::WriteOptions(), idstr);
+                }
+            }
+            std::string file_path = stale.store_path() + Block::BuildFilePath(stale.block_id());
+            remove(file_path.c_str());
+            remove((file_path + ".tmp").c_str());
+            LOG(INFO, "Remove stale copy of interrupted move: %s", file_path.c_str());
+        }
+    }
+    s = metadb->Delete(leveldb::WriteOptions(), MoveRecordKey());
+    if (!s.ok()) {
+        LOG(WARNING, "Clear move record on %s fail: %s",
+            store_path_list_[disk].c_str(), s.ToString().c_str());
+        return false;
+    }
+    return true;
+}
+
 bool BlockManager::RemoveAllBlocksAsync() {
-    leveldb::Iterator* it = metadb_->NewIterator(leveldb::ReadOptions());
-    for (it->Seek(BlockId2Str(0)); it->Valid(); it->Next()) {
-        int64_t block_id = 0;
-        if (1 != sscanf(it->key().data(), "%ld", &block_id)) {
-            LOG(FATAL, "[ListBlocks] Unknown meta key: %s\n",
-                it->key().ToString().c_str());
-            delete it;
-            return false;
+    for (size_t i = 0; i < metadbs_.size(); i++) {
+        ThreadPool* pool = disk_scheduler_->WritePool(store_path_list_[i]);
+        leveldb::Iterator* it = metadbs_[i]->NewIterator(leveldb::ReadOptions());
+        for (it->Seek(BlockId2Str(0)); it->Valid(); it->Next()) {
+            int64_t block_id = 0;
+            if (1 != sscanf(it->key().data(), "%ld", &block_id)) {
+                LOG(FATAL, "[ListBlocks] Unknown meta key: %s\n",
+                    it->key().ToString().c_str());
+                delete it;
+                return false;
+            }
+            pool->AddTask(boost::bind(&BlockManager::RemoveBlock, this, block_id));
         }
-        thread_pool_->AddTask(boost::bind(&BlockManager::RemoveBlock, this, block_id));
+        delete it;
     }
-    delete it;
     return true;
 }
 
@@ -8,11 +8,14 @@
 #define  BAIDU_BFS_BLOCK_MANAGER_H_
 
 #include <stdint.h>
+#include <deque>
 #include <map>
 #include <string>
 #include <vector>
 
+#include <boost/function.hpp>
 #include <common/thread_pool.h>
+#include "chunkserver/disk_selector.h"
 #include "proto/status_code.pb.h"
 
 namespace leveldb {
@@ -25,39 +28,144 @@ namespace bfs {
 class BlockMeta;
 class Block;
 class FileCache;
+class DiskScheduler;
+class IoThrottle;
+class MetaCommitter;
+class FileSyncer;
+class Journal;
 
 class BlockManager {
 public:
     BlockManager(const std::string& store_path);
     ~BlockManager();
     int64_t DiskQuota()  const;
+    /// Part of DiskQuota on store paths tagged [ssd]
+    int64_t SsdQuota() const;
+    /// Comma separated store paths, "[ssd]" before a path marks it as ssd
     void CheckStorePath(const std::string& store_path);
+    /// Placement of blocks whose meta has no store path
     const std::string& GetStorePath(int64_t block_id);
+    /// Placement of new blocks, by the disk select policy among disks of media,
+    /// hdd ones for kMediaAny, or among all disks if there is none
+    std::string SelectStorePath(int64_t block_id, StorageMedia media = kMediaAny);
+    /// Media of a configured store path, kMediaAny if unknown
+    StorageMedia GetDiskMedia(const std::string& store_path);
     /// Load meta from disk
     bool LoadStorage();
     int64_t NameSpaceVersion() const;
     bool SetNameSpaceVersion(int64_t version);
     bool ListBlocks(std::vector<BlockMeta>* blocks, int64_t offset, int32_t num);
-    Block* CreateBlock(int64_t block_id, int64_t* sync_time, StatusCode* status);
+    /// A block created on a given media is pinned there, the tier mover leaves it alone
+    Block* CreateBlock(int64_t block_id, int64_t* sync_time, StatusCode* status,
+                       StorageClass storage_class = kStorageDisk,
+                       StorageMedia media = kMediaAny);
+    /// Memory budget of memory and lazy persist blocks has room for len bytes
+    bool MemoryAvailable(int64_t len);
     Block* FindBlock(int64_t block_id);
     std::string BlockId2Str(int64_t block_id);
     bool SyncBlockMeta(const BlockMeta& meta, int64_t* sync_time);
     bool CloseBlock(Block* block);
+    /// Write buffered data of block to its file, and make it durable if to_disk
+    bool SyncBlockData(Block* block, bool to_disk);
     bool RemoveBlock(int64_t block_id);
+    /// Metas are removed in one write per disk, files go to the trash of their disk,
+    /// return the number of blocks removed
+    int64_t RemoveBlocks(const std::vector<int64_t>& block_ids);
+    /// Unlink trash files until throttle asks to wait, return the micros to wait,
+    /// 0 if the trash is empty
+    int64_t PurgeTrash(IoThrottle* throttle);
+    int64_t TrashBytes();
     bool RemoveAllBlocksAsync();
     bool RemoveAllBlocks();
+    DiskScheduler* GetDiskScheduler();
+    /// Usage and load of every store path
+    void GetDiskInfo(std::vector<DiskInfo>* disks);
+    /// Up to num closed blocks on store_path
+    void ListMoveCandidates(const std::string& store_path, int32_t num,
+                            std::vector<int64_t>* blocks);
+    /// Copy a closed block to dest_path and switch readers and meta to the copy
+    StatusCode MoveBlock(int64_t block_id, const std::string& dest_path,
+                         IoThrottle* throttle, int64_t* block_size);
+    /// Up to num closed blocks on disks of media that are not pinned to it,
+    /// hottest first of those read at least heat times if hot, else coldest first
+    /// of those read less
+    void ListTierCandidates(StorageMedia media, bool hot, int32_t heat, int32_t num,
+                            std::vector<int64_t>* blocks);
+    /// Halve the read heat of every block, so heat follows recent reads
+    void CoolBlocks();
+    /// Drop Block objects of closed blocks nobody uses, keep them in the compact index
+    int64_t CompactBlocks();
 private:
-    bool RemoveBlockMeta(int64_t block_id);
+    /// Closed block without a Block object, the metadb has the full meta
+    struct SealedBlock {
+        int64_t size;
+        int64_t version;
+        int16_t disk;   ///< index in store_path_list_
+        uint8_t heat;   ///< Block::Heat, capped
+        bool pinned;    ///< BlockMeta has media
+    };
+    /// Part of the block index, blocks are spread over shards by id
+    struct BlockMapShard {
+        Mutex mu;
+        std::map<int64_t, Block*> blocks;  ///< blocks in use, holds a ref of each block
+        std::map<int64_t, SealedBlock> sealed;
+    };
+    BlockMapShard* GetShard(int64_t block_id);
+    /// Create the Block object of a sealed block, shard->mu must be held
+    Block* OpenSealedBlock(BlockMapShard* shard, int64_t block_id);
+    void BackgroundCompact();
+    /// Metadb of a configured store path, NULL if unknown
+    leveldb::DB* GetMetaDB(const std::string& store_path);
+    MetaCommitter* GetMetaCommitter(const std::string& store_path);
+    FileSyncer* GetFileSyncer(const std::string& store_path);
+    bool OpenMetaDB(size_t disk);
+    /// Run task on all disks in parallel, true if it succeeds on every disk
+    bool ForEachDisk(const boost::function<bool (size_t)>& task);
+    /// Move metas of blocks stored on other disks to their own metadb
+    bool MigrateMeta(size_t disk);
+    /// Index blocks of a disk, block files are checked unless it was shut down cleanly
+    bool LoadDiskMeta(size_t disk, std::vector<int64_t>* block_nums);
+    /// Block file exists and holds the size in meta, a longer tail is left
+    /// by an append never closed and is truncated if truncate_tail
+    bool CheckBlockFile(const BlockMeta& meta, bool truncate_tail);
+    /// Background check of blocks loaded without checking their files
+    void VerifyDiskBlocks(size_t disk);
+    bool SetDiskVersion(size_t disk, int64_t version);
+    /// Rename the block file under store_path into its trash, du bytes are freed by PurgeTrash
+    void MoveToTrash(int64_t block_id, const std::string& store_path, int64_t du);
+    /// Queue trash files left by the last run for purging
+    bool LoadTrash(size_t disk);
+    void RefreshDiskInfo();
+    bool CopyBlockFile(const std::string& src_file, const std::string& dest_file,
+                       int64_t size, IoThrottle* throttle);
+    /// Remove the stale copy left by a move interrupted by crash
+    bool CleanMoveRecord(size_t disk);
 private:
-    ThreadPool* thread_pool_;
+    DiskScheduler* disk_scheduler_;
+    DiskSelector* disk_selector_;
+    Mutex disk_mu_;
+    std::vector<DiskInfo> disk_info_;   ///< guarded by disk_mu_
+    int64_t disk_info_time_;
     std::vector<std::string> store_path_list_;
-    typedef std::map<int64_t, Block*> BlockMap;
-    BlockMap  block_map_;
-    leveldb::DB* metadb_;
+    std::vector<StorageMedia> store_media_;    ///< media of each store path, same order
+    static const int32_t kBlockMapShardNum = 64;
+    BlockMapShard block_map_[kBlockMapShardNum];
+    std::vector<leveldb::DB*> metadbs_;  ///< one per store path, same order
+    std::vector<MetaCommitter*> meta_committers_;   ///< block meta writes of each metadb
+    std::vector<FileSyncer*> file_syncers_;         ///< block file syncs of each disk
+    Journal* journal_;      ///< durable writes go here instead of file syncs, if set
     FileCache* file_cache_;
-    Mutex   mu_;
+    ThreadPool* background_thread_;    ///< block verification and index compaction
+    volatile bool stop_background_;
+    std::vector<std::vector<int64_t> > unverified_;  ///< blocks of each disk to verify
+    Mutex   mu_;        ///< serializes storage loading and namespace version updates
+    Mutex   trash_mu_;
+    std::deque<std::pair<std::string, int64_t> > trash_;    ///< file and size, guarded by trash_mu_
+    int64_t trash_bytes_;
+    Mutex   move_mu_;   ///< orders MoveBlock's meta switch with RemoveBlock
     int64_t namespace_version_;
     int64_t disk_quota_;
+    int64_t ssd_quota_;
 };
 
 } // bfs
@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/vfs.h>
@@ -31,6 +32,12 @@
 #include "chunkserver/counter_manager.h"
 #include "chunkserver/data_block.h"
 #include "chunkserver/block_manager.h"
+#include "chunkserver/disk_balancer.h"
+#include "chunkserver/tier_mover.h"
+#include "chunkserver/disk_scheduler.h"
+#include "chunkserver/io_throttle.h"
+#include "ec/ec_layout.h"
+#include "ec/rs_codec.h"
 
 // Avoid conflict, we define LOG...
 #include <common/logging.h>
@@ -44,11 +51,26 @@ DECLARE_int32(blockreport_interval);
 DECLARE_int32(blockreport_size);
 DECLARE_int32(write_buf_size);
 DECLARE_int32(chunkserver_work_thread_num);
+DECLARE_int32(chunkserver_inline_write_size);
 DECLARE_int32(chunkserver_read_thread_num);
 DECLARE_int32(chunkserver_write_thread_num);
 DECLARE_int32(chunkserver_recover_thread_num);
+DECLARE_int32(chunkserver_recover_window);
+DECLARE_bool(chunkserver_multi_source_recover);
+DECLARE_int32(chunkserver_foreground_io_rate);
+DECLARE_int32(chunkserver_recover_io_rate);
+DECLARE_int32(chunkserver_scrub_io_rate);
+DECLARE_int32(chunkserver_delete_io_rate);
+DECLARE_int32(chunkserver_balance_io_rate);
+DECLARE_int32(chunkserver_transcode_io_rate);
+DECLARE_int32(chunkserver_disk_balance_interval);
+DECLARE_int32(chunkserver_disk_balance_threshold);
+DECLARE_int32(chunkserver_tier_move_interval);
+DECLARE_int32(chunkserver_hot_block_reads);
+DECLARE_int32(chunkserver_ssd_usage_limit);
 DECLARE_int32(chunkserver_max_pending_buffers);
 DECLARE_int64(chunkserver_max_unfinished_bytes);
+DECLARE_int32(chunkserver_reopen_timeout);
 DECLARE_bool(chunkserver_auto_clean);
 DECLARE_int32(block_report_timeout);
 
@@ -74,6 +96,7 @@ extern common::Counter g_rpc_delay;
 extern common::Counter g_rpc_delay_all;
 extern common::Counter g_rpc_count;
 extern common::Counter g_data_size;
+extern common::Counter g_memory_data;
 
 ChunkServerImpl::ChunkServerImpl()
     : chunkserver_id_(-1),
@@ -90,12 +113,29 @@ ChunkServerImpl::ChunkServerImpl()
     write_thread_pool_ = new ThreadPool(FLAGS_chunkserver_write_thread_num);
     recover_thread_pool_ = new ThreadPool(FLAGS_chunkserver_recover_thread_num);
     heartbeat_thread_ = new ThreadPool(1);
+    balance_thread_ = new ThreadPool(1);
+    // One thread for removals, one for the purge loop
+    delete_thread_ = new ThreadPool(2);
     block_manager_ = new BlockManager(FLAGS_block_store_path);
     bool s_ret = block_manager_->LoadStorage();
     assert(s_ret == true);
     rpc_client_ = new RpcClient();
     nameserver_ = new NameServerClient(rpc_client_, FLAGS_nameserver_nodes);
     counter_manager_ = new CounterManager;
+    io_throttle_ = new IoThrottle;
+    io_throttle_->SetRate(kForegroundIo, static_cast<int64_t>(FLAGS_chunkserver_foreground_io_rate) << 20);
+    io_throttle_->SetRate(kRecoverIo, static_cast<int64_t>(FLAGS_chunkserver_recover_io_rate) << 20);
+    io_throttle_->SetRate(kScrubIo, static_cast<int64_t>(FLAGS_chunkserver_scrub_io_rate) << 20);
+    io_throttle_->SetRate(kDeleteIo, static_cast<int64_t>(FLAGS_chunkserver_delete_io_rate) << 20);
+    io_throttle_->SetRate(kBalanceIo, static_cast<int64_t>(FLAGS_chunkserver_balance_io_rate) << 20);
+    io_throttle_->SetRate(kTranscodeIo, static_cast<int64_t>(FLAGS_chunkserver_transcode_io_rate) << 20);
+    disk_balancer_ = new DiskBalancer(block_manager_, io_throttle_);
+    balance_thread_->DelayTask(FLAGS_chunkserver_disk_balance_interval * 1000,
+                               boost::bind(&ChunkServerImpl::BalanceDisks, this));
+    tier_mover_ = new TierMover(block_manager_, io_throttle_);
+    balance_thread_->DelayTask(FLAGS_chunkserver_tier_move_interval * 1000,
+                               boost::bind(&ChunkServerImpl::MoveTiers, this));
+    delete_thread_->AddTask(boost::bind(&ChunkServerImpl::PurgeTrash, this));
     heartbeat_thread_->AddTask(boost::bind(&ChunkServerImpl::LogStatus, this, true));
     heartbeat_thread_->AddTask(boost::bind(&ChunkServerImpl::Register, this));
 }
@@ -107,15 +147,22 @@ ChunkServerImpl::~ChunkServerImpl() {
     read_thread_pool_->Stop(true);
     write_thread_pool_->Stop(true);
     heartbeat_thread_->Stop(true);
+    balance_thread_->Stop(true);
+    delete_thread_->Stop(true);
     delete block_manager_;
     delete rpc_client_;
     LogStatus(false);
     delete counter_manager_;
+    delete disk_balancer_;
+    delete tier_mover_;
+    delete io_throttle_;
     delete recover_thread_pool_;
     delete work_thread_pool_;
     delete read_thread_pool_;
     delete write_thread_pool_;
     delete heartbeat_thread_;
+    delete balance_thread_;
+    delete delete_thread_;
 }
 
 void ChunkServerImpl::LogStatus(bool routine) {
@@ -124,14 +171,19 @@ void ChunkServerImpl::LogStatus(bool routine) {
 
     LOG(INFO, "[Status] blocks %ld %ld buffers %ld pending %ld data %sB, "
               "find %ld read %ld write %ld %ld %.2f MB, rpc %ld %ld %ld, "
-              "unfinished: %ld recovering %ld",
+              "unfinished: %ld recovering %ld, meta %ld batch %ld %ldus, "
+              "sync %ld batch %ld %ldus, trash %sB, memory %sB, throttle wait %ldms/s",
         g_writing_blocks.Get() ,g_blocks.Get(), g_block_buffers.Get(), g_pending_writes.Get(),
         common::HumanReadableString(g_data_size.Get()).c_str(),
         counters.find_ops, counters.read_ops,
         counters.write_ops, counters.refuse_ops,
         counters.write_bytes / 1024.0 / 1024,
         counters.rpc_delay, counters.delay_all, work_thread_pool_->PendingNum(),
-        counters.unfinished_write_bytes, g_recover_count.Get());
+        counters.unfinished_write_bytes, g_recover_count.Get(),
+        counters.meta_ops, counters.meta_batch_size, counters.meta_commit_latency,
+        counters.data_syncs, counters.data_sync_batch, counters.data_flush_latency,
+        common::HumanReadableString(block_manager_->TrashBytes()).c_str(),
+        common::HumanReadableString(g_memory_data.Get()).c_str(), counters.io_throttle_wait);
     if (routine) {
         heartbeat_thread_->DelayTask(1000,
             boost::bind(&ChunkServerImpl::LogStatus, this, true));
@@ -142,6 +194,7 @@ void ChunkServerImpl::Register() {
     RegisterRequest request;
     request.set_chunkserver_addr(data_server_addr_);
     request.set_disk_quota(block_manager_->DiskQuota());
+    request.set_ssd_quota(block_manager_->SsdQuota());
     request.set_namespace_version(block_manager_->NameSpaceVersion());
     request.set_tag(FLAGS_chunkserver_tag);
 
@@ -218,6 +271,17 @@ void ChunkServerImpl::SendHeartbeat() {
     request.set_r_qps(counters.read_ops);
     request.set_r_speed(counters.read_bytes);
     request.set_recover_speed(counters.recover_bytes);
+    if (block_manager_->SsdQuota() > 0) {
+        std::vector<DiskInfo> disks;
+        block_manager_->GetDiskInfo(&disks);
+        int64_t ssd_free = 0;
+        for (size_t i = 0; i < disks.size(); i++) {
+            if (disks[i].media == kMediaSsd) {
+                ssd_free += disks[i].free_size;
+            }
+        }
+        request.set_ssd_free(ssd_free);
+    }
     HeartBeatResponse response;
     if (!nameserver_->SendRequest(&NameServer_Stub::HeartBeat, &request, &response, 15)) {
         LOG(WARNING, "Heart beat fail\n");
@@ -306,9 +370,8 @@ void ChunkServerImpl::SendBlockReport() {
         }
         if (!obsolete_blocks.empty()) {
             boost::function<void ()> task =
-                boost::bind(&ChunkServerImpl::RemoveObsoleteBlocks,
-                            this, obsolete_blocks);
-            write_thread_pool_->AddTask(task);
+                boost::bind(&ChunkServerImpl::RemoveObsoleteBlocks, this, obsolete_blocks);
+            delete_thread_->AddTask(task);
         }
 
         LOG(INFO, "Block report (%lu) done. %d replica blocks last_id %ld next_id %ld",
@@ -327,6 +390,15 @@ void ChunkServerImpl::SendBlockReport() {
             }
         }
 
+        for (int i = 0; i < response.transcode_blocks_size(); ++i) {
+            const TranscodeInfo& info = response.transcode_blocks(i);
+            int32_t cancel_time = common::timer::now_time() + info.timeout();
+            LOG(INFO, "schedule transcode #%ld to group #%ld",
+                info.block_id(), info.ec_group_id());
+            recover_thread_pool_->AddTask(
+                boost::bind(&ChunkServerImpl::TranscodeBlock, this, info, cancel_time));
+        }
+
         for (int i = 0; i < response.close_blocks_size(); ++i) {
             boost::function<void ()> close_block_task = // TODO
                 boost::bind(&ChunkServerImpl::CloseIncompleteBlock, this, response.close_blocks(i));
@@ -400,7 +472,7 @@ void ChunkServerImpl::WriteBlock(::google::protobuf::RpcController* controller,
     }
 
     response->add_timestamp(common::timer::get_micros());
-    LOG(INFO, "[WriteBlock] #%ld seq:%d, offset:%ld, len:%lu",
+    LOG(DEBUG, "[WriteBlock] #%ld seq:%d, offset:%ld, len:%lu",
            block_id, packet_seq, offset, databuf.size());
 
     int next_cs_offset = -1;
@@ -418,6 +490,9 @@ void ChunkServerImpl::WriteBlock(::google::protobuf::RpcController* controller,
         const std::string& next_server = request->chunkservers(next_cs_offset);
         rpc_client_->GetStub(next_server, &stub);
         WriteNext(next_server, stub, next_request, next_response, request, response, done);
+    } else if (static_cast<int64_t>(databuf.size()) <= FLAGS_chunkserver_inline_write_size) {
+        // Already on a work thread, small packets like wal appends skip another queueing
+        LocalWriteBlock(request, response, done);
     } else {
         boost::function<void ()> callback =
             boost::bind(&ChunkServerImpl::LocalWriteBlock, this, request, response, done);
@@ -434,7 +509,7 @@ void ChunkServerImpl::WriteNext(const std::string& next_server,
                                 ::google::protobuf::Closure* done) {
     int64_t block_id = request->block_id();
     int32_t packet_seq = request->packet_seq();
-    LOG(INFO, "[WriteBlock] send #%ld seq:%d to next %s\n",
+    LOG(DEBUG, "[WriteBlock] send #%ld seq:%d to next %s\n",
         block_id, packet_seq, next_server.c_str());
     boost::function<void (const WriteBlockRequest*, WriteBlockResponse*, bool, int)> callback =
         boost::bind(&ChunkServerImpl::WriteNextCallback,
@@ -481,7 +556,7 @@ void ChunkServerImpl::WriteNextCallback(const WriteBlockRequest* next_request,
         done->Run();
         return;
     } else {
-        LOG(INFO, "[Writeblock] send #%ld seq:%d to next done", block_id, packet_seq);
+        LOG(DEBUG, "[Writeblock] send #%ld seq:%d to next done", block_id, packet_seq);
         delete next_response;
     }
 
@@ -507,9 +582,39 @@ void ChunkServerImpl::LocalWriteBlock(const WriteBlockRequest* request,
     int64_t sync_time = 0;
     Block* block = NULL;
 
-    if (packet_seq == 0) {
+    if (packet_seq == 0 && request->has_append_version()) {
+        block = block_manager_->FindBlock(block_id);
+        StatusCode s = block ? block->Reopen(request->append_version(), offset) : kCsNotFound;
+        if (s != kOK) {
+            LOG(INFO, "[LocalWriteBlock] #%ld reopen V%ld %ld failed, reason %s",
+                block_id, request->append_version(), offset, StatusCode_Name(s).c_str());
+            if (block) {
+                block->DecRef();
+            }
+            response->set_status(s);
+            g_unfinished_bytes.Sub(databuf.size());
+            done->Run();
+            return;
+        }
+        // The writer may fail on another replica and never come back
+        work_thread_pool_->DelayTask(FLAGS_chunkserver_reopen_timeout * 1000,
+            boost::bind(&ChunkServerImpl::CancelReopen, this, block_id));
+    } else if (packet_seq == 0) {
         StatusCode s;
-        block = block_manager_->CreateBlock(block_id, &sync_time, &s);
+        // Media of this replica, replica_media follows the chain, or has only ours
+        StorageMedia media = kMediaAny;
+        int32_t replica = 0;
+        for (int i = 0; i < request->chunkservers_size(); i++) {
+            if (request->chunkservers(i) == data_server_addr_) {
+                replica = i;
+                break;
+            }
+        }
+        if (replica < request->replica_media_size()) {
+            media = request->replica_media(replica);
+        }
+        block = block_manager_->CreateBlock(block_id, &sync_time, &s,
+                                            request->storage_class(), media);
         if (s != kOK) {
             LOG(INFO, "[LocalWriteBlock] #%ld created failed, reason %s",
                     block_id, StatusCode_Name(s).c_str());
@@ -523,6 +628,9 @@ void ChunkServerImpl::LocalWriteBlock(const WriteBlockRequest* request,
             done->Run();
             return;
         }
+        if (request->has_expected_size()) {
+            block->SetExpectedSize(request->expected_size());
+        }
     } else {
         block = block_manager_->FindBlock(block_id);
         if (!block) {
@@ -536,11 +644,26 @@ void ChunkServerImpl::LocalWriteBlock(const WriteBlockRequest* request,
     if (request->has_recover_version()) {
         block->SetRecover();
     }
-    LOG(INFO, "[WriteBlock] local write #%ld %d recover=%d",
+    if (block->GetStorageClass() == kStorageMemory
+        && !block_manager_->MemoryAvailable(databuf.size())) {
+        LOG(WARNING, "[WriteBlock] No memory for #%ld seq:%d len:%lu",
+            block_id, packet_seq, databuf.size());
+        block->DecRef();
+        response->set_status(kNoEnoughSpace);
+        g_unfinished_bytes.Sub(databuf.size());
+        done->Run();
+        return;
+    }
+    LOG(DEBUG, "[WriteBlock] local write #%ld %d recover=%d",
         block_id, packet_seq, block->IsRecover());
+    // Writes don't wait here, but their bytes count against the class budget, delay
+    // its later reads and hold back lower classes. Recover senders are throttled at the source.
+    io_throttle_->Reserve(request->has_recover_version() ? kRecoverIo : kForegroundIo,
+                          databuf.size());
     int64_t add_used = 0;
     int64_t write_start = common::timer::get_micros();
     if (!block->Write(packet_seq, offset, databuf.data(), databuf.size(), &add_used)) {
+        block->CancelReopen();
         block->DecRef();
         response->set_status(kWriteError);
         g_unfinished_bytes.Sub(databuf.size());
@@ -548,12 +671,32 @@ void ChunkServerImpl::LocalWriteBlock(const WriteBlockRequest* request,
         return;
     }
     int64_t write_end = common::timer::get_micros();
+    bool sync_to_disk = request->durability() == kDurabilityDisk;
+    bool synced = true;
     if (request->is_last()) {
         if (request->has_recover_version()) {
             block->SetVersion(request->recover_version());
             LOG(INFO, "Recover block set version #%ld V%d ", block_id, request->recover_version());
         }
+        // Before SetSliceNum, the packet completing the block must see it
+        if (sync_to_disk) {
+            block->SetSyncOnClose();
+        }
         block->SetSliceNum(packet_seq + 1);
+    } else if (request->durability() != kDurabilityMemory) {
+        // Sdk sends a sync packet once the packets before it are acked,
+        // so all of them are in the block and written out here
+        synced = block_manager_->SyncBlockData(block, sync_to_disk);
+    }
+    if (synced && block->IsComplete() && block->SyncOnClose()) {
+        synced = block_manager_->SyncBlockData(block, true);
+    }
+    if (!synced) {
+        block->DecRef();
+        response->set_status(kWriteError);
+        g_unfinished_bytes.Sub(databuf.size());
+        done->Run();
+        return;
     }
 
     // If complete, close block, and report only once(close block return true).
@@ -607,6 +750,40 @@ void ChunkServerImpl::CloseIncompleteBlock(int64_t block_id) {
     block->DecRef();
 }
 
+void ChunkServerImpl::CancelReopen(int64_t block_id) {
+    Block* block = block_manager_->FindBlock(block_id);
+    if (!block) {
+        return;
+    }
+    if (block->CancelReopen()) {
+        LOG(INFO, "[CancelReopen] no data for #%ld in %d s, sealed again",
+            block_id, FLAGS_chunkserver_reopen_timeout);
+    }
+    block->DecRef();
+}
+
+void ChunkServerImpl::BalanceDisks() {
+    if (FLAGS_chunkserver_disk_balance_threshold > 0) {
+        disk_balancer_->Balance(FLAGS_chunkserver_disk_balance_threshold / 100.0,
+                                &service_stop_);
+    }
+    if (!service_stop_) {
+        balance_thread_->DelayTask(FLAGS_chunkserver_disk_balance_interval * 1000,
+                                   boost::bind(&ChunkServerImpl::BalanceDisks, this));
+    }
+}
+
+void ChunkServerImpl::MoveTiers() {
+    if (FLAGS_chunkserver_hot_block_reads > 0 && block_manager_->SsdQuota() > 0) {
+        tier_mover_->Move(FLAGS_chunkserver_hot_block_reads,
+                          FLAGS_chunkserver_ssd_usage_limit / 100.0, &service_stop_);
+    }
+    if (!service_stop_) {
+        balance_thread_->DelayTask(FLAGS_chunkserver_tier_move_interval * 1000,
+                                   boost::bind(&ChunkServerImpl::MoveTiers, this));
+    }
+}
+
 void ChunkServerImpl::ReadBlock(::google::protobuf::RpcController* controller,
                         const ReadBlockRequest* request,
                         ReadBlockResponse* response,
@@ -625,7 +802,26 @@ void ChunkServerImpl::ReadBlock(::google::protobuf::RpcController* controller,
         response->add_timestamp(common::timer::get_micros());
         boost::function<void ()> task =
             boost::bind(&ChunkServerImpl::ReadBlock, this, controller, request, response, done);
-        read_thread_pool_->AddTask(task);
+        // Queue on the block's disk, so a slow disk can't hold up reads of the others
+        Block* block = block_manager_->FindBlock(block_id);
+        if (block == NULL) {
+            LOG(WARNING, "ReadBlock not found: #%ld offset: %ld len: %d\n",
+                block_id, offset, read_len);
+            response->set_status(kCsNotFound);
+            done->Run();
+            return;
+        }
+        std::string store_path = block->GetStorePath();
+        block->DecRef();
+        // Throttle without blocking a read thread
+        int64_t wait = io_throttle_->Reserve(request->is_recover() ? kRecoverIo : kForegroundIo,
+                                             read_len);
+        DiskScheduler* disk_scheduler = block_manager_->GetDiskScheduler();
+        if (!disk_scheduler->AddRead(store_path, task, wait > 0 ? wait / 1000 + 1 : 0)) {
+            g_refuse_ops.Inc();
+            response->set_status(kCsDiskBusy);
+            done->Run();
+        }
         return;
     }
 
@@ -668,10 +864,18 @@ void ChunkServerImpl::ReadBlock(::google::protobuf::RpcController* controller,
     }
 }
 void ChunkServerImpl::RemoveObsoleteBlocks(std::vector<int64_t> blocks) {
-    for (size_t i = 0; i < blocks.size(); i++) {
-        if (!block_manager_->RemoveBlock(blocks[i])) {
-            LOG(INFO, "Remove block fail: #%ld ", blocks[i]);
-        }
+    // Cheap: renames into the trash and a meta write per disk, PurgeTrash frees the space
+    int64_t removed = block_manager_->RemoveBlocks(blocks);
+    if (removed != static_cast<int64_t>(blocks.size())) {
+        LOG(INFO, "Remove %lu obsolete blocks, %ld removed", blocks.size(), removed);
+    }
+}
+
+void ChunkServerImpl::PurgeTrash() {
+    int64_t wait = block_manager_->PurgeTrash(io_throttle_);
+    if (!service_stop_) {
+        delete_thread_->DelayTask(wait > 0 ? wait / 1000 + 1 : 1000,
+                                  boost::bind(&ChunkServerImpl::PurgeTrash, this));
     }
 }
 
@@ -694,6 +898,10 @@ void ChunkServerImpl::PushBlock(const ReplicaInfo& new_replica_info, int32_t can
 }
 
 StatusCode ChunkServerImpl::PushBlockProcess(const ReplicaInfo& new_replica_info, int32_t cancel_time) {
+    if (new_replica_info.ec_source_address_size() > 0) {
+        // Lost unit of an erasure coded group, there is no local copy to push
+        return RequestEcRebuild(new_replica_info, cancel_time);
+    }
     int64_t block_id = new_replica_info.block_id();
     Block* block = block_manager_->FindBlock(block_id);
     if (!block) {
@@ -711,7 +919,16 @@ StatusCode ChunkServerImpl::PushBlockProcess(const ReplicaInfo& new_replica_info
         }
         LOG(INFO, "[PushBlock] started push #%ld to %s, attempt %d/%d",
                 block_id, cs_addr.c_str(), i + 1, attempts);
-        status = WriteRecoverBlock(block, chunkserver, cancel_time, &timeout);
+        if (FLAGS_chunkserver_multi_source_recover && new_replica_info.source_address_size() > 1) {
+            status = RequestPullBlock(block, chunkserver, new_replica_info, cancel_time, &timeout);
+            if (status != kOK && status != kServiceStop && !timeout) {
+                LOG(INFO, "[PushBlock] pull #%ld by %s fail %s, fall back to push",
+                    block_id, cs_addr.c_str(), StatusCode_Name(status).c_str());
+                status = WriteRecoverBlock(block, chunkserver, cancel_time, &timeout);
+            }
+        } else {
+            status = WriteRecoverBlock(block, chunkserver, cancel_time, &timeout);
+        }
         if (status == kOK) {
             LOG(INFO, "[PushBlock] success #%ld to %s", block_id, cs_addr.c_str());
             break;
@@ -728,64 +945,736 @@ StatusCode ChunkServerImpl::PushBlockProcess(const ReplicaInfo& new_replica_info
     return status;
 }
 
+/// Packets of one recover transfer which are sent but not acked yet
+struct ChunkServerImpl::RecoverWindow {
+    Mutex mu;
+    CondVar cv;
+    int32_t inflight;
+    StatusCode status;
+    int64_t current_size;
+    int32_t current_seq;
+    RecoverWindow() : cv(&mu), inflight(0), status(kOK), current_size(0), current_seq(-1) {}
+};
+
 StatusCode ChunkServerImpl::WriteRecoverBlock(Block* block, ChunkServer_Stub* chunkserver, int32_t cancel_time, bool* timeout) {
     int32_t read_len = 1 << 20;
+    // Keep below the receiver's sliding window size
+    int32_t window_size = std::max(1, std::min(FLAGS_chunkserver_recover_window, 64));
     int64_t offset = 0;
     int32_t seq = 0;
-    char* buf = new char[read_len];
     int64_t start_recover = common::timer::get_micros();
-    while (!service_stop_) {
+    RecoverWindow window;
+    StatusCode status = kOK;
+    bool finished = false;
+    while (!finished) {
+        if (service_stop_) {
+            LOG(INFO, "[WriteRecoverBlock] #%ld service_stop_", block->Id());
+            status = kServiceStop;
+            break;
+        }
         int32_t now_time = common::timer::now_time();
         if (now_time > cancel_time) {
-            delete[] buf;
             *timeout = true;
-            return kTimeout;
+            status = kTimeout;
+            break;
         }
-        int64_t len = block->Read(buf, read_len, offset);
+        {
+            MutexLock lock(&window.mu);
+            while (window.status == kOK && window.inflight >= window_size) {
+                window.cv.TimeWait(100, "WriteRecoverBlock");
+                if (service_stop_ || common::timer::now_time() > cancel_time) {
+                    break;
+                }
+            }
+            if (window.status != kOK) {
+                status = window.status;
+                break;
+            }
+            if (window.inflight >= window_size) {
+                continue;
+            }
+        }
+        WriteBlockRequest* request = new WriteBlockRequest;
+        WriteBlockResponse* response = new WriteBlockResponse;
+        std::string* databuf = request->mutable_databuf();
+        databuf->resize(read_len);
+        // Disk read overlaps with the packets still in flight
+        int64_t len = block->Read(&(*databuf)[0], read_len, offset);
         g_read_bytes.Add(len);
         g_read_ops.Inc();
         if (len < 0) {
             LOG(WARNING, "[WriteRecoverBlock] #%ld read offset %ld len %d return %d",
                     block->Id(), offset, read_len, len);
-            delete[] buf;
-            return kReadError;
+            delete request;
+            delete response;
+            status = kReadError;
+            break;
+        }
+        databuf->resize(len);
+        io_throttle_->Acquire(kRecoverIo, len);
+        request->set_sequence_id(common::timer::get_micros());
+        request->set_block_id(block->Id());
+        request->set_is_last(len == 0);
+        request->set_packet_seq(seq);
+        request->set_offset(offset);
+        request->set_recover_version(block->GetVersion());
+        if (seq == 0) {
+            request->set_expected_size(block->Size());
+            if (block->GetStorageClass() != kStorageDisk) {
+                request->set_storage_class(block->GetStorageClass());
+            }
+        }
+        {
+            MutexLock lock(&window.mu);
+            ++window.inflight;
         }
-        WriteBlockRequest request;
-        WriteBlockResponse response;
+        boost::function<void (const WriteBlockRequest*, WriteBlockResponse*, bool, int)> callback =
+            boost::bind(&ChunkServerImpl::WriteRecoverCallback, this, _1, _2, _3, _4, &window);
+        rpc_client_->AsyncRequest(chunkserver, &ChunkServer_Stub::WriteBlock,
+                                  request, response, callback, 60, 1);
+        if (seq == 0) {
+            // The first packet creates the block, so wait for it before pipelining.
+            // Destination may already have part of the block, resume from there
+            MutexLock lock(&window.mu);
+            while (window.inflight > 0) {
+                window.cv.Wait();
+            }
+            if (window.status == kBlockExist) {
+                offset = window.current_size;
+                seq = window.current_seq + 1;
+                window.status = kOK;
+                continue;
+            }
+        }
+        offset += len;
+        ++seq;
+        finished = (len == 0);
+    }
+    MutexLock lock(&window.mu);
+    while (window.inflight > 0) {
+        window.cv.Wait();
+    }
+    if (status == kOK && window.status != kOK) {
+        status = window.status;
+    }
+    if (status == kOK) {
+        int64_t end_recover = common::timer::get_micros();
+        LOG(DEBUG, "[WriteRecoverBlock] #%ld finish recover, use %ld ms",
+                block->Id(), (end_recover - start_recover) / 1000);
+    }
+    return status;
+}
+
+void ChunkServerImpl::WriteRecoverCallback(const WriteBlockRequest* request,
+                                           WriteBlockResponse* response,
+                                           bool failed, int error,
+                                           RecoverWindow* window) {
+    MutexLock lock(&window->mu);
+    if (failed || response->status() != kOK) {
+        if (!failed && response->status() == kBlockExist && request->packet_seq() == 0) {
+            window->current_size = response->current_size();
+            window->current_seq = response->current_seq();
+            window->status = kBlockExist;
+        } else {
+            LOG(WARNING, "[WriteRecoverBlock] #%ld write failed, seq: %d offset: %ld len: %lu "
+                    "error: %d, status: %s",
+                    request->block_id(), request->packet_seq(), request->offset(),
+                    request->databuf().size(), error, StatusCode_Name(response->status()).c_str());
+            window->status = kWriteError;
+        }
+    } else {
+        g_recover_bytes.Add(request->databuf().size());
+    }
+    --window->inflight;
+    window->cv.Signal();
+    delete request;
+    delete response;
+}
+
+StatusCode ChunkServerImpl::RequestPullBlock(Block* block, ChunkServer_Stub* chunkserver,
+                                             const ReplicaInfo& new_replica_info,
+                                             int32_t cancel_time, bool* timeout) {
+    int32_t left_time = cancel_time - common::timer::now_time();
+    if (left_time <= 0) {
+        *timeout = true;
+        return kTimeout;
+    }
+    PullBlockRequest request;
+    PullBlockResponse response;
+    request.set_sequence_id(common::timer::get_micros());
+    request.set_block_id(block->Id());
+    request.set_block_size(block->Size());
+    request.set_block_version(block->GetVersion());
+    request.set_timeout(left_time);
+    for (int i = 0; i < new_replica_info.source_address_size(); ++i) {
+        request.add_source_address(new_replica_info.source_address(i));
+    }
+    bool ret = rpc_client_->SendRequest(chunkserver, &ChunkServer_Stub::PullBlock,
+                                        &request, &response, left_time + 5, 1);
+    if (!ret) {
+        return kNetworkUnavailable;
+    }
+    if (response.status() == kTimeout) {
+        *timeout = true;
+    }
+    return response.status();
+}
+
+StatusCode ChunkServerImpl::RequestEcRebuild(const ReplicaInfo& new_replica_info,
+                                             int32_t cancel_time) {
+    int64_t block_id = new_replica_info.block_id();
+    StatusCode status = kGetChunkServerError;
+    for (int i = 0; i < new_replica_info.chunkserver_address_size(); ++i) {
+        int32_t left_time = cancel_time - common::timer::now_time();
+        if (left_time <= 0) {
+            status = kTimeout;
+            break;
+        }
+        const std::string& cs_addr = new_replica_info.chunkserver_address(i);
+        ChunkServer_Stub* chunkserver = NULL;
+        if (!rpc_client_->GetStub(cs_addr, &chunkserver)) {
+            continue;
+        }
+        PullBlockRequest request;
+        PullBlockResponse response;
         request.set_sequence_id(common::timer::get_micros());
-        request.set_block_id(block->Id());
-        request.set_databuf(buf, len);
-        request.set_is_last(len == 0);
-        request.set_packet_seq(seq);
-        request.set_offset(offset);
-        request.set_recover_version(block->GetVersion());
-        bool ret = rpc_client_->SendRequest(chunkserver, &ChunkServer_Stub::WriteBlock,
-                                 &request, &response, 60, 1);
-        if (!ret || (response.status() != kOK && response.status() != kBlockExist)) {
-            LOG(WARNING, "[WriteRecoverBlock] #%ld write failed, offset: %ld len: %ld ret: %d, status: %s",
-                    block->Id(), offset, len, ret, StatusCode_Name(response.status()).c_str());
-            delete[] buf;
-            return kWriteError;
-        }
-        if (response.status() == kOK) {
-            offset += len;
-            g_recover_bytes.Add(len);
-            ++seq;
-        } else if (response.status() == kBlockExist) {
-            offset = response.current_size();
-            seq = response.current_seq() + 1;
-        }
-        if (len == 0) {
-            delete[] buf;
-            int64_t end_recover = common::timer::get_micros();
-            LOG(DEBUG, "[WriteRecoverBlock] #%ld finish recover, use %ld ms",
-                    block->Id(), (end_recover - start_recover) / 1000);
-            return kOK;
-        }
-    }
-    LOG(INFO, "[WriteRecoverBlock] #%ld service_stop_", block->Id());
-    delete[] buf;
-    return kServiceStop;
+        request.set_block_id(block_id);
+        request.set_block_size(new_replica_info.block_size());
+        request.set_block_version(new_replica_info.block_version());
+        request.set_timeout(left_time);
+        request.mutable_ec()->CopyFrom(new_replica_info.ec());
+        request.set_ec_group_id(new_replica_info.ec_group_id());
+        for (int j = 0; j < new_replica_info.ec_source_address_size(); ++j) {
+            request.add_ec_source_address(new_replica_info.ec_source_address(j));
+            request.add_ec_unit_size(j < new_replica_info.ec_unit_size_size()
+                                     ? new_replica_info.ec_unit_size(j) : 0);
+        }
+        bool ret = rpc_client_->SendRequest(chunkserver, &ChunkServer_Stub::PullBlock,
+                                            &request, &response, left_time + 5, 1);
+        delete chunkserver;
+        status = ret ? response.status() : kNetworkUnavailable;
+        LOG(INFO, "[EcRebuild] #%ld of group #%ld on %s: %s", block_id,
+            new_replica_info.ec_group_id(), cs_addr.c_str(), StatusCode_Name(status).c_str());
+        if (status == kOK || status == kServiceStop || status == kTimeout) {
+            break;
+        }
+    }
+    return status;
+}
+
+void ChunkServerImpl::PullBlock(::google::protobuf::RpcController* controller,
+                                const PullBlockRequest* request,
+                                PullBlockResponse* response,
+                                ::google::protobuf::Closure* done) {
+    response->set_sequence_id(request->sequence_id());
+    if ((request->source_address_size() == 0 && request->ec_source_address_size() == 0)
+        || request->block_size() < 0) {
+        response->set_status(kBadParameter);
+        done->Run();
+        return;
+    }
+    response->add_timestamp(common::timer::get_micros());
+    boost::function<void ()> task =
+        boost::bind(&ChunkServerImpl::PullBlockProcess, this, request, response, done);
+    recover_thread_pool_->AddTask(task);
+}
+
+void ChunkServerImpl::PullBlockProcess(const PullBlockRequest* request,
+                                       PullBlockResponse* response,
+                                       ::google::protobuf::Closure* done) {
+    int64_t block_id = request->block_id();
+    int32_t cancel_time = common::timer::now_time() + request->timeout();
+    StatusCode s = kOK;
+    Block* block = block_manager_->CreateBlock(block_id, NULL, &s);
+    if (s != kOK) {
+        // Partial block is resumed by push
+        LOG(INFO, "[PullBlock] #%ld create failed, reason %s", block_id, StatusCode_Name(s).c_str());
+        response->set_status(s);
+        done->Run();
+        return;
+    }
+    block->SetRecover();
+    block->SetExpectedSize(request->block_size());
+    int64_t start_pull = common::timer::get_micros();
+    if (request->has_ec()) {
+        s = RebuildEcBlock(block, request, cancel_time);
+    } else {
+        s = PullBlockRanges(block, request, cancel_time);
+    }
+    if (s == kOK) {
+        block->SetVersion(request->block_version());
+        if (block->IsComplete() && block_manager_->CloseBlock(block)) {
+            LOG(INFO, "[PullBlock] #%ld V%d size:%ld from %d sources use %ld ms",
+                block_id, request->block_version(), block->Size(),
+                request->source_address_size() + request->ec_source_address_size(),
+                (common::timer::get_micros() - start_pull) / 1000);
+            ReportFinish(block);
+        }
+    } else {
+        LOG(WARNING, "[PullBlock] #%ld fail %s", block_id, StatusCode_Name(s).c_str());
+    }
+    response->set_status(s);
+    done->Run();
+    block->DecRef();
+}
+
+/// Ranges of one pulled block which are requested but not received yet
+struct ChunkServerImpl::PullWindow {
+    Mutex mu;
+    CondVar cv;
+    Block* block;
+    int32_t inflight;
+    StatusCode status;
+    std::vector<int32_t> attempts;
+    std::vector<int32_t> retry;
+    std::set<int32_t> pending;      /// requested but not written yet
+    std::vector<bool> bad_source;
+    PullWindow(Block* b, int32_t packet_num, int32_t source_num)
+        : cv(&mu), block(b), inflight(0), status(kOK),
+          attempts(packet_num, 0), bad_source(source_num, false) {}
+};
+
+StatusCode ChunkServerImpl::PullBlockRanges(Block* block, const PullBlockRequest* request,
+                                            int32_t cancel_time) {
+    const int32_t read_len = 1 << 20;
+    int32_t window_size = std::max(1, std::min(FLAGS_chunkserver_recover_window, 64));
+    int32_t source_num = request->source_address_size();
+    int64_t block_size = request->block_size();
+    int32_t packet_num = (block_size + read_len - 1) / read_len;
+    std::vector<ChunkServer_Stub*> stubs(source_num, NULL);
+    for (int32_t i = 0; i < source_num; ++i) {
+        rpc_client_->GetStub(request->source_address(i), &stubs[i]);
+    }
+    PullWindow window(block, packet_num, source_num);
+    int32_t next_seq = 0;
+    MutexLock lock(&window.mu);
+    while (window.status == kOK) {
+        if (service_stop_) {
+            window.status = kServiceStop;
+            break;
+        }
+        if (common::timer::now_time() > cancel_time) {
+            window.status = kTimeout;
+            break;
+        }
+        int32_t seq = -1;
+        if (window.inflight < window_size) {
+            if (!window.retry.empty()) {
+                seq = window.retry.back();
+                window.retry.pop_back();
+            } else if (next_seq < packet_num && (window.pending.empty()
+                       || next_seq - *window.pending.begin() < window_size)) {
+                // Stay inside the block's receive window
+                seq = next_seq++;
+                window.pending.insert(seq);
+            } else if (window.pending.empty()) {
+                break;
+            }
+        }
+        if (seq == -1) {
+            window.cv.TimeWait(100, "PullBlockRanges");
+            continue;
+        }
+        // Spread ranges over the sources, skip the ones failed before
+        int32_t source = -1;
+        while (window.attempts[seq] < source_num) {
+            int32_t s = (seq + window.attempts[seq]) % source_num;
+            if (!window.bad_source[s] && stubs[s]) {
+                source = s;
+                break;
+            }
+            ++window.attempts[seq];
+        }
+        if (source == -1) {
+            LOG(WARNING, "[PullBlock] #%ld seq %d no source available", block->Id(), seq);
+            window.status = kReadError;
+            break;
+        }
+        ReadBlockRequest* read_request = new ReadBlockRequest;
+        ReadBlockResponse* read_response = new ReadBlockResponse;
+        read_request->set_sequence_id(common::timer::get_micros());
+        read_request->set_block_id(block->Id());
+        read_request->set_offset(static_cast<int64_t>(seq) * read_len);
+        read_request->set_read_len(std::min(static_cast<int64_t>(read_len),
+                                            block_size - read_request->offset()));
+        read_request->set_is_recover(true);
+        ++window.inflight;
+        boost::function<void (const ReadBlockRequest*, ReadBlockResponse*, bool, int)> callback =
+            boost::bind(&ChunkServerImpl::PullBlockCallback, this, _1, _2, _3, _4, &window, source);
+        window.mu.Unlock();
+        io_throttle_->Acquire(kRecoverIo, read_request->read_len());
+        rpc_client_->AsyncRequest(stubs[source], &ChunkServer_Stub::ReadBlock,
+                                  read_request, read_response, callback, 60, 1);
+        window.mu.Lock();
+    }
+    while (window.inflight > 0) {
+        window.cv.Wait();
+    }
+    for (int32_t i = 0; i < source_num; ++i) {
+        delete stubs[i];
+    }
+    if (window.status == kOK) {
+        if (packet_num == 0) {
+            block->Write(0, 0, NULL, 0, NULL);
+            block->SetSliceNum(1);
+        } else {
+            block->SetSliceNum(packet_num);
+        }
+    }
+    return window.status;
+}
+
+void ChunkServerImpl::PullBlockCallback(const ReadBlockRequest* request,
+                                        ReadBlockResponse* response,
+                                        bool failed, int error,
+                                        PullWindow* window, int32_t source) {
+    int32_t seq = request->offset() / (1 << 20);
+    bool ok = !failed && response->status() == kOK
+              && static_cast<int32_t>(response->databuf().size()) == request->read_len();
+    if (ok) {
+        const std::string& databuf = response->databuf();
+        if (window->block->Write(seq, request->offset(), databuf.data(), databuf.size(), NULL)) {
+            g_recover_bytes.Add(databuf.size());
+        } else {
+            MutexLock lock(&window->mu);
+            window->status = kWriteError;
+        }
+    } else {
+        LOG(WARNING, "[PullBlock] #%ld read seq %d from source %d fail, error: %d status: %s",
+            request->block_id(), seq, source, error, StatusCode_Name(response->status()).c_str());
+    }
+    MutexLock lock(&window->mu);
+    if (ok) {
+        window->pending.erase(seq);
+    } else {
+        window->bad_source[source] = true;
+        ++window->attempts[seq];
+        window->retry.push_back(seq);
+    }
+    --window->inflight;
+    window->cv.Signal();
+    delete request;
+    delete response;
+}
+
+/// Reads of one range from the other units of an erasure coded group
+struct ChunkServerImpl::EcReadWindow {
+    Mutex mu;
+    CondVar cv;
+    int32_t inflight;
+    std::vector<std::string> units;
+    std::vector<bool> ok;
+    EcReadWindow(int32_t unit_num) : cv(&mu), inflight(0), units(unit_num), ok(unit_num, false) {}
+};
+
+StatusCode ChunkServerImpl::RebuildEcBlock(Block* block, const PullBlockRequest* request,
+                                           int32_t cancel_time) {
+    const int32_t read_len = 1 << 20;
+    const EcLayout& ec = request->ec();
+    int32_t data_num = ec.data_num();
+    int32_t unit_num = data_num + ec.parity_num();
+    int32_t index = block->Id() - request->ec_group_id();
+    if (data_num <= 0 || index < 0 || index >= unit_num
+        || request->ec_source_address_size() != unit_num
+        || request->ec_unit_size_size() != unit_num) {
+        LOG(WARNING, "[EcRebuild] #%ld bad layout", block->Id());
+        return kBadParameter;
+    }
+    std::vector<ChunkServer_Stub*> stubs(unit_num, NULL);
+    std::vector<bool> bad_unit(unit_num, false);
+    for (int32_t u = 0; u < unit_num; ++u) {
+        if (u == index || request->ec_source_address(u).empty()
+            || !rpc_client_->GetStub(request->ec_source_address(u), &stubs[u])) {
+            bad_unit[u] = true;
+        }
+    }
+    RsCodec codec(data_num, ec.parity_num());
+    int64_t block_size = request->block_size();
+    int32_t packet_num = (block_size + read_len - 1) / read_len;
+    StatusCode status = kOK;
+    for (int32_t seq = 0; seq < packet_num; ++seq) {
+        if (service_stop_) {
+            status = kServiceStop;
+            break;
+        }
+        if (common::timer::now_time() > cancel_time) {
+            status = kTimeout;
+            break;
+        }
+        int64_t offset = static_cast<int64_t>(seq) * read_len;
+        int64_t len = std::min(static_cast<int64_t>(read_len), block_size - offset);
+        // Read data_num of the units, more if some of them fail
+        EcReadWindow window(unit_num);
+        int32_t got = 0;
+        int32_t next = 0;
+        while (got < data_num) {
+            std::vector<int32_t> to_read;
+            for (; next < unit_num && got + static_cast<int32_t>(to_read.size()) < data_num;
+                 ++next) {
+                if (!bad_unit[next]) {
+                    to_read.push_back(next);
+                }
+            }
+            if (to_read.empty()) {
+                break;
+            }
+            ReadEcUnits(request, offset, len, stubs, to_read, &window);
+            for (size_t i = 0; i < to_read.size(); ++i) {
+                if (window.ok[to_read[i]]) {
+                    ++got;
+                } else {
+                    bad_unit[to_read[i]] = true;
+                }
+            }
+        }
+        if (got < data_num) {
+            LOG(WARNING, "[EcRebuild] #%ld offset %ld only %d units readable",
+                block->Id(), offset, got);
+            status = kReadError;
+            break;
+        }
+        std::vector<int32_t> erased;
+        std::vector<char*> ptrs(unit_num);
+        for (int32_t u = 0; u < unit_num; ++u) {
+            if (!window.ok[u]) {
+                erased.push_back(u);
+                window.units[u].assign(len, '\0');
+            }
+            ptrs[u] = &window.units[u][0];
+        }
+        if (!codec.Decode(&ptrs[0], erased, len)
+            || !block->Write(seq, offset, ptrs[index], len, NULL)) {
+            status = kWriteError;
+            break;
+        }
+        g_recover_bytes.Add(len);
+    }
+    for (int32_t u = 0; u < unit_num; ++u) {
+        delete stubs[u];
+    }
+    if (status == kOK) {
+        if (packet_num == 0) {
+            block->Write(0, 0, NULL, 0, NULL);
+            block->SetSliceNum(1);
+        } else {
+            block->SetSliceNum(packet_num);
+        }
+    }
+    return status;
+}
+
+void ChunkServerImpl::ReadEcUnits(const PullBlockRequest* request, int64_t offset, int64_t len,
+                                  const std::vector<ChunkServer_Stub*>& stubs,
+                                  const std::vector<int32_t>& units, EcReadWindow* window) {
+    for (size_t i = 0; i < units.size(); ++i) {
+        int32_t u = units[i];
+        // Short units read as zeros past their end, as they were encoded
+        window->units[u].assign(len, '\0');
+        int64_t unit_len = std::min(len, request->ec_unit_size(u) - offset);
+        if (unit_len <= 0) {
+            MutexLock lock(&window->mu);
+            window->ok[u] = true;
+            continue;
+        }
+        ReadBlockRequest* read_request = new ReadBlockRequest;
+        ReadBlockResponse* read_response = new ReadBlockResponse;
+        read_request->set_sequence_id(common::timer::get_micros());
+        read_request->set_block_id(request->ec_group_id() + u);
+        read_request->set_offset(offset);
+        read_request->set_read_len(unit_len);
+        read_request->set_is_recover(true);
+        {
+            MutexLock lock(&window->mu);
+            ++window->inflight;
+        }
+        boost::function<void (const ReadBlockRequest*, ReadBlockResponse*, bool, int)> callback =
+            boost::bind(&ChunkServerImpl::EcReadCallback, this, _1, _2, _3, _4, window, u);
+        io_throttle_->Acquire(kRecoverIo, unit_len);
+        rpc_client_->AsyncRequest(stubs[u], &ChunkServer_Stub::ReadBlock,
+                                  read_request, read_response, callback, 60, 1);
+    }
+    MutexLock lock(&window->mu);
+    while (window->inflight > 0) {
+        window->cv.Wait();
+    }
+}
+
+void ChunkServerImpl::EcReadCallback(const ReadBlockRequest* request,
+                                     ReadBlockResponse* response,
+                                     bool failed, int error,
+                                     EcReadWindow* window, int32_t unit) {
+    const std::string& databuf = response->databuf();
+    bool ok = !failed && response->status() == kOK
+              && static_cast<int32_t>(databuf.size()) == request->read_len();
+    if (!ok) {
+        LOG(WARNING, "[EcRebuild] read #%ld offset %ld fail, error: %d status: %s",
+            request->block_id(), request->offset(), error,
+            StatusCode_Name(response->status()).c_str());
+    }
+    MutexLock lock(&window->mu);
+    if (ok) {
+        memcpy(&window->units[unit][0], databuf.data(), databuf.size());
+        window->ok[unit] = true;
+    }
+    --window->inflight;
+    window->cv.Signal();
+    delete request;
+    delete response;
+}
+
+void ChunkServerImpl::TranscodeBlock(const TranscodeInfo& info, int32_t cancel_time) {
+    TranscodeReportRequest request;
+    request.set_sequence_id(common::timer::get_micros());
+    request.set_chunkserver_id(chunkserver_id_);
+    request.set_block_id(info.block_id());
+    request.set_ec_group_id(info.ec_group_id());
+    request.set_status(TranscodeProcess(info, cancel_time));
+    LOG(INFO, "[Transcode] #%ld to group #%ld %s", info.block_id(), info.ec_group_id(),
+        StatusCode_Name(request.status()).c_str());
+    TranscodeReportResponse response;
+    if (!nameserver_->SendRequest(&NameServer_Stub::TranscodeReport,
+                                  &request, &response, 15)) {
+        LOG(WARNING, "[Transcode] report #%ld fail", info.block_id());
+    }
+}
+
+StatusCode ChunkServerImpl::TranscodeProcess(const TranscodeInfo& info, int32_t cancel_time) {
+    int64_t block_id = info.block_id();
+    const EcLayout& ec = info.ec();
+    int32_t data_num = ec.data_num();
+    int32_t parity_num = ec.parity_num();
+    int32_t unit_num = data_num + parity_num;
+    int64_t cell = ec.cell_size();
+    if (data_num <= 0 || parity_num <= 0 || cell <= 0
+        || info.chunkserver_address_size() != unit_num) {
+        LOG(WARNING, "[Transcode] #%ld bad layout", block_id);
+        return kBadParameter;
+    }
+    Block* block = block_manager_->FindBlock(block_id);
+    if (!block) {
+        LOG(INFO, "[Transcode] #%ld does not exist anymore", block_id);
+        return kCsNotFound;
+    }
+    if (block->GetVersion() != info.block_version()) {
+        LOG(INFO, "[Transcode] #%ld V%ld changed to V%ld",
+            block_id, info.block_version(), block->GetVersion());
+        block->DecRef();
+        return kVersionError;
+    }
+    StatusCode status = kOK;
+    std::vector<ChunkServer_Stub*> stubs(unit_num, NULL);
+    for (int32_t u = 0; u < unit_num; ++u) {
+        if (!rpc_client_->GetStub(info.chunkserver_address(u), &stubs[u])) {
+            status = kGetChunkServerError;
+        }
+    }
+    int64_t block_size = block->Size();
+    int64_t stripe_size = cell * data_num;
+    int32_t stripe_num = (block_size + stripe_size - 1) / stripe_size;
+    int32_t window_size = unit_num * std::max(1, std::min(FLAGS_chunkserver_recover_window, 64));
+    RsCodec codec(data_num, parity_num);
+    std::string stripe;
+    std::vector<std::string> parity(parity_num);
+    RecoverWindow window;
+    // Packet 0 creates the units, packet i carries cell i - 1 of every unit,
+    // and the last one closes them with the version of the source block
+    for (int32_t seq = 0; status == kOK && seq <= stripe_num + 1; ++seq) {
+        if (service_stop_) {
+            status = kServiceStop;
+            break;
+        }
+        if (common::timer::now_time() > cancel_time) {
+            status = kTimeout;
+            break;
+        }
+        {
+            MutexLock lock(&window.mu);
+            while (window.status == kOK && window.inflight + unit_num > window_size) {
+                window.cv.Wait();
+            }
+            if (window.status != kOK) {
+                status = window.status;
+                break;
+            }
+        }
+        int64_t len = 0;
+        if (seq > 0 && seq <= stripe_num) {
+            int64_t offset = (seq - 1) * stripe_size;
+            len = std::min(stripe_size, block_size - offset);
+            stripe.assign(stripe_size, '\0');
+            if (block->Read(&stripe[0], len, offset) != len) {
+                LOG(WARNING, "[Transcode] #%ld read offset %ld len %ld fail",
+                    block_id, offset, len);
+                status = kReadError;
+                break;
+            }
+            g_read_bytes.Add(len);
+            g_read_ops.Inc();
+            io_throttle_->Acquire(kTranscodeIo, len);
+            std::vector<const char*> data(data_num);
+            std::vector<char*> out(parity_num);
+            for (int32_t i = 0; i < data_num; ++i) {
+                data[i] = stripe.data() + i * cell;
+            }
+            for (int32_t i = 0; i < parity_num; ++i) {
+                parity[i].assign(cell, '\0');
+                out[i] = &parity[i][0];
+            }
+            codec.Encode(&data[0], &out[0], cell);
+        }
+        for (int32_t u = 0; u < unit_num; ++u) {
+            WriteBlockRequest* request = new WriteBlockRequest;
+            WriteBlockResponse* response = new WriteBlockResponse;
+            request->set_sequence_id(common::timer::get_micros());
+            request->set_block_id(info.ec_group_id() + u);
+            request->set_packet_seq(seq);
+            request->set_recover_version(info.block_version());
+            int64_t unit_size = EcUnitSize(block_size, data_num, cell, u);
+            if (seq == 0) {
+                request->set_offset(0);
+                request->set_expected_size(unit_size);
+            } else if (seq <= stripe_num) {
+                // Parity cells are as long as the cell of unit 0
+                int32_t data_index = u < data_num ? u : 0;
+                int64_t unit_len = std::min(cell, std::max<int64_t>(0, len - data_index * cell));
+                const char* src = u < data_num ? stripe.data() + u * cell
+                                               : parity[u - data_num].data();
+                request->set_offset((seq - 1) * cell);
+                request->mutable_databuf()->assign(src, unit_len);
+            } else {
+                request->set_offset(unit_size);
+                request->set_is_last(true);
+            }
+            {
+                MutexLock lock(&window.mu);
+                ++window.inflight;
+            }
+            boost::function<void (const WriteBlockRequest*, WriteBlockResponse*, bool, int)>
+                callback = boost::bind(&ChunkServerImpl::WriteRecoverCallback,
+                                       this, _1, _2, _3, _4, &window);
+            rpc_client_->AsyncRequest(stubs[u], &ChunkServer_Stub::WriteBlock,
+                                      request, response, callback, 60, 1);
+        }
+        if (seq == 0) {
+            // Units are new blocks, one left over from an earlier try fails the task
+            MutexLock lock(&window.mu);
+            while (window.inflight > 0) {
+                window.cv.Wait();
+            }
+        }
+    }
+    MutexLock lock(&window.mu);
+    while (window.inflight > 0) {
+        window.cv.Wait();
+    }
+    if (status == kOK && window.status != kOK) {
+        status = window.status;
+    }
+    for (int32_t u = 0; u < unit_num; ++u) {
+        delete stubs[u];
+    }
+    block->DecRef();
+    return status;
 }
 
 void ChunkServerImpl::GetBlockInfo(::google::protobuf::RpcController* controller,
@@ -828,8 +1717,33 @@ void ChunkServerImpl::GetBlockInfo(::google::protobuf::RpcController* controller
 
 }
 
+bool ChunkServerImpl::SetIoRate(const sofa::pbrpc::HTTPRequest& request,
+                                sofa::pbrpc::HTTPResponse& response) {
+    std::map<const std::string, std::string>::const_iterator it = request.query_params->begin();
+    for (; it != request.query_params->end(); ++it) {
+        int i = 0;
+        for (; i < kIoClassNum; i++) {
+            if (it->first == std::string(IoThrottle::ClassName(static_cast<IoClass>(i))) + "_io_rate") {
+                break;
+            }
+        }
+        int32_t v = atoi(it->second.c_str());
+        if (i == kIoClassNum || v < 0) {
+            response.content->Append("<h1>Bad Parameter : " + it->first + "</h1>");
+            return true;
+        }
+        io_throttle_->SetRate(static_cast<IoClass>(i), static_cast<int64_t>(v) << 20);
+        LOG(INFO, "Set %s to %d MB/s", it->first.c_str(), v);
+    }
+    response.content->Append("<body onload=\"history.back()\"></body>");
+    return true;
+}
+
 bool ChunkServerImpl::WebService(const sofa::pbrpc::HTTPRequest& request,
                                 sofa::pbrpc::HTTPResponse& response) {
+    if (request.path == "/dfs/set") {
+        return SetIoRate(request, response);
+    }
     CounterManager::Counters counters = counter_manager_->GetCounters();
     std::string str =
             "<html><head><title>BFS console</title>"
@@ -862,6 +1776,33 @@ bool ChunkServerImpl::WebService(const sofa::pbrpc::HTTPRequest& request,
            + common::NumToString(recover_thread_pool_->PendingNum()) + "</td>";
     str += "</tr>";
     str += "</table>";
+    str += "<table class=dataintable>";
+    str += "<tr><td>IO class</td><td>Speed</td><td>Limit</td></tr>";
+    for (int i = 0; i < kIoClassNum; i++) {
+        IoClass io_class = static_cast<IoClass>(i);
+        int64_t rate = io_throttle_->GetRate(io_class);
+        str += "<tr><td>" + std::string(IoThrottle::ClassName(io_class)) + "</td>";
+        str += "<td>" + common::HumanReadableString(counters.io_class_bytes[i]) + "/S</td>";
+        str += "<td>" + (rate ? common::HumanReadableString(rate) + "/S" : "unlimited") + "</td></tr>";
+    }
+    str += "<tr><td>Throttle wait</td><td colspan=2>"
+           + common::NumToString(counters.io_throttle_wait) + "ms/S</td></tr>";
+    str += "</table>";
+    std::vector<DiskScheduler::DiskStat> disk_stats;
+    block_manager_->GetDiskScheduler()->GetStat(&disk_stats);
+    str += "<table class=dataintable>";
+    str += "<tr><td>Disk</td><td>PendingTask(R/W)</td><td>Read ops</td>"
+           "<td>Refused reads</td><td>Read latency(ms)</td></tr>";
+    for (size_t i = 0; i < disk_stats.size(); i++) {
+        const DiskScheduler::DiskStat& stat = disk_stats[i];
+        str += "<tr><td>" + stat.path + "</td>";
+        str += "<td>" + common::NumToString(stat.pending_reads) + "/"
+               + common::NumToString(stat.pending_writes) + "</td>";
+        str += "<td>" + common::NumToString(stat.read_ops) + "</td>";
+        str += "<td>" + common::NumToString(stat.refused_reads) + "</td>";
+        str += "<td>" + common::NumToString(stat.read_latency / 1000) + "</td></tr>";
+    }
+    str += "</table>";
     str += "<script> var int = setInterval('window.location.reload()', 1000);"
            "function check(box) {"
            "if(box.checked) {"
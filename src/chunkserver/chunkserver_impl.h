@@ -29,6 +29,9 @@ class NameServerClient;
 class ChunkServer_Stub;
 class Block;
 class CounterManager;
+class IoThrottle;
+class DiskBalancer;
+class TierMover;
 
 class ChunkServerImpl : public ChunkServer {
 public:
@@ -51,9 +54,14 @@ public:
                               const GetBlockInfoRequest* request,
                               GetBlockInfoResponse* response,
                               ::google::protobuf::Closure* done);
+    virtual void PullBlock(::google::protobuf::RpcController* controller,
+                           const PullBlockRequest* request,
+                           PullBlockResponse* response,
+                           ::google::protobuf::Closure* done);
     bool WebService(const sofa::pbrpc::HTTPRequest& request,
                     sofa::pbrpc::HTTPResponse& response);
 private:
+    bool SetIoRate(const sofa::pbrpc::HTTPRequest& request, sofa::pbrpc::HTTPResponse& response);
     void LogStatus(bool routine);
     void WriteNext(const std::string& next_server,
                    ChunkServer_Stub* stub,
@@ -73,10 +81,45 @@ private:
                          WriteBlockResponse* response,
                          ::google::protobuf::Closure* done);
     void RemoveObsoleteBlocks(std::vector<int64_t> blocks);
+    void PurgeTrash();
     void PushBlock(const ReplicaInfo& new_replica_info, int32_t cancel_time);
     StatusCode PushBlockProcess(const ReplicaInfo& new_replica_info, int32_t cancel_time);
     StatusCode WriteRecoverBlock(Block* block, ChunkServer_Stub* chunkserver, int32_t cancel_time, bool* timeout);
+    struct RecoverWindow;
+    void WriteRecoverCallback(const WriteBlockRequest* request,
+                              WriteBlockResponse* response,
+                              bool failed, int error,
+                              RecoverWindow* window);
+    StatusCode RequestPullBlock(Block* block, ChunkServer_Stub* chunkserver,
+                                const ReplicaInfo& new_replica_info,
+                                int32_t cancel_time, bool* timeout);
+    StatusCode RequestEcRebuild(const ReplicaInfo& new_replica_info, int32_t cancel_time);
+    /// Encode a local replica into the units of info's group and report to nameserver
+    void TranscodeBlock(const TranscodeInfo& info, int32_t cancel_time);
+    StatusCode TranscodeProcess(const TranscodeInfo& info, int32_t cancel_time);
+    void PullBlockProcess(const PullBlockRequest* request,
+                          PullBlockResponse* response,
+                          ::google::protobuf::Closure* done);
+    StatusCode PullBlockRanges(Block* block, const PullBlockRequest* request, int32_t cancel_time);
+    struct PullWindow;
+    void PullBlockCallback(const ReadBlockRequest* request,
+                           ReadBlockResponse* response,
+                           bool failed, int error,
+                           PullWindow* window, int32_t source);
+    StatusCode RebuildEcBlock(Block* block, const PullBlockRequest* request, int32_t cancel_time);
+    struct EcReadWindow;
+    void ReadEcUnits(const PullBlockRequest* request, int64_t offset, int64_t len,
+                     const std::vector<ChunkServer_Stub*>& stubs,
+                     const std::vector<int32_t>& units, EcReadWindow* window);
+    void EcReadCallback(const ReadBlockRequest* request,
+                        ReadBlockResponse* response,
+                        bool failed, int error,
+                        EcReadWindow* window, int32_t unit);
     void CloseIncompleteBlock(int64_t block_id);
+    /// Seal a block reopened for append again if its writer sent no data
+    void CancelReopen(int64_t block_id);
+    void BalanceDisks();
+    void MoveTiers();
     void StopBlockReport();
 private:
     BlockManager*   block_manager_;
@@ -87,9 +130,14 @@ private:
     ThreadPool*     write_thread_pool_;
     ThreadPool*     recover_thread_pool_;
     ThreadPool*     heartbeat_thread_;
+    ThreadPool*     balance_thread_;
+    ThreadPool*     delete_thread_;     ///< block removal and trash purging
     NameServerClient* nameserver_;
     int32_t chunkserver_id_;
     CounterManager* counter_manager_;
+    IoThrottle*     io_throttle_;
+    DiskBalancer*   disk_balancer_;
+    TierMover*      tier_mover_;
     int64_t heartbeat_task_id_;
     volatile int64_t blockreport_task_id_;
     int64_t last_report_blockid_;
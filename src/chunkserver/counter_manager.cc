@@ -32,6 +32,15 @@ common::Counter g_rpc_delay;
 common::Counter g_rpc_delay_all;
 common::Counter g_rpc_count;
 common::Counter g_data_size;
+common::Counter g_memory_data;
+common::Counter g_io_class_bytes[kIoClassNum];
+common::Counter g_io_throttle_wait;
+common::Counter g_meta_batches;
+common::Counter g_meta_ops;
+common::Counter g_meta_commit_time;
+common::Counter g_data_syncs;
+common::Counter g_data_flushes;
+common::Counter g_data_flush_time;
 
 
 CounterManager::CounterManager() {
@@ -62,6 +71,30 @@ void CounterManager::GatherCounters() {
     counters.buffers_new = g_buffers_new.Clear() * 1000000 / interval;
     counters.buffers_delete = g_buffers_delete.Clear() * 1000000 / interval;
     counters.unfinished_write_bytes = g_unfinished_bytes.Get();
+    for (int i = 0; i < kIoClassNum; i++) {
+        counters.io_class_bytes[i] = g_io_class_bytes[i].Clear() * 1000000 / interval;
+    }
+    counters.io_throttle_wait = g_io_throttle_wait.Clear() * 1000 / interval;
+    int64_t meta_batches = g_meta_batches.Clear();
+    int64_t meta_ops = g_meta_ops.Clear();
+    int64_t meta_commit_time = g_meta_commit_time.Clear();
+    counters.meta_ops = meta_ops * 1000000 / interval;
+    counters.meta_batch_size = 0;
+    counters.meta_commit_latency = 0;
+    if (meta_batches) {
+        counters.meta_batch_size = meta_ops / meta_batches;
+        counters.meta_commit_latency = meta_commit_time / meta_batches;
+    }
+    int64_t data_flushes = g_data_flushes.Clear();
+    int64_t data_syncs = g_data_syncs.Clear();
+    int64_t data_flush_time = g_data_flush_time.Clear();
+    counters.data_syncs = data_syncs * 1000000 / interval;
+    counters.data_sync_batch = 0;
+    counters.data_flush_latency = 0;
+    if (data_flushes) {
+        counters.data_sync_batch = data_syncs / data_flushes;
+        counters.data_flush_latency = data_flush_time / data_flushes;
+    }
     MutexLock lock(&counters_lock_);
     counters_ = counters;
 }
@@ -12,6 +12,8 @@
 
 #include <common/mutex.h>
 
+#include "chunkserver/io_throttle.h"
+
 namespace baidu {
 namespace bfs {
 
@@ -33,6 +35,14 @@ public:
         int64_t buffers_new;
         int64_t buffers_delete;
         int64_t unfinished_write_bytes;
+        int64_t io_class_bytes[kIoClassNum];
+        int64_t io_throttle_wait;
+        int64_t meta_ops;
+        int64_t meta_batch_size;
+        int64_t meta_commit_latency;
+        int64_t data_syncs;
+        int64_t data_sync_batch;
+        int64_t data_flush_latency;
     };
     CounterManager();
     void GatherCounters();
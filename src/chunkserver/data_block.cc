@@ -20,8 +20,12 @@
 #include <common/logging.h>
 
 #include "file_cache.h"
+#include "file_syncer.h"
+#include "journal.h"
 
 DECLARE_int32(write_buf_size);
+DECLARE_int32(chunkserver_prealloc_limit);
+DECLARE_int32(chunkserver_memory_limit);
 
 namespace baidu {
 namespace bfs {
@@ -42,13 +46,15 @@ extern common::Counter g_rpc_delay;
 extern common::Counter g_rpc_delay_all;
 extern common::Counter g_rpc_count;
 extern common::Counter g_data_size;
+extern common::Counter g_memory_data;
 
 Block::Block(const BlockMeta& meta, ThreadPool* thread_pool, FileCache* file_cache) :
   thread_pool_(thread_pool), meta_(meta),
-  last_seq_(-1), slice_num_(-1), blockbuf_(NULL), buflen_(0),
+  last_seq_(-1), version_base_(0), reopen_size_(-1), slice_num_(-1), blockbuf_(NULL), buflen_(0),
   bufdatalen_(0), disk_writing_(false),
-  disk_file_size_(meta.block_size()), file_desc_(-1), refs_(0),
-  close_cv_(&mu_), is_recover_(false), deleted_(false),
+  disk_file_size_(meta.block_size()), file_desc_(-1), prealloc_size_(0),
+  journaled_size_(0), storage_class_(meta.storage_class()), mem_held_(0), heat_(0), refs_(0),
+  close_cv_(&mu_), is_recover_(false), sync_on_close_(false), deleted_(false),
   file_cache_(file_cache) {
     assert(meta_.block_id() < (1L<<40));
     g_data_size.Add(meta.block_size());
@@ -65,7 +71,7 @@ Block::Block(const BlockMeta& meta, ThreadPool* thread_pool, FileCache* file_cac
 }
 Block::~Block() {
     if (bufdatalen_ > 0) {
-        if (!deleted_) {
+        if (!deleted_ && storage_class_ != kStorageMemory) {
             LOG(WARNING, "Data lost, %d bytes in #%ld %s",
                 bufdatalen_, meta_.block_id(), disk_file_.c_str());
         }
@@ -79,12 +85,14 @@ Block::~Block() {
     buflen_ = 0;
     bufdatalen_ = 0;
 
-    LOG(INFO, "Release #%ld block_buf_list_ size= %lu",
+    LOG(DEBUG, "Release #%ld block_buf_list_ size= %lu",
         meta_.block_id(), block_buf_list_.size());
     for (uint32_t i = 0; i < block_buf_list_.size(); i++) {
         const char* buf = block_buf_list_[i].first;
         int len = block_buf_list_[i].second;
-        if (!deleted_) {
+        if (storage_class_ == kStorageMemory) {
+            LOG(DEBUG, "Release memory block buffer %d for #%ld ", len, meta_.block_id());
+        } else if (!deleted_) {
             LOG(WARNING, "Data lost, %d bytes in %s, #%ld block_buf_list_",
                 len, disk_file_.c_str(), meta_.block_id());
         } else {
@@ -92,10 +100,13 @@ Block::~Block() {
         }
         delete[] buf;
         g_block_buffers.Dec();
-        g_pending_writes.Dec();
+        if (storage_class_ != kStorageMemory) {
+            g_pending_writes.Dec();
+        }
         g_buffers_delete.Inc();
     }
     block_buf_list_.clear();
+    g_memory_data.Sub(mem_held_);
 
     if (file_desc_ >= 0) {
         close(file_desc_);
@@ -114,7 +125,7 @@ Block::~Block() {
         }
         delete recv_window_;
     }
-    LOG(INFO, "Block #%ld deconstruct", meta_.block_id());
+    LOG(DEBUG, "Block #%ld deconstruct", meta_.block_id());
     g_blocks.Dec();
     g_data_size.Sub(meta_.block_size());
 }
@@ -134,10 +145,16 @@ BlockMeta Block::GetMeta() const {
 int64_t Block::DiskUsed() {
     return disk_file_size_;
 }
+StorageClass Block::GetStorageClass() const {
+    return storage_class_;
+}
 bool Block::SetDeleted() {
     int deleted = common::atomic_swap(&deleted_, 1);
     return (0 == deleted);
 }
+bool Block::IsDeleted() {
+    return deleted_ != 0;
+}
 void Block::SetVersion(int64_t version) {
     meta_.set_version(std::max(version, meta_.version()));
 }
@@ -159,18 +176,39 @@ std::string Block::BuildFilePath(int64_t block_id) {
 bool Block::OpenForWrite() {
     mu_.AssertHeld();
     if (file_desc_ >= 0) return true;
+    int64_t prealloc = prealloc_size_;
+    int64_t sealed_size = disk_file_size_;
     /// Unlock for disk operating.
     mu_.Unlock();
     std::string dir = disk_file_.substr(0, disk_file_.rfind('/'));
     // Mkdir dir for data block, ignore error, may already exist.
     mkdir(dir.c_str(), 0755);
-    int fd  = open(disk_file_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR);
+    int fd = -1;
+    if (sealed_size > 0) {
+        // A reopened block, data past the sealed size is from an append never closed
+        chmod(disk_file_.c_str(), S_IRUSR | S_IWUSR);
+        fd = open(disk_file_.c_str(), O_WRONLY | O_APPEND);
+        if (fd >= 0 && (fchmod(fd, S_IRUSR) != 0 || ftruncate(fd, sealed_size) != 0)) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
+        fd = open(disk_file_.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR);
+    }
+    // One allocation for the whole block, instead of extents interleaved with
+    // other blocks written at the same time. The tail is truncated on close.
+    if (fd >= 0 && prealloc > 0 && fallocate(fd, 0, 0, prealloc) != 0) {
+        LOG(DEBUG, "Preallocate %ld bytes for #%ld fail: %s",
+            prealloc, meta_.block_id(), strerror(errno));
+        prealloc = 0;
+    }
     mu_.Lock("Block::OpenForWrite");
     if (fd < 0) {
         LOG(WARNING, "Open block #%ld %s fail: %s",
             meta_.block_id(), disk_file_.c_str(), strerror(errno));
         return false;
     }
+    prealloc_size_ = prealloc;
     g_writing_blocks.Inc();
     file_desc_ = fd;
     return true;
@@ -179,6 +217,14 @@ bool Block::OpenForWrite() {
 void Block::SetSliceNum(int32_t num) {
     slice_num_ = num;
 }
+void Block::SetExpectedSize(int64_t size) {
+    MutexLock lock(&mu_, "Block::SetExpectedSize", 1000);
+    if (file_desc_ != -1) {
+        return;
+    }
+    int64_t limit = static_cast<int64_t>(FLAGS_chunkserver_prealloc_limit) << 20;
+    prealloc_size_ = std::max(0L, std::min(size, limit));
+}
 /// Is all slice is arrival(Notify by the sliding window)
 bool Block::IsComplete() {
     return (slice_num_ == last_seq_ + 1);
@@ -186,9 +232,22 @@ bool Block::IsComplete() {
 bool Block::IsFinished() {
     return finished_;
 }
+int32_t Block::Heat() {
+    MutexLock lock(&mu_, "Block::Heat", 1000);
+    return heat_;
+}
+void Block::SetHeat(int32_t heat) {
+    MutexLock lock(&mu_, "Block::SetHeat", 1000);
+    heat_ = heat;
+}
+void Block::Cool() {
+    MutexLock lock(&mu_, "Block::Cool", 1000);
+    heat_ >>= 1;
+}
 /// Read operation.
 int64_t Block::Read(char* buf, int64_t len, int64_t offset) {
     MutexLock lock(&mu_, "Block::Read", 1000);
+    ++heat_;
     if (offset > meta_.block_size()) {
         LOG(INFO, "Wrong offset %ld > %ld", offset, meta_.block_size());
         return -1;
@@ -198,12 +257,19 @@ int64_t Block::Read(char* buf, int64_t len, int64_t offset) {
 
     /// Read from disk
     int64_t readlen = 0;
+    // disk_file_ may be switched by SetStorePath while unlocked
+    std::string disk_file = disk_file_;
     while (offset + readlen < disk_file_size_) {
         int64_t pread_len = std::min(len - readlen, disk_file_size_ - offset - readlen);
         mu_.Unlock();
-        int64_t ret = file_cache_->ReadFile(disk_file_,
+        int64_t ret = file_cache_->ReadFile(disk_file,
                         buf + readlen, pread_len, offset + readlen);
         mu_.Lock("Block::Read relock", 1000);
+        if (ret != pread_len && disk_file != disk_file_) {
+            // Moved to another disk meanwhile, the old file may be in the trash
+            disk_file = disk_file_;
+            continue;
+        }
         if (ret != pread_len) {
             LOG(WARNING, "ReadFile fail: pread_len: %ld offset: %ld ret: %ld %s",
                     pread_len, offset + readlen, ret, strerror(errno));
@@ -213,10 +279,13 @@ int64_t Block::Read(char* buf, int64_t len, int64_t offset) {
         if (readlen >= len) return readlen;
         // If disk_file_size change, read again.
     }
-    // Read from block_buf_list
+    // Read from block_buf_list, buffers pushed by Sync or Close are short
     int64_t mem_offset = offset + readlen - disk_file_size_;
-    uint32_t buf_id = mem_offset / FLAGS_write_buf_size;
-    mem_offset %= FLAGS_write_buf_size;
+    uint32_t buf_id = 0;
+    while (buf_id < block_buf_list_.size() && mem_offset >= block_buf_list_[buf_id].second) {
+        mem_offset -= block_buf_list_[buf_id].second;
+        buf_id++;
+    }
     while (buf_id < block_buf_list_.size()) {
         const char* block_buf = block_buf_list_[buf_id].first;
         int buf_len = block_buf_list_[buf_id].second;
@@ -274,6 +343,10 @@ bool Block::Write(int32_t seq, int64_t offset, const char* data,
     if (ret == 0) {
         g_write_bytes.Add(len);
     }
+    if (seq > 0) {
+        // The append goes on, CancelReopen can't roll it back anymore
+        reopen_size_ = -1;
+    }
     return true;
 }
 /// Flush block to disk.
@@ -283,27 +356,166 @@ bool Block::Close() {
         return false;
     }
 
-    block_buf_list_.push_back(std::make_pair(blockbuf_, bufdatalen_));
-    g_pending_writes.Inc();
+    if (storage_class_ != kStorageMemory) {
+        block_buf_list_.push_back(std::make_pair(blockbuf_, bufdatalen_));
+        g_pending_writes.Inc();
+    } else if (blockbuf_) {
+        // Memory blocks are read from block_buf_list_ for good
+        block_buf_list_.push_back(std::make_pair(blockbuf_, bufdatalen_));
+    }
     blockbuf_ = NULL;
     bufdatalen_ = 0;
 
     finished_ = true;
-    // DiskWrite will close file_desc_ asynchronously.
-    this->AddRef();
-    thread_pool_->AddPriorityTask(boost::bind(&Block::DiskWrite, this));
-
-    while (file_desc_ != -2) {
-        close_cv_.Wait();
+    if (storage_class_ == kStorageDisk) {
+        // DiskWrite will close file_desc_ asynchronously.
+        this->AddRef();
+        thread_pool_->AddPriorityTask(boost::bind(&Block::DiskWrite, this));
+        while (file_desc_ != -2) {
+            close_cv_.Wait();
+        }
+    } else if (storage_class_ == kStorageLazyPersist) {
+        // Readers are served from memory until DiskWrite catches up
+        this->AddRef();
+        thread_pool_->AddTask(boost::bind(&Block::DiskWrite, this));
     }
     if (meta_.version() == -1) {
-        SetVersion(last_seq_);
+        SetVersion(version_base_ + last_seq_);
     }
     LOG(INFO, "Block #%ld closed %s V%ld %ld",
         meta_.block_id(), disk_file_.c_str(), meta_.version(), meta_.block_size());
     return true;
 }
 
+StatusCode Block::Reopen(int64_t version, int64_t size) {
+    MutexLock lock(&mu_, "Block::Reopen", 1000);
+    if (deleted_) {
+        return kCsNotFound;
+    }
+    if (!finished_) {
+        LOG(INFO, "Reopen #%ld fail, block is being written", meta_.block_id());
+        return kBlockExist;
+    }
+    // Memory blocks keep their data in buffers that can't be appended to
+    if (storage_class_ == kStorageMemory) {
+        LOG(INFO, "Reopen memory block #%ld fail", meta_.block_id());
+        return kBlockClosed;
+    }
+    if (meta_.version() != version || meta_.block_size() != size) {
+        LOG(INFO, "Reopen #%ld V%ld %ld fail, now V%ld %ld",
+            meta_.block_id(), version, size, meta_.version(), meta_.block_size());
+        return kVersionError;
+    }
+    // Appends go after the block file, lazy persist blocks get there first
+    while (!deleted_ && (disk_writing_ || !block_buf_list_.empty())) {
+        close_cv_.Wait();
+    }
+    if (deleted_ || file_desc_ >= 0) {
+        return kCsNotFound;
+    }
+    delete recv_window_;
+    recv_window_ = new common::SlidingWindow<Buffer>(100,
+                   boost::bind(&Block::WriteCallback, this, _1, _2));
+    meta_.set_version(-1);
+    version_base_ = version;
+    reopen_size_ = size;
+    last_seq_ = -1;
+    slice_num_ = -1;
+    prealloc_size_ = 0;
+    file_desc_ = -1;
+    sync_on_close_ = false;
+    finished_ = false;
+    LOG(INFO, "Block #%ld reopened %s V%ld %ld",
+        meta_.block_id(), disk_file_.c_str(), version, size);
+    return kOK;
+}
+
+bool Block::CancelReopen() {
+    MutexLock lock(&mu_, "Block::CancelReopen", 1000);
+    if (reopen_size_ < 0 || finished_ || deleted_) {
+        return false;
+    }
+    // Only packet 0 came, it holds no data and the block file is untouched
+    assert(meta_.block_size() == reopen_size_ && file_desc_ == -1);
+    if (blockbuf_) {
+        delete[] blockbuf_;
+        g_block_buffers.Dec();
+        g_buffers_delete.Inc();
+        blockbuf_ = NULL;
+    }
+    bufdatalen_ = 0;
+    delete recv_window_;
+    recv_window_ = NULL;
+    meta_.set_version(version_base_);
+    file_desc_ = -2;
+    reopen_size_ = -1;
+    finished_ = true;
+    LOG(INFO, "Block #%ld reopen canceled, back to V%ld %ld",
+        meta_.block_id(), meta_.version(), meta_.block_size());
+    return true;
+}
+
+bool Block::Sync(FileSyncer* syncer, Journal* journal) {
+    MutexLock lock(&mu_, "Block::Sync", 1000);
+    if (storage_class_ == kStorageMemory) {
+        // Nothing of a memory block goes to disk
+        return !deleted_;
+    }
+    if (!finished_ && bufdatalen_ > 0) {
+        block_buf_list_.push_back(std::make_pair(blockbuf_, bufdatalen_));
+        g_pending_writes.Inc();
+        blockbuf_ = NULL;
+        bufdatalen_ = 0;
+        this->AddRef();
+        thread_pool_->AddPriorityTask(boost::bind(&Block::DiskWrite, this));
+    }
+    while (!deleted_ && (disk_writing_ || !block_buf_list_.empty())) {
+        close_cv_.Wait();
+    }
+    if (deleted_) {
+        return false;
+    }
+    int64_t start = journal ? journaled_size_ : 0;
+    int64_t end = disk_file_size_;
+    if ((syncer == NULL && journal == NULL) || end <= start) {
+        return true;
+    }
+    // A dup keeps the file open even if the block is closed meanwhile,
+    // the journal reads the file back and needs a readable fd
+    int fd = file_desc_ >= 0 && journal == NULL ? dup(file_desc_) : -1;
+    mu_.Unlock();
+    if (fd < 0) {
+        fd = open(disk_file_.c_str(), O_RDONLY);
+    }
+    bool ret = fd >= 0;
+    if (ret && journal) {
+        // Read back from the page cache, the block file reaches disk at a checkpoint
+        std::string data(end - start, '\0');
+        ret = pread(fd, &data[0], data.size(), start) == static_cast<ssize_t>(data.size())
+              && journal->Append(disk_file_, start, data.data(), data.size());
+    } else if (ret) {
+        ret = syncer->Sync(fd);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    mu_.Lock("Block::Sync relock", 1000);
+    if (ret && journal && journaled_size_ < end) {
+        journaled_size_ = end;
+    }
+    if (!ret) {
+        LOG(WARNING, "Sync block #%ld %s fail", meta_.block_id(), disk_file_.c_str());
+    }
+    return ret;
+}
+
+void Block::SetSyncOnClose() {
+    sync_on_close_ = true;
+}
+bool Block::SyncOnClose() {
+    return sync_on_close_;
+}
+
 void Block::AddRef() {
     common::atomic_inc(&refs_);
     assert (refs_ > 0);
@@ -358,12 +570,21 @@ void Block::DiskWrite() {
                 g_block_buffers.Dec();
                 g_buffers_delete.Inc();
                 disk_file_size_ += len;
+                int64_t persisted = std::min(mem_held_, static_cast<int64_t>(len));
+                mem_held_ -= persisted;
+                g_memory_data.Sub(persisted);
             }
             disk_writing_ = false;
+            close_cv_.Broadcast();
         }
         if (finished_ || deleted_) {
             assert (deleted_ || block_buf_list_.empty());
             if (file_desc_ != -2) {
+                if (file_desc_ >= 0 && prealloc_size_ > disk_file_size_
+                    && ftruncate(file_desc_, disk_file_size_) != 0) {
+                    LOG(WARNING, "Truncate #%ld %s to %ld fail: %s", meta_.block_id(),
+                        disk_file_.c_str(), disk_file_size_, strerror(errno));
+                }
                 int ret = close(file_desc_);
                 LOG(INFO, "[DiskWrite] close file %s", disk_file_.c_str());
                 assert(ret == 0);
@@ -382,7 +603,7 @@ void Block::DiskWrite() {
                     recv_window_ = NULL;
                 }
             }
-            close_cv_.Signal();
+            close_cv_.Broadcast();
         }
     }
     this->DecRef();
@@ -393,6 +614,21 @@ void Block::SetRecover() {
 bool Block::IsRecover() {
     return is_recover_;
 }
+bool Block::SetStorePath(const std::string& store_path, ThreadPool* thread_pool) {
+    MutexLock lock(&mu_, "Block::SetStorePath", 1000);
+    // Only blocks wholly in the block file can move
+    if (!finished_ || deleted_ || file_desc_ >= 0 || !block_buf_list_.empty()) {
+        return false;
+    }
+    meta_.set_store_path(store_path);
+    disk_file_ = store_path + BuildFilePath(meta_.block_id());
+    thread_pool_ = thread_pool;
+    return true;
+}
+std::string Block::GetStorePath() {
+    MutexLock lock(&mu_, "Block::GetStorePath", 1000);
+    return meta_.store_path();
+}
 /// Append to block buffer
 StatusCode Block::Append(int32_t seq, const char* buf, int64_t len) {
     mu_.AssertHeld();
@@ -407,11 +643,17 @@ StatusCode Block::Append(int32_t seq, const char* buf, int64_t len) {
         int64_t wlen = buflen_ - bufdatalen_;
         memcpy(blockbuf_ + bufdatalen_, buf, wlen);
         block_buf_list_.push_back(std::make_pair(blockbuf_, FLAGS_write_buf_size));
-        this->AddRef();
-        thread_pool_->AddTask(boost::bind(&Block::DiskWrite, this));
+        if (storage_class_ != kStorageMemory) {
+            g_pending_writes.Inc();
+        }
+        // Lazy persist blocks spill to disk once the memory budget is used up
+        if (storage_class_ == kStorageDisk || (storage_class_ == kStorageLazyPersist
+            && g_memory_data.Get() > (static_cast<int64_t>(FLAGS_chunkserver_memory_limit) << 20))) {
+            this->AddRef();
+            thread_pool_->AddTask(boost::bind(&Block::DiskWrite, this));
+        }
 
         blockbuf_ = new char[buflen_];
-        g_pending_writes.Inc();
         g_block_buffers.Inc();
         g_buffers_new.Inc();
         bufdatalen_ = 0;
@@ -424,6 +666,10 @@ StatusCode Block::Append(int32_t seq, const char* buf, int64_t len) {
     }
     meta_.set_block_size(meta_.block_size() + len);
     g_data_size.Add(len);
+    if (storage_class_ != kStorageDisk) {
+        mem_held_ += len;
+        g_memory_data.Add(len);
+    }
     last_seq_ = seq;
     return kOK;
 }
@@ -33,6 +33,8 @@ struct Buffer {
 
 
 class FileCache;
+class FileSyncer;
+class Journal;
 
 /// Data block
 class Block {
@@ -46,18 +48,26 @@ public:
     std::string GetFilePath() const;
     BlockMeta GetMeta() const;
     int64_t DiskUsed();
+    StorageClass GetStorageClass() const;
     bool SetDeleted();
+    bool IsDeleted();
     void SetVersion(int64_t version);
     int GetVersion();
     int32_t GetLastSaq();
     /// Set expected slice num, for IsComplete.
     void SetSliceNum(int32_t num);
+    /// Size hint of the writer, the file is preallocated when opened
+    void SetExpectedSize(int64_t size);
     /// Is all slice is arrival(Notify by the sliding window)
     bool IsComplete();
     /// Block is closed
     bool IsFinished();
     /// Read operation.
     int64_t Read(char* buf, int64_t len, int64_t offset);
+    /// Reads since the last cooling, halved by every Cool
+    int32_t Heat();
+    void SetHeat(int32_t heat);
+    void Cool();
     /// Write operation.
     bool Write(int32_t seq, int64_t offset, const char* data,
                int64_t len, int64_t* add_use = NULL);
@@ -65,8 +75,24 @@ public:
     StatusCode Append(int32_t seq, const char*buf, int64_t len);
     void SetRecover();
     bool IsRecover();
-    /// Flush block to disk.
+    /// Point a closed block at its copy under store_path, later writes of an append
+    /// go through thread_pool, the write pool of that disk
+    bool SetStorePath(const std::string& store_path, ThreadPool* thread_pool);
+    std::string GetStorePath();
+    /// Write data appended so far to the block file, then make it durable by
+    /// journal if set, or else by syncer if set
+    bool Sync(FileSyncer* syncer, Journal* journal = NULL);
+    /// The writer asked for data on disk before the block is closed
+    void SetSyncOnClose();
+    bool SyncOnClose();
+    /// Flush block to disk, lazy persist blocks are flushed in background
+    /// and memory blocks stay in memory.
     bool Close();
+    /// Reopen a closed block of version and size for append. Packet seqs start over
+    /// from 0, the version after the next Close is version plus the last seq.
+    StatusCode Reopen(int64_t version, int64_t size);
+    /// Back to the sealed state if no data packet came after Reopen, true if rolled back
+    bool CancelReopen();
     void AddRef();
     void DecRef();
     int GetRef();
@@ -77,13 +103,11 @@ private:
     void WriteCallback(int32_t seq, Buffer buffer);
     void DiskWrite();
 private:
-    enum Type {
-        InDisk,
-        InMem,
-    };
     ThreadPool* thread_pool_;
     BlockMeta   meta_;
     int32_t     last_seq_;
+    int64_t     version_base_;  ///< version the block was reopened at, 0 for a new block
+    int64_t     reopen_size_;   ///< sealed size until the first data packet after Reopen, or -1
     int32_t     slice_num_;
     char*       blockbuf_;
     int64_t     buflen_;
@@ -93,11 +117,17 @@ private:
     std::string disk_file_;
     int64_t     disk_file_size_;
     int         file_desc_; ///< disk file fd
+    int64_t     prealloc_size_; ///< file size to preallocate, or preallocated once opened
+    int64_t     journaled_size_;    ///< file data before it is in the journal
+    StorageClass storage_class_;
+    int64_t     mem_held_;  ///< data of a memory or lazy persist block not on disk
+    int32_t     heat_;
     volatile int refs_;
     Mutex       mu_;
-    CondVar     close_cv_;
+    CondVar     close_cv_;  ///< DiskWrite drained the buffers or closed the file
     common::SlidingWindow<Buffer>* recv_window_;
     bool        is_recover_;
+    bool        sync_on_close_;
     bool        finished_;
     volatile int deleted_;
 
@@ -0,0 +1,103 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/disk_balancer.h"
+
+#include <common/logging.h>
+
+#include "chunkserver/block_manager.h"
+
+namespace baidu {
+namespace bfs {
+
+/// Blocks moved between two usage checks
+const int32_t kBalanceBatch = 16;
+
+static double DiskUsage(const DiskInfo& disk) {
+    return 1.0 - static_cast<double>(disk.free_size) / disk.disk_size;
+}
+
+DiskBalancer::DiskBalancer(BlockManager* block_manager, IoThrottle* throttle)
+    : block_manager_(block_manager), throttle_(throttle) {
+}
+
+bool DiskBalancer::Plan(const std::vector<DiskInfo>& disks, double threshold,
+                        int* src, int* dest) {
+    // Blocks only move between disks of the same media, the tier mover moves them across
+    const StorageMedia kMedia[] = {kMediaHdd, kMediaSsd};
+    double max_gap = threshold;
+    bool planned = false;
+    for (size_t m = 0; m < sizeof(kMedia) / sizeof(kMedia[0]); m++) {
+        int max_disk = -1;
+        int min_disk = -1;
+        for (size_t i = 0; i < disks.size(); i++) {
+            // Skip disks that can't be statted
+            if (disks[i].disk_size <= 0 || disks[i].media != kMedia[m]) {
+                continue;
+            }
+            double usage = DiskUsage(disks[i]);
+            if (max_disk < 0 || usage > DiskUsage(disks[max_disk])) {
+                max_disk = i;
+            }
+            if (min_disk < 0 || usage < DiskUsage(disks[min_disk])) {
+                min_disk = i;
+            }
+        }
+        if (max_disk < 0 || max_disk == min_disk
+            || DiskUsage(disks[max_disk]) - DiskUsage(disks[min_disk]) <= max_gap) {
+            continue;
+        }
+        max_gap = DiskUsage(disks[max_disk]) - DiskUsage(disks[min_disk]);
+        *src = max_disk;
+        *dest = min_disk;
+        planned = true;
+    }
+    return planned;
+}
+
+int64_t DiskBalancer::Balance(double threshold, volatile bool* stop) {
+    int64_t moved = 0;
+    int32_t moved_num = 0;
+    while (!*stop) {
+        std::vector<DiskInfo> disks;
+        block_manager_->GetDiskInfo(&disks);
+        int src = -1;
+        int dest = -1;
+        if (!Plan(disks, threshold, &src, &dest)) {
+            break;
+        }
+        std::vector<int64_t> blocks;
+        block_manager_->ListMoveCandidates(disks[src].path, kBalanceBatch, &blocks);
+        if (blocks.empty()) {
+            LOG(INFO, "[DiskBalancer] Nothing to move on %s", disks[src].path.c_str());
+            break;
+        }
+        int32_t batch_moved = 0;
+        for (size_t i = 0; i < blocks.size() && !*stop; i++) {
+            int64_t block_size = 0;
+            StatusCode s = block_manager_->MoveBlock(blocks[i], disks[dest].path,
+                                                     throttle_, &block_size);
+            if (s == kOK) {
+                moved += block_size;
+                ++batch_moved;
+            } else {
+                LOG(INFO, "[DiskBalancer] Move #%ld to %s fail: %s",
+                    blocks[i], disks[dest].path.c_str(), StatusCode_Name(s).c_str());
+            }
+        }
+        if (batch_moved == 0) {
+            break;
+        }
+        moved_num += batch_moved;
+    }
+    if (moved_num) {
+        LOG(INFO, "[DiskBalancer] Moved %d blocks %ld bytes", moved_num, moved);
+    }
+    return moved;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
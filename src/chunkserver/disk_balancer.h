@@ -0,0 +1,38 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  BFS_DISK_BALANCER_H_
+#define  BFS_DISK_BALANCER_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "chunkserver/disk_selector.h"
+
+namespace baidu {
+namespace bfs {
+
+class BlockManager;
+class IoThrottle;
+
+/// Moves closed blocks from the fullest store path to the emptiest one
+class DiskBalancer {
+public:
+    DiskBalancer(BlockManager* block_manager, IoThrottle* throttle);
+    /// Pick the disks of the next move, false if usage gap is within threshold
+    static bool Plan(const std::vector<DiskInfo>& disks, double threshold,
+                     int* src, int* dest);
+    /// Move blocks until disks are balanced or stop is set, return bytes moved
+    int64_t Balance(double threshold, volatile bool* stop);
+private:
+    BlockManager* block_manager_;
+    IoThrottle* throttle_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_DISK_BALANCER_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
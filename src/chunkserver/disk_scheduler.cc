@@ -0,0 +1,110 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/disk_scheduler.h"
+
+#include <assert.h>
+#include <boost/bind.hpp>
+
+#include <common/logging.h>
+#include <common/timer.h>
+
+namespace baidu {
+namespace bfs {
+
+DiskScheduler::DiskScheduler(const std::vector<std::string>& store_path_list,
+                             int32_t write_thread_num, int32_t read_thread_num,
+                             int32_t max_pending_reads)
+    : max_pending_reads_(max_pending_reads) {
+    assert(!store_path_list.empty());
+    for (size_t i = 0; i < store_path_list.size(); i++) {
+        Disk* disk = new Disk;
+        disk->path = store_path_list[i];
+        disk->write_pool = new ThreadPool(write_thread_num);
+        disk->read_pool = new ThreadPool(read_thread_num);
+        disks_.push_back(disk);
+        disk_map_[disk->path] = disk;
+    }
+    LOG(INFO, "DiskScheduler: %lu disks, %d write %d read threads per disk",
+        disks_.size(), write_thread_num, read_thread_num);
+}
+
+DiskScheduler::~DiskScheduler() {
+    Stop();
+    for (size_t i = 0; i < disks_.size(); i++) {
+        delete disks_[i]->write_pool;
+        delete disks_[i]->read_pool;
+        delete disks_[i];
+    }
+    disks_.clear();
+    disk_map_.clear();
+}
+
+void DiskScheduler::Stop() {
+    for (size_t i = 0; i < disks_.size(); i++) {
+        disks_[i]->read_pool->Stop(true);
+        disks_[i]->write_pool->Stop(true);
+    }
+}
+
+DiskScheduler::Disk* DiskScheduler::GetDisk(const std::string& store_path) {
+    std::map<std::string, Disk*>::iterator it = disk_map_.find(store_path);
+    if (it == disk_map_.end()) {
+        return disks_[0];
+    }
+    return it->second;
+}
+
+ThreadPool* DiskScheduler::WritePool(const std::string& store_path) {
+    return GetDisk(store_path)->write_pool;
+}
+
+bool DiskScheduler::AddRead(const std::string& store_path,
+                            const boost::function<void ()>& task, int64_t delay) {
+    Disk* disk = GetDisk(store_path);
+    int64_t pending = disk->pending_reads.Inc();
+    if (max_pending_reads_ > 0 && pending > max_pending_reads_) {
+        disk->pending_reads.Dec();
+        disk->refused_reads.Inc();
+        LOG(WARNING, "Disk %s has %ld pending reads, refuse", disk->path.c_str(), pending);
+        return false;
+    }
+    boost::function<void ()> read_task =
+        boost::bind(&DiskScheduler::RunRead, this, disk, task, common::timer::get_micros());
+    if (delay > 0) {
+        disk->read_pool->DelayTask(delay, read_task);
+    } else {
+        disk->read_pool->AddTask(read_task);
+    }
+    return true;
+}
+
+void DiskScheduler::RunRead(Disk* disk, boost::function<void ()> task, int64_t queue_time) {
+    task();
+    // Latency seen by the caller, queueing included
+    int64_t latency = common::timer::get_micros() - queue_time;
+    int64_t old = disk->read_latency.Get();
+    disk->read_latency.Set(old + (latency - old) / 8);
+    disk->read_ops.Inc();
+    disk->pending_reads.Dec();
+}
+
+void DiskScheduler::GetStat(std::vector<DiskStat>* stats) {
+    for (size_t i = 0; i < disks_.size(); i++) {
+        Disk* disk = disks_[i];
+        DiskStat stat;
+        stat.path = disk->path;
+        stat.pending_reads = disk->pending_reads.Get();
+        stat.pending_writes = disk->write_pool->PendingNum();
+        stat.read_ops = disk->read_ops.Get();
+        stat.refused_reads = disk->refused_reads.Get();
+        stat.read_latency = disk->read_latency.Get();
+        stats->push_back(stat);
+    }
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,68 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  BFS_DISK_SCHEDULER_H_
+#define  BFS_DISK_SCHEDULER_H_
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+#include <common/counter.h>
+#include <common/mutex.h>
+#include <common/thread_pool.h>
+
+namespace baidu {
+namespace bfs {
+
+/// Io queues per store path, so a slow disk only blocks requests for itself
+class DiskScheduler {
+public:
+    struct DiskStat {
+        std::string path;
+        int64_t pending_reads;
+        int64_t pending_writes;
+        int64_t read_ops;
+        int64_t refused_reads;
+        int64_t read_latency;   ///< moving average, micros
+    };
+    DiskScheduler(const std::vector<std::string>& store_path_list,
+                  int32_t write_thread_num, int32_t read_thread_num,
+                  int32_t max_pending_reads);
+    ~DiskScheduler();
+    /// Wait for queued io and stop all workers
+    void Stop();
+    /// Flush queue of store_path, unknown paths share the first disk's
+    ThreadPool* WritePool(const std::string& store_path);
+    /// Queue a read on store_path after delay ms,
+    /// false if the disk already has max_pending_reads queued
+    bool AddRead(const std::string& store_path, const boost::function<void ()>& task,
+                 int64_t delay = 0);
+    void GetStat(std::vector<DiskStat>* stats);
+private:
+    struct Disk {
+        std::string path;
+        ThreadPool* write_pool;
+        ThreadPool* read_pool;
+        common::Counter pending_reads;
+        common::Counter read_ops;
+        common::Counter refused_reads;
+        common::Counter read_latency;
+    };
+    Disk* GetDisk(const std::string& store_path);
+    void RunRead(Disk* disk, boost::function<void ()> task, int64_t queue_time);
+private:
+    int32_t max_pending_reads_;
+    std::vector<Disk*> disks_;
+    std::map<std::string, Disk*> disk_map_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_DISK_SCHEDULER_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
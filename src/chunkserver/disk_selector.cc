@@ -0,0 +1,74 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/disk_selector.h"
+
+#include <stdlib.h>
+#include <algorithm>
+
+namespace baidu {
+namespace bfs {
+
+/// Disks with less free space than this take no new blocks
+const int64_t kDiskReserveSize = 1L << 30;
+/// Read latency at which a disk's weight is halved
+const int64_t kLatencyUnit = 20 * 1000;
+
+DiskSelector* DiskSelector::Create(const std::string& policy) {
+    if (policy == "hash") {
+        return new HashDiskSelector();
+    } else if (policy == "capacity") {
+        return new CapacityDiskSelector();
+    } else if (policy == "load") {
+        return new LoadDiskSelector();
+    }
+    return NULL;
+}
+
+int HashDiskSelector::Select(int64_t block_id, const std::vector<DiskInfo>& disks) {
+    return block_id % disks.size();
+}
+
+CapacityDiskSelector::CapacityDiskSelector(unsigned int seed) : seed_(seed) {
+}
+
+double CapacityDiskSelector::Weight(const DiskInfo& disk) {
+    return static_cast<double>(disk.free_size - kDiskReserveSize);
+}
+
+int CapacityDiskSelector::Select(int64_t block_id, const std::vector<DiskInfo>& disks) {
+    std::vector<double> weights(disks.size(), 0);
+    double total = 0;
+    for (size_t i = 0; i < disks.size(); i++) {
+        weights[i] = std::max(Weight(disks[i]), 0.0);
+        total += weights[i];
+    }
+    if (total <= 0) {
+        // Every disk is full, let the write fail on its original disk
+        return block_id % disks.size();
+    }
+    double r = total * rand_r(&seed_) / (RAND_MAX + 1.0);
+    for (size_t i = 0; i < disks.size(); i++) {
+        if (r < weights[i]) {
+            return i;
+        }
+        r -= weights[i];
+    }
+    return disks.size() - 1;
+}
+
+LoadDiskSelector::LoadDiskSelector(unsigned int seed) : CapacityDiskSelector(seed) {
+}
+
+double LoadDiskSelector::Weight(const DiskInfo& disk) {
+    double weight = CapacityDiskSelector::Weight(disk);
+    weight /= 1.0 + disk.pending_io;
+    weight /= 1.0 + static_cast<double>(disk.read_latency) / kLatencyUnit;
+    return weight;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,69 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  BFS_DISK_SELECTOR_H_
+#define  BFS_DISK_SELECTOR_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "proto/status_code.pb.h"
+
+namespace baidu {
+namespace bfs {
+
+/// Snapshot of one store path used for placement
+struct DiskInfo {
+    std::string path;
+    int64_t disk_size;
+    int64_t free_size;
+    int64_t pending_io;     ///< queued reads and flushes
+    int64_t read_latency;   ///< micros
+    StorageMedia media;     ///< kMediaHdd unless the store path is tagged [ssd]
+    DiskInfo() : disk_size(0), free_size(0), pending_io(0), read_latency(0),
+                 media(kMediaHdd) {}
+};
+
+/// Chooses the store path of a new block. Not thread safe.
+class DiskSelector {
+public:
+    virtual ~DiskSelector() {}
+    /// Index into disks, disks is never empty
+    virtual int Select(int64_t block_id, const std::vector<DiskInfo>& disks) = 0;
+    /// "hash", "capacity" or "load", NULL for unknown policies
+    static DiskSelector* Create(const std::string& policy);
+};
+
+/// block_id % disk num, the original placement
+class HashDiskSelector : public DiskSelector {
+public:
+    virtual int Select(int64_t block_id, const std::vector<DiskInfo>& disks);
+};
+
+/// Random pick weighted by free space
+class CapacityDiskSelector : public DiskSelector {
+public:
+    explicit CapacityDiskSelector(unsigned int seed = 0);
+    virtual int Select(int64_t block_id, const std::vector<DiskInfo>& disks);
+protected:
+    virtual double Weight(const DiskInfo& disk);
+private:
+    unsigned int seed_;
+};
+
+/// Free space weight, discounted by queue depth and read latency
+class LoadDiskSelector : public CapacityDiskSelector {
+public:
+    explicit LoadDiskSelector(unsigned int seed = 0);
+protected:
+    virtual double Weight(const DiskInfo& disk);
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_DISK_SELECTOR_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,80 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/file_syncer.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+
+#include <common/counter.h>
+#include <common/logging.h>
+#include <common/timer.h>
+
+namespace baidu {
+namespace bfs {
+
+extern common::Counter g_data_syncs;
+extern common::Counter g_data_flushes;
+extern common::Counter g_data_flush_time;
+
+FileSyncer::FileSyncer(int32_t max_batch_files)
+    : max_batch_files_(max_batch_files > 0 ? max_batch_files : 1) {
+}
+
+bool FileSyncer::Sync(int fd) {
+    Syncer syncer(&mu_, fd);
+    MutexLock lock(&mu_);
+    syncers_.push_back(&syncer);
+    while (!syncer.done && &syncer != syncers_.front()) {
+        syncer.cv.Wait();
+    }
+    if (syncer.done) {
+        return syncer.ret;
+    }
+    // The front syncer flushes for everyone queued behind it, once per file
+    Syncer* last = &syncer;
+    int32_t files = 0;
+    std::map<int, bool> results;
+    for (std::deque<Syncer*>::iterator it = syncers_.begin();
+         it != syncers_.end() && files < max_batch_files_; ++it) {
+        last = *it;
+        results[last->fd] = false;
+        ++files;
+    }
+    mu_.Unlock();
+    int64_t start = common::timer::get_micros();
+    for (std::map<int, bool>::iterator it = results.begin(); it != results.end(); ++it) {
+        it->second = (fdatasync(it->first) == 0);
+        if (!it->second) {
+            LOG(WARNING, "Sync fd %d fail: %s", it->first, strerror(errno));
+        }
+    }
+    g_data_flushes.Inc();
+    g_data_syncs.Add(files);
+    g_data_flush_time.Add(common::timer::get_micros() - start);
+    mu_.Lock();
+    while (true) {
+        Syncer* ready = syncers_.front();
+        syncers_.pop_front();
+        if (ready != &syncer) {
+            ready->ret = results[ready->fd];
+            ready->done = true;
+            ready->cv.Signal();
+        }
+        if (ready == last) {
+            break;
+        }
+    }
+    if (!syncers_.empty()) {
+        syncers_.front()->cv.Signal();
+    }
+    return results[fd];
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
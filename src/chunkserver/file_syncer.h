@@ -0,0 +1,43 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  BFS_FILE_SYNCER_H_
+#define  BFS_FILE_SYNCER_H_
+
+#include <stdint.h>
+#include <deque>
+
+#include <common/mutex.h>
+
+namespace baidu {
+namespace bfs {
+
+/// Group commit of file syncs on one disk. Syncs queued while a flush is
+/// running share the next one, which fdatasyncs every fd of the batch once.
+class FileSyncer {
+public:
+    /// max_batch_files: max syncs sharing one flush
+    explicit FileSyncer(int32_t max_batch_files);
+    /// Return once data written to fd before the call is on disk
+    bool Sync(int fd);
+private:
+    struct Syncer {
+        int fd;
+        bool done;
+        bool ret;
+        CondVar cv;
+        Syncer(Mutex* mu, int file) : fd(file), done(false), ret(false), cv(mu) {}
+    };
+private:
+    int32_t max_batch_files_;
+    Mutex mu_;
+    std::deque<Syncer*> syncers_;   ///< front is the one flushing
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_FILE_SYNCER_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,112 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/io_throttle.h"
+
+#include <unistd.h>
+
+#include <common/counter.h>
+#include <common/timer.h>
+
+namespace baidu {
+namespace bfs {
+
+extern common::Counter g_io_class_bytes[kIoClassNum];
+extern common::Counter g_io_throttle_wait;
+
+/// Burst allowance, in micros of the class rate
+const int64_t kIoThrottleBurst = 100 * 1000;
+/// A class is active for this long after its last io
+const int64_t kIoPreemptWindow = 100 * 1000;
+/// Lower classes refill at 1/kIoPreemptFactor of their rate while a higher one is active
+const int64_t kIoPreemptFactor = 4;
+
+IoThrottle::IoThrottle() {
+    int64_t now = common::timer::get_micros();
+    for (int i = 0; i < kIoClassNum; i++) {
+        buckets_[i].rate = 0;
+        buckets_[i].tokens = 0;
+        buckets_[i].last_refill = now;
+        buckets_[i].last_io = 0;
+    }
+}
+
+void IoThrottle::SetRate(IoClass io_class, int64_t rate) {
+    MutexLock lock(&mu_);
+    Bucket& bucket = buckets_[io_class];
+    bucket.rate = rate;
+    bucket.tokens = 0;
+    bucket.last_refill = common::timer::get_micros();
+}
+
+int64_t IoThrottle::GetRate(IoClass io_class) {
+    MutexLock lock(&mu_);
+    return buckets_[io_class].rate;
+}
+
+double IoThrottle::CurrentRate(int io_class, int64_t now) {
+    mu_.AssertHeld();
+    for (int i = 0; i < io_class; i++) {
+        if (buckets_[i].last_io > 0 && now - buckets_[i].last_io < kIoPreemptWindow) {
+            return static_cast<double>(buckets_[io_class].rate) / kIoPreemptFactor;
+        }
+    }
+    return buckets_[io_class].rate;
+}
+
+int64_t IoThrottle::Reserve(IoClass io_class, int64_t bytes) {
+    g_io_class_bytes[io_class].Add(bytes);
+    MutexLock lock(&mu_);
+    Bucket& bucket = buckets_[io_class];
+    int64_t now = common::timer::get_micros();
+    bucket.last_io = now;
+    if (bucket.rate <= 0) {
+        return 0;
+    }
+    double rate = CurrentRate(io_class, now);
+    double burst = rate * kIoThrottleBurst / 1000000;
+    bucket.tokens += rate * (now - bucket.last_refill) / 1000000;
+    if (bucket.tokens > burst) {
+        bucket.tokens = burst;
+    }
+    bucket.last_refill = now;
+    // Take the tokens now, later callers queue behind the debt
+    bucket.tokens -= bytes;
+    if (bucket.tokens >= 0) {
+        return 0;
+    }
+    int64_t wait = static_cast<int64_t>(-bucket.tokens * 1000000 / rate);
+    g_io_throttle_wait.Add(wait);
+    return wait;
+}
+
+void IoThrottle::Acquire(IoClass io_class, int64_t bytes) {
+    int64_t wait = Reserve(io_class, bytes);
+    if (wait > 0) {
+        usleep(wait);
+    }
+}
+
+const char* IoThrottle::ClassName(IoClass io_class) {
+    switch (io_class) {
+        case kForegroundIo:
+            return "foreground";
+        case kRecoverIo:
+            return "recover";
+        case kScrubIo:
+            return "scrub";
+        case kDeleteIo:
+            return "delete";
+        case kBalanceIo:
+            return "balance";
+        case kTranscodeIo:
+            return "transcode";
+    }
+    return "unknown";
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
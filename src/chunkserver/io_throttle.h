@@ -0,0 +1,59 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  BFS_IO_THROTTLE_H_
+#define  BFS_IO_THROTTLE_H_
+
+#include <stdint.h>
+
+#include <common/mutex.h>
+
+namespace baidu {
+namespace bfs {
+
+/// QoS classes of chunkserver disk and network traffic, in priority order.
+/// A limited class is slowed down while a class before it is doing io.
+enum IoClass {
+    kForegroundIo = 0,
+    kRecoverIo = 1,
+    kScrubIo = 2,
+    kDeleteIo = 3,
+    kBalanceIo = 4,
+    kTranscodeIo = 5,
+};
+const int kIoClassNum = 6;
+
+/// Token bucket per IoClass. A bucket refills at a fraction of its rate while a class
+/// of higher priority, limited or not, did io recently, so background io gives way.
+class IoThrottle {
+public:
+    IoThrottle();
+    /// Bytes per second, 0 for unlimited
+    void SetRate(IoClass io_class, int64_t rate);
+    int64_t GetRate(IoClass io_class);
+    /// Charge bytes to io_class, return micros the caller should wait before doing the io.
+    /// Callers of lower classes queue behind the debt at the preempted rate.
+    int64_t Reserve(IoClass io_class, int64_t bytes);
+    /// Reserve and sleep
+    void Acquire(IoClass io_class, int64_t bytes);
+    static const char* ClassName(IoClass io_class);
+private:
+    struct Bucket {
+        int64_t rate;
+        double tokens;
+        int64_t last_refill;
+        int64_t last_io;
+    };
+    /// Rate of the bucket of io_class now, lowered if a higher class is active
+    double CurrentRate(int io_class, int64_t now);
+    Mutex mu_;
+    Bucket buckets_[kIoClassNum];
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_IO_THROTTLE_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,207 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <map>
+
+#include <common/logging.h>
+#include <common/timer.h>
+
+namespace baidu {
+namespace bfs {
+
+static const uint32_t kRecordMagic = 0x4a524e4c;
+static const int32_t kMaxPathLen = 4096;
+
+Journal::Journal(const std::string& path, int64_t max_size)
+    : path_(path), max_size_(max_size), fd_(-1), size_(0), syncer_(1024) {
+}
+
+Journal::~Journal() {
+    if (fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+uint32_t Journal::Checksum(const RecordHeader& header, const char* path, const char* data) {
+    // FNV-1a, enough to find a torn tail
+    uint32_t hash = 2166136261u;
+    const char* parts[5] = {reinterpret_cast<const char*>(&header.offset),
+                            reinterpret_cast<const char*>(&header.len),
+                            reinterpret_cast<const char*>(&header.path_len), path, data};
+    int64_t lens[5] = {sizeof(header.offset), sizeof(header.len), sizeof(header.path_len),
+                       header.path_len, header.len};
+    for (int i = 0; i < 5; i++) {
+        for (int64_t j = 0; j < lens[i]; j++) {
+            hash = (hash ^ static_cast<uint8_t>(parts[i][j])) * 16777619u;
+        }
+    }
+    return hash;
+}
+
+bool Journal::Open() {
+    MutexLock lock(&mu_);
+    fd_ = open(path_.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
+    if (fd_ < 0) {
+        LOG(WARNING, "Open journal %s fail: %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    if (!Replay()) {
+        return false;
+    }
+    if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) {
+        LOG(WARNING, "Reset journal %s fail: %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    size_ = 0;
+    return true;
+}
+
+bool Journal::Replay() {
+    struct stat st;
+    if (fstat(fd_, &st) != 0) {
+        return false;
+    }
+    int64_t start = common::timer::get_micros();
+    std::map<std::string, int> files;
+    int64_t pos = 0;
+    int64_t records = 0;
+    std::string record;
+    bool ret = true;
+    while (pos + static_cast<int64_t>(sizeof(RecordHeader)) <= st.st_size) {
+        RecordHeader header;
+        if (pread(fd_, &header, sizeof(header), pos) != sizeof(header)
+            || header.magic != kRecordMagic || header.len < 0
+            || header.path_len <= 0 || header.path_len > kMaxPathLen
+            || pos + static_cast<int64_t>(sizeof(header)) + header.path_len + header.len
+               > st.st_size) {
+            break;
+        }
+        record.resize(header.path_len + header.len);
+        if (pread(fd_, &record[0], record.size(), pos + sizeof(header))
+                != static_cast<ssize_t>(record.size())
+            || Checksum(header, record.data(), record.data() + header.path_len)
+               != header.checksum) {
+            break;
+        }
+        pos += sizeof(header) + record.size();
+        std::string file(record.data(), header.path_len);
+        std::map<std::string, int>::iterator it = files.find(file);
+        if (it == files.end()) {
+            // Blocks deleted since are gone, nothing to apply
+            it = files.insert(std::make_pair(file, open(file.c_str(), O_WRONLY))).first;
+        }
+        if (it->second < 0) {
+            continue;
+        }
+        const char* data = record.data() + header.path_len;
+        if (pwrite(it->second, data, header.len, header.offset) != header.len) {
+            LOG(WARNING, "Replay journal into %s fail: %s", file.c_str(), strerror(errno));
+            ret = false;
+            break;
+        }
+        ++records;
+    }
+    for (std::map<std::string, int>::iterator it = files.begin(); it != files.end(); ++it) {
+        if (it->second >= 0) {
+            if (fdatasync(it->second) != 0) {
+                LOG(WARNING, "Sync %s fail: %s", it->first.c_str(), strerror(errno));
+                ret = false;
+            }
+            close(it->second);
+        }
+    }
+    LOG(INFO, "Replay journal %s: %ld records %ld of %ld bytes into %lu files, use %ld ms",
+        path_.c_str(), records, pos, st.st_size, files.size(),
+        (common::timer::get_micros() - start) / 1000);
+    return ret;
+}
+
+bool Journal::Append(const std::string& file, int64_t offset, const char* data, int64_t len) {
+    RecordHeader header;
+    memset(&header, 0, sizeof(header));
+    header.magic = kRecordMagic;
+    header.offset = offset;
+    header.len = len;
+    header.path_len = file.size();
+    header.checksum = Checksum(header, file.data(), data);
+    std::string record(reinterpret_cast<const char*>(&header), sizeof(header));
+    record.append(file);
+    record.append(data, len);
+
+    MutexLock lock(&mu_);
+    if (fd_ < 0) {
+        return false;
+    }
+    if (size_ + static_cast<int64_t>(record.size()) > max_size_ && !CheckpointLocked()) {
+        return false;
+    }
+    // A failed write is overwritten by the next record, replay stops at it anyway
+    if (pwrite(fd_, record.data(), record.size(), size_)
+            != static_cast<ssize_t>(record.size())) {
+        LOG(WARNING, "Append journal %s fail: %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    size_ += record.size();
+    files_.insert(file);
+    int fd = fd_;
+    mu_.Unlock();
+    // Concurrent appends share the sync
+    bool ret = syncer_.Sync(fd);
+    mu_.Lock();
+    return ret;
+}
+
+bool Journal::Checkpoint() {
+    MutexLock lock(&mu_);
+    return CheckpointLocked();
+}
+
+bool Journal::CheckpointLocked() {
+    mu_.AssertHeld();
+    if (fd_ < 0 || size_ == 0) {
+        return true;
+    }
+    int64_t start = common::timer::get_micros();
+    // Journaled data is in the page cache of the block files, flushing them
+    // makes the records useless
+    for (std::set<std::string>::iterator it = files_.begin(); it != files_.end(); ++it) {
+        int fd = open(it->c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+        int ret = fdatasync(fd);
+        close(fd);
+        if (ret != 0) {
+            LOG(WARNING, "Checkpoint sync %s fail: %s", it->c_str(), strerror(errno));
+            return false;
+        }
+    }
+    // A truncate lost in a crash would replay old records over newer block data
+    if (ftruncate(fd_, 0) != 0 || fdatasync(fd_) != 0) {
+        LOG(WARNING, "Truncate journal %s fail: %s", path_.c_str(), strerror(errno));
+        return false;
+    }
+    LOG(INFO, "Journal checkpoint %ld bytes of %lu files, use %ld ms",
+        size_, files_.size(), (common::timer::get_micros() - start) / 1000);
+    size_ = 0;
+    files_.clear();
+    return true;
+}
+
+int64_t Journal::Size() {
+    MutexLock lock(&mu_);
+    return size_;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
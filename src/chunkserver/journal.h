@@ -0,0 +1,61 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  BFS_JOURNAL_H_
+#define  BFS_JOURNAL_H_
+
+#include <stdint.h>
+#include <set>
+#include <string>
+
+#include <common/mutex.h>
+
+#include "chunkserver/file_syncer.h"
+
+namespace baidu {
+namespace bfs {
+
+/// Write-ahead journal of block data on a fast device. A durable write is
+/// acked once its data is synced here, block files reach their own disks
+/// at the next checkpoint. Records left by a crash are replayed into the
+/// block files on restart.
+class Journal {
+public:
+    /// max_size: journal bytes that force a checkpoint
+    Journal(const std::string& path, int64_t max_size);
+    ~Journal();
+    /// Replay records of the last run into block files, then start empty
+    bool Open();
+    /// Return once data, already written to file at offset, is synced to the journal
+    bool Append(const std::string& file, int64_t offset, const char* data, int64_t len);
+    /// Sync block files written since the last checkpoint and empty the journal
+    bool Checkpoint();
+    int64_t Size();
+private:
+    struct RecordHeader {
+        uint32_t magic;
+        uint32_t checksum;  ///< of the rest of the record
+        int64_t offset;
+        int64_t len;
+        int32_t path_len;
+    };
+    static uint32_t Checksum(const RecordHeader& header, const char* path, const char* data);
+    bool Replay();
+    bool CheckpointLocked();
+private:
+    std::string path_;
+    int64_t max_size_;
+    Mutex mu_;
+    int fd_;
+    int64_t size_;
+    std::set<std::string> files_;   ///< block files with records in the journal
+    FileSyncer syncer_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_JOURNAL_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
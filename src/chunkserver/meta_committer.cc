@@ -0,0 +1,104 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/meta_committer.h"
+
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+#include <common/counter.h>
+#include <common/timer.h>
+
+namespace baidu {
+namespace bfs {
+
+extern common::Counter g_meta_batches;
+extern common::Counter g_meta_ops;
+extern common::Counter g_meta_commit_time;
+
+MetaCommitter::MetaCommitter(leveldb::DB* db, bool sync, int32_t max_batch_ops)
+    : db_(db), sync_(sync), max_batch_ops_(max_batch_ops > 0 ? max_batch_ops : 1) {
+}
+
+leveldb::Status MetaCommitter::Put(const std::string& key, const std::string& value) {
+    Writer writer(&mu_);
+    writer.key = &key;
+    writer.value = &value;
+    return Commit(&writer);
+}
+
+leveldb::Status MetaCommitter::Delete(const std::string& key) {
+    Writer writer(&mu_);
+    writer.is_delete = true;
+    writer.key = &key;
+    return Commit(&writer);
+}
+
+leveldb::Status MetaCommitter::Delete(const std::vector<std::string>& keys) {
+    Writer writer(&mu_);
+    writer.is_delete = true;
+    writer.keys = &keys;
+    return Commit(&writer);
+}
+
+leveldb::Status MetaCommitter::Commit(Writer* writer) {
+    MutexLock lock(&mu_);
+    writers_.push_back(writer);
+    while (!writer->done && writer != writers_.front()) {
+        writer->cv.Wait();
+    }
+    if (writer->done) {
+        return writer->status;
+    }
+    // The front writer commits for everyone queued behind it
+    leveldb::WriteBatch batch;
+    Writer* last = writer;
+    int32_t ops = 0;
+    for (std::deque<Writer*>::iterator it = writers_.begin();
+         it != writers_.end() && ops < max_batch_ops_; ++it) {
+        last = *it;
+        if (last->keys) {
+            for (size_t i = 0; i < last->keys->size(); i++) {
+                batch.Delete((*last->keys)[i]);
+            }
+            ops += last->keys->size();
+        } else if (last->is_delete) {
+            batch.Delete(*last->key);
+            ++ops;
+        } else {
+            batch.Put(*last->key, *last->value);
+            ++ops;
+        }
+    }
+    mu_.Unlock();
+    int64_t start = common::timer::get_micros();
+    leveldb::WriteOptions options;
+    options.sync = sync_;
+    leveldb::Status s = db_->Write(options, &batch);
+    int64_t commit_time = common::timer::get_micros() - start;
+    g_meta_batches.Inc();
+    g_meta_ops.Add(ops);
+    g_meta_commit_time.Add(commit_time);
+    mu_.Lock();
+    while (true) {
+        Writer* ready = writers_.front();
+        writers_.pop_front();
+        if (ready != writer) {
+            ready->status = s;
+            ready->done = true;
+            ready->cv.Signal();
+        }
+        if (ready == last) {
+            break;
+        }
+    }
+    if (!writers_.empty()) {
+        writers_.front()->cv.Signal();
+    }
+    return s;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,61 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  BFS_META_COMMITTER_H_
+#define  BFS_META_COMMITTER_H_
+
+#include <stdint.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include <common/mutex.h>
+#include <leveldb/status.h>
+
+namespace leveldb {
+class DB;
+class WriteBatch;
+}
+
+namespace baidu {
+namespace bfs {
+
+/// Group commit of block meta updates to one metadb. Concurrent updates are
+/// merged into one WriteBatch, so a synced commit costs one fsync per group.
+class MetaCommitter {
+public:
+    /// max_batch_ops: max updates merged into one write
+    MetaCommitter(leveldb::DB* db, bool sync, int32_t max_batch_ops);
+    /// Return once the update is committed
+    leveldb::Status Put(const std::string& key, const std::string& value);
+    leveldb::Status Delete(const std::string& key);
+    /// Delete keys in one write
+    leveldb::Status Delete(const std::vector<std::string>& keys);
+private:
+    struct Writer {
+        bool is_delete;
+        const std::string* key;
+        const std::string* value;
+        const std::vector<std::string>* keys;   ///< deleted together, if set
+        bool done;
+        leveldb::Status status;
+        CondVar cv;
+        explicit Writer(Mutex* mu) : is_delete(false), key(NULL), value(NULL), keys(NULL),
+                                     done(false), cv(mu) {}
+    };
+    leveldb::Status Commit(Writer* writer);
+private:
+    leveldb::DB* db_;
+    bool sync_;
+    int32_t max_batch_ops_;
+    Mutex mu_;
+    std::deque<Writer*> writers_;   ///< front is the one committing
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_META_COMMITTER_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,421 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/block_manager.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <malloc.h>
+#include <sys/stat.h>
+#include <boost/bind.hpp>
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <leveldb/db.h>
+#include <common/atomic.h>
+#include <common/counter.h>
+#include <common/thread_pool.h>
+#include <common/timer.h>
+
+#include "chunkserver/data_block.h"
+#include "chunkserver/io_throttle.h"
+
+DECLARE_int32(chunkserver_use_root_partition);
+DECLARE_bool(chunkserver_background_verify);
+DECLARE_string(chunkserver_journal_path);
+DECLARE_int32(chunkserver_memory_limit);
+
+namespace baidu {
+namespace bfs {
+
+extern common::Counter g_blocks;
+extern common::Counter g_data_size;
+
+const int64_t kLoadedBlocks = 100000;
+const int64_t kBlocks = 100;
+
+class BlockManagerTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        FLAGS_chunkserver_use_root_partition = 1;
+        system("rm -rf ./block_manager_test_data && mkdir -p ./block_manager_test_data");
+        block_manager_ = new BlockManager("./block_manager_test_data/");
+        ASSERT_TRUE(block_manager_->LoadStorage());
+        for (int64_t i = 0; i < kLoadedBlocks; i++) {
+            StatusCode status;
+            Block* block = block_manager_->CreateBlock(i, NULL, &status);
+            ASSERT_TRUE(block != NULL);
+            block->DecRef();
+        }
+    }
+    static void TearDownTestCase() {
+        delete block_manager_;
+        block_manager_ = NULL;
+        system("rm -rf ./block_manager_test_data");
+    }
+    static void FindLoop(int64_t seed, volatile bool* stop, volatile int64_t* ops,
+                         volatile int64_t* misses) {
+        unsigned int rand_seed = seed;
+        int64_t done = 0;
+        while (!*stop) {
+            int64_t block_id = rand_r(&rand_seed) % kLoadedBlocks;
+            Block* block = block_manager_->FindBlock(block_id);
+            if (block == NULL) {
+                common::atomic_inc(misses);
+            } else {
+                block->DecRef();
+            }
+            ++done;
+        }
+        common::atomic_add64(ops, done);
+    }
+    static void ChurnLoop(volatile bool* stop) {
+        // Writes and deletes on other blocks while readers run
+        for (int64_t block_id = kLoadedBlocks; !*stop; block_id++) {
+            StatusCode status;
+            Block* block = block_manager_->CreateBlock(block_id, NULL, &status);
+            if (block) {
+                block->DecRef();
+            }
+            block_manager_->RemoveBlock(block_id);
+        }
+    }
+    static BlockManager* block_manager_;
+};
+
+BlockManager* BlockManagerTest::block_manager_ = NULL;
+
+TEST_F(BlockManagerTest, FindWithRef) {
+    Block* block = block_manager_->FindBlock(1);
+    ASSERT_TRUE(block != NULL);
+    ASSERT_EQ(block->Id(), 1);
+    // One ref for the index, one for us
+    ASSERT_EQ(block->GetRef(), 2);
+    block->DecRef();
+    ASSERT_TRUE(block_manager_->FindBlock(kLoadedBlocks + 1) == NULL);
+}
+
+TEST_F(BlockManagerTest, ConcurrentFind) {
+    const int32_t kSeconds = 2;
+    for (int threads = 1; threads <= 32; threads *= 2) {
+        ThreadPool pool(threads + 1);
+        volatile bool stop = false;
+        volatile int64_t ops = 0;
+        volatile int64_t misses = 0;
+        for (int i = 0; i < threads; i++) {
+            pool.AddTask(boost::bind(&BlockManagerTest::FindLoop, i, &stop, &ops, &misses));
+        }
+        pool.AddTask(boost::bind(&BlockManagerTest::ChurnLoop, &stop));
+        sleep(kSeconds);
+        stop = true;
+        pool.Stop(true);
+        printf("%2d readers: %ld finds/s\n", threads, ops / kSeconds);
+        ASSERT_EQ(misses, 0);
+    }
+}
+
+class BlockManagerRestartTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        FLAGS_chunkserver_use_root_partition = 1;
+        system("rm -rf ./block_manager_restart_data && mkdir -p ./block_manager_restart_data");
+        block_manager_ = Open();
+        for (int64_t i = 0; i < kBlocks; i++) {
+            StatusCode status;
+            Block* block = block_manager_->CreateBlock(i, NULL, &status);
+            ASSERT_TRUE(block != NULL);
+            int64_t add_use = 0;
+            ASSERT_TRUE(block->Write(0, 0, "data", 4, &add_use));
+            ASSERT_TRUE(block_manager_->CloseBlock(block));
+            block->DecRef();
+        }
+    }
+    virtual void TearDown() {
+        delete block_manager_;
+        FLAGS_chunkserver_background_verify = false;
+        FLAGS_chunkserver_journal_path = "";
+        FLAGS_chunkserver_memory_limit = 4096;
+        system("rm -rf ./block_manager_restart_data");
+    }
+    static BlockManager* Open() {
+        BlockManager* block_manager = new BlockManager("./block_manager_restart_data/");
+        EXPECT_TRUE(block_manager->LoadStorage());
+        return block_manager;
+    }
+    /// Truncate the file of block 0 behind the back of the meta
+    void CorruptBlock() {
+        Block* block = block_manager_->FindBlock(0);
+        ASSERT_TRUE(block != NULL);
+        std::string file = block->GetStorePath() + Block::BuildFilePath(0);
+        block->DecRef();
+        ASSERT_EQ(truncate(file.c_str(), 1), 0);
+    }
+    /// Like a crash: the clean shutdown mark of the last run is lost
+    void Crash() {
+        delete block_manager_;
+        leveldb::DB* db = NULL;
+        ASSERT_TRUE(leveldb::DB::Open(leveldb::Options(),
+                                      "./block_manager_restart_data/meta/", &db).ok());
+        db->Delete(leveldb::WriteOptions(), std::string(8, '\0') + "clean");
+        delete db;
+        block_manager_ = Open();
+    }
+    bool HasBlock(int64_t block_id) {
+        Block* block = block_manager_->FindBlock(block_id);
+        if (block) {
+            block->DecRef();
+        }
+        return block != NULL;
+    }
+    static int64_t HeapInUse() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+        return mallinfo2().uordblks;
+#else
+        return mallinfo().uordblks;
+#endif
+    }
+    BlockManager* block_manager_;
+};
+
+TEST_F(BlockManagerRestartTest, CleanShutdownSkipsCheck) {
+    CorruptBlock();
+    delete block_manager_;
+    block_manager_ = Open();
+    // Files are trusted after a clean shutdown
+    ASSERT_TRUE(HasBlock(0));
+    Crash();
+    ASSERT_FALSE(HasBlock(0));
+    ASSERT_TRUE(HasBlock(1));
+}
+
+TEST_F(BlockManagerRestartTest, BackgroundVerify) {
+    FLAGS_chunkserver_background_verify = true;
+    CorruptBlock();
+    Crash();
+    for (int i = 0; i < 100 && HasBlock(0); i++) {
+        usleep(10000);
+    }
+    ASSERT_FALSE(HasBlock(0));
+    for (int64_t i = 1; i < kBlocks; i++) {
+        ASSERT_TRUE(HasBlock(i));
+    }
+}
+
+TEST_F(BlockManagerRestartTest, UnclosedAppend) {
+    Block* block = block_manager_->FindBlock(0);
+    ASSERT_TRUE(block != NULL);
+    BlockMeta sealed = block->GetMeta();
+    std::string file = block->GetFilePath();
+    ASSERT_EQ(block->Reopen(sealed.version(), 4), kOK);
+    ASSERT_TRUE(block->Write(0, 4, "", 0));
+    ASSERT_TRUE(block->Write(1, 4, "more", 4));
+    ASSERT_TRUE(block_manager_->SyncBlockData(block, false));
+    block->DecRef();
+    struct stat st;
+    ASSERT_EQ(stat(file.c_str(), &st), 0);
+    ASSERT_EQ(st.st_size, 8);
+    // Crash in the middle of the append: the file has grown, the meta is still the sealed one
+    ASSERT_EQ(system(("cp " + file + " ./append.bak").c_str()), 0);
+    std::string key = block_manager_->BlockId2Str(0);
+    delete block_manager_;
+    block_manager_ = NULL;
+    leveldb::DB* db = NULL;
+    ASSERT_TRUE(leveldb::DB::Open(leveldb::Options(),
+                                  "./block_manager_restart_data/meta/", &db).ok());
+    ASSERT_TRUE(db->Put(leveldb::WriteOptions(), key, sealed.SerializeAsString()).ok());
+    delete db;
+    ASSERT_EQ(system(("mv -f ./append.bak " + file).c_str()), 0);
+    Crash();
+    // The sealed replica is kept, without the tail of the append
+    block = block_manager_->FindBlock(0);
+    ASSERT_TRUE(block != NULL);
+    ASSERT_EQ(block->Size(), 4);
+    ASSERT_EQ(block->GetVersion(), sealed.version());
+    char buf[8];
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 4);
+    ASSERT_EQ(std::string(buf, 4), "data");
+    block->DecRef();
+    ASSERT_EQ(stat(file.c_str(), &st), 0);
+    ASSERT_EQ(st.st_size, 4);
+}
+
+TEST_F(BlockManagerRestartTest, CompactIndex) {
+    int64_t blocks = g_blocks.Get();
+    int64_t data_size = g_data_size.Get();
+    // The disk write of a closed block may still hold a ref for a moment
+    int64_t compacted = 0;
+    for (int i = 0; i < 100 && compacted < kBlocks; i++) {
+        compacted += block_manager_->CompactBlocks();
+        usleep(1000);
+    }
+    ASSERT_EQ(compacted, kBlocks);
+    ASSERT_EQ(block_manager_->CompactBlocks(), 0);
+    ASSERT_EQ(g_blocks.Get(), blocks);
+    ASSERT_EQ(g_data_size.Get(), data_size);
+
+    Block* block = block_manager_->FindBlock(5);
+    ASSERT_TRUE(block != NULL);
+    ASSERT_EQ(block->Size(), 4);
+    ASSERT_TRUE(block->IsFinished());
+    char buf[8];
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 4);
+    ASSERT_EQ(std::string(buf, 4), "data");
+    // In use, stays a Block
+    ASSERT_EQ(block_manager_->CompactBlocks(), 0);
+    block->DecRef();
+    ASSERT_EQ(block_manager_->CompactBlocks(), 1);
+    ASSERT_EQ(g_blocks.Get(), blocks);
+
+    StatusCode status;
+    ASSERT_TRUE(block_manager_->CreateBlock(6, NULL, &status) == NULL);
+    ASSERT_EQ(status, kReadOnly);
+    ASSERT_TRUE(block_manager_->RemoveBlock(7));
+    ASSERT_FALSE(HasBlock(7));
+    ASSERT_EQ(g_blocks.Get(), blocks - 1);
+}
+
+TEST_F(BlockManagerRestartTest, TrashPurge) {
+    std::vector<int64_t> ids;
+    ids.push_back(1);
+    ids.push_back(2);
+    ids.push_back(3);
+    ids.push_back(kBlocks + 1);
+    std::string file = "./block_manager_restart_data/" + Block::BuildFilePath(1);
+    ASSERT_EQ(access(file.c_str(), F_OK), 0);
+    ASSERT_EQ(block_manager_->RemoveBlocks(ids), 3);
+    ASSERT_FALSE(HasBlock(1));
+    ASSERT_NE(access(file.c_str(), F_OK), 0);
+    // Space is freed by purging
+    ASSERT_EQ(block_manager_->TrashBytes(), 12);
+
+    IoThrottle throttle;
+    throttle.SetRate(kDeleteIo, 4);
+    ASSERT_GT(block_manager_->PurgeTrash(&throttle), 0);
+    ASSERT_GT(block_manager_->TrashBytes(), 0);
+    ASSERT_LT(block_manager_->TrashBytes(), 12);
+    ASSERT_EQ(block_manager_->PurgeTrash(NULL), 0);
+    ASSERT_EQ(block_manager_->TrashBytes(), 0);
+
+    // Trash left at shutdown is purged after restart
+    ASSERT_TRUE(block_manager_->RemoveBlock(4));
+    delete block_manager_;
+    block_manager_ = Open();
+    ASSERT_FALSE(HasBlock(4));
+    ASSERT_EQ(block_manager_->TrashBytes(), 4);
+    ASSERT_EQ(block_manager_->PurgeTrash(NULL), 0);
+    ASSERT_EQ(system("test -z \"$(ls ./block_manager_restart_data/trash)\""), 0);
+}
+
+TEST_F(BlockManagerRestartTest, JournalReplay) {
+    FLAGS_chunkserver_journal_path = "./block_manager_restart_data/journal";
+    delete block_manager_;
+    block_manager_ = Open();
+    StatusCode status;
+    Block* block = block_manager_->CreateBlock(kBlocks, NULL, &status);
+    ASSERT_TRUE(block != NULL);
+    ASSERT_TRUE(block->Write(0, 0, "journal", 7));
+    ASSERT_TRUE(block_manager_->SyncBlockData(block, true));
+    ASSERT_TRUE(block_manager_->CloseBlock(block));
+    std::string file = block->GetFilePath();
+    block->DecRef();
+    // Crash before the block file was written back, only the journal has the data
+    ASSERT_EQ(system("cp ./block_manager_restart_data/journal ./journal.bak"), 0);
+    delete block_manager_;
+    block_manager_ = NULL;
+    ASSERT_EQ(system("mv ./journal.bak ./block_manager_restart_data/journal"), 0);
+    ASSERT_EQ(truncate(file.c_str(), 0), 0);
+    Crash();
+    block = block_manager_->FindBlock(kBlocks);
+    ASSERT_TRUE(block != NULL);
+    char buf[8];
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 7);
+    ASSERT_EQ(std::string(buf, 7), "journal");
+    block->DecRef();
+}
+
+TEST_F(BlockManagerRestartTest, StorageClasses) {
+    StatusCode status;
+    Block* block = block_manager_->CreateBlock(kBlocks, NULL, &status, kStorageMemory);
+    ASSERT_TRUE(block != NULL);
+    ASSERT_TRUE(block->Write(0, 0, "memory", 6));
+    ASSERT_TRUE(block_manager_->CloseBlock(block));
+    ASSERT_NE(access(block->GetFilePath().c_str(), F_OK), 0);
+    block->DecRef();
+    block = block_manager_->CreateBlock(kBlocks + 1, NULL, &status, kStorageLazyPersist);
+    ASSERT_TRUE(block != NULL);
+    ASSERT_TRUE(block->Write(0, 0, "lazy", 4));
+    ASSERT_TRUE(block_manager_->CloseBlock(block));
+    block->DecRef();
+    // The memory block has no file to be dropped to
+    for (int i = 0; i < 100; i++) {
+        block_manager_->CompactBlocks();
+        usleep(1000);
+    }
+    block = block_manager_->FindBlock(kBlocks);
+    ASSERT_TRUE(block != NULL);
+    ASSERT_EQ(block->GetStorageClass(), kStorageMemory);
+    char buf[8];
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 6);
+    ASSERT_EQ(std::string(buf, 6), "memory");
+    block->DecRef();
+    block = block_manager_->FindBlock(kBlocks + 1);
+    ASSERT_TRUE(block != NULL);
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 4);
+    ASSERT_EQ(std::string(buf, 4), "lazy");
+    block->DecRef();
+
+    // Memory budget is used up
+    FLAGS_chunkserver_memory_limit = 0;
+    ASSERT_TRUE(block_manager_->CreateBlock(kBlocks + 2, NULL, &status, kStorageMemory) == NULL);
+    ASSERT_EQ(status, kNoEnoughSpace);
+    ASSERT_FALSE(block_manager_->MemoryAvailable(1));
+
+    // Memory blocks are gone after restart, persisted ones stay
+    delete block_manager_;
+    block_manager_ = Open();
+    ASSERT_FALSE(HasBlock(kBlocks));
+    ASSERT_TRUE(HasBlock(kBlocks + 1));
+}
+
+TEST_F(BlockManagerRestartTest, IndexMemory) {
+    const int64_t kMany = 20000;
+    for (int64_t i = kBlocks; i < kMany; i++) {
+        StatusCode status;
+        Block* block = block_manager_->CreateBlock(i, NULL, &status);
+        ASSERT_TRUE(block != NULL);
+        int64_t add_use = 0;
+        ASSERT_TRUE(block->Write(0, 0, "data", 4, &add_use));
+        ASSERT_TRUE(block_manager_->CloseBlock(block));
+        block->DecRef();
+    }
+    delete block_manager_;
+    std::vector<Block*> blocks;
+    blocks.reserve(kMany);
+    int64_t base = HeapInUse();
+    block_manager_ = Open();
+    int64_t sealed = HeapInUse() - base;
+    for (int64_t i = 0; i < kMany; i++) {
+        blocks.push_back(block_manager_->FindBlock(i));
+        ASSERT_TRUE(blocks.back() != NULL);
+    }
+    int64_t opened = HeapInUse() - base;
+    printf("Index memory per block: sealed %ld bytes, with Block object %ld bytes\n",
+           sealed / kMany, opened / kMany);
+    ASSERT_LT(sealed * 2, opened);
+    for (size_t i = 0; i < blocks.size(); i++) {
+        blocks[i]->DecRef();
+    }
+    ASSERT_EQ(block_manager_->CompactBlocks(), kMany);
+    ASSERT_LT(HeapInUse() - base, opened);
+}
+
+}
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,378 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/data_block.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+
+#include <boost/bind.hpp>
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+#include <common/counter.h>
+#include <common/thread_pool.h>
+#include <common/timer.h>
+
+#include "chunkserver/file_cache.h"
+#include "chunkserver/file_syncer.h"
+#include "chunkserver/journal.h"
+
+DECLARE_int32(write_buf_size);
+
+namespace baidu {
+namespace bfs {
+
+extern common::Counter g_memory_data;
+
+const int32_t kBlocks = 4;
+const int64_t kSliceSize = 256 * 1024;
+const int32_t kSlices = 64;
+
+class DataBlockTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        system("rm -rf ./data_block_test_data && mkdir -p ./data_block_test_data");
+        thread_pool_ = new ThreadPool(1);
+        file_cache_ = new FileCache(10);
+    }
+    virtual void TearDown() {
+        thread_pool_->Stop(true);
+        delete thread_pool_;
+        delete file_cache_;
+        system("rm -rf ./data_block_test_data");
+    }
+    /// Write kBlocks blocks slice by slice in turn, like concurrent writers
+    void WriteInterleaved(int64_t first_id, int64_t expected_size, std::vector<Block*>* blocks) {
+        for (int32_t i = 0; i < kBlocks; i++) {
+            Block* block = NewBlock(first_id + i);
+            if (expected_size) {
+                block->SetExpectedSize(expected_size);
+            }
+            blocks->push_back(block);
+        }
+        std::string slice(kSliceSize, '\0');
+        for (int32_t seq = 0; seq < kSlices; seq++) {
+            for (int32_t i = 0; i < kBlocks; i++) {
+                memset(&slice[0], 'a' + (seq + i) % 26, kSliceSize);
+                ASSERT_TRUE((*blocks)[i]->Write(seq, seq * kSliceSize, slice.data(), kSliceSize));
+            }
+        }
+        for (int32_t i = 0; i < kBlocks; i++) {
+            ASSERT_TRUE((*blocks)[i]->Close());
+        }
+    }
+    /// Extent count of a file, -1 if the filesystem can't tell
+    static int32_t Extents(const std::string& file) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        struct fiemap fm;
+        memset(&fm, 0, sizeof(fm));
+        fm.fm_length = FIEMAP_MAX_OFFSET;
+        fm.fm_flags = FIEMAP_FLAG_SYNC;
+        int ret = ioctl(fd, FS_IOC_FIEMAP, &fm);
+        close(fd);
+        return ret == 0 ? static_cast<int32_t>(fm.fm_mapped_extents) : -1;
+    }
+    /// Sequential read speed of a file out of page cache, MB/s
+    static double ReadSpeed(const std::string& file) {
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return 0;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        std::string buf(1 << 20, '\0');
+        int64_t start = common::timer::get_micros();
+        int64_t total = 0;
+        int64_t len = 0;
+        while ((len = read(fd, &buf[0], buf.size())) > 0) {
+            total += len;
+        }
+        int64_t use = common::timer::get_micros() - start;
+        close(fd);
+        return static_cast<double>(total) / (use ? use : 1);
+    }
+    Block* NewBlock(int64_t block_id, StorageClass storage_class = kStorageDisk) {
+        BlockMeta meta;
+        meta.set_block_id(block_id);
+        meta.set_store_path("./data_block_test_data/");
+        meta.set_version(-1);
+        meta.set_storage_class(storage_class);
+        Block* block = new Block(meta, thread_pool_, file_cache_);
+        block->AddRef();
+        return block;
+    }
+    /// Write kSlices slices, then check they read back after close
+    void WriteAndRead(Block* block) {
+        std::string slice(kSliceSize, '\0');
+        for (int32_t seq = 0; seq < kSlices; seq++) {
+            memset(&slice[0], 'a' + seq % 26, kSliceSize);
+            ASSERT_TRUE(block->Write(seq, seq * kSliceSize, slice.data(), kSliceSize));
+        }
+        ASSERT_TRUE(block->Close());
+        char buf[16];
+        for (int32_t seq = 0; seq < kSlices; seq += 5) {
+            ASSERT_EQ(block->Read(buf, sizeof(buf), seq * kSliceSize + kSliceSize - 8), 16);
+            ASSERT_EQ(buf[0], 'a' + seq % 26);
+            if (seq + 1 < kSlices) {
+                ASSERT_EQ(buf[15], 'a' + (seq + 1) % 26);
+            }
+        }
+    }
+    static void Hold(volatile int* hold) {
+        while (*hold) {
+            usleep(1000);
+        }
+    }
+    static int64_t FileSize(const std::string& file) {
+        struct stat st;
+        return stat(file.c_str(), &st) == 0 ? st.st_size : -1;
+    }
+    void CheckAndRelease(const char* name, std::vector<Block*>* blocks) {
+        const int64_t size = kSliceSize * kSlices;
+        for (int32_t i = 0; i < kBlocks; i++) {
+            Block* block = (*blocks)[i];
+            ASSERT_EQ(block->Size(), size);
+            std::string file = block->GetFilePath();
+            struct stat st;
+            ASSERT_EQ(stat(file.c_str(), &st), 0);
+            // The preallocated tail is truncated on close
+            ASSERT_EQ(st.st_size, size);
+            char buf[16];
+            for (int32_t seq = 0; seq < kSlices; seq += 7) {
+                ASSERT_EQ(block->Read(buf, sizeof(buf), seq * kSliceSize), 16);
+                ASSERT_EQ(buf[0], 'a' + (seq + i) % 26);
+                ASSERT_EQ(buf[15], 'a' + (seq + i) % 26);
+            }
+            printf("%s #%ld: %d extents, read %.1f MB/s\n", name, block->Id(),
+                   Extents(file), ReadSpeed(file));
+        }
+        for (int32_t i = 0; i < kBlocks; i++) {
+            (*blocks)[i]->DecRef();
+        }
+        blocks->clear();
+    }
+    ThreadPool* thread_pool_;
+    FileCache* file_cache_;
+};
+
+TEST_F(DataBlockTest, InterleavedWrite) {
+    std::vector<Block*> blocks;
+    WriteInterleaved(0, 0, &blocks);
+    CheckAndRelease("No hint", &blocks);
+}
+
+TEST_F(DataBlockTest, PreallocatedWrite) {
+    std::vector<Block*> blocks;
+    // Hint larger than the data, the tail must be cut
+    WriteInterleaved(100, kSliceSize * kSlices * 2, &blocks);
+    CheckAndRelease("Preallocated", &blocks);
+}
+
+TEST_F(DataBlockTest, Sync) {
+    Block* block = NewBlock(200);
+    ASSERT_TRUE(block->Write(0, 0, "data", 4));
+    // Buffered in memory until synced
+    ASSERT_LE(FileSize(block->GetFilePath()), 0);
+    ASSERT_TRUE(block->Sync(NULL));
+    ASSERT_EQ(FileSize(block->GetFilePath()), 4);
+    FileSyncer syncer(64);
+    ASSERT_TRUE(block->Write(1, 4, "more", 4));
+    ASSERT_TRUE(block->Sync(&syncer));
+    ASSERT_EQ(FileSize(block->GetFilePath()), 8);
+    ASSERT_TRUE(block->Close());
+    // Closed blocks are synced through a new fd
+    ASSERT_TRUE(block->Sync(&syncer));
+    char buf[8];
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 8);
+    ASSERT_EQ(std::string(buf, 8), "datamore");
+    block->DecRef();
+}
+
+TEST_F(DataBlockTest, ReadSyncedPartialBuffer) {
+    // Keep the write pool busy, so buffers stay in memory
+    volatile int hold = 1;
+    thread_pool_->AddTask(boost::bind(&DataBlockTest::Hold, &hold));
+    Block* block = NewBlock(250);
+    ASSERT_TRUE(block->Write(0, 0, "data", 4));
+    // Sync pushes the 4 byte buffer, then waits for the pool
+    ThreadPool sync_pool(1);
+    sync_pool.AddTask(boost::bind(&Block::Sync, block, static_cast<FileSyncer*>(NULL),
+                                  static_cast<Journal*>(NULL)));
+    usleep(100000);
+    std::string data(FLAGS_write_buf_size + 4, '\0');
+    for (size_t i = 0; i < data.size(); i++) {
+        data[i] = 'a' + i % 26;
+    }
+    // A full buffer after the short one, and 4 bytes in the block buf
+    ASSERT_TRUE(block->Write(1, 4, data.data(), data.size()));
+    // Across the end of the full buffer, and across the short one
+    char buf[16];
+    int64_t offset = FLAGS_write_buf_size - 12;
+    EXPECT_EQ(block->Read(buf, sizeof(buf), 4 + offset), 16);
+    EXPECT_EQ(std::string(buf, 16), data.substr(offset, 16));
+    EXPECT_EQ(block->Read(buf, 8, 0), 8);
+    EXPECT_EQ(std::string(buf, 8), "data" + data.substr(0, 4));
+    hold = 0;
+    sync_pool.Stop(true);
+    ASSERT_TRUE(block->Close());
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 4 + offset), 16);
+    ASSERT_EQ(std::string(buf, 16), data.substr(offset, 16));
+    block->DecRef();
+}
+
+TEST_F(DataBlockTest, SyncLatency) {
+    const char* levels[] = {"memory", "page cache", "disk"};
+    const int32_t kPackets = 200;
+    FileSyncer syncer(64);
+    std::string packet(4096, 'x');
+    for (int32_t level = 0; level < 3; level++) {
+        Block* block = NewBlock(300 + level);
+        int64_t start = common::timer::get_micros();
+        for (int32_t seq = 0; seq < kPackets; seq++) {
+            ASSERT_TRUE(block->Write(seq, seq * packet.size(), packet.data(), packet.size()));
+            if (level > 0) {
+                ASSERT_TRUE(block->Sync(level == 2 ? &syncer : NULL));
+            }
+        }
+        int64_t use = common::timer::get_micros() - start;
+        printf("Durability %s: %ld us per 4KB packet\n", levels[level], use / kPackets);
+        ASSERT_TRUE(block->Close());
+        ASSERT_EQ(FileSize(block->GetFilePath()), kPackets * 4096L);
+        block->DecRef();
+    }
+}
+
+TEST_F(DataBlockTest, MemoryBlock) {
+    int64_t memory = g_memory_data.Get();
+    Block* block = NewBlock(400, kStorageMemory);
+    WriteAndRead(block);
+    ASSERT_EQ(block->Size(), kSliceSize * kSlices);
+    ASSERT_EQ(g_memory_data.Get(), memory + kSliceSize * kSlices);
+    // Never touches the disk
+    ASSERT_TRUE(block->Sync(NULL));
+    ASSERT_EQ(FileSize(block->GetFilePath()), -1);
+    ASSERT_EQ(block->DiskUsed(), 0);
+    block->DecRef();
+    ASSERT_EQ(g_memory_data.Get(), memory);
+}
+
+TEST_F(DataBlockTest, LazyPersist) {
+    int64_t memory = g_memory_data.Get();
+    Block* block = NewBlock(500, kStorageLazyPersist);
+    int64_t start = common::timer::get_micros();
+    WriteAndRead(block);
+    int64_t close_use = common::timer::get_micros() - start;
+    // Written to the block file in background
+    for (int i = 0; i < 1000 && g_memory_data.Get() > memory; i++) {
+        usleep(10000);
+    }
+    int64_t persist_use = common::timer::get_micros() - start;
+    ASSERT_EQ(g_memory_data.Get(), memory);
+    ASSERT_EQ(block->DiskUsed(), kSliceSize * kSlices);
+    ASSERT_EQ(FileSize(block->GetFilePath()), kSliceSize * kSlices);
+    printf("Lazy persist %ld MB: closed in %ld ms, persisted in %ld ms\n",
+           kSliceSize * kSlices >> 20, close_use / 1000, persist_use / 1000);
+    char buf[4];
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 4);
+    ASSERT_EQ(buf[0], 'a');
+    block->DecRef();
+}
+
+TEST_F(DataBlockTest, Reopen) {
+    Block* block = NewBlock(600);
+    ASSERT_TRUE(block->Write(0, 0, "", 0));
+    ASSERT_TRUE(block->Write(1, 0, "data", 4));
+    ASSERT_TRUE(block->Close());
+    ASSERT_EQ(block->GetVersion(), 1);
+    // Only at the sealed version and size
+    ASSERT_EQ(block->Reopen(0, 4), kVersionError);
+    ASSERT_EQ(block->Reopen(1, 3), kVersionError);
+    ASSERT_EQ(block->Reopen(1, 4), kOK);
+    ASSERT_EQ(block->Reopen(1, 4), kBlockExist);
+    ASSERT_FALSE(block->IsFinished());
+    // Packet seqs start over, the version goes on from the sealed one
+    ASSERT_TRUE(block->Write(0, 4, "", 0));
+    ASSERT_TRUE(block->Write(1, 4, "more", 4));
+    ASSERT_TRUE(block->Write(2, 8, "tail", 4));
+    ASSERT_TRUE(block->Close());
+    ASSERT_EQ(block->GetVersion(), 3);
+    ASSERT_EQ(block->Size(), 12);
+    ASSERT_EQ(FileSize(block->GetFilePath()), 12);
+    char buf[12];
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 12);
+    ASSERT_EQ(std::string(buf, 12), "datamoretail");
+    block->DecRef();
+
+    // A block loaded from its meta, with the tail of an append never closed
+    BlockMeta meta;
+    meta.set_block_id(600);
+    meta.set_store_path("./data_block_test_data/");
+    meta.set_version(3);
+    meta.set_block_size(8);
+    block = new Block(meta, thread_pool_, file_cache_);
+    block->AddRef();
+    ASSERT_EQ(block->Reopen(3, 8), kOK);
+    ASSERT_TRUE(block->Write(0, 8, "", 0));
+    ASSERT_TRUE(block->Write(1, 8, "end", 3));
+    ASSERT_TRUE(block->Close());
+    ASSERT_EQ(block->GetVersion(), 4);
+    ASSERT_EQ(FileSize(block->GetFilePath()), 11);
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 11);
+    ASSERT_EQ(std::string(buf, 11), "datamoreend");
+    block->DecRef();
+
+    Block* memory = NewBlock(601, kStorageMemory);
+    ASSERT_TRUE(memory->Write(0, 0, "data", 4));
+    ASSERT_TRUE(memory->Close());
+    ASSERT_EQ(memory->Reopen(0, 4), kBlockClosed);
+    memory->DecRef();
+}
+
+TEST_F(DataBlockTest, CancelReopen) {
+    Block* block = NewBlock(610);
+    ASSERT_TRUE(block->Write(0, 0, "", 0));
+    ASSERT_TRUE(block->Write(1, 0, "data", 4));
+    ASSERT_TRUE(block->Close());
+    ASSERT_FALSE(block->CancelReopen());
+    // The writer failed after packet 0, the block is sealed as before
+    ASSERT_EQ(block->Reopen(1, 4), kOK);
+    ASSERT_TRUE(block->Write(0, 4, "", 0));
+    ASSERT_EQ(block->GetVersion(), -1);
+    ASSERT_TRUE(block->CancelReopen());
+    ASSERT_TRUE(block->IsFinished());
+    ASSERT_EQ(block->GetVersion(), 1);
+    ASSERT_EQ(block->Size(), 4);
+    ASSERT_FALSE(block->Write(1, 4, "late", 4));
+    ASSERT_FALSE(block->Close());
+    char buf[8];
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 4);
+    ASSERT_EQ(std::string(buf, 4), "data");
+    // Once data came, the append is kept
+    ASSERT_EQ(block->Reopen(1, 4), kOK);
+    ASSERT_TRUE(block->Write(0, 4, "", 0));
+    ASSERT_TRUE(block->Write(1, 4, "more", 4));
+    ASSERT_FALSE(block->CancelReopen());
+    ASSERT_TRUE(block->Close());
+    ASSERT_EQ(block->GetVersion(), 2);
+    ASSERT_EQ(FileSize(block->GetFilePath()), 8);
+    block->DecRef();
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,89 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/disk_balancer.h"
+
+#include <gtest/gtest.h>
+
+namespace baidu {
+namespace bfs {
+
+class DiskBalancerTest : public ::testing::Test {
+protected:
+    void AddDisk(int64_t size_gb, int64_t free_gb, StorageMedia media = kMediaHdd) {
+        DiskInfo disk;
+        disk.disk_size = size_gb << 30;
+        disk.free_size = free_gb << 30;
+        disk.media = media;
+        disks_.push_back(disk);
+    }
+    std::vector<DiskInfo> disks_;
+};
+
+TEST_F(DiskBalancerTest, Balanced) {
+    AddDisk(1000, 500);
+    AddDisk(2000, 950);
+    int src = -1, dest = -1;
+    ASSERT_FALSE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+    disks_.resize(1);
+    ASSERT_FALSE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+}
+
+TEST_F(DiskBalancerTest, NewDisk) {
+    // A replaced disk next to saturated ones
+    AddDisk(4000, 400);
+    AddDisk(4000, 200);
+    AddDisk(4000, 3990);
+    int src = -1, dest = -1;
+    ASSERT_TRUE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+    ASSERT_EQ(src, 1);
+    ASSERT_EQ(dest, 2);
+}
+
+TEST_F(DiskBalancerTest, UsageNotSize) {
+    // The big disk holds more bytes but is less used
+    AddDisk(8000, 4000);
+    AddDisk(1000, 100);
+    int src = -1, dest = -1;
+    ASSERT_TRUE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+    ASSERT_EQ(src, 1);
+    ASSERT_EQ(dest, 0);
+}
+
+TEST_F(DiskBalancerTest, BadDisk) {
+    AddDisk(0, 0);
+    AddDisk(1000, 100);
+    int src = -1, dest = -1;
+    ASSERT_FALSE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+    AddDisk(1000, 900);
+    ASSERT_TRUE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+    ASSERT_EQ(dest, 2);
+}
+
+TEST_F(DiskBalancerTest, SameMediaOnly) {
+    // An empty ssd doesn't take blocks of a full hdd
+    AddDisk(4000, 200);
+    AddDisk(400, 390, kMediaSsd);
+    int src = -1, dest = -1;
+    ASSERT_FALSE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+    AddDisk(400, 200, kMediaSsd);
+    AddDisk(4000, 3000);
+    ASSERT_TRUE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+    ASSERT_EQ(src, 0);
+    ASSERT_EQ(dest, 3);
+    disks_.resize(3);
+    ASSERT_TRUE(DiskBalancer::Plan(disks_, 0.1, &src, &dest));
+    ASSERT_EQ(src, 2);
+    ASSERT_EQ(dest, 1);
+}
+
+}
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,88 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/disk_scheduler.h"
+
+#include <unistd.h>
+#include <boost/bind.hpp>
+#include <common/counter.h>
+#include <common/timer.h>
+
+#include <gtest/gtest.h>
+
+namespace baidu {
+namespace bfs {
+
+class DiskSchedulerTest : public ::testing::Test {
+};
+
+namespace {
+void SlowRead(int64_t sleep_us, common::Counter* done) {
+    usleep(sleep_us);
+    done->Inc();
+}
+}
+
+TEST_F(DiskSchedulerTest, IsolateSlowDisk) {
+    std::vector<std::string> paths;
+    paths.push_back("/disk1/");
+    paths.push_back("/disk2/");
+    DiskScheduler scheduler(paths, 1, 1, 0);
+    common::Counter slow_done, fast_done;
+    // disk1 hangs for a while
+    for (int i = 0; i < 3; i++) {
+        ASSERT_TRUE(scheduler.AddRead("/disk1/", boost::bind(&SlowRead, 500000, &slow_done)));
+    }
+    int64_t start = common::timer::get_micros();
+    ASSERT_TRUE(scheduler.AddRead("/disk2/", boost::bind(&SlowRead, 0, &fast_done)));
+    while (fast_done.Get() == 0) {
+        usleep(1000);
+    }
+    ASSERT_LT(common::timer::get_micros() - start, 400000);
+    ASSERT_EQ(slow_done.Get(), 0);
+    scheduler.Stop();
+    ASSERT_EQ(slow_done.Get(), 3);
+}
+
+TEST_F(DiskSchedulerTest, MaxPendingReads) {
+    std::vector<std::string> paths;
+    paths.push_back("/disk1/");
+    paths.push_back("/disk2/");
+    DiskScheduler scheduler(paths, 1, 1, 2);
+    common::Counter done;
+    ASSERT_TRUE(scheduler.AddRead("/disk1/", boost::bind(&SlowRead, 200000, &done)));
+    ASSERT_TRUE(scheduler.AddRead("/disk1/", boost::bind(&SlowRead, 0, &done)));
+    ASSERT_FALSE(scheduler.AddRead("/disk1/", boost::bind(&SlowRead, 0, &done)));
+    // Other disks are not affected
+    ASSERT_TRUE(scheduler.AddRead("/disk2/", boost::bind(&SlowRead, 0, &done)));
+    scheduler.Stop();
+    std::vector<DiskScheduler::DiskStat> stats;
+    scheduler.GetStat(&stats);
+    ASSERT_EQ(stats.size(), 2U);
+    ASSERT_EQ(stats[0].path, "/disk1/");
+    ASSERT_EQ(stats[0].read_ops, 2);
+    ASSERT_EQ(stats[0].refused_reads, 1);
+    ASSERT_EQ(stats[0].pending_reads, 0);
+    ASSERT_EQ(stats[1].read_ops, 1);
+    ASSERT_GT(stats[0].read_latency, stats[1].read_latency);
+}
+
+TEST_F(DiskSchedulerTest, UnknownPath) {
+    std::vector<std::string> paths;
+    paths.push_back("/disk1/");
+    paths.push_back("/disk2/");
+    DiskScheduler scheduler(paths, 1, 1, 0);
+    ASSERT_EQ(scheduler.WritePool("/disk3/"), scheduler.WritePool("/disk1/"));
+    ASSERT_NE(scheduler.WritePool("/disk2/"), scheduler.WritePool("/disk1/"));
+}
+
+}
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
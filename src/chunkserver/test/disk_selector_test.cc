@@ -0,0 +1,91 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/disk_selector.h"
+
+#include <gtest/gtest.h>
+
+namespace baidu {
+namespace bfs {
+
+class DiskSelectorTest : public ::testing::Test {
+protected:
+    void AddDisk(int64_t free_gb, int64_t pending_io, int64_t read_latency) {
+        DiskInfo disk;
+        disk.path = "/disk" + std::string(1, '0' + disks_.size()) + "/";
+        disk.disk_size = 4000L << 30;
+        disk.free_size = free_gb << 30;
+        disk.pending_io = pending_io;
+        disk.read_latency = read_latency;
+        disks_.push_back(disk);
+    }
+    std::vector<int> Run(DiskSelector* selector, int times) {
+        std::vector<int> hits(disks_.size(), 0);
+        for (int i = 0; i < times; i++) {
+            hits[selector->Select(i, disks_)]++;
+        }
+        return hits;
+    }
+    std::vector<DiskInfo> disks_;
+};
+
+TEST_F(DiskSelectorTest, Create) {
+    const char* policies[] = {"hash", "capacity", "load"};
+    for (int i = 0; i < 3; i++) {
+        DiskSelector* selector = DiskSelector::Create(policies[i]);
+        ASSERT_TRUE(selector != NULL);
+        delete selector;
+    }
+    ASSERT_TRUE(DiskSelector::Create("unknown") == NULL);
+}
+
+TEST_F(DiskSelectorTest, Hash) {
+    AddDisk(100, 0, 0);
+    AddDisk(100, 0, 0);
+    AddDisk(100, 0, 0);
+    HashDiskSelector selector;
+    ASSERT_EQ(selector.Select(7, disks_), 1);
+    ASSERT_EQ(selector.Select(9, disks_), 0);
+}
+
+TEST_F(DiskSelectorTest, Capacity) {
+    AddDisk(3001, 0, 0);
+    AddDisk(1001, 0, 0);
+    AddDisk(1, 0, 0);
+    CapacityDiskSelector selector(1);
+    std::vector<int> hits = Run(&selector, 40000);
+    // 3:1 by free space, a full disk gets nothing
+    ASSERT_NEAR(hits[0], 30000, 1000);
+    ASSERT_NEAR(hits[1], 10000, 1000);
+    ASSERT_EQ(hits[2], 0);
+}
+
+TEST_F(DiskSelectorTest, AllFull) {
+    AddDisk(0, 0, 0);
+    AddDisk(0, 0, 0);
+    CapacityDiskSelector selector(1);
+    ASSERT_EQ(selector.Select(3, disks_), 1);
+}
+
+TEST_F(DiskSelectorTest, Load) {
+    AddDisk(1001, 0, 0);
+    AddDisk(1001, 3, 0);
+    AddDisk(1001, 0, 20000);
+    LoadDiskSelector selector(1);
+    std::vector<int> hits = Run(&selector, 35000);
+    // Weights 1 : 1/4 : 1/2
+    ASSERT_NEAR(hits[0], 20000, 1000);
+    ASSERT_NEAR(hits[1], 5000, 1000);
+    ASSERT_NEAR(hits[2], 10000, 1000);
+}
+
+}
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
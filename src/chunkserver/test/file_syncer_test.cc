@@ -0,0 +1,124 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/file_syncer.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <boost/bind.hpp>
+
+#include <gtest/gtest.h>
+#include <common/counter.h>
+#include <common/thread_pool.h>
+#include <common/timer.h>
+
+namespace baidu {
+namespace bfs {
+
+extern common::Counter g_data_syncs;
+extern common::Counter g_data_flushes;
+
+class FileSyncerTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        system("rm -rf ./file_syncer_test_data && mkdir -p ./file_syncer_test_data");
+        g_data_syncs.Clear();
+        g_data_flushes.Clear();
+    }
+    virtual void TearDown() {
+        system("rm -rf ./file_syncer_test_data");
+    }
+    /// Append a small record and sync it, like a log writer
+    static void SyncLoop(FileSyncer* syncer, int32_t thread, int32_t num, volatile int* failed) {
+        char file[64];
+        snprintf(file, sizeof(file), "./file_syncer_test_data/%d", thread);
+        int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        if (fd < 0) {
+            *failed = 1;
+            return;
+        }
+        char record[512] = {0};
+        for (int32_t i = 0; i < num; i++) {
+            if (write(fd, record, sizeof(record)) != sizeof(record) || !syncer->Sync(fd)) {
+                *failed = 1;
+            }
+        }
+        close(fd);
+    }
+    /// Sync an fd that is not open
+    static void SyncBadFd(FileSyncer* syncer, int32_t num, volatile int* synced) {
+        for (int32_t i = 0; i < num; i++) {
+            if (syncer->Sync(1000000)) {
+                *synced = 1;
+            }
+        }
+    }
+};
+
+TEST_F(FileSyncerTest, Sync) {
+    FileSyncer syncer(64);
+    int fd = open("./file_syncer_test_data/single", O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(write(fd, "data", 4), 4);
+    ASSERT_TRUE(syncer.Sync(fd));
+    close(fd);
+    ASSERT_FALSE(syncer.Sync(fd));
+    ASSERT_EQ(g_data_flushes.Get(), 2);
+    ASSERT_EQ(g_data_syncs.Get(), 2);
+}
+
+TEST_F(FileSyncerTest, ConcurrentGroupSync) {
+    const int32_t kThreads = 16;
+    const int32_t kSyncs = 200;
+    FileSyncer syncer(64);
+    volatile int failed = 0;
+    int64_t start = common::timer::get_micros();
+    {
+        ThreadPool pool(kThreads);
+        for (int32_t t = 0; t < kThreads; t++) {
+            pool.AddTask(boost::bind(&FileSyncerTest::SyncLoop, &syncer, t, kSyncs, &failed));
+        }
+        pool.Stop(true);
+    }
+    int64_t use = common::timer::get_micros() - start;
+    ASSERT_EQ(failed, 0);
+    int64_t syncs = g_data_syncs.Get();
+    int64_t flushes = g_data_flushes.Get();
+    printf("%ld syncs in %ld flushes, %ld syncs/s\n",
+           syncs, flushes, syncs * 1000000 / (use ? use : 1));
+    ASSERT_EQ(syncs, kThreads * kSyncs);
+    // Concurrent syncers share flushes
+    ASSERT_LT(flushes, syncs);
+}
+
+TEST_F(FileSyncerTest, MixedBatch) {
+    const int32_t kThreads = 8;
+    const int32_t kSyncs = 100;
+    FileSyncer syncer(64);
+    volatile int failed = 0;
+    volatile int bad_synced = 0;
+    {
+        ThreadPool pool(kThreads + 1);
+        for (int32_t t = 0; t < kThreads; t++) {
+            pool.AddTask(boost::bind(&FileSyncerTest::SyncLoop, &syncer, t, kSyncs, &failed));
+        }
+        // Sharing a batch with a bad fd fails neither side's result
+        pool.AddTask(boost::bind(&FileSyncerTest::SyncBadFd, &syncer, kSyncs, &bad_synced));
+        pool.Stop(true);
+    }
+    ASSERT_EQ(failed, 0);
+    ASSERT_EQ(bad_synced, 0);
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
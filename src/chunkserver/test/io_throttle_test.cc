@@ -0,0 +1,82 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/io_throttle.h"
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+namespace baidu {
+namespace bfs {
+
+class IoThrottleTest : public ::testing::Test {
+};
+
+TEST_F(IoThrottleTest, Unlimited) {
+    IoThrottle throttle;
+    for (int i = 0; i < kIoClassNum; i++) {
+        ASSERT_EQ(throttle.GetRate(static_cast<IoClass>(i)), 0);
+        ASSERT_EQ(throttle.Reserve(static_cast<IoClass>(i), 1L << 30), 0);
+    }
+}
+
+TEST_F(IoThrottleTest, Reserve) {
+    IoThrottle throttle;
+    throttle.SetRate(kRecoverIo, 1 << 20);
+    // 1MB at 1MB/s from an empty bucket waits about one second
+    int64_t wait = throttle.Reserve(kRecoverIo, 1 << 20);
+    ASSERT_GT(wait, 900 * 1000);
+    ASSERT_LE(wait, 1000 * 1000);
+    // Later callers queue behind the debt
+    int64_t wait2 = throttle.Reserve(kRecoverIo, 1 << 20);
+    ASSERT_GT(wait2, wait + 900 * 1000);
+    // Other classes are not affected
+    ASSERT_EQ(throttle.Reserve(kForegroundIo, 1 << 20), 0);
+    // Lifting the limit drops the debt
+    throttle.SetRate(kRecoverIo, 0);
+    ASSERT_EQ(throttle.Reserve(kRecoverIo, 1 << 20), 0);
+}
+
+TEST_F(IoThrottleTest, Preempt) {
+    IoThrottle throttle;
+    throttle.SetRate(kRecoverIo, 1 << 20);
+    throttle.SetRate(kBalanceIo, 1 << 20);
+    // Balance is saturated, about two seconds queued
+    throttle.Reserve(kBalanceIo, 1 << 20);
+    int64_t saturated = throttle.Reserve(kBalanceIo, 1 << 20);
+    ASSERT_GT(saturated, 1900 * 1000);
+    // Recover is served at its own rate, before the queued balance io
+    int64_t recover = throttle.Reserve(kRecoverIo, 1 << 20);
+    ASSERT_LE(recover, 1000 * 1000);
+    // While it runs, balance drains its queue at a quarter of its rate
+    int64_t preempted = throttle.Reserve(kBalanceIo, 1 << 20);
+    ASSERT_GT(preempted, 4 * saturated);
+    // Foreground is never held back, and recover gives way to it
+    ASSERT_EQ(throttle.Reserve(kForegroundIo, 1 << 20), 0);
+    ASSERT_GT(throttle.Reserve(kRecoverIo, 1 << 20), 4 * recover);
+    // Back to the full rate once the higher classes are idle
+    usleep(200 * 1000);
+    int64_t idle = throttle.Reserve(kBalanceIo, 1 << 20);
+    ASSERT_LT(idle, preempted / 2);
+}
+
+TEST_F(IoThrottleTest, ClassName) {
+    ASSERT_STREQ(IoThrottle::ClassName(kForegroundIo), "foreground");
+    ASSERT_STREQ(IoThrottle::ClassName(kRecoverIo), "recover");
+    ASSERT_STREQ(IoThrottle::ClassName(kScrubIo), "scrub");
+    ASSERT_STREQ(IoThrottle::ClassName(kDeleteIo), "delete");
+    ASSERT_STREQ(IoThrottle::ClassName(kBalanceIo), "balance");
+    ASSERT_STREQ(IoThrottle::ClassName(kTranscodeIo), "transcode");
+}
+
+}
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
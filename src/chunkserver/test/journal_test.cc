@@ -0,0 +1,137 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/journal.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <common/timer.h>
+
+#include "chunkserver/file_syncer.h"
+
+namespace baidu {
+namespace bfs {
+
+class JournalTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        system("rm -rf ./journal_test_data && mkdir -p ./journal_test_data");
+    }
+    virtual void TearDown() {
+        system("rm -rf ./journal_test_data");
+    }
+    static std::string ReadFile(const std::string& file) {
+        char buf[64];
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return "";
+        }
+        int len = read(fd, buf, sizeof(buf));
+        close(fd);
+        return std::string(buf, len > 0 ? len : 0);
+    }
+    static int64_t FileSize(const std::string& file) {
+        struct stat st;
+        return stat(file.c_str(), &st) == 0 ? st.st_size : -1;
+    }
+    /// Write a packet to the file and make it durable, return the latency in us
+    static int64_t SyncWrite(int fd, int64_t offset, const std::string& packet,
+                             const std::string& file, FileSyncer* syncer, Journal* journal) {
+        int64_t start = common::timer::get_micros();
+        if (pwrite(fd, packet.data(), packet.size(), offset)
+                != static_cast<ssize_t>(packet.size())) {
+            return -1;
+        }
+        bool ret = journal ? journal->Append(file, offset, packet.data(), packet.size())
+                           : syncer->Sync(fd);
+        return ret ? common::timer::get_micros() - start : -1;
+    }
+};
+
+TEST_F(JournalTest, Replay) {
+    const std::string block = "./journal_test_data/block";
+    const std::string journal_file = "./journal_test_data/journal";
+    {
+        Journal journal(journal_file, 1 << 20);
+        ASSERT_TRUE(journal.Open());
+        ASSERT_TRUE(journal.Append(block, 0, "data", 4));
+        ASSERT_TRUE(journal.Append(block, 4, "more", 4));
+        ASSERT_TRUE(journal.Append("./journal_test_data/deleted", 0, "gone", 4));
+        ASSERT_GT(journal.Size(), 8);
+        // Crash: the journal is not checkpointed
+    }
+    // Writeback of the block file was lost
+    ASSERT_EQ(system("touch ./journal_test_data/block"), 0);
+    // A torn record at the tail is ignored
+    ASSERT_EQ(system("printf 'torn' >> ./journal_test_data/journal"), 0);
+    Journal journal(journal_file, 1 << 20);
+    ASSERT_TRUE(journal.Open());
+    ASSERT_EQ(ReadFile(block), "datamore");
+    ASSERT_EQ(FileSize("./journal_test_data/deleted"), -1);
+    ASSERT_EQ(journal.Size(), 0);
+    ASSERT_EQ(FileSize(journal_file), 0);
+}
+
+TEST_F(JournalTest, Checkpoint) {
+    const std::string block = "./journal_test_data/block";
+    Journal journal("./journal_test_data/journal", 256);
+    ASSERT_TRUE(journal.Open());
+    std::string packet(100, 'x');
+    int fd = open(block.c_str(), O_WRONLY | O_CREAT, S_IRUSR | S_IWUSR);
+    ASSERT_GE(fd, 0);
+    for (int i = 0; i < 5; i++) {
+        ASSERT_EQ(pwrite(fd, packet.data(), packet.size(), i * 100), 100);
+        ASSERT_TRUE(journal.Append(block, i * 100, packet.data(), packet.size()));
+        // A full journal is checkpointed before the append
+        ASSERT_LE(journal.Size(), 256);
+    }
+    close(fd);
+    ASSERT_TRUE(journal.Checkpoint());
+    ASSERT_EQ(journal.Size(), 0);
+    ASSERT_EQ(FileSize(block), 500);
+}
+
+TEST_F(JournalTest, SyncLatency) {
+    const int32_t kPackets = 500;
+    const std::string block = "./journal_test_data/block";
+    std::string packet(4096, 'x');
+    FileSyncer syncer(64);
+    Journal journal("./journal_test_data/journal", 64 << 20);
+    ASSERT_TRUE(journal.Open());
+    for (int with_journal = 0; with_journal < 2; with_journal++) {
+        int fd = open(block.c_str(), O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+        ASSERT_GE(fd, 0);
+        std::vector<int64_t> latency;
+        for (int32_t i = 0; i < kPackets; i++) {
+            latency.push_back(SyncWrite(fd, i * packet.size(), packet, block, &syncer,
+                                        with_journal ? &journal : NULL));
+            ASSERT_GE(latency.back(), 0);
+        }
+        close(fd);
+        std::sort(latency.begin(), latency.end());
+        int64_t total = 0;
+        for (size_t i = 0; i < latency.size(); i++) {
+            total += latency[i];
+        }
+        printf("Sync write %s journal: avg %ld us, p99 %ld us\n", with_journal ? "with" : "without",
+               total / kPackets, latency[kPackets * 99 / 100]);
+    }
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,123 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/meta_committer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <boost/bind.hpp>
+
+#include <gtest/gtest.h>
+#include <leveldb/db.h>
+#include <common/counter.h>
+#include <common/thread_pool.h>
+#include <common/timer.h>
+
+namespace baidu {
+namespace bfs {
+
+extern common::Counter g_meta_batches;
+extern common::Counter g_meta_ops;
+
+class MetaCommitterTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        system("rm -rf ./meta_committer_test_db");
+        leveldb::Options options;
+        options.create_if_missing = true;
+        db_ = NULL;
+        ASSERT_TRUE(leveldb::DB::Open(options, "./meta_committer_test_db", &db_).ok());
+        g_meta_batches.Clear();
+        g_meta_ops.Clear();
+    }
+    virtual void TearDown() {
+        delete db_;
+        system("rm -rf ./meta_committer_test_db");
+    }
+    static std::string Key(int32_t thread, int32_t i) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%04d-%06d", thread, i);
+        return buf;
+    }
+    /// Put every key, then delete the odd ones
+    static void WriteLoop(MetaCommitter* committer, int32_t thread, int32_t num,
+                          volatile int* failed) {
+        for (int32_t i = 0; i < num; i++) {
+            if (!committer->Put(Key(thread, i), Key(i, thread)).ok()) {
+                *failed = 1;
+            }
+            if (i % 2 && !committer->Delete(Key(thread, i)).ok()) {
+                *failed = 1;
+            }
+        }
+    }
+    leveldb::DB* db_;
+};
+
+TEST_F(MetaCommitterTest, PutDelete) {
+    MetaCommitter committer(db_, false, 256);
+    ASSERT_TRUE(committer.Put("k1", "v1").ok());
+    ASSERT_TRUE(committer.Put("k2", "v2").ok());
+    ASSERT_TRUE(committer.Delete("k1").ok());
+    std::string value;
+    ASSERT_TRUE(db_->Get(leveldb::ReadOptions(), "k1", &value).IsNotFound());
+    ASSERT_TRUE(db_->Get(leveldb::ReadOptions(), "k2", &value).ok());
+    ASSERT_EQ(value, "v2");
+    // Nothing to merge with, one write per update
+    ASSERT_EQ(g_meta_batches.Get(), 3);
+    ASSERT_EQ(g_meta_ops.Get(), 3);
+    std::vector<std::string> keys;
+    keys.push_back("k2");
+    keys.push_back("k3");
+    ASSERT_TRUE(committer.Delete(keys).ok());
+    ASSERT_TRUE(db_->Get(leveldb::ReadOptions(), "k2", &value).IsNotFound());
+    ASSERT_EQ(g_meta_batches.Get(), 4);
+    ASSERT_EQ(g_meta_ops.Get(), 5);
+}
+
+TEST_F(MetaCommitterTest, ConcurrentGroupCommit) {
+    const int32_t kThreads = 16;
+    const int32_t kKeys = 1000;
+    MetaCommitter committer(db_, true, 256);
+    volatile int failed = 0;
+    int64_t start = common::timer::get_micros();
+    {
+        ThreadPool pool(kThreads);
+        for (int32_t t = 0; t < kThreads; t++) {
+            pool.AddTask(boost::bind(&MetaCommitterTest::WriteLoop, &committer, t, kKeys, &failed));
+        }
+        pool.Stop(true);
+    }
+    int64_t use = common::timer::get_micros() - start;
+    ASSERT_EQ(failed, 0);
+    int64_t ops = g_meta_ops.Get();
+    int64_t batches = g_meta_batches.Get();
+    printf("%ld synced updates in %ld batches, %ld ops/s\n",
+           ops, batches, ops * 1000000 / (use ? use : 1));
+    ASSERT_EQ(ops, kThreads * kKeys * 3 / 2);
+    // Concurrent writers share syncs
+    ASSERT_LT(batches, ops);
+    for (int32_t t = 0; t < kThreads; t++) {
+        for (int32_t i = 0; i < kKeys; i++) {
+            std::string value;
+            leveldb::Status s = db_->Get(leveldb::ReadOptions(), Key(t, i), &value);
+            if (i % 2) {
+                ASSERT_TRUE(s.IsNotFound());
+            } else {
+                ASSERT_TRUE(s.ok());
+                ASSERT_EQ(value, Key(i, t));
+            }
+        }
+    }
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
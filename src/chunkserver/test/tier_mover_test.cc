@@ -0,0 +1,174 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/tier_mover.h"
+
+#include <stdlib.h>
+
+#include <gflags/gflags.h>
+#include <gtest/gtest.h>
+
+#include "chunkserver/block_manager.h"
+#include "chunkserver/data_block.h"
+
+DECLARE_int32(chunkserver_use_root_partition);
+
+namespace baidu {
+namespace bfs {
+
+const char* kHddPath = "./tier_mover_test_data/";
+/// tmpfs stands in for an ssd, it has to be another filesystem
+const char* kSsdPath = "/dev/shm/tier_mover_test_data/";
+const int64_t kBlocks = 10;
+
+class TierMoverTest : public ::testing::Test {
+protected:
+    virtual void SetUp() {
+        FLAGS_chunkserver_use_root_partition = 1;
+        system("rm -rf ./tier_mover_test_data /dev/shm/tier_mover_test_data");
+        system("mkdir -p ./tier_mover_test_data /dev/shm/tier_mover_test_data");
+        block_manager_ = new BlockManager(std::string(kHddPath) + ",[ssd]" + kSsdPath);
+        ASSERT_TRUE(block_manager_->LoadStorage());
+        stop_ = false;
+    }
+    virtual void TearDown() {
+        delete block_manager_;
+        system("rm -rf ./tier_mover_test_data /dev/shm/tier_mover_test_data");
+    }
+    void AddDisk(int64_t size_gb, int64_t free_gb, StorageMedia media) {
+        DiskInfo disk;
+        disk.disk_size = size_gb << 30;
+        disk.free_size = free_gb << 30;
+        disk.media = media;
+        disks_.push_back(disk);
+    }
+    void WriteBlock(int64_t block_id, StorageMedia media) {
+        StatusCode status;
+        Block* block = block_manager_->CreateBlock(block_id, NULL, &status, kStorageDisk, media);
+        ASSERT_TRUE(block != NULL);
+        ASSERT_TRUE(block->Write(0, 0, "data", 4));
+        ASSERT_TRUE(block_manager_->CloseBlock(block));
+        block->DecRef();
+    }
+    void ReadBlock(int64_t block_id, int32_t times) {
+        Block* block = block_manager_->FindBlock(block_id);
+        ASSERT_TRUE(block != NULL);
+        char buf[4];
+        for (int32_t i = 0; i < times; i++) {
+            ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 4);
+        }
+        block->DecRef();
+    }
+    std::string StorePath(int64_t block_id) {
+        Block* block = block_manager_->FindBlock(block_id);
+        EXPECT_TRUE(block != NULL);
+        std::string store_path = block->GetStorePath();
+        block->DecRef();
+        return store_path;
+    }
+    BlockManager* block_manager_;
+    std::vector<DiskInfo> disks_;
+    volatile bool stop_;
+};
+
+TEST_F(TierMoverTest, PickDisk) {
+    ASSERT_EQ(TierMover::MediaUsage(disks_, kMediaSsd), -1);
+    ASSERT_EQ(TierMover::PickDisk(disks_, kMediaSsd), -1);
+    AddDisk(4000, 1000, kMediaHdd);
+    AddDisk(400, 100, kMediaSsd);
+    AddDisk(400, 300, kMediaSsd);
+    AddDisk(4000, 3000, kMediaHdd);
+    ASSERT_DOUBLE_EQ(TierMover::MediaUsage(disks_, kMediaSsd), 0.5);
+    ASSERT_EQ(TierMover::PickDisk(disks_, kMediaSsd), 2);
+    ASSERT_EQ(TierMover::PickDisk(disks_, kMediaHdd), 3);
+}
+
+TEST_F(TierMoverTest, StorePathMedia) {
+    ASSERT_EQ(block_manager_->GetDiskMedia(kHddPath), kMediaHdd);
+    ASSERT_EQ(block_manager_->GetDiskMedia(kSsdPath), kMediaSsd);
+    ASSERT_GT(block_manager_->SsdQuota(), 0);
+    ASSERT_LT(block_manager_->SsdQuota(), block_manager_->DiskQuota());
+    for (int64_t i = 0; i < kBlocks; i++) {
+        ASSERT_EQ(block_manager_->SelectStorePath(i, kMediaSsd), kSsdPath);
+        ASSERT_EQ(block_manager_->SelectStorePath(i, kMediaHdd), kHddPath);
+    }
+    WriteBlock(0, kMediaSsd);
+    ASSERT_EQ(StorePath(0), kSsdPath);
+    Block* block = block_manager_->FindBlock(0);
+    ASSERT_EQ(block->GetMeta().media(), kMediaSsd);
+    block->DecRef();
+}
+
+TEST_F(TierMoverTest, PromoteAndDemote) {
+    TierMover mover(block_manager_, NULL);
+    // Blocks written without a media go to hdd and may move
+    for (int64_t i = 0; i < kBlocks; i++) {
+        WriteBlock(i, kMediaAny);
+        ASSERT_EQ(StorePath(i), kHddPath);
+    }
+    // Pinned blocks stay where the writer put them
+    WriteBlock(kBlocks, kMediaHdd);
+    WriteBlock(kBlocks + 1, kMediaSsd);
+    std::vector<int64_t> blocks;
+    block_manager_->ListTierCandidates(kMediaHdd, false, 16, 100, &blocks);
+    ASSERT_EQ(blocks.size(), static_cast<size_t>(kBlocks));
+    ReadBlock(3, 20);
+    ReadBlock(7, 40);
+    ReadBlock(kBlocks, 40);
+    // Heat is kept in the compact index
+    for (int i = 0; i < 100; i++) {
+        block_manager_->CompactBlocks();
+        usleep(1000);
+    }
+    blocks.clear();
+    block_manager_->ListTierCandidates(kMediaHdd, true, 16, 100, &blocks);
+    ASSERT_EQ(blocks.size(), 2U);
+    ASSERT_EQ(blocks[0], 7);
+    ASSERT_EQ(blocks[1], 3);
+    ASSERT_EQ(mover.Move(16, 0.9, &stop_), 8);
+    ASSERT_EQ(StorePath(3), kSsdPath);
+    ASSERT_EQ(StorePath(7), kSsdPath);
+    ASSERT_EQ(StorePath(5), kHddPath);
+    ASSERT_EQ(StorePath(kBlocks), kHddPath);
+    // The old copies wait in the trash, for readers that took their path
+    ASSERT_EQ(block_manager_->TrashBytes(), 8);
+    char buf[4];
+    Block* block = block_manager_->FindBlock(3);
+    ASSERT_EQ(block->Read(buf, sizeof(buf), 0), 4);
+    ASSERT_EQ(std::string(buf, 4), "data");
+    block->DecRef();
+    // An append after the move is written on the ssd
+    block = block_manager_->FindBlock(7);
+    ASSERT_EQ(block->Reopen(block->GetVersion(), 4), kOK);
+    ASSERT_TRUE(block->Write(0, 4, "", 0));
+    ASSERT_TRUE(block->Write(1, 4, "more", 4));
+    ASSERT_TRUE(block_manager_->CloseBlock(block));
+    ASSERT_EQ(block->GetFilePath(), kSsdPath + Block::BuildFilePath(7));
+    char appended[8];
+    ASSERT_EQ(block->Read(appended, sizeof(appended), 0), 8);
+    ASSERT_EQ(std::string(appended, 8), "datamore");
+    block->DecRef();
+
+    // Cooled by half in each round, the hotter one is still hot
+    ASSERT_EQ(mover.Move(16, -1, &stop_), 4);
+    ASSERT_EQ(StorePath(3), kHddPath);
+    ASSERT_EQ(StorePath(7), kSsdPath);
+    ASSERT_EQ(StorePath(kBlocks + 1), kSsdPath);
+    // Moves survive restart
+    delete block_manager_;
+    block_manager_ = new BlockManager(std::string(kHddPath) + ",[ssd]" + kSsdPath);
+    ASSERT_TRUE(block_manager_->LoadStorage());
+    ASSERT_EQ(StorePath(3), kHddPath);
+    ASSERT_EQ(StorePath(7), kSsdPath);
+}
+
+}
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
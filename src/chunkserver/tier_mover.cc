@@ -0,0 +1,120 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "chunkserver/tier_mover.h"
+
+#include <common/logging.h>
+
+#include "chunkserver/block_manager.h"
+
+namespace baidu {
+namespace bfs {
+
+/// Blocks moved between two usage checks
+const int32_t kTierBatch = 16;
+
+TierMover::TierMover(BlockManager* block_manager, IoThrottle* throttle)
+    : block_manager_(block_manager), throttle_(throttle) {
+}
+
+double TierMover::MediaUsage(const std::vector<DiskInfo>& disks, StorageMedia media) {
+    int64_t disk_size = 0;
+    int64_t free_size = 0;
+    for (size_t i = 0; i < disks.size(); i++) {
+        if (disks[i].media == media && disks[i].disk_size > 0) {
+            disk_size += disks[i].disk_size;
+            free_size += disks[i].free_size;
+        }
+    }
+    if (disk_size == 0) {
+        return -1;
+    }
+    return 1.0 - static_cast<double>(free_size) / disk_size;
+}
+
+int TierMover::PickDisk(const std::vector<DiskInfo>& disks, StorageMedia media) {
+    int pick = -1;
+    double min_usage = 0;
+    for (size_t i = 0; i < disks.size(); i++) {
+        if (disks[i].media != media || disks[i].disk_size <= 0) {
+            continue;
+        }
+        double usage = 1.0 - static_cast<double>(disks[i].free_size) / disks[i].disk_size;
+        if (pick < 0 || usage < min_usage) {
+            pick = i;
+            min_usage = usage;
+        }
+    }
+    return pick;
+}
+
+int64_t TierMover::MoveBatch(const std::vector<int64_t>& blocks, StorageMedia media,
+                             volatile bool* stop, int32_t* moved_num) {
+    std::vector<DiskInfo> disks;
+    block_manager_->GetDiskInfo(&disks);
+    int dest = PickDisk(disks, media);
+    if (dest < 0) {
+        return 0;
+    }
+    int64_t moved = 0;
+    for (size_t i = 0; i < blocks.size() && !*stop; i++) {
+        int64_t block_size = 0;
+        StatusCode s = block_manager_->MoveBlock(blocks[i], disks[dest].path,
+                                                 throttle_, &block_size);
+        if (s == kOK) {
+            moved += block_size;
+            ++*moved_num;
+        } else {
+            LOG(INFO, "[TierMover] Move #%ld to %s fail: %s",
+                blocks[i], disks[dest].path.c_str(), StatusCode_Name(s).c_str());
+        }
+    }
+    return moved;
+}
+
+int64_t TierMover::Move(int32_t hot_reads, double usage_limit, volatile bool* stop) {
+    int64_t moved = 0;
+    int32_t demoted = 0;
+    int32_t promoted = 0;
+    std::vector<DiskInfo> disks;
+    block_manager_->GetDiskInfo(&disks);
+    if (MediaUsage(disks, kMediaSsd) < 0 || MediaUsage(disks, kMediaHdd) < 0) {
+        block_manager_->CoolBlocks();
+        return 0;
+    }
+    // Make room first, blocks read less than hot_reads times are cold
+    while (!*stop && MediaUsage(disks, kMediaSsd) > usage_limit) {
+        std::vector<int64_t> blocks;
+        block_manager_->ListTierCandidates(kMediaSsd, false, hot_reads, kTierBatch, &blocks);
+        int32_t batch_moved = 0;
+        moved += MoveBatch(blocks, kMediaHdd, stop, &batch_moved);
+        if (batch_moved == 0) {
+            break;
+        }
+        demoted += batch_moved;
+        block_manager_->GetDiskInfo(&disks);
+    }
+    while (!*stop && MediaUsage(disks, kMediaSsd) < usage_limit) {
+        std::vector<int64_t> blocks;
+        block_manager_->ListTierCandidates(kMediaHdd, true, hot_reads, kTierBatch, &blocks);
+        int32_t batch_moved = 0;
+        moved += MoveBatch(blocks, kMediaSsd, stop, &batch_moved);
+        if (batch_moved == 0) {
+            break;
+        }
+        promoted += batch_moved;
+        block_manager_->GetDiskInfo(&disks);
+    }
+    block_manager_->CoolBlocks();
+    if (demoted || promoted) {
+        LOG(INFO, "[TierMover] Promoted %d blocks, demoted %d blocks, %ld bytes",
+            promoted, demoted, moved);
+    }
+    return moved;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
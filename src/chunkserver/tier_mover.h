@@ -0,0 +1,46 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef  BFS_TIER_MOVER_H_
+#define  BFS_TIER_MOVER_H_
+
+#include <stdint.h>
+#include <vector>
+
+#include "chunkserver/disk_selector.h"
+
+namespace baidu {
+namespace bfs {
+
+class BlockManager;
+class IoThrottle;
+
+/// Moves hot blocks to ssd store paths and cold blocks back to hdd ones.
+/// Blocks written with a media policy are pinned and never moved.
+class TierMover {
+public:
+    TierMover(BlockManager* block_manager, IoThrottle* throttle);
+    /// Used fraction of the disks of media, -1 if there is none
+    static double MediaUsage(const std::vector<DiskInfo>& disks, StorageMedia media);
+    /// Least used disk of media, -1 if there is none
+    static int PickDisk(const std::vector<DiskInfo>& disks, StorageMedia media);
+    /// Demote cold blocks while ssd usage is over usage_limit, then promote blocks
+    /// read at least hot_reads times while it is under, then cool all blocks.
+    /// Return bytes moved
+    int64_t Move(int32_t hot_reads, double usage_limit, volatile bool* stop);
+private:
+    /// Move blocks of a batch to the least used disk of media, return bytes moved
+    int64_t MoveBatch(const std::vector<int64_t>& blocks, StorageMedia media,
+                      volatile bool* stop, int32_t* moved_num);
+private:
+    BlockManager* block_manager_;
+    IoThrottle* throttle_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_TIER_MOVER_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
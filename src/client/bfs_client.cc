@@ -34,7 +34,7 @@ void print_usage() {
     printf("\t    touchz <path> : create a new file\n");
     printf("\t    rm <path> : remove a file\n");
     printf("\t    get <bfsfile> <localfile> : copy file to local\n");
-    printf("\t    put <localfile> <bfsfile> : copy file from local to bfs\n");
+    printf("\t    put <localfile> <bfsfile> [disk|memory|lazy_persist] : copy file from local to bfs\n");
     printf("\t    rmdir <path> : remove empty directory\n");
     printf("\t    rmr <path> : remove directory recursively\n");
     printf("\t    du <path> : count disk usage for path\n");
@@ -155,10 +155,21 @@ int BfsGet(baidu::bfs::FS* fs, int argc, char* argv[]) {
 }
 
 int BfsPut(baidu::bfs::FS* fs, int argc, char* argv[]) {
-    if (argc != 4) {
+    if (argc != 4 && argc != 5) {
         print_usage();
         return 0;
     }
+    baidu::bfs::WriteOptions options;
+    if (argc == 5) {
+        if (strcmp(argv[4], "memory") == 0) {
+            options.storage_policy = baidu::bfs::kStoreInMemory;
+        } else if (strcmp(argv[4], "lazy_persist") == 0) {
+            options.storage_policy = baidu::bfs::kStoreLazyPersist;
+        } else if (strcmp(argv[4], "disk") != 0) {
+            print_usage();
+            return 1;
+        }
+    }
 
     std::string source = argv[2];
     std::string target = argv[3];
@@ -191,7 +202,7 @@ int BfsPut(baidu::bfs::FS* fs, int argc, char* argv[]) {
         return 1;
     }
     baidu::bfs::File* file;
-    if (fs->OpenFile(target.c_str(), O_WRONLY | O_TRUNC, st.st_mode, &file, baidu::bfs::WriteOptions()) != 0) {
+    if (fs->OpenFile(target.c_str(), O_WRONLY | O_TRUNC, st.st_mode, &file, options) != 0) {
         fprintf(stderr, "Can't Open bfs file %s\n", target.c_str());
         fclose(fp);
         return 1;
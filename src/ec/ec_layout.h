@@ -0,0 +1,42 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BFS_EC_EC_LAYOUT_H_
+#define BFS_EC_EC_LAYOUT_H_
+
+#include <stdint.h>
+#include <algorithm>
+
+namespace baidu {
+namespace bfs {
+
+/// An erasure coded file is one group of data_num + parity_num blocks, unit i is
+/// block group_id + i. File data goes round robin over the data units in cells of
+/// cell_size, a stripe is one cell of every unit at the same block offset.
+
+/// Data unit of the file offset, and the offset in that unit's block
+inline void EcLocate(int64_t offset, int32_t data_num, int32_t cell_size,
+                     int32_t* unit, int64_t* unit_offset) {
+    int64_t stripe_size = static_cast<int64_t>(data_num) * cell_size;
+    int64_t in_stripe = offset % stripe_size;
+    *unit = in_stripe / cell_size;
+    *unit_offset = offset / stripe_size * cell_size + in_stripe % cell_size;
+}
+
+/// Block size of unit index for a file of file_size, parity units are as long as unit 0
+inline int64_t EcUnitSize(int64_t file_size, int32_t data_num, int32_t cell_size,
+                          int32_t index) {
+    int64_t stripe_size = static_cast<int64_t>(data_num) * cell_size;
+    int32_t data_index = index < data_num ? index : 0;
+    int64_t tail = file_size % stripe_size - static_cast<int64_t>(data_index) * cell_size;
+    return file_size / stripe_size * cell_size
+           + std::min<int64_t>(std::max<int64_t>(tail, 0), cell_size);
+}
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_EC_EC_LAYOUT_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
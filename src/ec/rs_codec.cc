@@ -0,0 +1,278 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ec/rs_codec.h"
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) \
+    && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define BFS_EC_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+namespace baidu {
+namespace bfs {
+
+namespace {
+
+/// Multiplication tables of GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1
+struct GfTables {
+    uint8_t exp[512];
+    uint8_t log[256];
+    uint8_t mul[256][256];
+    uint8_t lo[256][16];    ///< c * x for x in 0..15
+    uint8_t hi[256][16];    ///< c * (x << 4) for x in 0..15
+    GfTables() {
+        int32_t x = 1;
+        for (int32_t i = 0; i < 255; i++) {
+            exp[i] = exp[i + 255] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) {
+                x ^= 0x11d;
+            }
+        }
+        exp[510] = exp[511] = 0;
+        log[0] = 0;
+        for (int32_t a = 0; a < 256; a++) {
+            for (int32_t b = 0; b < 256; b++) {
+                mul[a][b] = (a && b) ? exp[log[a] + log[b]] : 0;
+            }
+            for (int32_t n = 0; n < 16; n++) {
+                lo[a][n] = mul[a][n];
+                hi[a][n] = mul[a][n << 4];
+            }
+        }
+    }
+};
+
+const GfTables g_gf;
+
+uint8_t GfInverse(uint8_t a) {
+    return g_gf.exp[255 - g_gf.log[a]];
+}
+
+void MulRegionScalar(uint8_t c, const uint8_t* src, uint8_t* dst, int64_t len, bool add) {
+    const uint8_t* table = g_gf.mul[c];
+    if (add) {
+        for (int64_t i = 0; i < len; i++) {
+            dst[i] ^= table[src[i]];
+        }
+    } else {
+        for (int64_t i = 0; i < len; i++) {
+            dst[i] = table[src[i]];
+        }
+    }
+}
+
+#ifdef BFS_EC_X86_SIMD
+/// Split every byte into nibbles and look both up in 16 entry tables with pshufb
+__attribute__((target("ssse3")))
+void MulRegionSsse3(uint8_t c, const uint8_t* src, uint8_t* dst, int64_t len, bool add) {
+    const __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g_gf.lo[c]));
+    const __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(g_gf.hi[c]));
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    int64_t i = 0;
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i p = _mm_xor_si128(_mm_shuffle_epi8(lo, _mm_and_si128(x, mask)),
+                                  _mm_shuffle_epi8(hi, _mm_and_si128(_mm_srli_epi64(x, 4), mask)));
+        if (add) {
+            p = _mm_xor_si128(p, _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + i)));
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), p);
+    }
+    MulRegionScalar(c, src + i, dst + i, len - i, add);
+}
+
+__attribute__((target("avx2")))
+void MulRegionAvx2(uint8_t c, const uint8_t* src, uint8_t* dst, int64_t len, bool add) {
+    const __m256i lo = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(g_gf.lo[c])));
+    const __m256i hi = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(g_gf.hi[c])));
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    int64_t i = 0;
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+        __m256i p = _mm256_xor_si256(
+            _mm256_shuffle_epi8(lo, _mm256_and_si256(x, mask)),
+            _mm256_shuffle_epi8(hi, _mm256_and_si256(_mm256_srli_epi64(x, 4), mask)));
+        if (add) {
+            p = _mm256_xor_si256(p, _mm256_loadu_si256(reinterpret_cast<const __m256i*>(dst + i)));
+        }
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), p);
+    }
+    MulRegionScalar(c, src + i, dst + i, len - i, add);
+}
+#endif
+
+/// Bytes of every unit multiplied at a time, so the output stays in cache
+const int64_t kChunkSize = 8192;
+
+} // namespace
+
+RsCodec::RsCodec(int32_t data_num, int32_t parity_num, bool use_simd)
+    : data_num_(data_num), parity_num_(parity_num),
+      mul_region_(MulRegionScalar), simd_("scalar") {
+    assert(data_num > 0 && parity_num >= 0 && data_num + parity_num <= 256);
+    // Cauchy matrix 1 / (x_i + y_j), x_i = data_num + i and y_j = j are all distinct
+    parity_matrix_.resize(parity_num * data_num);
+    for (int32_t i = 0; i < parity_num; i++) {
+        for (int32_t j = 0; j < data_num; j++) {
+            parity_matrix_[i * data_num + j] = GfInverse((data_num + i) ^ j);
+        }
+    }
+#ifdef BFS_EC_X86_SIMD
+    if (use_simd) {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            mul_region_ = MulRegionAvx2;
+            simd_ = "avx2";
+        } else if (__builtin_cpu_supports("ssse3")) {
+            mul_region_ = MulRegionSsse3;
+            simd_ = "ssse3";
+        }
+    }
+#endif
+}
+
+void RsCodec::Encode(const char* const* data, char** parity, int64_t len) const {
+    Multiply(&parity_matrix_[0], reinterpret_cast<const uint8_t* const*>(data), data_num_,
+             reinterpret_cast<uint8_t* const*>(parity), parity_num_, len);
+}
+
+bool RsCodec::Decode(char** units, const std::vector<int32_t>& erased, int64_t len) const {
+    int32_t total = data_num_ + parity_num_;
+    std::vector<bool> lost(total, false);
+    for (size_t i = 0; i < erased.size(); i++) {
+        if (erased[i] < 0 || erased[i] >= total) {
+            return false;
+        }
+        lost[erased[i]] = true;
+    }
+    std::vector<int32_t> alive;
+    for (int32_t i = 0; i < total && static_cast<int32_t>(alive.size()) < data_num_; i++) {
+        if (!lost[i]) {
+            alive.push_back(i);
+        }
+    }
+    if (static_cast<int32_t>(alive.size()) < data_num_) {
+        return false;
+    }
+    uint8_t* const* u = reinterpret_cast<uint8_t* const*>(units);
+    // Lost data units are the inverse of the alive units' rows applied to them
+    std::vector<uint8_t> coefs;
+    std::vector<uint8_t*> dst;
+    std::vector<uint8_t> inverse;
+    for (int32_t j = 0; j < data_num_; j++) {
+        if (!lost[j]) {
+            continue;
+        }
+        if (inverse.empty()) {
+            std::vector<uint8_t> matrix(data_num_ * data_num_);
+            for (int32_t r = 0; r < data_num_; r++) {
+                GeneratorRow(alive[r], &matrix[r * data_num_]);
+            }
+            if (!Invert(&matrix, data_num_, &inverse)) {
+                return false;
+            }
+        }
+        coefs.insert(coefs.end(), inverse.begin() + j * data_num_,
+                     inverse.begin() + (j + 1) * data_num_);
+        dst.push_back(u[j]);
+    }
+    if (!dst.empty()) {
+        std::vector<const uint8_t*> src;
+        for (int32_t r = 0; r < data_num_; r++) {
+            src.push_back(u[alive[r]]);
+        }
+        Multiply(&coefs[0], &src[0], data_num_, &dst[0], dst.size(), len);
+    }
+    // Data is whole now, lost parity is encoded again
+    coefs.clear();
+    dst.clear();
+    for (int32_t i = 0; i < parity_num_; i++) {
+        if (lost[data_num_ + i]) {
+            coefs.insert(coefs.end(), parity_matrix_.begin() + i * data_num_,
+                         parity_matrix_.begin() + (i + 1) * data_num_);
+            dst.push_back(u[data_num_ + i]);
+        }
+    }
+    if (!dst.empty()) {
+        Multiply(&coefs[0], u, data_num_, &dst[0], dst.size(), len);
+    }
+    return true;
+}
+
+void RsCodec::Multiply(const uint8_t* coefs, const uint8_t* const* src, int32_t src_num,
+                       uint8_t* const* dst, int32_t dst_num, int64_t len) const {
+    for (int64_t offset = 0; offset < len; offset += kChunkSize) {
+        int64_t n = std::min(kChunkSize, len - offset);
+        for (int32_t r = 0; r < dst_num; r++) {
+            const uint8_t* row = coefs + r * src_num;
+            for (int32_t i = 0; i < src_num; i++) {
+                mul_region_(row[i], src[i] + offset, dst[r] + offset, n, i > 0);
+            }
+        }
+    }
+}
+
+void RsCodec::GeneratorRow(int32_t index, uint8_t* row) const {
+    if (index < data_num_) {
+        memset(row, 0, data_num_);
+        row[index] = 1;
+    } else {
+        memcpy(row, &parity_matrix_[(index - data_num_) * data_num_], data_num_);
+    }
+}
+
+bool RsCodec::Invert(std::vector<uint8_t>* matrix, int32_t n, std::vector<uint8_t>* inverse) {
+    std::vector<uint8_t>& m = *matrix;
+    std::vector<uint8_t>& inv = *inverse;
+    inv.assign(n * n, 0);
+    for (int32_t i = 0; i < n; i++) {
+        inv[i * n + i] = 1;
+    }
+    // Gauss-Jordan elimination, addition is xor
+    for (int32_t col = 0; col < n; col++) {
+        int32_t pivot = col;
+        while (pivot < n && m[pivot * n + col] == 0) {
+            ++pivot;
+        }
+        if (pivot == n) {
+            return false;
+        }
+        if (pivot != col) {
+            std::swap_ranges(m.begin() + pivot * n, m.begin() + (pivot + 1) * n,
+                             m.begin() + col * n);
+            std::swap_ranges(inv.begin() + pivot * n, inv.begin() + (pivot + 1) * n,
+                             inv.begin() + col * n);
+        }
+        uint8_t scale = GfInverse(m[col * n + col]);
+        for (int32_t c = 0; c < n; c++) {
+            m[col * n + c] = g_gf.mul[scale][m[col * n + c]];
+            inv[col * n + c] = g_gf.mul[scale][inv[col * n + c]];
+        }
+        for (int32_t r = 0; r < n; r++) {
+            uint8_t f = m[r * n + col];
+            if (r == col || f == 0) {
+                continue;
+            }
+            for (int32_t c = 0; c < n; c++) {
+                m[r * n + c] ^= g_gf.mul[f][m[col * n + c]];
+                inv[r * n + c] ^= g_gf.mul[f][inv[col * n + c]];
+            }
+        }
+    }
+    return true;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
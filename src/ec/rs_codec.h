@@ -0,0 +1,51 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BFS_EC_RS_CODEC_H_
+#define BFS_EC_RS_CODEC_H_
+
+#include <stdint.h>
+#include <vector>
+
+namespace baidu {
+namespace bfs {
+
+/// Reed-Solomon code over GF(2^8). Data units are kept as they are, parity units
+/// come from a Cauchy matrix, so any data_num of the units rebuild all the others.
+class RsCodec {
+public:
+    /// use_simd false always takes the table lookup path, for comparison
+    RsCodec(int32_t data_num, int32_t parity_num, bool use_simd = true);
+    int32_t DataNum() const { return data_num_; }
+    int32_t ParityNum() const { return parity_num_; }
+    /// Instructions used for region multiplies: "avx2", "ssse3" or "scalar"
+    const char* Simd() const { return simd_; }
+    /// Compute the parity units from the data units, all of len bytes
+    void Encode(const char* const* data, char** parity, int64_t len) const;
+    /// units holds data_num + parity_num units of len bytes, rebuild the erased
+    /// ones in place from the others. False if more than parity_num are erased.
+    bool Decode(char** units, const std::vector<int32_t>& erased, int64_t len) const;
+private:
+    typedef void (*MulRegionFunc)(uint8_t c, const uint8_t* src, uint8_t* dst,
+                                  int64_t len, bool add);
+    /// dst[r] = sum of coefs[r * src_num + i] * src[i]
+    void Multiply(const uint8_t* coefs, const uint8_t* const* src, int32_t src_num,
+                  uint8_t* const* dst, int32_t dst_num, int64_t len) const;
+    /// Coefficients of unit index over the data units
+    void GeneratorRow(int32_t index, uint8_t* row) const;
+    static bool Invert(std::vector<uint8_t>* matrix, int32_t n, std::vector<uint8_t>* inverse);
+private:
+    int32_t data_num_;
+    int32_t parity_num_;
+    std::vector<uint8_t> parity_matrix_;    ///< parity_num rows of data_num
+    MulRegionFunc mul_region_;
+    const char* simd_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_EC_RS_CODEC_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
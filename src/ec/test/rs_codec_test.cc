@@ -0,0 +1,253 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "ec/rs_codec.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <common/timer.h>
+
+#include "ec/ec_layout.h"
+
+namespace baidu {
+namespace bfs {
+
+class RsCodecTest : public ::testing::Test {
+protected:
+    /// Random data units and their parity
+    void MakeUnits(const RsCodec& codec, int64_t len, std::vector<std::string>* units) {
+        int32_t total = codec.DataNum() + codec.ParityNum();
+        units->assign(total, std::string(len, '\0'));
+        std::vector<const char*> data;
+        std::vector<char*> parity;
+        for (int32_t i = 0; i < total; i++) {
+            if (i < codec.DataNum()) {
+                for (int64_t j = 0; j < len; j++) {
+                    (*units)[i][j] = rand();
+                }
+                data.push_back((*units)[i].data());
+            } else {
+                parity.push_back(&(*units)[i][0]);
+            }
+        }
+        codec.Encode(&data[0], &parity[0], len);
+    }
+    /// Wipe the erased units, decode and compare with the originals
+    bool EraseAndDecode(const RsCodec& codec, const std::vector<std::string>& units,
+                        const std::vector<int32_t>& erased) {
+        std::vector<std::string> copy(units);
+        std::vector<char*> ptrs;
+        for (size_t i = 0; i < erased.size(); i++) {
+            copy[erased[i]].assign(copy[erased[i]].size(), '\0');
+        }
+        for (size_t i = 0; i < copy.size(); i++) {
+            ptrs.push_back(&copy[i][0]);
+        }
+        return codec.Decode(&ptrs[0], erased, units[0].size()) && copy == units;
+    }
+    /// MB of data units per second through encode and through decode of parity_num losses
+    static void Benchmark(const RsCodec& codec, int64_t len, double* encode, double* decode) {
+        const int32_t kRounds = 20;
+        int32_t total = codec.DataNum() + codec.ParityNum();
+        std::vector<std::string> units(total, std::string(len, 'x'));
+        std::vector<char*> ptrs;
+        for (int32_t i = 0; i < total; i++) {
+            ptrs.push_back(&units[i][0]);
+        }
+        int64_t start = common::timer::get_micros();
+        for (int32_t r = 0; r < kRounds; r++) {
+            codec.Encode(&ptrs[0], &ptrs[codec.DataNum()], len);
+        }
+        int64_t use = common::timer::get_micros() - start;
+        *encode = static_cast<double>(len) * codec.DataNum() * kRounds / (use ? use : 1);
+        // The worst case, the first data units are lost
+        std::vector<int32_t> erased;
+        for (int32_t i = 0; i < codec.ParityNum(); i++) {
+            erased.push_back(i);
+        }
+        start = common::timer::get_micros();
+        for (int32_t r = 0; r < kRounds; r++) {
+            codec.Decode(&ptrs[0], erased, len);
+        }
+        use = common::timer::get_micros() - start;
+        *decode = static_cast<double>(len) * codec.DataNum() * kRounds / (use ? use : 1);
+    }
+};
+
+TEST_F(RsCodecTest, DecodeAnyErasures) {
+    RsCodec codec(6, 3);
+    std::vector<std::string> units;
+    // Not a multiple of the vector width, so the tails are covered
+    MakeUnits(codec, 1000 + 7, &units);
+    int32_t cases = 0;
+    for (int32_t a = 0; a < 9; a++) {
+        for (int32_t b = a; b < 9; b++) {
+            for (int32_t c = b; c < 9; c++) {
+                std::vector<int32_t> erased;
+                erased.push_back(a);
+                if (b != a) {
+                    erased.push_back(b);
+                }
+                if (c != b) {
+                    erased.push_back(c);
+                }
+                ASSERT_TRUE(EraseAndDecode(codec, units, erased)) << a << " " << b << " " << c;
+                ++cases;
+            }
+        }
+    }
+    ASSERT_EQ(cases, 165);
+    std::vector<int32_t> too_many;
+    for (int32_t i = 0; i < 4; i++) {
+        too_many.push_back(i * 2);
+    }
+    ASSERT_FALSE(EraseAndDecode(codec, units, too_many));
+}
+
+TEST_F(RsCodecTest, SimdMatchesScalar) {
+    RsCodec simd(10, 4);
+    RsCodec scalar(10, 4, false);
+    printf("Region multiplies use %s\n", simd.Simd());
+    ASSERT_STREQ(scalar.Simd(), "scalar");
+    std::vector<std::string> units;
+    MakeUnits(simd, 4096 + 33, &units);
+    std::vector<std::string> parity(4, std::string(units[0].size(), '\0'));
+    std::vector<const char*> data;
+    std::vector<char*> out;
+    for (int32_t i = 0; i < 10; i++) {
+        data.push_back(units[i].data());
+    }
+    for (int32_t i = 0; i < 4; i++) {
+        out.push_back(&parity[i][0]);
+    }
+    scalar.Encode(&data[0], &out[0], units[0].size());
+    for (int32_t i = 0; i < 4; i++) {
+        ASSERT_TRUE(parity[i] == units[10 + i]);
+    }
+}
+
+TEST_F(RsCodecTest, Layout) {
+    const int32_t kCell = 100;
+    int32_t unit = 0;
+    int64_t unit_offset = 0;
+    EcLocate(0, 6, kCell, &unit, &unit_offset);
+    ASSERT_EQ(unit, 0);
+    ASSERT_EQ(unit_offset, 0);
+    EcLocate(250, 6, kCell, &unit, &unit_offset);
+    ASSERT_EQ(unit, 2);
+    ASSERT_EQ(unit_offset, 50);
+    EcLocate(6 * kCell + 120, 6, kCell, &unit, &unit_offset);
+    ASSERT_EQ(unit, 1);
+    ASSERT_EQ(unit_offset, kCell + 20);
+    // One full stripe and 250 bytes
+    int64_t size = 6 * kCell + 250;
+    int64_t expected[] = {200, 200, 150, 100, 100, 100, 200, 200, 200};
+    int64_t data = 0;
+    for (int32_t i = 0; i < 9; i++) {
+        ASSERT_EQ(EcUnitSize(size, 6, kCell, i), expected[i]) << i;
+        if (i < 6) {
+            data += expected[i];
+        }
+    }
+    ASSERT_EQ(data, size);
+    ASSERT_EQ(EcUnitSize(0, 6, kCell, 8), 0);
+}
+
+TEST_F(RsCodecTest, TailLayout) {
+    // RS(3,2), files ending anywhere in the first stripes
+    const int32_t kData = 3;
+    const int32_t kParity = 2;
+    const int32_t kCell = 10;
+    int64_t sizes[] = {1, 9, 10, 11, 29, 30, 31, 55};
+    int64_t expected[][kData] = {{1, 0, 0}, {9, 0, 0}, {10, 0, 0}, {10, 1, 0},
+                                 {10, 10, 9}, {10, 10, 10}, {11, 10, 10}, {20, 20, 15}};
+    for (int32_t s = 0; s < 8; s++) {
+        for (int32_t i = 0; i < kData; i++) {
+            ASSERT_EQ(EcUnitSize(sizes[s], kData, kCell, i), expected[s][i]) << s << " " << i;
+        }
+        // Parity covers the longest data unit
+        for (int32_t i = kData; i < kData + kParity; i++) {
+            ASSERT_EQ(EcUnitSize(sizes[s], kData, kCell, i), expected[s][0]) << s << " " << i;
+        }
+    }
+    // Every byte of the file is the next byte of its unit, and units end where they should
+    for (int64_t size = 0; size <= 4 * kData * kCell; size++) {
+        std::vector<int64_t> mapped(kData, 0);
+        int32_t unit = 0;
+        int64_t unit_offset = 0;
+        for (int64_t offset = 0; offset < size; offset++) {
+            EcLocate(offset, kData, kCell, &unit, &unit_offset);
+            ASSERT_EQ(unit_offset, mapped[unit]) << offset;
+            ++mapped[unit];
+        }
+        for (int32_t i = 0; i < kData; i++) {
+            ASSERT_EQ(EcUnitSize(size, kData, kCell, i), mapped[i]) << size << " " << i;
+        }
+        ASSERT_EQ(EcUnitSize(size, kData, kCell, kData + kParity - 1), mapped[0]) << size;
+    }
+}
+
+TEST_F(RsCodecTest, StripeLayout) {
+    // A striped file is a group of width units and no parity
+    const int32_t kWidth = 4;
+    const int32_t kUnit = 100;
+    int32_t unit = 0;
+    int64_t unit_offset = 0;
+    for (int32_t i = 0; i < 2 * kWidth; i++) {
+        EcLocate(i * kUnit + 7, kWidth, kUnit, &unit, &unit_offset);
+        ASSERT_EQ(unit, i % kWidth);
+        ASSERT_EQ(unit_offset, i / kWidth * kUnit + 7);
+    }
+    EcLocate(kWidth * kUnit - 1, kWidth, kUnit, &unit, &unit_offset);
+    ASSERT_EQ(unit, kWidth - 1);
+    ASSERT_EQ(unit_offset, kUnit - 1);
+
+    int64_t sizes[] = {0, 50, kUnit, 2 * kWidth * kUnit, 2 * kWidth * kUnit + 130};
+    int64_t expected[][kWidth] = {{0, 0, 0, 0}, {50, 0, 0, 0}, {100, 0, 0, 0},
+                                  {200, 200, 200, 200}, {300, 230, 200, 200}};
+    for (int32_t s = 0; s < 5; s++) {
+        std::vector<int64_t> mapped(kWidth, 0);
+        for (int64_t offset = 0; offset < sizes[s]; offset++) {
+            EcLocate(offset, kWidth, kUnit, &unit, &unit_offset);
+            ASSERT_EQ(unit_offset, mapped[unit]) << offset;
+            ++mapped[unit];
+        }
+        for (int32_t i = 0; i < kWidth; i++) {
+            ASSERT_EQ(EcUnitSize(sizes[s], kWidth, kUnit, i), expected[s][i]) << s << " " << i;
+            ASSERT_EQ(mapped[i], expected[s][i]) << s << " " << i;
+        }
+    }
+}
+
+TEST_F(RsCodecTest, Throughput) {
+    const int64_t kUnitSize = 1 << 20;
+    int32_t schemes[][2] = {{6, 3}, {10, 4}};
+    for (int32_t s = 0; s < 2; s++) {
+        RsCodec simd(schemes[s][0], schemes[s][1]);
+        RsCodec scalar(schemes[s][0], schemes[s][1], false);
+        double encode = 0, decode = 0, scalar_encode = 0, scalar_decode = 0;
+        Benchmark(simd, kUnitSize, &encode, &decode);
+        Benchmark(scalar, kUnitSize, &scalar_encode, &scalar_decode);
+        printf("RS(%d,%d) %s: encode %.0f MB/s, decode %.0f MB/s; "
+               "scalar: encode %.0f MB/s, decode %.0f MB/s\n",
+               schemes[s][0], schemes[s][1], simd.Simd(), encode, decode,
+               scalar_encode, scalar_decode);
+        ASSERT_GT(encode, 0);
+        ASSERT_GT(decode, 0);
+    }
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
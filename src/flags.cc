@@ -13,6 +13,7 @@ DEFINE_int32(web_recover_list_size, 10, "Max recover list size displayed in webs
 DEFINE_string(bfs_log, "", "BFS log");
 DEFINE_int32(bfs_log_size, 1024, "BFS log size");
 DEFINE_int32(bfs_log_limit, 102400, "BFS log total size limit");
+DEFINE_string(tera_wal_suffix, ".log", "Tera files opened for write in wal mode, by name suffix, empty to disable");
 DEFINE_int32(block_report_timeout, 600, "BlockReport rpc timeout");
 
 // nameserver
@@ -21,11 +22,25 @@ DEFINE_int64(namedb_cache_size, 1024L, "Namespace datebase memery cache size");
 DEFINE_int32(expect_chunkserver_num, 3, "Read only threshtrold");
 DEFINE_int32(keepalive_timeout, 10, "Chunkserver keepalive timeout");
 DEFINE_int32(default_replica_num, 3, "Default replica num of data block");
+DEFINE_int32(ec_max_units, 32, "Max data plus parity blocks of an erasure coded file");
+DEFINE_int32(stripe_max_width, 32, "Max blocks a striped file goes round robin over");
+DEFINE_int32(ec_transcode_age, 0, "Seconds after creation a replicated file is cold and transcoded to erasure code, 0 to disable");
+DEFINE_int32(ec_transcode_min_size, 64, "Min size in MB of the files to transcode");
+DEFINE_int32(ec_transcode_data_num, 6, "Data blocks of transcoded files");
+DEFINE_int32(ec_transcode_parity_num, 3, "Parity blocks of transcoded files");
+DEFINE_int32(ec_transcode_cell_size, 1024*1024, "Stripe cell size of transcoded files in bytes");
+DEFINE_int32(ec_transcode_max_tasks, 10, "Max files transcoded at a time");
+DEFINE_int32(ec_transcode_interval, 60, "Seconds between cold file scans");
+DEFINE_int32(ec_transcode_scan_num, 10000, "Files checked by a cold file scan");
+DEFINE_int32(ec_transcode_timeout, 3600, "Seconds to give up a transcode task");
 DEFINE_int32(nameserver_log_level, 4, "Nameserver log level");
 DEFINE_string(nameserver_warninglog, "./wflog", "Warning log file");
 DEFINE_int32(nameserver_start_recover_timeout, 3600, "Nameserver starts recover in second");
 DEFINE_int32(recover_speed, 100, "Max num of block to recover for one chunkserver");
 DEFINE_int32(recover_dest_limit, 5, "Number of recover dest");
+DEFINE_int32(recover_node_bandwidth, 200, "Recover bandwidth budget per chunkserver in MB/s, 0 for unlimited");
+DEFINE_int32(recover_rack_bandwidth, 2048, "Cross rack recover bandwidth budget per rack in MB/s, 0 for unlimited");
+DEFINE_int32(rebalance_threshold, 10, "Move replicas off chunkservers whose usage is this many percent over the mean, 0 to disable");
 DEFINE_int32(hi_recover_timeout, 180, "Recover timeout for high priority blocks");
 DEFINE_int32(lo_recover_timeout, 600, "Recover timeout for low priority blocks");
 DEFINE_bool(clean_redundancy, false, "Clean redundant replica");
@@ -40,6 +55,7 @@ DEFINE_int32(blockmapping_bucket_num, 19, "Partation num of blockmapping");
 DEFINE_int32(blockmapping_working_thread_num, 5, "Working thread num of blockmapping");
 DEFINE_int32(block_id_allocation_size, 10000, "Block id allocatoin size");
 DEFINE_bool(check_orphan, false, "Check orphan entry in RebuildBlockMap");
+DEFINE_int32(nameserver_append_lease, 600, "Seconds a file reopened for append is kept for its writer, then sealed again if the writer never finished");
 
 // ha
 DEFINE_string(ha_strategy, "master_slave", "[master_slave, raft, none]");
@@ -51,7 +67,7 @@ DEFINE_string(master_slave_role, "master", "This server's role in master/slave h
 DEFINE_string(raftdb_path,"./raftdb", "Raft log storage path");
 
 // chunkserver
-DEFINE_string(block_store_path, "./data", "Data path");
+DEFINE_string(block_store_path, "./data", "Data paths, comma separated, [ssd] in front of a path marks it as ssd");
 DEFINE_string(chunkserver_port, "8825", "Chunkserver port");
 DEFINE_string(chunkserver_tag, "", "Chunkserver tag");
 DEFINE_int32(heartbeat_interval, 1, "Heartbeat interval");
@@ -63,11 +79,38 @@ DEFINE_int32(write_buf_size, 1024*1024, "Block write buffer size, bytes");
 DEFINE_int32(chunkserver_max_pending_buffers, 10240, "Max buffer num wait flush to disk");
 DEFINE_int64(chunkserver_max_unfinished_bytes, 2147483648, "Max unfinished write bytes");
 DEFINE_int32(chunkserver_work_thread_num, 10, "Chunkserver work thread num");
+DEFINE_int32(chunkserver_inline_write_size, 4096, "Packets up to this size are written without requeueing to the work threads");
 DEFINE_int32(chunkserver_read_thread_num, 20, "Chunkserver work thread num");
 DEFINE_int32(chunkserver_write_thread_num, 10, "Chunkserver work thread num");
-DEFINE_int32(chunkserver_io_thread_num, 10, "Chunkserver io thread num");
+DEFINE_int32(chunkserver_io_thread_num, 10, "Chunkserver io thread num per disk");
+DEFINE_int32(chunkserver_disk_read_thread_num, 10, "Chunkserver read thread num per disk");
+DEFINE_string(chunkserver_disk_select_policy, "load", "Store path of new blocks: hash/capacity/load");
+DEFINE_int32(chunkserver_disk_max_pending_reads, 1000, "Max queued reads per disk, 0 for unlimited");
+DEFINE_bool(chunkserver_sync_meta, true, "Sync block meta to disk, once per group commit");
+DEFINE_int32(chunkserver_meta_batch_ops, 256, "Max block meta updates merged into one metadb write");
+DEFINE_string(chunkserver_journal_path, "", "Journal file on a fast device for durable writes, empty to disable");
+DEFINE_int32(chunkserver_journal_size, 1024, "Journal size in MB that forces a checkpoint");
+DEFINE_int32(chunkserver_sync_batch_files, 64, "Max block file syncs sharing one disk flush");
+DEFINE_int32(chunkserver_memory_limit, 4096, "Max MB of memory and lazy persist block data held in memory");
+DEFINE_int32(chunkserver_prealloc_limit, 256, "Max MB preallocated for a block file by the expected size, 0 to disable");
+DEFINE_int32(chunkserver_block_compact_interval, 10, "Seconds between moving idle closed blocks to the compact block index");
+DEFINE_bool(chunkserver_background_verify, false, "After an unclean shutdown, check block files in background instead of before registering");
 DEFINE_int32(chunkserver_recover_thread_num, 10, "Chunkserver work thread num");
+DEFINE_int32(chunkserver_recover_window, 8, "Max packets in flight when pushing a recover block");
+DEFINE_bool(chunkserver_multi_source_recover, true, "Recover dest pulls block ranges from all replicas");
+DEFINE_int32(chunkserver_foreground_io_rate, 0, "Foreground read rate limit in MB/s, 0 for unlimited");
+DEFINE_int32(chunkserver_recover_io_rate, 100, "Recover io rate limit in MB/s, 0 for unlimited");
+DEFINE_int32(chunkserver_scrub_io_rate, 20, "Scrub io rate limit in MB/s, 0 for unlimited");
+DEFINE_int32(chunkserver_delete_io_rate, 0, "Rate of freeing deleted block files in MB/s, 0 for unlimited");
+DEFINE_int32(chunkserver_balance_io_rate, 20, "Disk balance io rate limit in MB/s, 0 for unlimited");
+DEFINE_int32(chunkserver_transcode_io_rate, 20, "Erasure code transcode io rate limit in MB/s, 0 for unlimited");
+DEFINE_int32(chunkserver_disk_balance_interval, 60, "Seconds between disk balance rounds");
+DEFINE_int32(chunkserver_disk_balance_threshold, 10, "Disk usage gap in percent that triggers balance, 0 to disable");
+DEFINE_int32(chunkserver_tier_move_interval, 300, "Seconds between moves of blocks between ssd and hdd store paths");
+DEFINE_int32(chunkserver_hot_block_reads, 16, "Reads in a tier move interval that move a block to ssd, decayed by half each interval, 0 to disable");
+DEFINE_int32(chunkserver_ssd_usage_limit, 90, "Ssd usage in percent over which cold blocks move to hdd and hot ones stop moving in");
 DEFINE_int32(chunkserver_file_cache_size, 1000, "Chunkserver file cache size");
+DEFINE_int32(chunkserver_reopen_timeout, 60, "Seconds a block reopened for append waits for data before it is sealed again");
 DEFINE_int32(chunkserver_use_root_partition, 1, "Should chunkserver use root partition, 0: forbidden");
 DEFINE_bool(chunkserver_auto_clean, true, "If namespace version mismatch, chunkserver clean itself");
 // SDK
@@ -76,6 +119,9 @@ DEFINE_int32(sdk_file_reada_len, 1024*1024, "Read ahead buffer len");
 DEFINE_string(sdk_write_mode, "chains", "Sdk write mode: chains/fan-out");
 DEFINE_int32(sdk_createblock_retry, 5, "Create block retry times before fail");
 DEFINE_int32(sdk_write_retry_times, 5, "Write retry times before fail");
+DEFINE_int32(sdk_ec_cell_size, 1024*1024, "Stripe cell size of erasure coded files in bytes");
+DEFINE_int32(sdk_block_size, 256, "Size in MB at which writers start a new block of a file, 0 for a single block");
+DEFINE_int32(sdk_stripe_unit_size, 1024*1024, "Stripe unit size of striped files in bytes");
 
 
 /* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
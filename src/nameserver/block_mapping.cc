@@ -26,13 +26,15 @@ extern common::Counter g_blocks_num;
 
 NSBlock::NSBlock()
     : id(-1), version(-1), block_size(-1),
-      expect_replica_num(0), recover_stat(kNotInRecover) {
+      expect_replica_num(0), recover_stat(kNotInRecover),
+      ec_group(-1), ec_data_num(0), ec_parity_num(0) {
 }
 NSBlock::NSBlock(int64_t block_id, int32_t replica,
                  int64_t block_version, int64_t block_size)
     : id(block_id), version(block_version),
       block_size(block_size), expect_replica_num(replica),
-      recover_stat(block_version < 0 ? kBlockWriting : kNotInRecover) {
+      recover_stat(block_version < 0 ? kBlockWriting : kNotInRecover),
+      ec_group(-1), ec_data_num(0), ec_parity_num(0) {
 }
 
 BlockMapping::BlockMapping(ThreadPool* thread_pool) : thread_pool_(thread_pool) {}
@@ -265,7 +267,28 @@ bool BlockMapping::UpdateNormalBlock(NSBlock* nsblock,
     }
 
     TryRecover(nsblock);
-    if (FLAGS_clean_redundancy && replica.size() > nsblock->expect_replica_num) {
+    if (replica.size() > nsblock->expect_replica_num) {
+        // A rebalance move drops its source even without redundancy cleaning
+        std::map<int64_t, int32_t>::iterator r_it = rebalance_source_.find(block_id);
+        if (r_it != rebalance_source_.end()) {
+            int32_t src_id = r_it->second;
+            if (src_id != cs_id && replica.find(src_id) != replica.end()) {
+                // Keep the rebalanced copy, the source drops its replica on next report
+                LOG(INFO, "Rebalance replica #%ld C%d -> C%d R%lu",
+                    block_id, src_id, cs_id, replica.size());
+                return true;
+            }
+            if (src_id == cs_id) {
+                rebalance_source_.erase(r_it);
+                LOG(INFO, "Rebalance drop source replica #%ld C%d R%lu",
+                    block_id, cs_id, replica.size());
+                replica.erase(cs_id);
+                return false;
+            }
+        }
+        if (!FLAGS_clean_redundancy) {
+            return true;
+        }
         LOG(INFO, "Too much replica #%ld R%lu expect=%d C%d ",
             block_id, replica.size(), nsblock->expect_replica_num, cs_id);
         replica.erase(cs_id);
@@ -527,9 +550,11 @@ void BlockMapping::RemoveBlock(int64_t block_id, std::map<int64_t, std::set<int3
         lost_blocks_.erase(block_id);
     } else if (block->recover_stat == kHiRecover) {
         hi_pri_recover_.erase(block_id);
+        ec_recover_.erase(block_id);
     } else if (block->recover_stat == kLoRecover) {
         lo_pri_recover_.erase(block_id);
     }
+    rebalance_source_.erase(block_id);
     delete block;
     block_map_.erase(block_id);
     g_blocks_num.Dec();
@@ -557,6 +582,10 @@ void BlockMapping::DealWithDeadBlockInternal(int32_t cs_id, int64_t block_id) {
         LOG(DEBUG, "DealWithDeadBlocks for C%d can't find block: #%ld ", cs_id, block_id);
         return;
     }
+    std::map<int64_t, int32_t>::iterator r_it = rebalance_source_.find(block_id);
+    if (r_it != rebalance_source_.end() && r_it->second == cs_id) {
+        rebalance_source_.erase(r_it);
+    }
     std::set<int32_t>& inc_replica = block->incomplete_replica;
     std::set<int32_t>& replica = block->replica;
     if (inc_replica.erase(cs_id)) {
@@ -684,6 +713,61 @@ void BlockMapping::PickRecoverBlocks(int32_t cs_id, int32_t block_num,
     LOG(INFO, "C%d picked %lu blocks to recover", cs_id, recover_blocks->size());
 }
 
+void BlockMapping::MarkEcBlock(int64_t block_id, int64_t group_id,
+                               int32_t data_num, int32_t parity_num) {
+    MutexLock lock(&mu_);
+    NSBlock* block = NULL;
+    if (!GetBlockPtr(block_id, &block)) {
+        LOG(WARNING, "MarkEcBlock can't find block: #%ld ", block_id);
+        return;
+    }
+    block->ec_group = group_id;
+    block->ec_data_num = data_num;
+    block->ec_parity_num = parity_num;
+    if (block->recover_stat == kLost) {
+        // Not lost while the group can rebuild it
+        lost_blocks_.erase(block_id);
+        SetState(block, kNotInRecover);
+        TryRecover(block);
+    }
+}
+
+void BlockMapping::PickEcRecoverBlocks(int32_t cs_id, int32_t block_num,
+                                       std::vector<int64_t>* blocks) {
+    MutexLock lock(&mu_);
+    if (ec_recover_.empty()) {
+        return;
+    }
+    std::set<int64_t>& check_set = hi_recover_check_[cs_id];
+    int32_t timeout = 3 + FLAGS_hi_recover_timeout;
+    std::set<int64_t>::iterator it = ec_recover_.begin();
+    while (static_cast<int32_t>(blocks->size()) < block_num && it != ec_recover_.end()) {
+        NSBlock* block = NULL;
+        if (!GetBlockPtr(*it, &block)) {
+            ec_recover_.erase(it++);
+            continue;
+        }
+        if (!block->replica.empty()) {
+            ec_recover_.erase(it++);
+            SetState(block, kNotInRecover);
+            TryRecover(block);
+            continue;
+        }
+        // Any chunkserver can drive the rebuild, the timeout check puts it back on failure
+        blocks->push_back(block->id);
+        check_set.insert(block->id);
+        block->recover_stat = kCheck;
+        LOG(INFO, "PickEcRecoverBlocks for C%d #%ld of group #%ld",
+            cs_id, block->id, block->ec_group);
+        thread_pool_->DelayTask(timeout * 1000,
+            boost::bind(&BlockMapping::CheckRecover, this, cs_id, block->id));
+        ec_recover_.erase(it++);
+    }
+    if (check_set.empty()) {
+        hi_recover_check_.erase(cs_id);
+    }
+}
+
 bool BlockMapping::RemoveFromRecoverCheckList(int32_t cs_id, int64_t block_id) {
     mu_.AssertHeld();
     std::set<int64_t>::iterator it = lo_recover_check_[cs_id].find(block_id);
@@ -722,12 +806,49 @@ void BlockMapping::ProcessRecoveredBlock(int32_t cs_id, int64_t block_id, Status
     if (ret) {
         SetState(block, kNotInRecover);
     } else {
-        LOG(WARNING, "RemoveFromRecoverCheckList fail #%ld C%d %s",
-            block_id, cs_id, RecoverStat_Name(block->recover_stat).c_str());
+        std::map<int64_t, int32_t>::iterator r_it = rebalance_source_.find(block_id);
+        if (r_it != rebalance_source_.end() && r_it->second == cs_id) {
+            if (status != kOK) {
+                LOG(INFO, "Rebalance #%ld from C%d fail %s",
+                    block_id, cs_id, StatusCode_Name(status).c_str());
+                rebalance_source_.erase(r_it);
+            }
+        } else {
+            LOG(WARNING, "RemoveFromRecoverCheckList fail #%ld C%d %s",
+                block_id, cs_id, RecoverStat_Name(block->recover_stat).c_str());
+        }
     }
     TryRecover(block);
 }
 
+bool BlockMapping::MarkRebalance(int64_t block_id, int32_t src_id) {
+    MutexLock lock(&mu_);
+    NSBlock* block = NULL;
+    if (!GetBlockPtr(block_id, &block)) {
+        return false;
+    }
+    if (block->recover_stat != kNotInRecover
+        || block->replica.size() != block->expect_replica_num
+        || block->replica.find(src_id) == block->replica.end()
+        || !rebalance_source_.insert(std::make_pair(block_id, src_id)).second) {
+        return false;
+    }
+    // Give the copy and the source's next report enough time before forgetting it
+    int32_t timeout = 3 + 2 * FLAGS_lo_recover_timeout;
+    thread_pool_->DelayTask(timeout * 1000,
+        boost::bind(&BlockMapping::ClearRebalance, this, block_id, src_id));
+    return true;
+}
+
+void BlockMapping::ClearRebalance(int64_t block_id, int32_t src_id) {
+    MutexLock lock(&mu_);
+    std::map<int64_t, int32_t>::iterator it = rebalance_source_.find(block_id);
+    if (it != rebalance_source_.end() && it->second == src_id) {
+        LOG(INFO, "Rebalance #%ld from C%d timeout", block_id, src_id);
+        rebalance_source_.erase(it);
+    }
+}
+
 void BlockMapping::GetCloseBlocks(int32_t cs_id,
                                   google::protobuf::RepeatedField<int64_t>* close_blocks) {
     MutexLock lock(&mu_);
@@ -758,7 +879,7 @@ void BlockMapping::GetStat(int32_t cs_id, RecoverBlockNum* recover_num) {
             recover_num->hi_pending += (it->second).size();
         }
     }
-    recover_num->hi_recover_num = hi_pri_recover_.size();
+    recover_num->hi_recover_num = hi_pri_recover_.size() + ec_recover_.size();
     recover_num->lost_num = lost_blocks_.size();
     if (cs_id != -1) {
         recover_num->incomplete_num += incomplete_[cs_id].size();
@@ -800,6 +921,7 @@ void BlockMapping::ListRecover(RecoverBlockSet* recover_blocks) {
     MutexLock lock(&mu_);
     ListRecoverList(lo_pri_recover_, &(recover_blocks->lo_recover));
     ListRecoverList(hi_pri_recover_, &(recover_blocks->hi_recover));
+    ListRecoverList(ec_recover_, &(recover_blocks->hi_recover));
     ListRecoverList(lost_blocks_, &(recover_blocks->lost));
 
     ListCheckList(hi_recover_check_, &(recover_blocks->hi_check));
@@ -816,7 +938,16 @@ void BlockMapping::TryRecover(NSBlock* block) {
     }
     int64_t block_id = block->id;
     if (block->replica.size() < block->expect_replica_num) {
-        if (block->replica.size() == 0) {
+        if (block->replica.size() == 0 && block->ec_group >= 0) {
+            // The only replica of a unit, rebuilt from the rest of its group
+            if (block->block_size && block->recover_stat != kHiRecover) {
+                LOG(INFO, "[TryRecover] lost unit #%ld of group #%ld %s->kHiRecover",
+                    block_id, block->ec_group, RecoverStat_Name(block->recover_stat).c_str());
+                ec_recover_.insert(block_id);
+                SetState(block, kHiRecover);
+                lost_blocks_.erase(block_id);
+            }
+        } else if (block->replica.size() == 0) {
             if (block->block_size && block->recover_stat != kLost) {
                 LOG(INFO, "[TryRecover] lost block #%ld ", block_id);
                 lost_blocks_.insert(block_id);
@@ -852,6 +983,7 @@ void BlockMapping::TryRecover(NSBlock* block) {
         lost_blocks_.erase(block_id);
         hi_pri_recover_.erase(block_id);
         lo_pri_recover_.erase(block_id);
+        ec_recover_.erase(block_id);
     }
 }
 
@@ -28,6 +28,9 @@ struct NSBlock {
     uint32_t expect_replica_num;
     RecoverStat recover_stat;
     std::set<int32_t> incomplete_replica;
+    int64_t ec_group;       ///< first block of the erasure coded group, -1 for replicated
+    int32_t ec_data_num;
+    int32_t ec_parity_num;
     NSBlock();
     NSBlock(int64_t block_id, int32_t replica, int64_t version, int64_t size);
     bool operator<(const NSBlock &b) const {
@@ -80,7 +83,14 @@ public:
     void ListRecover(RecoverBlockSet* blocks);
     int32_t GetCheckNum();
     void MarkIncomplete(int64_t block_id);
+    /// Mark a rebalance copy of block_id off src_id, false if the block is busy
+    bool MarkRebalance(int64_t block_id, int32_t src_id);
+    /// Mark block_id a unit of the erasure coded group starting at group_id
+    void MarkEcBlock(int64_t block_id, int64_t group_id, int32_t data_num, int32_t parity_num);
+    /// Pick lost erasure coded units for cs_id to have rebuilt from their groups
+    void PickEcRecoverBlocks(int32_t cs_id, int32_t block_num, std::vector<int64_t>* blocks);
 private:
+    void ClearRebalance(int64_t block_id, int32_t src_id);
     void DealWithDeadBlockInternal(int32_t cs_id, int64_t block_id);
     typedef std::map<int32_t, std::set<int64_t> > CheckList;
     void ListCheckList(const CheckList& check_list, std::map<int32_t, std::set<int64_t> >* result);
@@ -112,6 +122,9 @@ private:
     std::set<int64_t> lo_pri_recover_;
     std::set<int64_t> hi_pri_recover_;
     std::set<int64_t> lost_blocks_;
+    std::set<int64_t> ec_recover_;      ///< erasure coded units lost, to rebuild
+    /// block_id -> chunkserver to drop the replica from once the new copy arrives
+    std::map<int64_t, int32_t> rebalance_source_;
 };
 
 } // namespace bfs
@@ -154,5 +154,26 @@ void BlockMappingManager::MarkIncomplete(int64_t block_id) {
     block_mapping_[bucket_offset]->MarkIncomplete(block_id);
 }
 
+bool BlockMappingManager::MarkRebalance(int64_t block_id, int32_t src_id) {
+    int32_t bucket_offset = GetBucketOffset(block_id);
+    return block_mapping_[bucket_offset]->MarkRebalance(block_id, src_id);
+}
+
+void BlockMappingManager::MarkEcBlock(int64_t block_id, int64_t group_id,
+                                      int32_t data_num, int32_t parity_num) {
+    int32_t bucket_offset = GetBucketOffset(block_id);
+    block_mapping_[bucket_offset]->MarkEcBlock(block_id, group_id, data_num, parity_num);
+}
+
+void BlockMappingManager::PickEcRecoverBlocks(int32_t cs_id, int32_t block_num,
+                                              std::vector<int64_t>* blocks) {
+    int start_bucket = rand() % blockmapping_bucket_num_;
+    for (int i = 0; i < blockmapping_bucket_num_ && (size_t)block_num > blocks->size(); i++) {
+        block_mapping_[start_bucket % blockmapping_bucket_num_]->
+            PickEcRecoverBlocks(cs_id, block_num, blocks);
+        ++start_bucket;
+    }
+}
+
 } //namespace bfs
 } //namespace baidu
@@ -39,6 +39,9 @@ public :
     void GetRecoverNum(int32_t bucket_id, RecoverBlockNum* recover_num);
     void ListRecover(RecoverBlockSet* recover_blocks);
     void MarkIncomplete(int64_t block_id);
+    bool MarkRebalance(int64_t block_id, int32_t src_id);
+    void MarkEcBlock(int64_t block_id, int64_t group_id, int32_t data_num, int32_t parity_num);
+    void PickEcRecoverBlocks(int32_t cs_id, int32_t block_num, std::vector<int64_t>* blocks);
 private:
     int32_t GetBucketOffset(int64_t block_id);
 private:
@@ -17,6 +17,9 @@ DECLARE_int32(keepalive_timeout);
 DECLARE_int32(chunkserver_max_pending_buffers);
 DECLARE_int32(recover_speed);
 DECLARE_int32(recover_dest_limit);
+DECLARE_int32(recover_node_bandwidth);
+DECLARE_int32(recover_rack_bandwidth);
+DECLARE_int32(rebalance_threshold);
 DECLARE_int32(heartbeat_interval);
 DECLARE_bool(select_chunkserver_by_zone);
 DECLARE_bool(select_chunkserver_by_tag);
@@ -32,7 +35,10 @@ ChunkServerManager::ChunkServerManager(ThreadPool* thread_pool, BlockMappingMana
     : thread_pool_(thread_pool),
       block_mapping_manager_(block_mapping_manager),
       chunkserver_num_(0),
-      next_chunkserver_id_(1) {
+      next_chunkserver_id_(1),
+      recover_planner_(static_cast<int64_t>(FLAGS_recover_node_bandwidth) << 20,
+                       static_cast<int64_t>(FLAGS_recover_rack_bandwidth) << 20),
+      rebalancer_(FLAGS_rebalance_threshold / 100.0) {
     memset(&stats_, 0, sizeof(stats_));
     thread_pool_->AddTask(boost::bind(&ChunkServerManager::DeadCheck, this));
     thread_pool_->AddTask(boost::bind(&ChunkServerManager::LogStats, this));
@@ -42,6 +48,9 @@ ChunkServerManager::ChunkServerManager(ThreadPool* thread_pool, BlockMappingMana
     params_.set_report_size(FLAGS_blockreport_size);
     params_.set_recover_size(FLAGS_recover_speed);
     params_.set_keepalive_timeout(FLAGS_keepalive_timeout);
+    params_.set_recover_node_bandwidth(FLAGS_recover_node_bandwidth);
+    params_.set_recover_rack_bandwidth(FLAGS_recover_rack_bandwidth);
+    params_.set_rebalance_threshold(FLAGS_rebalance_threshold);
     LOG(INFO, "Localhost: %s, localzone: %s",
         localhostname_.c_str(), localzone_.c_str());
 }
@@ -56,6 +65,7 @@ void ChunkServerManager::CleanChunkServer(ChunkServerInfo* cs, const std::string
     ChunkServerBlockMap* cs_block_map = it->second;
     MutexLock cs_block_map_lock(cs_block_map->mu);
     std::swap(blocks, cs_block_map->blocks);
+    recover_planner_.RemoveNode(id);
     LOG(INFO, "Remove ChunkServer C%d %s %s, cs_num=%d",
             cs->id(), cs->address().c_str(), reason.c_str(), chunkserver_num_);
     cs->set_status(kCsCleaning);
@@ -181,6 +191,10 @@ bool ChunkServerManager::HandleRegister(const std::string& ip,
                 cs_id, address.c_str(), chunkserver_num_, it->second->report_id);
         }
     }
+    ChunkServerInfo* info = NULL;
+    if (status == kOK && GetChunkServerPtr(cs_id, &info)) {
+        info->set_ssd_quota(request->ssd_quota());
+    }
     response->set_chunkserver_id(cs_id);
     response->set_report_interval(FLAGS_blockreport_interval);
     response->set_report_size(FLAGS_blockreport_size);
@@ -233,6 +247,7 @@ void ChunkServerManager::HandleHeartBeat(const HeartBeatRequest* request, HeartB
     info->set_r_qps(request->r_qps());
     info->set_r_speed(request->r_speed());
     info->set_recover_speed(request->recover_speed());
+    info->set_ssd_free(request->ssd_free());
     int32_t now_time = common::timer::now_time();
     heartbeat_list_[now_time].insert(info);
     info->set_last_heartbeat(now_time);
@@ -267,6 +282,14 @@ double ChunkServerManager::GetChunkServerLoad(ChunkServerInfo* cs) {
     return (data_score * data_score + pending_score) / 2;
 }
 
+bool ChunkServerManager::HasSsdSpace(const ChunkServerInfo* cs) {
+    return cs->ssd_quota() > 0 && cs->ssd_free() > std::max(cs->ssd_quota() / 20, 1L << 30);
+}
+
+bool ChunkServerManager::HasHdd(const ChunkServerInfo* cs) {
+    return cs->disk_quota() > cs->ssd_quota();
+}
+
 void ChunkServerManager::RandomSelect(std::vector<std::pair<double, ChunkServerInfo*> >* loads,
                                       int num) {
     std::sort(loads->begin(), loads->end());
@@ -284,7 +307,8 @@ void ChunkServerManager::RandomSelect(std::vector<std::pair<double, ChunkServerI
 
 bool ChunkServerManager::GetChunkServerChains(int num,
                           std::vector<std::pair<int32_t,std::string> >* chains,
-                          const std::string& client_address) {
+                          const std::string& client_address,
+                          MediaPolicy policy, std::vector<StorageMedia>* media) {
     MutexLock lock(&mu_, "GetChunkServerChains", 10);
     if (num > chunkserver_num_) {
         LOG(INFO, "not enough alive chunkservers [%ld] for GetChunkServerChains [%d]\n",
@@ -307,6 +331,7 @@ bool ChunkServerManager::GetChunkServerChains(int num,
     }
     std::map<int32_t, std::set<ChunkServerInfo*> >::iterator it = heartbeat_list_.begin();
     std::vector<std::pair<double, ChunkServerInfo*> > loads;
+    std::vector<std::pair<double, ChunkServerInfo*> > others;   ///< no room on the media
 
     for (; it != heartbeat_list_.end(); ++it) {
         std::set<ChunkServerInfo*>& set = it->second;
@@ -321,7 +346,11 @@ bool ChunkServerManager::GetChunkServerChains(int num,
             if (load <= kChunkServerLoadMax) {
                 double local_factor =
                     (cs == local_cs ? FLAGS_select_chunkserver_local_factor : 0) ;
-                loads.push_back(std::make_pair(load - local_factor, cs));
+                if ((policy == kAllSsd && !HasSsdSpace(cs)) || (policy == kAllHdd && !HasHdd(cs))) {
+                    others.push_back(std::make_pair(load - local_factor, cs));
+                } else {
+                    loads.push_back(std::make_pair(load - local_factor, cs));
+                }
             } else {
                 LOG(DEBUG, "Alloc ignore: ChunkServer %s data %ld/%ld buffer %d",
                     cs->address().c_str(), cs->data_size(),
@@ -329,12 +358,28 @@ bool ChunkServerManager::GetChunkServerChains(int num,
             }
         }
     }
+    if ((int)loads.size() < num && (int)(loads.size() + others.size()) >= num) {
+        // Fill up with the least loaded chunkservers on other media
+        LOG(INFO, "Only %lu chunkservers fit %s, %d replicas on other media",
+            loads.size(), MediaPolicy_Name(policy).c_str(), num - (int)loads.size());
+        std::sort(others.begin(), others.end());
+        loads.insert(loads.end(), others.begin(), others.begin() + (num - loads.size()));
+    }
     if ((int)loads.size() < num) {
         LOG(DEBUG, "Only %ld chunkserver of %d is not over overladen, GetChunkServerChains(%d) return false",
             loads.size(), chunkserver_num_, num);
         return false;
     }
     RandomSelect(&loads, num);
+    if (policy == kOneSsd) {
+        // The least loaded chunkserver with ssd space heads the chain
+        for (size_t i = 0; i < loads.size(); i++) {
+            if (HasSsdSpace(loads[i].second)) {
+                std::rotate(loads.begin(), loads.begin() + i, loads.begin() + i + 1);
+                break;
+            }
+        }
+    }
 
     if (FLAGS_select_chunkserver_by_zone) {
         int count = SelectChunkServerByZone(num, loads, chains);
@@ -348,10 +393,27 @@ bool ChunkServerManager::GetChunkServerChains(int num,
             chains->push_back(std::make_pair(cs->id(), cs->address()));
         }
     }
+    if (media && policy != kMediaPolicyAny) {
+        bool ssd_used = false;
+        for (size_t i = 0; i < chains->size(); i++) {
+            ChunkServerInfo* cs = NULL;
+            bool has_ssd = GetChunkServerPtr((*chains)[i].first, &cs) && HasSsdSpace(cs);
+            StorageMedia replica_media = kMediaHdd;
+            if (policy == kAllSsd) {
+                // Left to the chunkserver's placement if it has no ssd space
+                replica_media = has_ssd ? kMediaSsd : kMediaAny;
+            } else if (policy == kOneSsd && has_ssd && !ssd_used) {
+                replica_media = kMediaSsd;
+                ssd_used = true;
+            }
+            media->push_back(replica_media);
+        }
+    }
     return true;
 }
 
-bool ChunkServerManager::GetRecoverChains(const std::set<int32_t>& replica,
+bool ChunkServerManager::GetRecoverChains(ChunkServerInfo* src, int64_t block_size,
+                                          const std::set<int32_t>& replica,
                                           std::vector<std::string>* chains) {
     mu_.AssertHeld();
     std::map<int32_t, std::set<ChunkServerInfo*> >::iterator it = heartbeat_list_.begin();
@@ -414,12 +476,25 @@ bool ChunkServerManager::GetRecoverChains(const std::set<int32_t>& replica,
             return false;
         }
     }
-    RandomSelect(&loads, FLAGS_recover_dest_limit);
-    for (int i = 0; i < static_cast<int>(loads.size()) && i < FLAGS_recover_dest_limit; ++i) {
+    std::vector<RecoverPlanner::Node> candidates;
+    for (size_t i = 0; i < loads.size(); ++i) {
         ChunkServerInfo* cs = loads[i].second;
-        chains->push_back(cs->address());
+        candidates.push_back(RecoverPlanner::Node(cs->id(), cs->rack(), loads[i].first));
     }
-    return true;
+    std::vector<int32_t> dests;
+    if (!recover_planner_.Plan(RecoverPlanner::Node(src->id(), src->rack(), src->load()),
+                               block_size, candidates, FLAGS_recover_dest_limit,
+                               common::timer::get_micros(), &dests)) {
+        LOG(DEBUG, "Recover chain for C%d over bandwidth budget", src->id());
+        return false;
+    }
+    for (size_t i = 0; i < dests.size(); ++i) {
+        ChunkServerInfo* cs = NULL;
+        if (GetChunkServerPtr(dests[i], &cs)) {
+            chains->push_back(cs->address());
+        }
+    }
+    return !chains->empty();
 }
 int ChunkServerManager::SelectChunkServerByZone(int num,
         const std::vector<std::pair<double, ChunkServerInfo*> >& loads,
@@ -571,10 +646,29 @@ void ChunkServerManager::SetParam(const Params& p) {
     if (p.keepalive_timeout() != -1) {
         params_.set_keepalive_timeout(p.keepalive_timeout());
     }
+    if (p.recover_node_bandwidth() != -1 || p.recover_rack_bandwidth() != -1) {
+        if (p.recover_node_bandwidth() != -1) {
+            params_.set_recover_node_bandwidth(p.recover_node_bandwidth());
+        }
+        if (p.recover_rack_bandwidth() != -1) {
+            params_.set_recover_rack_bandwidth(p.recover_rack_bandwidth());
+        }
+        recover_planner_.SetBandwidth(
+                static_cast<int64_t>(params_.recover_node_bandwidth()) << 20,
+                static_cast<int64_t>(params_.recover_rack_bandwidth()) << 20);
+    }
+    if (p.rebalance_threshold() != -1) {
+        params_.set_rebalance_threshold(p.rebalance_threshold());
+        rebalancer_.SetThreshold(params_.rebalance_threshold() / 100.0);
+    }
     LOG(INFO, "SetParam to report_interval = %d report_size = %d "
-              "recover_size = %d keepalive_timeout = %d",
+              "recover_size = %d keepalive_timeout = %d "
+              "recover_node_bandwidth = %dMB/s recover_rack_bandwidth = %dMB/s "
+              "rebalance_threshold = %d%%",
             params_.report_interval(), params_.report_size(),
-            params_.recover_size(), params_.keepalive_timeout());
+            params_.recover_size(), params_.keepalive_timeout(),
+            params_.recover_node_bandwidth(), params_.recover_rack_bandwidth(),
+            params_.rebalance_threshold());
 }
 
 void ChunkServerManager::RemoveBlock(int32_t id, int64_t block_id) {
@@ -595,21 +689,43 @@ void ChunkServerManager::PickRecoverBlocks(int cs_id, RecoverVec* recover_blocks
         if (!GetChunkServerPtr(cs_id, &cs)) {
             return;
         }
+        if (!recover_planner_.HasBudget(RecoverPlanner::Node(cs->id(), cs->rack(), cs->load()),
+                                        common::timer::get_micros())) {
+            LOG(DEBUG, "C%d is out of recover bandwidth budget", cs_id);
+            return;
+        }
     }
     std::vector<std::pair<int64_t, std::set<int32_t> > > blocks;
     int64_t before_pick = common::timer::get_micros();
     block_mapping_manager_->PickRecoverBlocks(cs_id, params_.recover_size() - cs->pending_recover(),
                                               &blocks, hi_num, hi_only);
     int64_t before_get_recover_chain = common::timer::get_micros();
-    for (std::vector<std::pair<int64_t, std::set<int32_t> > >::iterator it = blocks.begin();
-         it != blocks.end(); ++it) {
+    // Plan blocks with fewer live replicas first, so they get the bandwidth budget
+    std::vector<RecoverItem> items(blocks.size());
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        NSBlock nsblock;
+        items[i].block_id = blocks[i].first;
+        items[i].replica.swap(blocks[i].second);
+        if (block_mapping_manager_->GetBlock(items[i].block_id, &nsblock)) {
+            items[i].block_size = nsblock.block_size;
+        }
+    }
+    int hi_picked = std::min(*hi_num, static_cast<int>(items.size()));
+    RecoverPlanner::SortByRedundancy(items.begin(), items.begin() + hi_picked);
+    RecoverPlanner::SortByRedundancy(items.begin() + hi_picked, items.end());
+    for (size_t i = 0; i < items.size(); ++i) {
+        const RecoverItem& item = items[i];
         MutexLock lock(&mu_);
-        recover_blocks->push_back(std::make_pair((*it).first, std::vector<std::string>()));
-        if (GetRecoverChains((*it).second, &(recover_blocks->back().second))) {
+        recover_blocks->push_back(std::make_pair(item.block_id, std::vector<std::string>()));
+        if (GetRecoverChains(cs, item.block_size, item.replica,
+                             &(recover_blocks->back().second))) {
             //
         } else {
-            block_mapping_manager_->ProcessRecoveredBlock(cs_id, (*it).first, kGetChunkServerError);
+            block_mapping_manager_->ProcessRecoveredBlock(cs_id, item.block_id, kGetChunkServerError);
             recover_blocks->pop_back();
+            if (static_cast<int>(i) < hi_picked) {
+                --(*hi_num);
+            }
         }
     }
     int64_t after_get_recover_chain = common::timer::get_micros();
@@ -626,6 +742,156 @@ void ChunkServerManager::PickRecoverBlocks(int cs_id, RecoverVec* recover_blocks
     }
 }
 
+void ChunkServerManager::PickEcRecoverBlocks(int cs_id, int picked,
+                                             std::vector<EcRecoverItem>* ec_blocks) {
+    int32_t block_num = 0;
+    {
+        MutexLock lock(&mu_, "PickEcRecoverBlocks 1", 10);
+        ChunkServerInfo* cs = NULL;
+        if (!GetChunkServerPtr(cs_id, &cs)) {
+            return;
+        }
+        block_num = params_.recover_size() - cs->pending_recover() - picked;
+    }
+    if (block_num <= 0) {
+        return;
+    }
+    std::vector<int64_t> blocks;
+    block_mapping_manager_->PickEcRecoverBlocks(cs_id, block_num, &blocks);
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        int64_t block_id = blocks[i];
+        NSBlock nsblock;
+        if (!block_mapping_manager_->GetBlock(block_id, &nsblock) || nsblock.ec_group < 0) {
+            continue;
+        }
+        EcRecoverItem item;
+        item.block_id = block_id;
+        item.group_id = nsblock.ec_group;
+        item.data_num = nsblock.ec_data_num;
+        item.parity_num = nsblock.ec_parity_num;
+        item.block_size = nsblock.block_size;
+        item.version = nsblock.version;
+        // The new unit must not share a chunkserver with the others
+        std::set<int32_t> holders;
+        std::vector<int32_t> unit_cs(item.data_num + item.parity_num, -1);
+        item.sizes.assign(unit_cs.size(), 0);
+        int32_t alive = 0;
+        for (int32_t u = 0; u < item.data_num + item.parity_num; ++u) {
+            std::vector<int32_t> replica;
+            int64_t unit_size = 0;
+            RecoverStat rs;
+            if (item.group_id + u == block_id
+                || !block_mapping_manager_->GetLocatedBlock(item.group_id + u, &replica,
+                                                            &unit_size, &rs)
+                || replica.empty()) {
+                continue;
+            }
+            unit_cs[u] = replica[0];
+            item.sizes[u] = unit_size;
+            holders.insert(replica.begin(), replica.end());
+            ++alive;
+        }
+        if (alive < item.data_num) {
+            // Left to the recover timeout, the other units may come back by then
+            LOG(WARNING, "Can't rebuild #%ld of group #%ld, only %d units alive",
+                block_id, item.group_id, alive);
+            continue;
+        }
+        MutexLock lock(&mu_);
+        ChunkServerInfo* cs = NULL;
+        if (!GetChunkServerPtr(cs_id, &cs)
+            || !GetRecoverChains(cs, item.block_size, holders, &item.dests)) {
+            block_mapping_manager_->ProcessRecoveredBlock(cs_id, block_id, kGetChunkServerError);
+            continue;
+        }
+        for (size_t u = 0; u < unit_cs.size(); ++u) {
+            ChunkServerInfo* unit_server = NULL;
+            item.sources.push_back(unit_cs[u] >= 0 && GetChunkServerPtr(unit_cs[u], &unit_server)
+                                   ? unit_server->address() : "");
+        }
+        ec_blocks->push_back(item);
+    }
+}
+
+void ChunkServerManager::PickRebalanceBlocks(int cs_id, RecoverVec* rebalance_blocks) {
+    int32_t max_moves = 0;
+    {
+        MutexLock lock(&mu_, "PickRebalanceBlocks 1", 10);
+        ChunkServerInfo* cs = NULL;
+        if (rebalancer_.Threshold() <= 0 || !GetChunkServerPtr(cs_id, &cs)
+            || cs->status() != kCsActive) {
+            return;
+        }
+        max_moves = params_.recover_size() - cs->pending_recover();
+    }
+    if (max_moves <= 0) {
+        return;
+    }
+    // Sample candidates from a random point of the chunkserver's block list
+    std::vector<int64_t> sample;
+    ChunkServerBlockMap* cs_block_map = NULL;
+    if (!GetChunkServerBlockMapPtr(chunkserver_block_map_, cs_id, &cs_block_map)) {
+        return;
+    }
+    {
+        MutexLock lock(cs_block_map->mu);
+        const std::set<int64_t>& blocks = cs_block_map->blocks;
+        if (blocks.empty()) {
+            return;
+        }
+        int64_t first = *blocks.begin();
+        int64_t span = *blocks.rbegin() - first + 1;
+        std::set<int64_t>::const_iterator it = blocks.lower_bound(first + rand() % span);
+        for (size_t i = 0; i < blocks.size() && sample.size() < 4U * max_moves; ++i) {
+            if (it == blocks.end()) {
+                it = blocks.begin();
+            }
+            sample.push_back(*it++);
+        }
+    }
+    std::vector<RecoverItem> items;
+    for (size_t i = 0; i < sample.size(); ++i) {
+        NSBlock nsblock;
+        if (!block_mapping_manager_->GetBlock(sample[i], &nsblock)
+            || nsblock.recover_stat != kNotInRecover || nsblock.block_size <= 0
+            || nsblock.replica.size() != nsblock.expect_replica_num) {
+            continue;
+        }
+        items.push_back(RecoverItem());
+        items.back().block_id = nsblock.id;
+        items.back().block_size = nsblock.block_size;
+        items.back().replica.swap(nsblock.replica);
+    }
+    MutexLock lock(&mu_, "PickRebalanceBlocks 2", 10);
+    ChunkServerInfo* src = NULL;
+    if (items.empty() || !GetChunkServerPtr(cs_id, &src)) {
+        return;
+    }
+    std::vector<Rebalancer::Server> servers;
+    for (ServerMap::iterator it = chunkservers_.begin(); it != chunkservers_.end(); ++it) {
+        ChunkServerInfo* cs = it->second;
+        if (cs->is_dead() || cs->status() != kCsActive || cs->zone() != localzone_) {
+            continue;
+        }
+        servers.push_back(Rebalancer::Server(cs->id(), cs->rack(),
+                                             cs->data_size(), cs->disk_quota()));
+    }
+    std::vector<RebalanceMove> moves;
+    rebalancer_.Plan(Rebalancer::Server(src->id(), src->rack(), src->data_size(),
+                                        src->disk_quota()),
+                     servers, items, max_moves, &recover_planner_,
+                     common::timer::get_micros(), &moves);
+    for (size_t i = 0; i < moves.size(); ++i) {
+        ChunkServerInfo* dest = NULL;
+        if (!GetChunkServerPtr(moves[i].dest, &dest)
+            || !block_mapping_manager_->MarkRebalance(moves[i].block_id, cs_id)) {
+            continue;
+        }
+        rebalance_blocks->push_back(
+            std::make_pair(moves[i].block_id, std::vector<std::string>(1, dest->address())));
+    }
+}
+
 void ChunkServerManager::GetStat(int32_t* w_qps, int64_t* w_speed,
                                  int32_t* r_qps, int64_t* r_speed, int64_t* recover_speed) {
     if (w_qps) *w_qps = stats_.w_qps;
@@ -8,6 +8,8 @@
 #include <common/thread_pool.h>
 #include "proto/nameserver.pb.h"
 #include "proto/status_code.pb.h"
+#include "nameserver/rebalancer.h"
+#include "nameserver/recover_planner.h"
 
 namespace baidu {
 namespace bfs {
@@ -17,6 +19,19 @@ const double kChunkServerLoadMax = 0.999999;
 class BlockMappingManager;
 typedef  std::vector<std::pair<int64_t, std::vector<std::string> > > RecoverVec;
 
+/// A lost unit of an erasure coded group, where to rebuild it and what to read
+struct EcRecoverItem {
+    int64_t block_id;
+    int64_t group_id;
+    int32_t data_num;
+    int32_t parity_num;
+    int64_t block_size;
+    int64_t version;
+    std::vector<std::string> dests;
+    std::vector<std::string> sources;   ///< one per unit, empty for lost ones
+    std::vector<int64_t> sizes;         ///< block size of every unit
+};
+
 class ChunkServerManager {
 public:
     struct Stats {
@@ -32,9 +47,14 @@ public:
                         RegisterResponse* response);
     void HandleHeartBeat(const HeartBeatRequest* request, HeartBeatResponse* response);
     void ListChunkServers(::google::protobuf::RepeatedPtrField<ChunkServerInfo>* chunkservers);
+    /// Chunkservers for a new block, and the media of each replica by policy.
+    /// Chunkservers without room on the media are used only if there are not enough others.
     bool GetChunkServerChains(int num, std::vector<std::pair<int32_t,std::string> >* chains,
-                              const std::string& client_address);
-    bool GetRecoverChains(const std::set<int32_t>& replica, std::vector<std::string>* chains);
+                              const std::string& client_address,
+                              MediaPolicy policy = kMediaPolicyAny,
+                              std::vector<StorageMedia>* media = NULL);
+    bool GetRecoverChains(ChunkServerInfo* src, int64_t block_size,
+                          const std::set<int32_t>& replica, std::vector<std::string>* chains);
     int32_t AddChunkServer(const std::string& address, const std::string& ip,
                            const std::string& tag, int64_t quota);
     bool KickChunkServer(int cs_id);
@@ -46,6 +66,10 @@ public:
     void RemoveBlock(int32_t id, int64_t block_id);
     void CleanChunkServer(ChunkServerInfo* cs, const std::string& reason);
     void PickRecoverBlocks(int cs_id,  RecoverVec* recover_blocks, int* hi_num, bool hi_only);
+    /// Pick lost erasure coded units for cs_id to rebuild, after picked other recover blocks
+    void PickEcRecoverBlocks(int cs_id, int picked, std::vector<EcRecoverItem>* ec_blocks);
+    /// Pick replicas on an over used cs_id to copy to emptier chunkservers
+    void PickRebalanceBlocks(int cs_id, RecoverVec* rebalance_blocks);
     void GetStat(int32_t* w_qps, int64_t* w_speed, int32_t* r_qps,
                  int64_t* r_speed, int64_t* recover_speed);
     StatusCode ShutdownChunkServer(const::google::protobuf::RepeatedPtrField<std::string>& chunkserver_address);
@@ -66,6 +90,10 @@ private:
         }
     };
     double GetChunkServerLoad(ChunkServerInfo* cs);
+    /// Has room for a replica on ssd
+    static bool HasSsdSpace(const ChunkServerInfo* cs);
+    /// Has store paths that are not ssd
+    static bool HasHdd(const ChunkServerInfo* cs);
     void DeadCheck();
     void RandomSelect(std::vector<std::pair<double, ChunkServerInfo*> >* loads, int num);
     bool GetChunkServerPtr(int32_t cs_id, ChunkServerInfo** cs);
@@ -97,6 +125,8 @@ private:
 
     // for chunkserver
     Params params_;
+    RecoverPlanner recover_planner_;    /// guarded by mu_
+    Rebalancer rebalancer_;             /// guarded by mu_
 };
 
 
@@ -6,6 +6,7 @@
 
 #include "nameserver_impl.h"
 
+#include <fcntl.h>
 #include <set>
 #include <map>
 #include <sstream>
@@ -24,6 +25,8 @@
 #include "nameserver/sync.h"
 #include "nameserver/chunkserver_manager.h"
 #include "nameserver/namespace.h"
+#include "nameserver/transcoder.h"
+#include "ec/ec_layout.h"
 
 #include "proto/status_code.pb.h"
 
@@ -39,6 +42,18 @@ DECLARE_int32(hi_recover_timeout);
 DECLARE_int32(lo_recover_timeout);
 DECLARE_int32(block_report_timeout);
 DECLARE_bool(clean_redundancy);
+DECLARE_int32(ec_max_units);
+DECLARE_int32(stripe_max_width);
+DECLARE_int32(ec_transcode_age);
+DECLARE_int32(ec_transcode_min_size);
+DECLARE_int32(ec_transcode_data_num);
+DECLARE_int32(ec_transcode_parity_num);
+DECLARE_int32(ec_transcode_cell_size);
+DECLARE_int32(ec_transcode_max_tasks);
+DECLARE_int32(ec_transcode_interval);
+DECLARE_int32(ec_transcode_scan_num);
+DECLARE_int32(ec_transcode_timeout);
+DECLARE_int32(nameserver_append_lease);
 
 namespace baidu {
 namespace bfs {
@@ -63,12 +78,19 @@ NameServerImpl::NameServerImpl(Sync* sync) : readonly_(true),
     heartbeat_thread_pool_ = new common::ThreadPool(FLAGS_nameserver_heartbeat_thread_num);
     chunkserver_manager_ = new ChunkServerManager(work_thread_pool_, block_mapping_manager_);
     namespace_ = new NameSpace(false);
+    transcoder_ = new Transcoder(FLAGS_ec_transcode_age,
+                                 static_cast<int64_t>(FLAGS_ec_transcode_min_size) << 20,
+                                 FLAGS_ec_transcode_max_tasks);
     if (sync_) {
         sync_->Init(boost::bind(&NameSpace::TailLog, namespace_, _1));
     }
     CheckLeader();
     start_time_ = common::timer::get_micros();
     read_thread_pool_->AddTask(boost::bind(&NameServerImpl::LogStatus, this));
+    if (FLAGS_ec_transcode_age > 0) {
+        work_thread_pool_->DelayTask(FLAGS_ec_transcode_interval * 1000,
+            boost::bind(&NameServerImpl::TranscodeColdFiles, this));
+    }
 }
 
 NameServerImpl::~NameServerImpl() {
@@ -296,6 +318,10 @@ void NameServerImpl::BlockReport(::google::protobuf::RpcController* controller,
         int hi_num = 0;
         chunkserver_manager_->PickRecoverBlocks(cs_id, &recover_blocks,
                                                 &hi_num, recover_mode_ == kHiOnly);
+        if (recover_blocks.empty() && recover_mode_ == kRecoverAll) {
+            // Spare recover capacity goes to moving replicas off over used servers
+            chunkserver_manager_->PickRebalanceBlocks(cs_id, &recover_blocks);
+        }
         int32_t priority = 0;
         for (std::vector<std::pair<int64_t, std::vector<std::string> > >::iterator it =
                 recover_blocks.begin(); it != recover_blocks.end(); ++it) {
@@ -306,14 +332,68 @@ void NameServerImpl::BlockReport(::google::protobuf::RpcController* controller,
                  dest_it != (*it).second.end(); ++dest_it) {
                 rep->add_chunkserver_address(*dest_it);
             }
+            // All live replicas, so the dest can pull from them in parallel
+            std::vector<int32_t> replica;
+            int64_t block_size = 0;
+            RecoverStat rs;
+            if (block_mapping_manager_->GetLocatedBlock((*it).first, &replica, &block_size, &rs)) {
+                for (uint32_t i = 0; i < replica.size(); i++) {
+                    std::string addr = chunkserver_manager_->GetChunkServerAddr(replica[i]);
+                    if (!addr.empty()) {
+                        rep->add_source_address(addr);
+                    }
+                }
+            }
             rep->set_recover_timeout(priority < hi_num ?
                                      FLAGS_hi_recover_timeout : FLAGS_lo_recover_timeout);
             ++priority;
         }
+        // Lost units of erasure coded files are rebuilt on a new chunkserver
+        std::vector<EcRecoverItem> ec_blocks;
+        chunkserver_manager_->PickEcRecoverBlocks(cs_id, response->new_replicas_size(),
+                                                  &ec_blocks);
+        for (size_t i = 0; i < ec_blocks.size(); ++i) {
+            const EcRecoverItem& item = ec_blocks[i];
+            ReplicaInfo* rep = response->add_new_replicas();
+            rep->set_block_id(item.block_id);
+            rep->set_block_size(item.block_size);
+            rep->set_block_version(item.version);
+            rep->set_priority(true);
+            rep->set_recover_timeout(FLAGS_hi_recover_timeout);
+            for (size_t j = 0; j < item.dests.size(); ++j) {
+                rep->add_chunkserver_address(item.dests[j]);
+            }
+            rep->mutable_ec()->set_data_num(item.data_num);
+            rep->mutable_ec()->set_parity_num(item.parity_num);
+            rep->set_ec_group_id(item.group_id);
+            for (size_t j = 0; j < item.sources.size(); ++j) {
+                rep->add_ec_source_address(item.sources[j]);
+                rep->add_ec_unit_size(item.sizes[j]);
+            }
+        }
         LOG(INFO, "Response to C%d %s new_replicas_size= %d",
             cs_id, request->chunkserver_addr().c_str(), response->new_replicas_size());
     }
     block_mapping_manager_->GetCloseBlocks(cs_id, response->mutable_close_blocks());
+
+    // Cold files this chunkserver holds a replica of go to erasure code
+    std::vector<TranscodeTask> transcodes;
+    transcoder_->TakeTasks(cs_id, &transcodes);
+    int32_t now_time = common::timer::now_time();
+    for (size_t i = 0; i < transcodes.size(); ++i) {
+        const TranscodeTask& task = transcodes[i];
+        TranscodeInfo* info = response->add_transcode_blocks();
+        info->set_block_id(task.block_id);
+        info->set_block_version(task.file_info.version());
+        info->mutable_ec()->CopyFrom(task.ec);
+        info->set_ec_group_id(task.group_id);
+        for (size_t j = 0; j < task.units.size(); ++j) {
+            info->add_chunkserver_address(chunkserver_manager_->GetChunkServerAddr(task.units[j]));
+        }
+        info->set_timeout(std::max<int64_t>(1, task.start_time + FLAGS_ec_transcode_timeout
+                                               - now_time));
+        LOG(INFO, "Transcode #%ld to group #%ld on C%d", task.block_id, task.group_id, cs_id);
+    }
     int64_t end_report = common::timer::get_micros();
     static __thread int64_t last_warning = 0;
     if (end_report - start_report > 1000 * 1000) {
@@ -348,6 +428,31 @@ void NameServerImpl::PushBlockReport(::google::protobuf::RpcController* controll
     done->Run();
 }
 
+void NameServerImpl::TranscodeReport(::google::protobuf::RpcController* controller,
+                   const TranscodeReportRequest* request,
+                   TranscodeReportResponse* response,
+                   ::google::protobuf::Closure* done) {
+    if (!is_leader_) {
+        response->set_status(kIsFollower);
+        done->Run();
+        return;
+    }
+    response->set_sequence_id(request->sequence_id());
+    int64_t block_id = request->block_id();
+    bool ok = request->status() == kOK;
+    TranscodeTask task;
+    if (!transcoder_->Report(block_id, request->ec_group_id(), ok, &task)) {
+        LOG(INFO, "TranscodeReport C%d #%ld group #%ld not running",
+            request->chunkserver_id(), block_id, request->ec_group_id());
+    } else if (!ok) {
+        LOG(INFO, "Transcode #%ld to group #%ld fail %s", block_id, request->ec_group_id(),
+            StatusCode_Name(request->status()).c_str());
+        RemoveTranscodeUnits(task);
+    }
+    response->set_status(kOK);
+    done->Run();
+}
+
 void NameServerImpl::CreateFile(::google::protobuf::RpcController* controller,
                         const CreateFileRequest* request,
                         CreateFileResponse* response,
@@ -366,9 +471,30 @@ void NameServerImpl::CreateFile(::google::protobuf::RpcController* controller,
         mode = 0644;    // default mode
     }
     int replica_num = request->replica_num();
+    const EcLayout* ec = request->has_ec() ? &request->ec() : NULL;
+    if (ec && (ec->data_num() <= 0 || ec->parity_num() <= 0 || ec->cell_size() <= 0
+               || ec->data_num() + ec->parity_num() > FLAGS_ec_max_units)) {
+        LOG(INFO, "Create %s with bad erasure code RS(%d,%d) cell %d", path.c_str(),
+            ec->data_num(), ec->parity_num(), ec->cell_size());
+        response->set_status(kBadParameter);
+        done->Run();
+        return;
+    }
+    const StripeLayout* stripe = request->has_stripe() ? &request->stripe() : NULL;
+    if (stripe && (ec || stripe->width() < 2 || stripe->width() > FLAGS_stripe_max_width
+                   || stripe->unit_size() <= 0)) {
+        LOG(INFO, "Create %s with bad stripe width %d unit %d", path.c_str(),
+            stripe->width(), stripe->unit_size());
+        response->set_status(kBadParameter);
+        done->Run();
+        return;
+    }
     NameServerLog log;
     std::vector<int64_t> blocks_to_remove;
-    StatusCode status = namespace_->CreateFile(path, flags, mode, replica_num, &blocks_to_remove, &log);
+    FileInfo sealed_info;
+    StatusCode status = namespace_->CreateFile(path, flags, mode, replica_num,
+                                               &blocks_to_remove, &log, ec, stripe,
+                                               &sealed_info);
     for (size_t i = 0; i < blocks_to_remove.size(); i++) {
         block_mapping_manager_->RemoveBlock(blocks_to_remove[i]);
     }
@@ -380,11 +506,74 @@ void NameServerImpl::CreateFile(::google::protobuf::RpcController* controller,
         done->Run();
         return;
     }
+    if ((flags & O_APPEND) && !(flags & O_TRUNC)) {
+        SetAppendBlock(path, sealed_info, response);
+        if (sealed_info.blocks_size() > 0) {
+            // Only FinishBlock seals the file again, a writer that dies would keep it open
+            work_thread_pool_->DelayTask(FLAGS_nameserver_append_lease * 1000,
+                boost::bind(&NameServerImpl::ExpireAppend, this, path, sealed_info,
+                            static_cast<int64_t>(time(NULL))));
+        }
+    }
     LogRemote(log, boost::bind(&NameServerImpl::SyncLogCallback, this,
                                controller, request, response, done,
                                (std::vector<FileInfo>*)NULL, _1));
 }
 
+void NameServerImpl::SetAppendBlock(const std::string& path, const FileInfo& file_info,
+                                    CreateFileResponse* response) {
+    if (file_info.blocks_size() == 0) {
+        return;
+    }
+    int last = file_info.blocks_size() - 1;
+    int64_t block_id = file_info.blocks(last);
+    int64_t offset = 0;
+    for (int i = 0; i < file_info.block_sizes_size() && i < last; i++) {
+        offset += file_info.block_sizes(i);
+    }
+    response->set_file_size(file_info.size());
+    response->set_last_block_version(file_info.version());
+    LocatedBlock* block = response->mutable_last_block();
+    block->set_block_id(block_id);
+    block->set_block_size(file_info.size() - offset);
+    block->set_offset(offset);
+    // Only a block all replicas of which have the file's version is reopened,
+    // a lagging replica would be left behind by the append
+    std::vector<int32_t> replica;
+    int64_t block_size = 0;
+    RecoverStat rs;
+    if (!block_mapping_manager_->GetLocatedBlock(block_id, &replica, &block_size, &rs)
+        || rs != kNotInRecover || block_size != block->block_size()
+        || static_cast<int32_t>(replica.size()) < file_info.replicas()
+        || block_mapping_manager_->CheckBlockVersion(block_id, file_info.version()) != kOK) {
+        LOG(INFO, "Append to %s in a new block, #%ld V%ld %ld R%lu",
+            path.c_str(), block_id, file_info.version(), block_size, replica.size());
+        return;
+    }
+    for (uint32_t i = 0; i < replica.size(); i++) {
+        std::string addr = chunkserver_manager_->GetChunkServerAddr(replica[i]);
+        if (addr == "") {
+            block->clear_chains();
+            return;
+        }
+        block->add_chains()->set_address(addr);
+    }
+    LOG(INFO, "Append to %s at #%ld V%ld %ld R%lu",
+        path.c_str(), block_id, file_info.version(), block_size, replica.size());
+}
+
+void NameServerImpl::ExpireAppend(const std::string& path, const FileInfo& sealed_info,
+                                  int64_t reopen_time) {
+    if (!is_leader_) {
+        return;
+    }
+    NameServerLog log;
+    if (namespace_->CancelReopen(path, sealed_info, reopen_time, &log)
+        && !LogRemote(log, boost::function<void (bool)>())) {
+        LOG(WARNING, "Seal %s again LogRemote fail", path.c_str());
+    }
+}
+
 bool NameServerImpl::LogRemote(const NameServerLog& log, boost::function<void (bool)> callback) {
     if (sync_ == NULL) {
         if (!callback.empty()) {
@@ -450,9 +639,31 @@ void NameServerImpl::AddBlock(::google::protobuf::RpcController* controller,
         return;
     }
 
-    if (file_info.blocks_size() > 0) {
+    /// index of the block the writer sealed, blocks after it are dropped
+    int prev = -1;
+    if (request->has_prev_block_id() && !file_info.has_ec() && !file_info.has_stripe()) {
+        for (int i = 0; i < file_info.blocks_size(); i++) {
+            if (file_info.blocks(i) == request->prev_block_id()) {
+                prev = i;
+                break;
+            }
+        }
+        if (prev < 0 || file_info.block_sizes_size() < prev) {
+            LOG(WARNING, "AddBlock for %s after unknown block #%ld",
+                path.c_str(), request->prev_block_id());
+            response->set_status(kNoPermission);
+            done->Run();
+            return;
+        }
+    }
+    if (file_info.blocks_size() > prev + 1) {
+        FileInfo dropped;
+        dropped.set_name(file_info.name());
+        for (int i = prev + 1; i < file_info.blocks_size(); i++) {
+            dropped.add_blocks(file_info.blocks(i));
+        }
         std::map<int64_t, std::set<int32_t> > block_cs;
-        block_mapping_manager_->RemoveBlocksForFile(file_info, &block_cs);
+        block_mapping_manager_->RemoveBlocksForFile(dropped, &block_cs);
         for (std::map<int64_t, std::set<int32_t> >::iterator it = block_cs.begin();
                 it != block_cs.end(); ++it) {
             const std::set<int32_t>& cs = it->second;
@@ -460,23 +671,71 @@ void NameServerImpl::AddBlock(::google::protobuf::RpcController* controller,
                 chunkserver_manager_->RemoveBlock(*cs_it, it->first);
             }
         }
-        file_info.clear_blocks();
-    }
-    /// replica num
+        file_info.mutable_blocks()->Truncate(prev + 1);
+    }
+    file_info.mutable_block_sizes()->Truncate(std::max(prev, 0));
+    file_info.mutable_block_versions()->Truncate(std::max(prev, 0));
+    if (prev >= 0) {
+        file_info.add_block_sizes(request->prev_block_size());
+        file_info.add_block_versions(request->prev_block_version());
+    }
+    file_info.clear_cs_addrs();
+    /// An erasure coded group has one chunkserver per unit, on distinct chunkservers.
+    /// The units of a striped file are replicated blocks, with chains picked per unit.
+    bool is_ec = file_info.has_ec();
+    int unit_num = 1;
     int replica_num = file_info.replicas();
+    if (is_ec) {
+        unit_num = file_info.ec().data_num() + file_info.ec().parity_num();
+        replica_num = 1;
+    } else if (file_info.has_stripe()) {
+        unit_num = file_info.stripe().width();
+    }
     /// check lease for write
     std::vector<std::pair<int32_t, std::string> > chains;
+    std::vector<StorageMedia> media;
     common::timer::TimeChecker add_block_timer;
-    if (chunkserver_manager_->GetChunkServerChains(replica_num, &chains, request->client_address())) {
+    bool got_chains = true;
+    if (is_ec) {
+        got_chains = chunkserver_manager_->GetChunkServerChains(unit_num, &chains,
+                                                                request->client_address(),
+                                                                request->media_policy(), &media)
+                     && static_cast<int>(chains.size()) >= unit_num;
+    }
+    bool all_media = true;
+    for (int u = 0; !is_ec && got_chains && u < unit_num; u++) {
+        std::vector<std::pair<int32_t, std::string> > unit_chains;
+        std::vector<StorageMedia> unit_media;
+        got_chains = chunkserver_manager_->GetChunkServerChains(replica_num, &unit_chains,
+                                                                request->client_address(),
+                                                                request->media_policy(),
+                                                                &unit_media)
+                     && static_cast<int>(unit_chains.size()) >= replica_num;
+        if (!got_chains) {
+            break;
+        }
+        chains.insert(chains.end(), unit_chains.begin(), unit_chains.begin() + replica_num);
+        all_media = all_media && static_cast<int>(unit_media.size()) >= replica_num;
+        if (all_media) {
+            media.insert(media.end(), unit_media.begin(), unit_media.begin() + replica_num);
+        }
+    }
+    if (!all_media) {
+        media.clear();
+    }
+    if (got_chains) {
         add_block_timer.Check(50 * 1000, "GetChunkServerChains");
         NameServerLog log;
-        int64_t new_block_id = namespace_->GetNewBlockId(&log);
-        LOG(INFO, "[AddBlock] new block for %s #%ld R%d %s",
-            path.c_str(), new_block_id, replica_num, request->client_address().c_str());
-        file_info.add_blocks(new_block_id);
+        int64_t new_block_id = namespace_->GetNewBlockId(&log, unit_num);
+        LOG(INFO, "[AddBlock] new block for %s #%ld %s%d*%d %s",
+            path.c_str(), new_block_id, is_ec ? "EC" : "R", replica_num, unit_num,
+            request->client_address().c_str());
+        for (int i = 0; i < unit_num; i++) {
+            file_info.add_blocks(new_block_id + i);
+        }
         file_info.set_version(-1);
         ///TODO: Lost update? Get&Update not atomic.
-        for (int i = 0; i < replica_num; i++) {
+        for (int i = 0; i < unit_num * replica_num; i++) {
             file_info.add_cs_addrs(chunkserver_manager_->GetChunkServerAddr(chains[i].first));
         }
         if (!namespace_->UpdateFileInfo(file_info, &log)) {
@@ -485,19 +744,31 @@ void NameServerImpl::AddBlock(::google::protobuf::RpcController* controller,
         }
         LocatedBlock* block = response->mutable_block();
         std::vector<int32_t> replicas;
-        for (int i = 0; i < replica_num; i++) {
+        for (int i = 0; i < unit_num * replica_num; i++) {
             ChunkServerInfo* info = block->add_chains();
             int32_t cs_id = chains[i].first;
+            int64_t unit_id = new_block_id + i / replica_num;
             info->set_address(chains[i].second);
             LOG(INFO, "Add C%d %s to #%ld response",
-                cs_id, chains[i].second.c_str(), new_block_id);
-            replicas.push_back(cs_id);
+                cs_id, chains[i].second.c_str(), unit_id);
+            if (i < static_cast<int>(media.size())) {
+                block->add_chains_media(media[i]);
+            }
             // update cs -> block
             add_block_timer.Reset();
-            chunkserver_manager_->AddBlock(cs_id, new_block_id, false);
+            chunkserver_manager_->AddBlock(cs_id, unit_id, false);
+            replicas.push_back(cs_id);
+            if (static_cast<int>(replicas.size()) == replica_num) {
+                block_mapping_manager_->AddNewBlock(unit_id, replica_num, -1, 0, &replicas);
+                if (is_ec) {
+                    block_mapping_manager_->MarkEcBlock(unit_id, new_block_id,
+                                                        file_info.ec().data_num(),
+                                                        file_info.ec().parity_num());
+                }
+                replicas.clear();
+            }
             add_block_timer.Check(50 * 1000, "AddBlock");
         }
-        block_mapping_manager_->AddNewBlock(new_block_id, replica_num, -1, 0, &replicas);
         add_block_timer.Check(50 * 1000, "AddNewBlock");
         block->set_block_id(new_block_id);
         response->set_status(kOK);
@@ -611,6 +882,11 @@ void NameServerImpl::FinishBlock(::google::protobuf::RpcController* controller,
         return;
     }
     StatusCode ret = block_mapping_manager_->CheckBlockVersion(block_id, block_version);
+    // Every unit of an erasure coded or striped group gets the same packets
+    bool is_group = file_info.has_ec() || file_info.has_stripe();
+    for (int i = 0; ret == kOK && is_group && i < file_info.blocks_size(); i++) {
+        ret = block_mapping_manager_->CheckBlockVersion(file_info.blocks(i), block_version);
+    }
     response->set_status(ret);
     if (ret != kOK) {
         LOG(INFO, "FinishBlock fail: #%ld %s", block_id, file_name.c_str());
@@ -645,7 +921,26 @@ void NameServerImpl::GetFileLocation(::google::protobuf::RpcController* controll
             request->file_name().c_str());
         response->set_status(kNsNotFound);
     } else {
-        for (int i = 0; i < info.blocks_size(); i++) {
+        if (info.has_ec()) {
+            response->mutable_ec()->CopyFrom(info.ec());
+        }
+        if (info.has_stripe()) {
+            response->mutable_stripe()->CopyFrom(info.stripe());
+        }
+        // Skip the sealed blocks before offset, units of a group are always returned
+        bool is_group = info.has_ec() || info.has_stripe();
+        int first = 0;
+        int64_t block_offset = 0;
+        while (!is_group && first < info.block_sizes_size()
+               && block_offset + info.block_sizes(first) <= request->offset()) {
+            block_offset += info.block_sizes(first++);
+        }
+        int last = info.blocks_size();
+        if (!is_group && request->block_num() > 0 && first + request->block_num() < last) {
+            last = first + request->block_num();
+            response->set_more_blocks(true);
+        }
+        for (int i = first; i < last; i++) {
             int64_t block_id = info.blocks(i);
             std::vector<int32_t> replica;
             int64_t block_size = 0;
@@ -654,10 +949,17 @@ void NameServerImpl::GetFileLocation(::google::protobuf::RpcController* controll
                 LOG(WARNING, "GetFileLocation GetBlockReplica fail #%ld ", block_id);
                 break;
             }
+            if (i < info.block_sizes_size()) {
+                block_size = info.block_sizes(i);
+            }
             LocatedBlock* lcblock = response->add_blocks();
             lcblock->set_block_id(block_id);
             lcblock->set_block_size(block_size);
             lcblock->set_status(rs);
+            if (!is_group) {
+                lcblock->set_offset(block_offset);
+                block_offset += block_size;
+            }
             for (uint32_t i = 0; i < replica.size(); i++) {
                 int32_t server_id = replica[i];
                 std::string addr = chunkserver_manager_->GetChunkServerAddr(server_id);
@@ -868,7 +1170,10 @@ void NameServerImpl::ChangeReplicaNum(::google::protobuf::RpcController* control
     int32_t replica_num = request->replica_num();
     StatusCode ret_status = kOK;
     FileInfo file_info;
-    if (namespace_->GetFileInfo(file_name, &file_info)) {
+    if (namespace_->GetFileInfo(file_name, &file_info) && file_info.has_ec()) {
+        LOG(INFO, "Can't change replica num of erasure coded %s", file_name.c_str());
+        ret_status = kBadParameter;
+    } else if (namespace_->GetFileInfo(file_name, &file_info)) {
         file_info.set_replicas(replica_num);
         NameServerLog log;
         bool ret = namespace_->UpdateFileInfo(file_info, &log);
@@ -900,8 +1205,173 @@ void NameServerImpl::RebuildBlockMapCallback(const FileInfo& file_info) {
     for (int i = 0; i < file_info.blocks_size(); i++) {
         int64_t block_id = file_info.blocks(i);
         int64_t version = file_info.version();
+        if (file_info.has_ec()) {
+            const EcLayout& ec = file_info.ec();
+            int64_t unit_size = EcUnitSize(file_info.size(), ec.data_num(), ec.cell_size(), i);
+            block_mapping_manager_->AddNewBlock(block_id, 1, version, unit_size, NULL);
+            block_mapping_manager_->MarkEcBlock(block_id, file_info.blocks(0),
+                                                ec.data_num(), ec.parity_num());
+            continue;
+        } else if (file_info.has_stripe()) {
+            const StripeLayout& stripe = file_info.stripe();
+            int64_t unit_size = EcUnitSize(file_info.size(), stripe.width(),
+                                           stripe.unit_size(), i);
+            block_mapping_manager_->AddNewBlock(block_id, file_info.replicas(),
+                                                version, unit_size, NULL);
+            continue;
+        }
+        int64_t block_size = file_info.size();
+        if (i < file_info.block_sizes_size()) {
+            version = file_info.block_versions(i);
+            block_size = file_info.block_sizes(i);
+        } else {
+            for (int j = 0; j < file_info.block_sizes_size(); j++) {
+                block_size -= file_info.block_sizes(j);
+            }
+        }
         block_mapping_manager_->AddNewBlock(block_id, file_info.replicas(),
-                                    version, file_info.size(), NULL);
+                                    version, block_size, NULL);
+    }
+}
+
+void NameServerImpl::TranscodeColdFiles() {
+    if (is_leader_ && !readonly_) {
+        int64_t now = common::timer::now_time();
+        std::vector<TranscodeTask> tasks;
+        transcoder_->RemoveExpired(now, FLAGS_ec_transcode_timeout, &tasks);
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            RemoveTranscodeUnits(tasks[i]);
+        }
+        tasks.clear();
+        transcoder_->GetWritten(&tasks);
+        for (size_t i = 0; i < tasks.size(); ++i) {
+            SwapTranscodedFile(tasks[i]);
+        }
+        // Go on scanning from where the last round stopped
+        int32_t available = transcoder_->Available();
+        int32_t scanned = 0;
+        while (available > 0 && scanned < FLAGS_ec_transcode_scan_num) {
+            std::vector<FileInfo> files;
+            namespace_->ScanFiles(&transcode_cursor_,
+                                  std::min(1000, FLAGS_ec_transcode_scan_num - scanned), &files);
+            scanned += files.size();
+            for (size_t i = 0; i < files.size() && available > 0; ++i) {
+                if (transcoder_->IsCold(files[i], now) && StartTranscode(files[i], now)) {
+                    --available;
+                }
+            }
+            if (transcode_cursor_.empty()) {
+                break;
+            }
+        }
+    }
+    work_thread_pool_->DelayTask(FLAGS_ec_transcode_interval * 1000,
+        boost::bind(&NameServerImpl::TranscodeColdFiles, this));
+}
+
+bool NameServerImpl::StartTranscode(const FileInfo& file_info, int64_t now) {
+    int64_t block_id = file_info.blocks(0);
+    std::vector<int32_t> replica;
+    int64_t block_size = 0;
+    RecoverStat rs;
+    if (!block_mapping_manager_->GetLocatedBlock(block_id, &replica, &block_size, &rs)
+        || replica.empty() || rs != kNotInRecover || block_size != file_info.size()) {
+        return false;
+    }
+    EcLayout ec;
+    ec.set_data_num(FLAGS_ec_transcode_data_num);
+    ec.set_parity_num(FLAGS_ec_transcode_parity_num);
+    ec.set_cell_size(FLAGS_ec_transcode_cell_size);
+    int32_t unit_num = ec.data_num() + ec.parity_num();
+    std::vector<std::pair<int32_t, std::string> > chains;
+    if (!chunkserver_manager_->GetChunkServerChains(unit_num, &chains, "")
+        || static_cast<int32_t>(chains.size()) < unit_num) {
+        LOG(INFO, "Transcode #%ld no %d chunkservers", block_id, unit_num);
+        return false;
+    }
+    NameServerLog log;
+    int64_t group_id = namespace_->GetNewBlockId(&log, unit_num);
+    if (!LogRemote(log, boost::function<void (bool)>())) {
+        LOG(WARNING, "Transcode #%ld LogRemote block id fail", block_id);
+        return false;
+    }
+    TranscodeTask task;
+    task.file_info = file_info;
+    task.block_id = block_id;
+    task.group_id = group_id;
+    task.ec = ec;
+    task.source = replica[0];
+    task.state = kTranscodeQueued;
+    task.start_time = now;
+    for (int32_t i = 0; i < unit_num; ++i) {
+        int32_t cs_id = chains[i].first;
+        std::vector<int32_t> unit_replica(1, cs_id);
+        task.units.push_back(cs_id);
+        chunkserver_manager_->AddBlock(cs_id, group_id + i, false);
+        block_mapping_manager_->AddNewBlock(group_id + i, 1, -1, 0, &unit_replica);
+        block_mapping_manager_->MarkEcBlock(group_id + i, group_id,
+                                            ec.data_num(), ec.parity_num());
+    }
+    if (!transcoder_->Add(task)) {
+        RemoveTranscodeUnits(task);
+        return false;
+    }
+    LOG(INFO, "Transcode %s #%ld V%ld %ld to group #%ld RS(%d,%d) from C%d",
+        file_info.name().c_str(), block_id, file_info.version(), file_info.size(),
+        group_id, ec.data_num(), ec.parity_num(), task.source);
+    return true;
+}
+
+void NameServerImpl::SwapTranscodedFile(const TranscodeTask& task) {
+    const FileInfo& old_info = task.file_info;
+    // Units get the version of the source block once they are closed
+    for (size_t i = 0; i < task.units.size(); ++i) {
+        if (block_mapping_manager_->CheckBlockVersion(task.group_id + i,
+                                                      old_info.version()) != kOK) {
+            return;
+        }
+    }
+    FileInfo new_info(old_info);
+    new_info.clear_blocks();
+    new_info.clear_cs_addrs();
+    for (size_t i = 0; i < task.units.size(); ++i) {
+        new_info.add_blocks(task.group_id + i);
+    }
+    new_info.mutable_ec()->CopyFrom(task.ec);
+    new_info.set_replicas(1);
+    NameServerLog log;
+    StatusCode status = namespace_->SwapFileInfo(old_info, new_info, &log);
+    if (status != kOK) {
+        LOG(INFO, "Transcode %s #%ld drop group #%ld, file changed: %s",
+            old_info.name().c_str(), task.block_id, task.group_id,
+            StatusCode_Name(status).c_str());
+        RemoveTranscodeUnits(task);
+        transcoder_->Finish(task.block_id, false);
+        return;
+    }
+    if (!LogRemote(log, boost::function<void (bool)>())) {
+        LOG(FATAL, "LogRemote namespace update fail");
+    }
+    std::map<int64_t, std::set<int32_t> > block_cs;
+    block_mapping_manager_->RemoveBlocksForFile(old_info, &block_cs);
+    for (std::map<int64_t, std::set<int32_t> >::iterator it = block_cs.begin();
+            it != block_cs.end(); ++it) {
+        const std::set<int32_t>& cs = it->second;
+        for (std::set<int32_t>::iterator cs_it = cs.begin(); cs_it != cs.end(); ++cs_it) {
+            chunkserver_manager_->RemoveBlock(*cs_it, it->first);
+        }
+    }
+    transcoder_->Finish(task.block_id, true);
+    LOG(INFO, "Transcode %s #%ld done, group #%ld saves %ld bytes", old_info.name().c_str(),
+        task.block_id, task.group_id,
+        Transcoder::SavedBytes(old_info.size(), old_info.replicas(), task.ec));
+}
+
+void NameServerImpl::RemoveTranscodeUnits(const TranscodeTask& task) {
+    // Chunkservers drop the unit blocks as obsolete on their next report
+    for (size_t i = 0; i < task.units.size(); ++i) {
+        block_mapping_manager_->RemoveBlock(task.group_id + i);
+        chunkserver_manager_->RemoveBlock(task.units[i], task.group_id + i);
     }
 }
 
@@ -1101,6 +1571,24 @@ bool NameServerImpl::WebService(const sofa::pbrpc::HTTPRequest& request,
                     return true;
                 }
                 p.set_keepalive_timeout(v);
+            } else if (it->first == "recover_node_bandwidth") {
+                if (v < 0 || v > 10240) {
+                    response.content->Append("<h1>Bad Parameter : 0 <= recover_node_bandwidth <= 10240 </h1>");
+                    return true;
+                }
+                p.set_recover_node_bandwidth(v);
+            } else if (it->first == "recover_rack_bandwidth") {
+                if (v < 0 || v > 102400) {
+                    response.content->Append("<h1>Bad Parameter : 0 <= recover_rack_bandwidth <= 102400 </h1>");
+                    return true;
+                }
+                p.set_recover_rack_bandwidth(v);
+            } else if (it->first == "rebalance_threshold") {
+                if (v < 0 || v > 100) {
+                    response.content->Append("<h1>Bad Parameter : 0 <= rebalance_threshold <= 100 </h1>");
+                    return true;
+                }
+                p.set_rebalance_threshold(v);
             } else if (it->first == "block_report_timeout") {
                 if (v < 2 || v > 3600) {
                     response.content->Append("<h1>Bad Parameter : 2 <= block_report_timeout <= 3600 </h1>");
@@ -1295,6 +1783,14 @@ bool NameServerImpl::WebService(const sofa::pbrpc::HTTPRequest& request,
             common::NumToString(recover_num.lo_pending) + "</br>";
     str += "Lost: " + common::NumToString(recover_num.lost_num) + "</br>";
     str += "Incomplete: " + common::NumToString(recover_num.incomplete_num) + "</br>";
+    Transcoder::Stats transcode;
+    transcoder_->GetStats(&transcode);
+    str += "Transcode(run/wait): " + common::NumToString(transcode.running + transcode.written)
+           + "/" + common::NumToString(transcode.queued) + "</br>";
+    str += "Transcoded: " + common::NumToString(transcode.done) + " ("
+           + common::HumanReadableString(transcode.done_bytes) + ") failed "
+           + common::NumToString(transcode.failed) + " saved "
+           + common::HumanReadableString(transcode.saved_bytes) + "</br>";
     str += "<a href=\"/dfs/details\">Details</a>";
     str += "</div>"; // <div class="col-sm-6 col-md-6">
     str += "</div>"; // <div class="col-sm-6 col-md-6">
@@ -1387,6 +1883,7 @@ void NameServerImpl::CallMethod(const ::google::protobuf::MethodDescriptor* meth
         std::make_pair("BlockReport", report_thread_pool_),
         std::make_pair("BlockReceived", work_thread_pool_),
         std::make_pair("PushBlockReport", work_thread_pool_),
+        std::make_pair("TranscodeReport", work_thread_pool_),
         std::make_pair("SysStat", read_thread_pool_)
     };
     static int method_num = sizeof(ThreadPoolOfMethod) /
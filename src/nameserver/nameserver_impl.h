@@ -25,6 +25,8 @@ class NameSpace;
 class ChunkServerManager;
 class BlockMappingManager;
 class Sync;
+class Transcoder;
+struct TranscodeTask;
 
 enum RecoverMode {
     kStopRecover = 0,
@@ -107,6 +109,10 @@ public:
                        const PushBlockReportRequest* request,
                        PushBlockReportResponse* response,
                        ::google::protobuf::Closure* done);
+    void TranscodeReport(::google::protobuf::RpcController* controller,
+                       const TranscodeReportRequest* request,
+                       TranscodeReportResponse* response,
+                       ::google::protobuf::Closure* done);
     void SysStat(::google::protobuf::RpcController* controller,
                        const SysStatRequest* request,
                        SysStatResponse* response,
@@ -152,6 +158,18 @@ private:
     bool CheckFileHasBlock(const FileInfo& file_info,
                            const std::string& file_name,
                            int64_t block_id);
+    /// Last block of file_info, as sealed before the reopen for append,
+    /// with chains if it can be reopened
+    void SetAppendBlock(const std::string& path, const FileInfo& file_info,
+                        CreateFileResponse* response);
+    /// The append lease of path is over, seal it again if its writer never finished
+    void ExpireAppend(const std::string& path, const FileInfo& sealed_info, int64_t reopen_time);
+    /// Periodic, erasure codes cold replicated files
+    void TranscodeColdFiles();
+    bool StartTranscode(const FileInfo& file_info, int64_t now);
+    /// Point the file to the units once they are all reported
+    void SwapTranscodedFile(const TranscodeTask& task);
+    void RemoveTranscodeUnits(const TranscodeTask& task);
 private:
     /// Global thread pool
     ThreadPool* read_thread_pool_;
@@ -169,6 +187,9 @@ private:
     int64_t start_time_;
     /// Namespace
     NameSpace* namespace_;
+    /// Cold file transcoding
+    Transcoder* transcoder_;
+    std::string transcode_cursor_;
     /// ha
     Sync* sync_;
     bool is_leader_;
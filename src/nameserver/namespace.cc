@@ -211,7 +211,9 @@ bool NameSpace::GetFileInfo(const std::string& path, FileInfo* file_info) {
 
 StatusCode NameSpace::CreateFile(const std::string& path, int flags, int mode, int replica_num,
                                  std::vector<int64_t>* blocks_to_remove,
-                                 NameServerLog* log) {
+                                 NameServerLog* log, const EcLayout* ec,
+                                 const StripeLayout* stripe, FileInfo* sealed_info) {
+    MutexLock update_lock(&update_mu_);
     std::vector<std::string> paths;
     if (!common::util::SplitPath(path, &paths)) {
         LOG(INFO, "CreateFile split fail %s", path.c_str());
@@ -247,7 +249,16 @@ StatusCode NameSpace::CreateFile(const std::string& path, int flags, int mode, i
     const std::string& fname = paths[depth-1];
     bool exist = LookUp(parent_id, fname, &file_info);
     if (exist) {
-        if ((flags & O_TRUNC) == 0) {
+        if ((flags & O_TRUNC) == 0 && (flags & O_APPEND) && !IsDir(file_info.type())) {
+            if (ec || stripe) {
+                LOG(INFO, "Append to %s fail: the layout is set at creation", path.c_str());
+                return kBadParameter;
+            }
+            if (sealed_info) {
+                sealed_info->CopyFrom(file_info);
+            }
+            return ReopenFile(path, parent_id, fname, &file_info, log);
+        } else if ((flags & O_TRUNC) == 0) {
             LOG(INFO, "CreateFile %s fail: already exist!", fname.c_str());
             return kFileExists;
         } else {
@@ -264,6 +275,20 @@ StatusCode NameSpace::CreateFile(const std::string& path, int flags, int mode, i
     file_info.set_entry_id(common::atomic_add64(&last_entry_id_, 1) + 1);
     file_info.set_ctime(time(NULL));
     file_info.set_replicas(replica_num <= 0 ? FLAGS_default_replica_num : replica_num);
+    if (ec) {
+        // Parity takes the place of replicas
+        file_info.mutable_ec()->CopyFrom(*ec);
+        file_info.set_replicas(1);
+    } else {
+        file_info.clear_ec();
+    }
+    if (stripe) {
+        file_info.mutable_stripe()->CopyFrom(*stripe);
+    } else {
+        file_info.clear_stripe();
+    }
+    file_info.clear_block_sizes();
+    file_info.clear_block_versions();
     //file_info.add_blocks();
     file_info.SerializeToString(&info_value);
     std::string file_key;
@@ -279,6 +304,58 @@ StatusCode NameSpace::CreateFile(const std::string& path, int flags, int mode, i
     }
 }
 
+StatusCode NameSpace::ReopenFile(const std::string& path, int64_t parent_id,
+                                 const std::string& fname, FileInfo* file_info,
+                                 NameServerLog* log) {
+    // Units of a group are written together, they can't grow one at a time
+    if (file_info->has_ec() || file_info->has_stripe()) {
+        LOG(INFO, "Append to %s fail: not a replicated file", path.c_str());
+        return kBadParameter;
+    }
+    if (file_info->version() < 0 && file_info->blocks_size() > 0) {
+        LOG(INFO, "Append to %s fail: file is being written", path.c_str());
+        return kNoPermission;
+    }
+    // Appending changes the file, it isn't cold anymore
+    file_info->set_ctime(time(NULL));
+    if (file_info->blocks_size() > 0) {
+        file_info->set_version(-1);
+    }
+    std::string info_value;
+    file_info->SerializeToString(&info_value);
+    std::string file_key;
+    EncodingStoreKey(parent_id, fname, &file_key);
+    leveldb::Status s = db_->Put(leveldb::WriteOptions(), file_key, info_value);
+    if (!s.ok()) {
+        LOG(WARNING, "Append to %s fail: db put fail %s", path.c_str(), s.ToString().c_str());
+        return kUpdateError;
+    }
+    LOG(INFO, "Reopen %s E%ld for append, %ld bytes",
+        path.c_str(), file_info->entry_id(), file_info->size());
+    EncodeLog(log, kSyncWrite, file_key, info_value);
+    return kOK;
+}
+
+bool NameSpace::CancelReopen(const std::string& path, const FileInfo& sealed_info,
+                             int64_t reopen_time, NameServerLog* log) {
+    MutexLock update_lock(&update_mu_);
+    FileInfo file_info;
+    if (!LookUp(path, &file_info) || file_info.entry_id() != sealed_info.entry_id()
+        || file_info.version() >= 0 || file_info.ctime() > reopen_time
+        || file_info.size() != sealed_info.size()
+        || file_info.blocks_size() != sealed_info.blocks_size()) {
+        return false;
+    }
+    file_info.set_version(sealed_info.version());
+    if (!UpdateFileInfo(file_info, log)) {
+        LOG(WARNING, "Seal %s again fail", path.c_str());
+        return false;
+    }
+    LOG(INFO, "Append to %s E%ld never finished, sealed again at V%ld %ld bytes",
+        path.c_str(), file_info.entry_id(), sealed_info.version(), sealed_info.size());
+    return true;
+}
+
 StatusCode NameSpace::ListDirectory(const std::string& path,
                              google::protobuf::RepeatedPtrField<FileInfo>* outputs) {
     outputs->Clear();
@@ -324,6 +401,7 @@ StatusCode NameSpace::Rename(const std::string& old_path,
                       bool* need_unlink,
                       FileInfo* remove_file,
                       NameServerLog* log) {
+    MutexLock update_lock(&update_mu_);
     *need_unlink = false;
     if (old_path == "/" || new_path == "/" || old_path == new_path) {
         return kBadParameter;
@@ -402,6 +480,7 @@ StatusCode NameSpace::Rename(const std::string& old_path,
 }
 
 StatusCode NameSpace::RemoveFile(const std::string& path, FileInfo* file_removed, NameServerLog* log) {
+    MutexLock update_lock(&update_mu_);
     StatusCode ret_status = kOK;
     if (LookUp(path, file_removed)) {
         // Only support file
@@ -479,6 +558,7 @@ StatusCode NameSpace::InternalComputeDiskUsage(const FileInfo& info, uint64_t* d
 
 StatusCode NameSpace::DeleteDirectory(const std::string& path, bool recursive,
                                std::vector<FileInfo>* files_removed, NameServerLog* log) {
+    MutexLock update_lock(&update_mu_);
     files_removed->clear();
     FileInfo info;
     if (!LookUp(path, &info)) {
@@ -634,6 +714,51 @@ std::string NameSpace::NormalizePath(const std::string& path) {
     return ret;
 }
 
+void NameSpace::ScanFiles(std::string* cursor, int32_t max_num, std::vector<FileInfo>* files) {
+    leveldb::Iterator* it = db_->NewIterator(leveldb::ReadOptions());
+    it->Seek(cursor->empty() ? std::string(7, '\0') + '\1' : *cursor);
+    int32_t num = 0;
+    for (; it->Valid() && num < max_num; it->Next()) {
+        FileInfo file_info;
+        if (!file_info.ParseFromArray(it->value().data(), it->value().size())
+            || IsDir(file_info.type())) {
+            continue;
+        }
+        int64_t parent_entry_id = 0;
+        std::string name;
+        DecodingStoreKey(it->key().ToString(), &parent_entry_id, &name);
+        file_info.set_parent_entry_id(parent_entry_id);
+        file_info.set_name(name);
+        files->push_back(file_info);
+        ++num;
+    }
+    *cursor = it->Valid() ? it->key().ToString() : "";
+    delete it;
+}
+
+StatusCode NameSpace::SwapFileInfo(const FileInfo& old_info, const FileInfo& new_info,
+                                   NameServerLog* log) {
+    MutexLock update_lock(&update_mu_);
+    FileInfo info;
+    if (!LookUp(old_info.parent_entry_id(), old_info.name(), &info)) {
+        return kNsNotFound;
+    }
+    // Entry id changes when the file is created again, version and blocks when it is written
+    if (info.entry_id() != old_info.entry_id() || info.version() != old_info.version()
+        || info.size() != old_info.size() || info.blocks_size() != old_info.blocks_size()) {
+        return kVersionError;
+    }
+    for (int i = 0; i < info.blocks_size(); i++) {
+        if (info.blocks(i) != old_info.blocks(i)) {
+            return kVersionError;
+        }
+    }
+    FileInfo update(new_info);
+    update.set_parent_entry_id(old_info.parent_entry_id());
+    update.set_name(old_info.name());
+    return UpdateFileInfo(update, log) ? kOK : kUpdateError;
+}
+
 void NameSpace::TailLog(const std::string& logstr) {
     NameServerLog log;
     if(!log.ParseFromString(logstr)) {
@@ -699,12 +824,16 @@ void NameSpace::InitBlockIdUpbound(NameServerLog* log) {
     }
 }
 
-int64_t NameSpace::GetNewBlockId(NameServerLog* log) {
+int64_t NameSpace::GetNewBlockId(NameServerLog* log, int32_t num) {
     MutexLock lock(&mu_);
-    if (next_block_id_ == block_id_upbound_) {
+    if (next_block_id_ + num > block_id_upbound_) {
+        // Skip the ids left below the upbound, a run never crosses it
+        next_block_id_ = block_id_upbound_;
         UpdateBlockIdUpbound(log);
     }
-    return next_block_id_++;
+    int64_t block_id = next_block_id_;
+    next_block_id_ += num;
+    return block_id;
 }
 
 } // namespace bfs
@@ -28,10 +28,12 @@ public:
     /// List a directory
     StatusCode ListDirectory(const std::string& path,
                       google::protobuf::RepeatedPtrField<FileInfo>* outputs);
-    /// Create file by name
+    /// Create file by name, erasure coded by ec or striped by stripe if it is not NULL.
+    /// With O_APPEND and no O_TRUNC an existing replicated file is kept as it is.
     StatusCode CreateFile(const std::string& file_name, int flags, int mode,
                           int replica_num, std::vector<int64_t>* blocks_to_remove,
-                          NameServerLog* log = NULL);
+                          NameServerLog* log = NULL, const EcLayout* ec = NULL,
+                          const StripeLayout* stripe = NULL, FileInfo* sealed_info = NULL);
     /// Remove file by name
     StatusCode RemoveFile(const std::string& path, FileInfo* file_removed, NameServerLog* log = NULL);
     /// Remove director.
@@ -48,17 +50,28 @@ public:
     bool GetFileInfo(const std::string& path, FileInfo* file_info);
     /// Update file
     bool UpdateFileInfo(const FileInfo& file_info, NameServerLog* log = NULL);
+    /// Seal a file reopened for append at reopen_time back to sealed_info, if the writer
+    /// never finished and the file was not reopened since. True if it was sealed again
+    bool CancelReopen(const std::string& path, const FileInfo& sealed_info,
+                      int64_t reopen_time, NameServerLog* log);
     /// Delete file
     bool DeleteFileInfo(const std::string file_key, NameServerLog* log = NULL);
     /// Namespace version
     int64_t Version() const;
     /// Rebuild blockmap
     bool RebuildBlockMap(boost::function<void (const FileInfo&)> callback);
+    /// Up to max_num files from cursor on, with name and parent_entry_id set.
+    /// cursor is empty at the start, and set empty again at the end of the namespace.
+    void ScanFiles(std::string* cursor, int32_t max_num, std::vector<FileInfo>* files);
+    /// Replace the file of old_info with new_info, if it was not changed since old_info
+    StatusCode SwapFileInfo(const FileInfo& old_info, const FileInfo& new_info,
+                            NameServerLog* log = NULL);
     /// NormalizePath
     static std::string NormalizePath(const std::string& path);
     /// ha - tail log from leader/master
     void TailLog(const std::string& log);
-    int64_t GetNewBlockId(NameServerLog* log);
+    /// First of num consecutive new block ids
+    int64_t GetNewBlockId(NameServerLog* log, int32_t num = 1);
     void InitBlockIdUpbound(NameServerLog* log);
 private:
     static bool IsDir(int type);
@@ -72,6 +85,10 @@ private:
     void SetupRoot();
     bool LookUp(const std::string& path, FileInfo* info);
     bool LookUp(int64_t pid, const std::string& name, FileInfo* info);
+    /// Reopen the existing file fname under parent_id for append, its last block
+    /// is marked as being written like a new one, so other writers are refused
+    StatusCode ReopenFile(const std::string& path, int64_t parent_id,
+                          const std::string& fname, FileInfo* file_info, NameServerLog* log);
     StatusCode InternalDeleteDirectory(const FileInfo& dir_info,
                                 bool recursive,
                                 std::vector<FileInfo>* files_removed,
@@ -88,6 +105,7 @@ private:
     int64_t block_id_upbound_;
     int64_t next_block_id_;
     Mutex mu_;
+    Mutex update_mu_;   /// Creations, renames and removals against SwapFileInfo
 
     /// HA module
     //Sync* sync_;
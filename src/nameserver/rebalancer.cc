@@ -0,0 +1,117 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "rebalancer.h"
+
+#include <map>
+
+#include <common/logging.h>
+
+namespace baidu {
+namespace bfs {
+
+double Rebalancer::Server::Usage() const {
+    if (quota <= 0) {
+        return 1.0;
+    }
+    return static_cast<double>(data_size) / quota;
+}
+
+Rebalancer::Rebalancer(double threshold) : threshold_(threshold) {
+}
+
+void Rebalancer::SetThreshold(double threshold) {
+    threshold_ = threshold;
+}
+
+double Rebalancer::Threshold() const {
+    return threshold_;
+}
+
+double Rebalancer::MeanUsage(const std::vector<Server>& servers) {
+    int64_t data_size = 0;
+    int64_t quota = 0;
+    for (size_t i = 0; i < servers.size(); ++i) {
+        if (servers[i].quota > 0) {
+            data_size += servers[i].data_size;
+            quota += servers[i].quota;
+        }
+    }
+    return quota > 0 ? static_cast<double>(data_size) / quota : 0;
+}
+
+int32_t Rebalancer::Plan(const Server& src, const std::vector<Server>& servers,
+                         const std::vector<RecoverItem>& blocks, int32_t max_moves,
+                         RecoverPlanner* planner, int64_t now,
+                         std::vector<RebalanceMove>* moves) {
+    if (threshold_ <= 0 || src.quota <= 0) {
+        return 0;
+    }
+    double mean = MeanUsage(servers);
+    // Like the HDFS balancer: over used servers always shed load, servers above
+    // the mean only feed under used ones
+    bool over_used = src.Usage() > mean + threshold_;
+    if (!over_used) {
+        bool has_under_used = false;
+        for (size_t i = 0; i < servers.size() && !has_under_used; ++i) {
+            has_under_used = servers[i].quota > 0 && servers[i].Usage() < mean - threshold_;
+        }
+        if (src.Usage() <= mean || !has_under_used) {
+            return 0;
+        }
+    }
+    int64_t excess = static_cast<int64_t>((src.Usage() - mean) * src.quota);
+    RecoverPlanner::Node src_node(src.id, src.rack, src.Usage());
+    // Bytes planned into each dest by this call
+    std::map<int32_t, int64_t> incoming;
+    int32_t planned = 0;
+    for (size_t i = 0; i < blocks.size() && planned < max_moves && excess > 0; ++i) {
+        if (!planner->HasBudget(src_node, now)) {
+            break;
+        }
+        const RecoverItem& item = blocks[i];
+        std::vector<RecoverPlanner::Node> candidates;
+        for (size_t j = 0; j < servers.size(); ++j) {
+            const Server& dest = servers[j];
+            if (dest.id == src.id || dest.quota <= 0
+                || item.replica.find(dest.id) != item.replica.end()) {
+                continue;
+            }
+            int64_t dest_size = dest.data_size + incoming[dest.id];
+            if (!over_used && static_cast<double>(dest_size) / dest.quota >= mean - threshold_) {
+                continue;
+            }
+            double usage = static_cast<double>(dest_size + item.block_size) / dest.quota;
+            // Never push a dest over the mean, or blocks would bounce back
+            if (usage > mean) {
+                continue;
+            }
+            candidates.push_back(RecoverPlanner::Node(dest.id, dest.rack, usage));
+        }
+        std::vector<int32_t> dests;
+        if (candidates.empty()
+            || !planner->Plan(src_node, item.block_size, candidates, 1, now, &dests)) {
+            continue;
+        }
+        RebalanceMove move;
+        move.block_id = item.block_id;
+        move.block_size = item.block_size;
+        move.src = src.id;
+        move.dest = dests[0];
+        moves->push_back(move);
+        incoming[move.dest] += item.block_size;
+        excess -= item.block_size;
+        ++planned;
+    }
+    if (planned) {
+        LOG(INFO, "Rebalance C%d usage %.3f mean %.3f, planned %d moves",
+            src.id, src.Usage(), mean, planned);
+    }
+    return planned;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
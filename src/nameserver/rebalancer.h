@@ -0,0 +1,58 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BFS_REBALANCER_H_
+#define BFS_REBALANCER_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "nameserver/recover_planner.h"
+
+namespace baidu {
+namespace bfs {
+
+/// Copy block_id from src to dest, then drop the replica on src
+struct RebalanceMove {
+    int64_t block_id;
+    int64_t block_size;
+    int32_t src;
+    int32_t dest;
+};
+
+/// Plans replica moves from over used chunkservers to those below the mean usage,
+/// and from servers above the mean to under used ones.
+/// Not thread safe, the caller should hold a lock.
+class Rebalancer {
+public:
+    struct Server {
+        int32_t id;
+        std::string rack;
+        int64_t data_size;
+        int64_t quota;
+        Server(int32_t i, const std::string& r, int64_t size, int64_t q)
+            : id(i), rack(r), data_size(size), quota(q) {}
+        double Usage() const;
+    };
+    /// threshold: usage gap to the mean that makes a server over or under used, 0 disables
+    explicit Rebalancer(double threshold);
+    void SetThreshold(double threshold);
+    double Threshold() const;
+    static double MeanUsage(const std::vector<Server>& servers);
+    /// Plan at most max_moves moves of blocks on src, charged to planner's budgets.
+    /// Moves stop once src would drop to the mean.
+    int32_t Plan(const Server& src, const std::vector<Server>& servers,
+                 const std::vector<RecoverItem>& blocks, int32_t max_moves,
+                 RecoverPlanner* planner, int64_t now, std::vector<RebalanceMove>* moves);
+private:
+    double threshold_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  //BFS_REBALANCER_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
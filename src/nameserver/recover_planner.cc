@@ -0,0 +1,134 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "recover_planner.h"
+
+#include <algorithm>
+
+#include <common/logging.h>
+
+namespace baidu {
+namespace bfs {
+
+/// Seconds of bandwidth a node or rack can burst
+const int64_t kPlannerBurstSeconds = 2;
+const double kPlannerUnlimited = 1e18;
+
+namespace {
+bool RedundancyLess(const RecoverItem& a, const RecoverItem& b) {
+    return a.replica.size() < b.replica.size();
+}
+
+struct DestCompare {
+    bool operator()(const std::pair<double, const RecoverPlanner::Node*>& a,
+                    const std::pair<double, const RecoverPlanner::Node*>& b) const {
+        if (a.first != b.first) {
+            return a.first > b.first;
+        }
+        if (a.second->load != b.second->load) {
+            return a.second->load < b.second->load;
+        }
+        return a.second->id < b.second->id;
+    }
+};
+}
+
+RecoverPlanner::RecoverPlanner(int64_t node_bandwidth, int64_t rack_bandwidth)
+    : node_bandwidth_(node_bandwidth), rack_bandwidth_(rack_bandwidth) {
+}
+
+void RecoverPlanner::SetBandwidth(int64_t node_bandwidth, int64_t rack_bandwidth) {
+    node_bandwidth_ = node_bandwidth;
+    rack_bandwidth_ = rack_bandwidth;
+    node_buckets_.clear();
+    rack_buckets_.clear();
+}
+
+void RecoverPlanner::SortByRedundancy(std::vector<RecoverItem>::iterator begin,
+                                      std::vector<RecoverItem>::iterator end) {
+    std::stable_sort(begin, end, RedundancyLess);
+}
+
+double RecoverPlanner::Refill(Bucket* bucket, int64_t bandwidth, int64_t now) {
+    if (bandwidth <= 0) {
+        return kPlannerUnlimited;
+    }
+    double capacity = static_cast<double>(bandwidth) * kPlannerBurstSeconds;
+    if (bucket->last_refill < 0) {
+        bucket->tokens = capacity;
+    } else if (now > bucket->last_refill) {
+        bucket->tokens += static_cast<double>(bandwidth) * (now - bucket->last_refill) / 1000000;
+        bucket->tokens = std::min(bucket->tokens, capacity);
+    }
+    bucket->last_refill = std::max(now, bucket->last_refill);
+    return bucket->tokens;
+}
+
+double RecoverPlanner::NodeTokens(int32_t id, int64_t now) {
+    return Refill(&node_buckets_[id], node_bandwidth_, now);
+}
+
+double RecoverPlanner::RackTokens(const std::string& rack, int64_t now) {
+    return Refill(&rack_buckets_[rack], rack_bandwidth_, now);
+}
+
+bool RecoverPlanner::HasBudget(const Node& src, int64_t now) {
+    // A node may go into debt by one block, so big blocks never starve
+    return NodeTokens(src.id, now) > 0;
+}
+
+void RecoverPlanner::Charge(const Node& src, const Node& dest, int64_t block_size) {
+    if (node_bandwidth_ > 0) {
+        node_buckets_[src.id].tokens -= block_size;
+        node_buckets_[dest.id].tokens -= block_size;
+    }
+    if (rack_bandwidth_ > 0 && src.rack != dest.rack) {
+        rack_buckets_[src.rack].tokens -= block_size;
+        rack_buckets_[dest.rack].tokens -= block_size;
+    }
+}
+
+bool RecoverPlanner::Plan(const Node& src, int64_t block_size,
+                          const std::vector<Node>& candidates, int32_t dest_limit,
+                          int64_t now, std::vector<int32_t>* dests) {
+    if (!HasBudget(src, now)) {
+        LOG(DEBUG, "Recover plan: source C%d out of budget", src.id);
+        return false;
+    }
+    bool src_rack_budget = RackTokens(src.rack, now) > 0;
+    std::vector<std::pair<double, const Node*> > loads;
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        const Node& dest = candidates[i];
+        if (dest.id == src.id) {
+            continue;
+        }
+        double tokens = NodeTokens(dest.id, now);
+        if (tokens <= 0) {
+            continue;
+        }
+        if (dest.rack != src.rack && (!src_rack_budget || RackTokens(dest.rack, now) <= 0)) {
+            continue;
+        }
+        loads.push_back(std::make_pair(tokens, &dest));
+    }
+    if (loads.empty()) {
+        LOG(DEBUG, "Recover plan: no dest with budget for C%d", src.id);
+        return false;
+    }
+    std::sort(loads.begin(), loads.end(), DestCompare());
+    for (size_t i = 0; i < loads.size() && static_cast<int32_t>(i) < dest_limit; ++i) {
+        dests->push_back(loads[i].second->id);
+    }
+    Charge(src, *loads[0].second, block_size);
+    return true;
+}
+
+void RecoverPlanner::RemoveNode(int32_t id) {
+    node_buckets_.erase(id);
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
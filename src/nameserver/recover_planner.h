@@ -0,0 +1,70 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BFS_RECOVER_PLANNER_H_
+#define BFS_RECOVER_PLANNER_H_
+
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+namespace baidu {
+namespace bfs {
+
+/// Block waiting for a recover destination
+struct RecoverItem {
+    int64_t block_id;
+    int64_t block_size;
+    std::set<int32_t> replica;
+    RecoverItem() : block_id(-1), block_size(0) {}
+};
+
+/// Assigns (source, dest, block) triples against per-node and per-rack
+/// bandwidth budgets. Not thread safe, the caller should hold a lock.
+class RecoverPlanner {
+public:
+    struct Node {
+        int32_t id;
+        std::string rack;
+        double load;
+        Node(int32_t i, const std::string& r, double l) : id(i), rack(r), load(l) {}
+    };
+    /// Bandwidth in bytes per second, 0 for unlimited
+    RecoverPlanner(int64_t node_bandwidth, int64_t rack_bandwidth);
+    void SetBandwidth(int64_t node_bandwidth, int64_t rack_bandwidth);
+    /// Sort items so that blocks with fewer live replicas are planned first
+    static void SortByRedundancy(std::vector<RecoverItem>::iterator begin,
+                                 std::vector<RecoverItem>::iterator end);
+    /// Whether `src` may start another recover at `now` (micros)
+    bool HasBudget(const Node& src, int64_t now);
+    /// Select up to `dest_limit` dests for `block_size` bytes from `src`, best first.
+    /// Budgets are charged to src and dests[0] only; the rest are fallbacks.
+    bool Plan(const Node& src, int64_t block_size, const std::vector<Node>& candidates,
+              int32_t dest_limit, int64_t now, std::vector<int32_t>* dests);
+    void RemoveNode(int32_t id);
+private:
+    struct Bucket {
+        double tokens;
+        int64_t last_refill;
+        Bucket() : tokens(-1), last_refill(-1) {}
+    };
+    double Refill(Bucket* bucket, int64_t bandwidth, int64_t now);
+    double NodeTokens(int32_t id, int64_t now);
+    double RackTokens(const std::string& rack, int64_t now);
+    void Charge(const Node& src, const Node& dest, int64_t block_size);
+private:
+    int64_t node_bandwidth_;
+    int64_t rack_bandwidth_;
+    std::map<int32_t, Bucket> node_buckets_;
+    std::map<std::string, Bucket> rack_buckets_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  //BFS_RECOVER_PLANNER_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
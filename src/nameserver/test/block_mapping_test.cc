@@ -0,0 +1,136 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "nameserver/block_mapping_manager.h"
+#include "nameserver/chunkserver_manager.h"
+
+#include <stdio.h>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <common/thread_pool.h>
+#include <gtest/gtest.h>
+
+#include "proto/nameserver.pb.h"
+
+namespace baidu {
+namespace bfs {
+
+class BlockMappingTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        // Their threads are never stopped, they live as long as the test
+        thread_pool_ = new ThreadPool(2);
+        block_mapping_ = new BlockMappingManager(1);
+        chunkservers_ = new ChunkServerManager(thread_pool_, block_mapping_);
+        // One chunkserver per rack, so any of them may take a rebuilt unit
+        for (int i = 0; i < 5; i++) {
+            char ip[32];
+            snprintf(ip, sizeof(ip), "10.0.%d.1", i + 1);
+            RegisterRequest request;
+            RegisterResponse response;
+            request.set_chunkserver_addr(std::string(ip) + ":8825");
+            request.set_disk_quota(1L << 40);
+            chunkservers_->HandleRegister(ip, &request, &response);
+            HeartBeatRequest heartbeat;
+            HeartBeatResponse heartbeat_response;
+            heartbeat.set_chunkserver_id(response.chunkserver_id());
+            heartbeat.set_chunkserver_addr(request.chunkserver_addr());
+            chunkservers_->HandleHeartBeat(&heartbeat, &heartbeat_response);
+            cs_ids_.push_back(response.chunkserver_id());
+        }
+    }
+    /// A sealed RS(data_num, parity_num) group from group_id, unit i on cs_ids_[i]
+    void AddEcGroup(int64_t group_id, int32_t data_num, int32_t parity_num,
+                    const std::vector<int64_t>& sizes) {
+        for (int32_t i = 0; i < data_num + parity_num; i++) {
+            std::vector<int32_t> replica(1, cs_ids_[i]);
+            block_mapping_->AddNewBlock(group_id + i, 1, 1, sizes[i], &replica);
+            block_mapping_->MarkEcBlock(group_id + i, group_id, data_num, parity_num);
+            chunkservers_->AddBlock(cs_ids_[i], group_id + i, false);
+        }
+    }
+    static ThreadPool* thread_pool_;
+    static BlockMappingManager* block_mapping_;
+    static ChunkServerManager* chunkservers_;
+    static std::vector<int32_t> cs_ids_;
+};
+
+ThreadPool* BlockMappingTest::thread_pool_ = NULL;
+BlockMappingManager* BlockMappingTest::block_mapping_ = NULL;
+ChunkServerManager* BlockMappingTest::chunkservers_ = NULL;
+std::vector<int32_t> BlockMappingTest::cs_ids_;
+
+TEST_F(BlockMappingTest, EcLostUnit) {
+    const int64_t kGroup = 100;
+    std::vector<int64_t> sizes;
+    sizes.push_back(300);
+    sizes.push_back(250);
+    sizes.push_back(300);
+    AddEcGroup(kGroup, 2, 1, sizes);
+
+    std::vector<EcRecoverItem> items;
+    chunkservers_->PickEcRecoverBlocks(cs_ids_[4], 0, &items);
+    ASSERT_TRUE(items.empty());
+
+    // The only replica of a unit is lost, it is rebuilt rather than reported lost
+    block_mapping_->DealWithDeadBlock(cs_ids_[1], kGroup + 1);
+    std::vector<int32_t> replica;
+    int64_t block_size = 0;
+    RecoverStat rs = kNotInRecover;
+    ASSERT_TRUE(block_mapping_->GetLocatedBlock(kGroup + 1, &replica, &block_size, &rs));
+    ASSERT_TRUE(replica.empty());
+    ASSERT_EQ(kHiRecover, rs);
+    RecoverBlockNum recover_num;
+    block_mapping_->GetStat(-1, &recover_num);
+    ASSERT_EQ(1, recover_num.hi_recover_num);
+    ASSERT_EQ(0, recover_num.lost_num);
+
+    chunkservers_->PickEcRecoverBlocks(cs_ids_[4], 0, &items);
+    ASSERT_EQ(1U, items.size());
+    const EcRecoverItem& item = items[0];
+    ASSERT_EQ(kGroup + 1, item.block_id);
+    ASSERT_EQ(kGroup, item.group_id);
+    ASSERT_EQ(2, item.data_num);
+    ASSERT_EQ(1, item.parity_num);
+    ASSERT_EQ(250, item.block_size);
+    // A source for each of the k live units, none for the lost one
+    ASSERT_EQ(3U, item.sources.size());
+    ASSERT_EQ(chunkservers_->GetChunkServerAddr(cs_ids_[0]), item.sources[0]);
+    ASSERT_EQ("", item.sources[1]);
+    ASSERT_EQ(chunkservers_->GetChunkServerAddr(cs_ids_[2]), item.sources[2]);
+    ASSERT_EQ(300, item.sizes[0]);
+    ASSERT_EQ(300, item.sizes[2]);
+    // The rebuilt unit goes to a chunkserver holding no other unit of the group
+    ASSERT_FALSE(item.dests.empty());
+    for (size_t i = 0; i < item.dests.size(); i++) {
+        ASSERT_NE(item.sources[0], item.dests[i]);
+        ASSERT_NE(item.sources[2], item.dests[i]);
+    }
+    ASSERT_TRUE(block_mapping_->GetLocatedBlock(kGroup + 1, &replica, &block_size, &rs));
+    ASSERT_EQ(kCheck, rs);
+}
+
+TEST_F(BlockMappingTest, EcTooManyUnitsLost) {
+    const int64_t kGroup = 200;
+    std::vector<int64_t> sizes(3, 100);
+    AddEcGroup(kGroup, 2, 1, sizes);
+    block_mapping_->DealWithDeadBlock(cs_ids_[0], kGroup);
+    block_mapping_->DealWithDeadBlock(cs_ids_[2], kGroup + 2);
+    // Queued, but with fewer than k live units nothing can be rebuilt yet
+    std::vector<EcRecoverItem> items;
+    chunkservers_->PickEcRecoverBlocks(cs_ids_[4], 0, &items);
+    ASSERT_TRUE(items.empty());
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
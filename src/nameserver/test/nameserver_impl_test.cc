@@ -3,10 +3,16 @@
 // found in the LICENSE file.
 //
 
+#define private public
 #include "proto/nameserver.pb.h"
 #include "proto/file.pb.h"
 #include "nameserver/nameserver_impl.h"
+#include "nameserver/block_mapping_manager.h"
+#include "nameserver/chunkserver_manager.h"
+#include "nameserver/namespace.h"
 
+#include <fcntl.h>
+#include <unistd.h>
 #include <iostream>
 #include <string>
 #include <sofa/pbrpc/pbrpc.h>
@@ -19,7 +25,10 @@
 #include <common/thread_pool.h>
 
 DECLARE_string(bfs_log);
+DECLARE_string(namedb_path);
+DECLARE_int32(stripe_max_width);
 DECLARE_int32(nameserver_work_thread_num);
+DECLARE_int32(nameserver_append_lease);
 
 namespace baidu {
 namespace bfs {
@@ -93,6 +102,277 @@ TEST_F(NameServerImplTest, NameServerImpl) {
     std::cerr << 100000.0 * 1000000.0 / interval << std::endl;
 }
 
+/// Closure of an rpc answered in another thread
+class RpcDone : public ::google::protobuf::Closure {
+public:
+    RpcDone() : done_(false) {}
+    virtual void Run() {
+        done_ = true;
+    }
+    void Wait() {
+        while (!done_) {
+            usleep(1000);
+        }
+        done_ = false;
+    }
+private:
+    volatile bool done_;
+};
+
+class NameServerBlockTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        FLAGS_namedb_path = "./block_test_db";
+        system("rm -rf ./block_test_db");
+        // Its threads are never stopped, it lives as long as the test
+        nameserver_ = new NameServerImpl(NULL);
+        RegisterRequest request;
+        RegisterResponse response;
+        request.set_chunkserver_addr("127.0.0.1:8825");
+        request.set_disk_quota(1L << 40);
+        nameserver_->chunkserver_manager_->HandleRegister("127.0.0.1", &request, &response);
+        // Chains are picked by load, which comes with the first heartbeat
+        HeartBeatRequest heartbeat;
+        HeartBeatResponse heartbeat_response;
+        heartbeat.set_chunkserver_id(response.chunkserver_id());
+        heartbeat.set_chunkserver_addr("127.0.0.1:8825");
+        nameserver_->chunkserver_manager_->HandleHeartBeat(&heartbeat, &heartbeat_response);
+        nameserver_->LeaveReadOnly();
+    }
+    static void TearDownTestCase() {
+        system("rm -rf ./block_test_db");
+    }
+    StatusCode CreateFile(const std::string& name, const StripeLayout* stripe = NULL,
+                          const EcLayout* ec = NULL) {
+        CreateFileRequest request;
+        CreateFileResponse response;
+        request.set_file_name(name);
+        request.set_replica_num(1);
+        if (stripe) {
+            request.mutable_stripe()->CopyFrom(*stripe);
+        }
+        if (ec) {
+            request.mutable_ec()->CopyFrom(*ec);
+        }
+        nameserver_->CreateFile(&controller_, &request, &response, &done_);
+        done_.Wait();
+        return response.status();
+    }
+    /// New block after prev_block_id sealed at size and version, -1 for the first block
+    int64_t AddBlock(const std::string& name, int64_t prev_block_id,
+                     int64_t size, int64_t version, StatusCode* status = NULL) {
+        AddBlockRequest request;
+        AddBlockResponse response;
+        request.set_file_name(name);
+        if (prev_block_id >= 0) {
+            request.set_prev_block_id(prev_block_id);
+            request.set_prev_block_size(size);
+            request.set_prev_block_version(version);
+        }
+        nameserver_->AddBlock(&controller_, &request, &response, &done_);
+        done_.Wait();
+        if (status) {
+            *status = response.status();
+        }
+        return response.status() == kOK ? response.block().block_id() : -1;
+    }
+    StatusCode Append(const std::string& name, CreateFileResponse* response) {
+        CreateFileRequest request;
+        request.set_file_name(name);
+        request.set_flags(O_APPEND);
+        request.set_replica_num(1);
+        nameserver_->CreateFile(&controller_, &request, response, &done_);
+        done_.Wait();
+        return response->status();
+    }
+    void GetFileLocation(const std::string& name, int64_t offset, int32_t block_num,
+                         FileLocationResponse* response) {
+        FileLocationRequest request;
+        request.set_file_name(name);
+        request.set_offset(offset);
+        request.set_block_num(block_num);
+        nameserver_->GetFileLocation(&controller_, &request, response, &done_);
+        done_.Wait();
+    }
+    FileInfo GetFileInfo(const std::string& name) {
+        FileInfo info;
+        EXPECT_TRUE(nameserver_->namespace_->GetFileInfo(name, &info));
+        return info;
+    }
+    static NameServerImpl* nameserver_;
+    sofa::pbrpc::RpcController controller_;
+    RpcDone done_;
+};
+
+NameServerImpl* NameServerBlockTest::nameserver_ = NULL;
+
+TEST_F(NameServerBlockTest, AddBlock) {
+    ASSERT_EQ(kOK, CreateFile("/add_block"));
+    int64_t b1 = AddBlock("/add_block", -1, 0, 0);
+    ASSERT_GE(b1, 0);
+    int64_t b2 = AddBlock("/add_block", b1, 100, 3);
+    int64_t b3 = AddBlock("/add_block", b2, 50, 2);
+    ASSERT_GE(b3, 0);
+    FileInfo info = GetFileInfo("/add_block");
+    ASSERT_EQ(3, info.blocks_size());
+    ASSERT_EQ(-1, info.version());
+    ASSERT_EQ(2, info.block_sizes_size());
+    ASSERT_EQ(100, info.block_sizes(0));
+    ASSERT_EQ(50, info.block_sizes(1));
+    ASSERT_EQ(3, info.block_versions(0));
+    ASSERT_EQ(2, info.block_versions(1));
+
+    // A writer retrying after b1 drops the blocks after it
+    int64_t b4 = AddBlock("/add_block", b1, 100, 3);
+    info = GetFileInfo("/add_block");
+    ASSERT_EQ(2, info.blocks_size());
+    ASSERT_EQ(b1, info.blocks(0));
+    ASSERT_EQ(b4, info.blocks(1));
+    ASSERT_EQ(1, info.block_sizes_size());
+    ASSERT_EQ(100, info.block_sizes(0));
+    ASSERT_EQ(1, info.block_versions_size());
+    ASSERT_EQ(3, info.block_versions(0));
+    std::vector<int32_t> replica;
+    int64_t block_size = 0;
+    RecoverStat rs;
+    ASSERT_FALSE(nameserver_->block_mapping_manager_->GetLocatedBlock(b2, &replica,
+                                                                      &block_size, &rs));
+    ASSERT_FALSE(nameserver_->block_mapping_manager_->GetLocatedBlock(b3, &replica,
+                                                                      &block_size, &rs));
+
+    // Not after a block the file doesn't have
+    StatusCode status = kOK;
+    ASSERT_EQ(-1, AddBlock("/add_block", b3, 50, 2, &status));
+    ASSERT_EQ(kNoPermission, status);
+    // Without a prev block, the file starts over
+    int64_t b5 = AddBlock("/add_block", -1, 0, 0);
+    info = GetFileInfo("/add_block");
+    ASSERT_EQ(1, info.blocks_size());
+    ASSERT_EQ(b5, info.blocks(0));
+    ASSERT_EQ(0, info.block_sizes_size());
+    ASSERT_EQ(0, info.block_versions_size());
+}
+
+TEST_F(NameServerBlockTest, AbandonedAppend) {
+    FLAGS_nameserver_append_lease = 1;
+    ASSERT_EQ(kOK, CreateFile("/append"));
+    ASSERT_GE(AddBlock("/append", -1, 0, 0), 0);
+    // Sealed by the first writer
+    FileInfo info = GetFileInfo("/append");
+    info.set_version(3);
+    info.set_size(100);
+    ASSERT_TRUE(nameserver_->namespace_->UpdateFileInfo(info));
+    CreateFileResponse response;
+    ASSERT_EQ(kOK, Append("/append", &response));
+    ASSERT_EQ(3, response.last_block_version());
+    ASSERT_EQ(-1, GetFileInfo("/append").version());
+    response.Clear();
+    ASSERT_EQ(kNoPermission, Append("/append", &response));
+    // The appender never finishes, its lease runs out
+    for (int i = 0; i < 300 && GetFileInfo("/append").version() < 0; i++) {
+        usleep(10000);
+    }
+    info = GetFileInfo("/append");
+    ASSERT_EQ(3, info.version());
+    ASSERT_EQ(100, info.size());
+    response.Clear();
+    ASSERT_EQ(kOK, Append("/append", &response));
+    ASSERT_EQ(3, response.last_block_version());
+    // This one finishes in time, the lease leaves the file alone
+    info = GetFileInfo("/append");
+    info.set_version(4);
+    info.set_size(150);
+    ASSERT_TRUE(nameserver_->namespace_->UpdateFileInfo(info));
+    sleep(2);
+    info = GetFileInfo("/append");
+    ASSERT_EQ(4, info.version());
+    ASSERT_EQ(150, info.size());
+    FLAGS_nameserver_append_lease = 600;
+}
+
+TEST_F(NameServerBlockTest, GetFileLocation) {
+    ASSERT_EQ(kOK, CreateFile("/location"));
+    std::vector<int64_t> blocks;
+    blocks.push_back(AddBlock("/location", -1, 0, 0));
+    for (int i = 0; i < 3; i++) {
+        blocks.push_back(AddBlock("/location", blocks.back(), 100, 1));
+    }
+    FileLocationResponse response;
+    GetFileLocation("/location", 0, 0, &response);
+    ASSERT_EQ(kOK, response.status());
+    ASSERT_EQ(4, response.blocks_size());
+    ASSERT_FALSE(response.more_blocks());
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQ(blocks[i], response.blocks(i).block_id());
+        ASSERT_EQ(i * 100, response.blocks(i).offset());
+        ASSERT_EQ(1, response.blocks(i).chains_size());
+    }
+    ASSERT_EQ(100, response.blocks(2).block_size());
+
+    // From the block holding offset, at most block_num of them
+    response.Clear();
+    GetFileLocation("/location", 150, 2, &response);
+    ASSERT_EQ(2, response.blocks_size());
+    ASSERT_TRUE(response.more_blocks());
+    ASSERT_EQ(blocks[1], response.blocks(0).block_id());
+    ASSERT_EQ(100, response.blocks(0).offset());
+    ASSERT_EQ(blocks[2], response.blocks(1).block_id());
+    ASSERT_EQ(200, response.blocks(1).offset());
+    // A block boundary is in the next block
+    response.Clear();
+    GetFileLocation("/location", 200, 2, &response);
+    ASSERT_EQ(2, response.blocks_size());
+    ASSERT_FALSE(response.more_blocks());
+    ASSERT_EQ(blocks[2], response.blocks(0).block_id());
+    ASSERT_EQ(blocks[3], response.blocks(1).block_id());
+    ASSERT_EQ(300, response.blocks(1).offset());
+    // Past the sealed blocks, the last one is returned
+    response.Clear();
+    GetFileLocation("/location", 1000, 1, &response);
+    ASSERT_EQ(1, response.blocks_size());
+    ASSERT_FALSE(response.more_blocks());
+    ASSERT_EQ(blocks[3], response.blocks(0).block_id());
+}
+
+TEST_F(NameServerBlockTest, CreateStripedFile) {
+    StripeLayout stripe;
+    stripe.set_width(FLAGS_stripe_max_width + 1);
+    stripe.set_unit_size(1024);
+    ASSERT_EQ(kBadParameter, CreateFile("/stripe", &stripe));
+    stripe.set_width(1);
+    ASSERT_EQ(kBadParameter, CreateFile("/stripe", &stripe));
+    stripe.set_width(4);
+    stripe.set_unit_size(0);
+    ASSERT_EQ(kBadParameter, CreateFile("/stripe", &stripe));
+    stripe.set_unit_size(1024);
+    // A file is striped or erasure coded, not both
+    EcLayout ec;
+    ec.set_data_num(2);
+    ec.set_parity_num(1);
+    ec.set_cell_size(1024);
+    ASSERT_EQ(kBadParameter, CreateFile("/stripe", &stripe, &ec));
+    FileInfo info;
+    ASSERT_FALSE(nameserver_->namespace_->GetFileInfo("/stripe", &info));
+
+    ASSERT_EQ(kOK, CreateFile("/stripe", &stripe));
+    info = GetFileInfo("/stripe");
+    ASSERT_EQ(4, info.stripe().width());
+    ASSERT_FALSE(info.has_ec());
+    // One group of width units with a chain each
+    int64_t group_id = AddBlock("/stripe", -1, 0, 0);
+    ASSERT_GE(group_id, 0);
+    info = GetFileInfo("/stripe");
+    ASSERT_EQ(4, info.blocks_size());
+    for (int i = 0; i < 4; i++) {
+        ASSERT_EQ(group_id + i, info.blocks(i));
+    }
+    FileLocationResponse response;
+    GetFileLocation("/stripe", 0, 0, &response);
+    ASSERT_EQ(kOK, response.status());
+    ASSERT_EQ(4, response.stripe().width());
+    ASSERT_EQ(4, response.blocks_size());
+}
+
 } // namespace baidu
 } // namespace bfs
 
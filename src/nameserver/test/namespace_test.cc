@@ -128,6 +128,85 @@ TEST_F(NameSpaceTest, CreateFile) {
     ASSERT_EQ(kOK, ns.CreateFile("/dir1/subdir2/file3", 0, 01755, -1, &blocks_to_remove));
 }
 
+TEST_F(NameSpaceTest, AppendFile) {
+    FLAGS_namedb_path = "./db";
+    system("rm -rf ./db");
+    NameSpace ns;
+    std::vector<int64_t> blocks_to_remove;
+    // Created if not there
+    ASSERT_EQ(kOK, ns.CreateFile("/file1", O_APPEND, 0, -1, &blocks_to_remove));
+    FileInfo info;
+    ASSERT_TRUE(ns.GetFileInfo("/file1", &info));
+    info.add_blocks(1);
+    info.set_version(5);
+    info.set_size(100);
+    ASSERT_TRUE(ns.UpdateFileInfo(info));
+    // Reopened with its blocks, the sealed version is returned
+    FileInfo sealed;
+    ASSERT_EQ(kOK, ns.CreateFile("/file1", O_APPEND, 0, -1, &blocks_to_remove,
+                                 NULL, NULL, NULL, &sealed));
+    ASSERT_EQ(5, sealed.version());
+    ASSERT_EQ(100, sealed.size());
+    FileInfo reopened;
+    ASSERT_TRUE(ns.GetFileInfo("/file1", &reopened));
+    ASSERT_EQ(info.entry_id(), reopened.entry_id());
+    ASSERT_EQ(1, reopened.blocks_size());
+    ASSERT_EQ(100, reopened.size());
+    ASSERT_TRUE(blocks_to_remove.empty());
+    // Marked as being written, a second appender is refused
+    ASSERT_EQ(-1, reopened.version());
+    ASSERT_EQ(kNoPermission, ns.CreateFile("/file1", O_APPEND, 0, -1, &blocks_to_remove));
+    // Open again once the first one finished
+    reopened.set_version(6);
+    ASSERT_TRUE(ns.UpdateFileInfo(reopened));
+    ASSERT_EQ(kOK, ns.CreateFile("/file1", O_APPEND, 0, -1, &blocks_to_remove));
+    // Nor to a directory or an erasure coded file
+    ASSERT_EQ(kOK, ns.CreateFile("/dir1/file2", 0, 0, -1, &blocks_to_remove));
+    ASSERT_EQ(kFileExists, ns.CreateFile("/dir1", O_APPEND, 0, -1, &blocks_to_remove));
+    EcLayout ec;
+    ec.set_data_num(6);
+    ec.set_parity_num(3);
+    ec.set_cell_size(1024);
+    ASSERT_EQ(kOK, ns.CreateFile("/file3", 0, 0, -1, &blocks_to_remove, NULL, &ec));
+    ASSERT_EQ(kBadParameter, ns.CreateFile("/file3", O_APPEND, 0, -1, &blocks_to_remove));
+}
+
+TEST_F(NameSpaceTest, CancelReopen) {
+    FLAGS_namedb_path = "./db";
+    system("rm -rf ./db");
+    NameSpace ns;
+    std::vector<int64_t> blocks_to_remove;
+    ASSERT_EQ(kOK, ns.CreateFile("/file1", 0, 0, -1, &blocks_to_remove));
+    FileInfo info;
+    ASSERT_TRUE(ns.GetFileInfo("/file1", &info));
+    info.add_blocks(1);
+    info.set_version(5);
+    info.set_size(100);
+    ASSERT_TRUE(ns.UpdateFileInfo(info));
+    FileInfo sealed;
+    ASSERT_EQ(kOK, ns.CreateFile("/file1", O_APPEND, 0, -1, &blocks_to_remove,
+                                 NULL, NULL, NULL, &sealed));
+    int64_t reopen_time = time(NULL);
+    // The writer is gone, the file is sealed at its old version and can be appended to again
+    ASSERT_TRUE(ns.CancelReopen("/file1", sealed, reopen_time, NULL));
+    ASSERT_TRUE(ns.GetFileInfo("/file1", &info));
+    ASSERT_EQ(5, info.version());
+    ASSERT_EQ(100, info.size());
+    ASSERT_FALSE(ns.CancelReopen("/file1", sealed, reopen_time, NULL));
+    ASSERT_EQ(kOK, ns.CreateFile("/file1", O_APPEND, 0, -1, &blocks_to_remove,
+                                 NULL, NULL, NULL, &sealed));
+    // Not once the writer finished and another one reopened the file
+    ASSERT_TRUE(ns.GetFileInfo("/file1", &info));
+    info.set_version(6);
+    info.set_size(150);
+    ASSERT_TRUE(ns.UpdateFileInfo(info));
+    ASSERT_EQ(kOK, ns.CreateFile("/file1", O_APPEND, 0, -1, &blocks_to_remove));
+    ASSERT_FALSE(ns.CancelReopen("/file1", sealed, reopen_time, NULL));
+    ASSERT_TRUE(ns.GetFileInfo("/file1", &info));
+    ASSERT_EQ(-1, info.version());
+    ASSERT_EQ(150, info.size());
+}
+
 TEST_F(NameSpaceTest, List) {
     FLAGS_namedb_path = "./db";
     system("rm -rf ./db");
@@ -0,0 +1,236 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "nameserver/rebalancer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <map>
+#include <set>
+
+#include <gtest/gtest.h>
+
+namespace baidu {
+namespace bfs {
+
+namespace {
+
+const int64_t kMB = 1024 * 1024;
+const int64_t kBlockSize = 64 * kMB;
+
+/// Time-stepped model of a cluster moving replicas the way the nameserver does:
+/// every second each chunkserver reports, gets up to recover_size moves planned,
+/// and the copy lands before the next report.
+class RebalanceSimulator {
+public:
+    RebalanceSimulator(int64_t node_bandwidth, int32_t recover_size, double threshold)
+        : planner_(node_bandwidth, 0), rebalancer_(threshold),
+          recover_size_(recover_size), next_block_(0), moved_(0) {
+    }
+    int32_t AddNode(const std::string& rack, int64_t quota) {
+        int32_t id = servers_.size();
+        servers_.push_back(Rebalancer::Server(id, rack, 0, quota));
+        return id;
+    }
+    /// Write blocks with `replica` copies to the given nodes, round robin
+    void Fill(const std::vector<int32_t>& nodes, int32_t block_num, int32_t replica) {
+        for (int32_t i = 0; i < block_num; ++i) {
+            int64_t block_id = next_block_++;
+            for (int32_t r = 0; r < replica; ++r) {
+                int32_t id = nodes[(i + r) % nodes.size()];
+                AddReplica(block_id, id);
+            }
+        }
+    }
+    /// Run until no moves are planned for `idle` seconds, return seconds used
+    int32_t Run(int32_t max_seconds) {
+        int32_t idle = 0;
+        int32_t t = 0;
+        for (; t < max_seconds && idle < 3; ++t) {
+            int64_t now = static_cast<int64_t>(t) * 1000000;
+            int32_t moves = 0;
+            for (size_t i = 0; i < servers_.size(); ++i) {
+                moves += Step(servers_[i].id, now);
+            }
+            idle = moves ? 0 : idle + 1;
+        }
+        return t;
+    }
+    double MaxUsage() const {
+        double usage = 0;
+        for (size_t i = 0; i < servers_.size(); ++i) {
+            usage = std::max(usage, servers_[i].Usage());
+        }
+        return usage;
+    }
+    double MinUsage() const {
+        double usage = 1;
+        for (size_t i = 0; i < servers_.size(); ++i) {
+            usage = std::min(usage, servers_[i].Usage());
+        }
+        return usage;
+    }
+    double Mean() const {
+        return Rebalancer::MeanUsage(servers_);
+    }
+    int64_t MaxTraffic() const {
+        int64_t traffic = 0;
+        for (std::map<int32_t, int64_t>::const_iterator it = traffic_.begin();
+             it != traffic_.end(); ++it) {
+            traffic = std::max(traffic, it->second);
+        }
+        return traffic;
+    }
+    int64_t TotalMoved() const { return moved_; }
+    /// Every block keeps exactly `replica` copies on distinct nodes
+    bool ReplicaIntact(int32_t replica) const {
+        for (std::map<int64_t, std::set<int32_t> >::const_iterator it = blocks_.begin();
+             it != blocks_.end(); ++it) {
+            if (static_cast<int32_t>(it->second.size()) != replica) {
+                return false;
+            }
+        }
+        return true;
+    }
+private:
+    void AddReplica(int64_t block_id, int32_t id) {
+        blocks_[block_id].insert(id);
+        node_blocks_[id].insert(block_id);
+        servers_[id].data_size += kBlockSize;
+    }
+    void RemoveReplica(int64_t block_id, int32_t id) {
+        blocks_[block_id].erase(id);
+        node_blocks_[id].erase(block_id);
+        servers_[id].data_size -= kBlockSize;
+    }
+    int32_t Step(int32_t id, int64_t now) {
+        std::vector<RecoverItem> items;
+        const std::set<int64_t>& blocks = node_blocks_[id];
+        for (std::set<int64_t>::const_iterator it = blocks.begin();
+             it != blocks.end() && items.size() < 4U * recover_size_; ++it) {
+            items.push_back(RecoverItem());
+            items.back().block_id = *it;
+            items.back().block_size = kBlockSize;
+            items.back().replica = blocks_[*it];
+        }
+        std::vector<RebalanceMove> moves;
+        rebalancer_.Plan(servers_[id], servers_, items, recover_size_, &planner_, now, &moves);
+        for (size_t i = 0; i < moves.size(); ++i) {
+            const RebalanceMove& move = moves[i];
+            EXPECT_EQ(move.src, id);
+            EXPECT_TRUE(blocks_[move.block_id].count(move.dest) == 0);
+            AddReplica(move.block_id, move.dest);
+            RemoveReplica(move.block_id, move.src);
+            traffic_[move.src] += move.block_size;
+            traffic_[move.dest] += move.block_size;
+            moved_ += move.block_size;
+        }
+        return moves.size();
+    }
+private:
+    RecoverPlanner planner_;
+    Rebalancer rebalancer_;
+    int32_t recover_size_;
+    int64_t next_block_;
+    std::vector<Rebalancer::Server> servers_;
+    std::map<int64_t, std::set<int32_t> > blocks_;
+    std::map<int32_t, std::set<int64_t> > node_blocks_;
+    std::map<int32_t, int64_t> traffic_;
+    int64_t moved_;
+};
+
+}
+
+TEST(RebalancerTest, Disabled) {
+    RecoverPlanner planner(0, 0);
+    Rebalancer rebalancer(0);
+    std::vector<Rebalancer::Server> servers;
+    servers.push_back(Rebalancer::Server(0, "r1", 900 * kMB, 1000 * kMB));
+    servers.push_back(Rebalancer::Server(1, "r1", 0, 1000 * kMB));
+    std::vector<RecoverItem> items(1);
+    items[0].block_id = 1;
+    items[0].block_size = kBlockSize;
+    items[0].replica.insert(0);
+    std::vector<RebalanceMove> moves;
+    ASSERT_EQ(rebalancer.Plan(servers[0], servers, items, 10, &planner, 0, &moves), 0);
+    rebalancer.SetThreshold(0.1);
+    ASSERT_EQ(rebalancer.Plan(servers[0], servers, items, 10, &planner, 0, &moves), 1);
+    ASSERT_EQ(moves[0].dest, 1);
+    // An emptier server is never a source
+    moves.clear();
+    ASSERT_EQ(rebalancer.Plan(servers[1], servers, items, 10, &planner, 0, &moves), 0);
+}
+
+TEST(RebalancerTest, SkipReplicaHolders) {
+    RecoverPlanner planner(0, 0);
+    Rebalancer rebalancer(0.1);
+    std::vector<Rebalancer::Server> servers;
+    servers.push_back(Rebalancer::Server(0, "r1", 900 * kMB, 1000 * kMB));
+    servers.push_back(Rebalancer::Server(1, "r1", 0, 1000 * kMB));
+    servers.push_back(Rebalancer::Server(2, "r2", 100 * kMB, 1000 * kMB));
+    std::vector<RecoverItem> items(1);
+    items[0].block_id = 1;
+    items[0].block_size = kBlockSize;
+    items[0].replica.insert(0);
+    items[0].replica.insert(1);
+    std::vector<RebalanceMove> moves;
+    ASSERT_EQ(rebalancer.Plan(servers[0], servers, items, 10, &planner, 0, &moves), 1);
+    ASSERT_EQ(moves[0].dest, 2);
+}
+
+TEST(RebalancerTest, ConvergeAfterAddingNodes) {
+    const int64_t kNodeBandwidth = 100 * kMB;
+    const int64_t kQuota = 64 * 1024 * kMB;
+    const double kThreshold = 0.1;
+    RebalanceSimulator sim(kNodeBandwidth, 10, kThreshold);
+    std::vector<int32_t> old_nodes;
+    char rack[16];
+    for (int i = 0; i < 12; ++i) {
+        snprintf(rack, sizeof(rack), "r%d", i % 3);
+        old_nodes.push_back(sim.AddNode(rack, kQuota));
+    }
+    // Old nodes are 80% used, then four empty nodes join
+    sim.Fill(old_nodes, 12 * 819 / 3, 3);
+    for (int i = 0; i < 4; ++i) {
+        snprintf(rack, sizeof(rack), "r%d", i % 3);
+        sim.AddNode(rack, kQuota);
+    }
+    double mean = sim.Mean();
+    ASSERT_NEAR(mean, 0.6, 0.01);
+    ASSERT_NEAR(sim.MinUsage(), 0, 0.001);
+
+    int32_t seconds = sim.Run(3600);
+    double block_usage = static_cast<double>(kBlockSize) / kQuota;
+    printf("Converged in %ds, moved %ldMB, usage %.3f-%.3f mean %.3f\n",
+           seconds, sim.TotalMoved() / kMB, sim.MinUsage(), sim.MaxUsage(), mean);
+    ASSERT_LT(seconds, 3600);
+    ASSERT_LE(sim.MaxUsage(), mean + kThreshold + block_usage);
+    // The new nodes took a share of the data
+    ASSERT_GE(sim.MinUsage(), mean - kThreshold - block_usage);
+    ASSERT_TRUE(sim.ReplicaIntact(3));
+    // No node moved more than its budget, plus the burst and one block of debt
+    ASSERT_LE(sim.MaxTraffic(), kNodeBandwidth * (seconds + 2) + kBlockSize);
+}
+
+TEST(RebalancerTest, BalancedClusterStaysIdle) {
+    RebalanceSimulator sim(100 * kMB, 10, 0.1);
+    std::vector<int32_t> nodes;
+    for (int i = 0; i < 6; ++i) {
+        nodes.push_back(sim.AddNode("r1", 1024 * kMB));
+    }
+    sim.Fill(nodes, 20, 3);
+    ASSERT_LE(sim.Run(100), 3);
+    ASSERT_EQ(sim.TotalMoved(), 0);
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,323 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "nameserver/recover_planner.h"
+
+#include <stdio.h>
+#include <algorithm>
+#include <list>
+
+#include <gtest/gtest.h>
+
+namespace baidu {
+namespace bfs {
+
+namespace {
+
+const int64_t kMB = 1024 * 1024;
+
+/// Deterministic time-stepped model of a cluster recovering from lost replicas.
+/// Every node link is shared fairly by the transfers running on it, and
+/// cross-rack transfers also share the rack uplinks.
+class RecoverSimulator {
+public:
+    struct Config {
+        int32_t node_num;
+        int32_t rack_num;
+        int64_t block_size;
+        int32_t expect_replica;
+        int64_t node_capacity;
+        int64_t rack_capacity;
+        int32_t recover_size;       /// max pending recover per source, like recover_speed
+        int32_t recover_timeout;    /// seconds
+    };
+    struct Result {
+        int32_t full_redundancy_time;
+        int32_t hi_redundancy_time;
+        int32_t max_node_transfers;
+        int32_t timeouts;
+    };
+    RecoverSimulator(const Config& conf, bool use_planner)
+        : conf_(conf), use_planner_(use_planner), seed_(301),
+          planner_(conf.node_capacity, conf.rack_capacity) {}
+    void AddBlock(const std::set<int32_t>& replica) {
+        RecoverItem item;
+        item.block_id = blocks_.size();
+        item.block_size = conf_.block_size;
+        item.replica = replica;
+        blocks_.push_back(item);
+        pending_.push_back(item.block_id);
+    }
+    Result Run(int32_t max_time);
+    uint32_t Random() {
+        seed_ = seed_ * 1103515245 + 12345;
+        return (seed_ >> 16) & 0x7fff;
+    }
+private:
+    struct Transfer {
+        int64_t block_id;
+        int32_t src;
+        int32_t dest;
+        int64_t left;
+        int32_t start;
+    };
+    std::string Rack(int32_t id) const {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "rack%d", id % conf_.rack_num);
+        return buf;
+    }
+    void Schedule(int32_t now);
+    void Progress(int32_t now, Result* result);
+    bool HiDone() const {
+        for (size_t i = 0; i < blocks_.size(); ++i) {
+            if (blocks_[i].replica.size() < 2) {
+                return false;
+            }
+        }
+        return true;
+    }
+private:
+    Config conf_;
+    bool use_planner_;
+    uint32_t seed_;
+    RecoverPlanner planner_;
+    std::vector<RecoverItem> blocks_;
+    std::list<int64_t> pending_;
+    std::list<Transfer> transfers_;
+};
+
+void RecoverSimulator::Schedule(int32_t now) {
+    std::vector<int32_t> inflight(conf_.node_num, 0);
+    for (std::list<Transfer>::iterator it = transfers_.begin(); it != transfers_.end(); ++it) {
+        ++inflight[it->src];
+    }
+    std::vector<RecoverItem> items;
+    for (std::list<int64_t>::iterator it = pending_.begin(); it != pending_.end(); ++it) {
+        items.push_back(blocks_[*it]);
+    }
+    if (use_planner_) {
+        RecoverPlanner::SortByRedundancy(items.begin(), items.end());
+    }
+    std::set<int64_t> scheduled;
+    for (size_t i = 0; i < items.size(); ++i) {
+        const RecoverItem& item = items[i];
+        // Every replica holder picks blocks on its heartbeat, the first one with quota wins
+        int32_t src = -1;
+        for (std::set<int32_t>::const_iterator r = item.replica.begin();
+             r != item.replica.end(); ++r) {
+            if (inflight[*r] < conf_.recover_size) {
+                src = *r;
+                break;
+            }
+        }
+        if (src == -1) {
+            continue;
+        }
+        int32_t dest = -1;
+        if (use_planner_) {
+            std::vector<RecoverPlanner::Node> candidates;
+            for (int32_t n = 0; n < conf_.node_num; ++n) {
+                if (item.replica.find(n) == item.replica.end()) {
+                    candidates.push_back(RecoverPlanner::Node(n, Rack(n), 0.0));
+                }
+            }
+            std::vector<int32_t> dests;
+            if (!planner_.Plan(RecoverPlanner::Node(src, Rack(src), 0.0), item.block_size,
+                               candidates, 5, static_cast<int64_t>(now) * 1000000, &dests)) {
+                continue;
+            }
+            dest = dests[0];
+        } else {
+            do {
+                dest = Random() % conf_.node_num;
+            } while (item.replica.find(dest) != item.replica.end());
+        }
+        Transfer t = {item.block_id, src, dest, item.block_size, now};
+        transfers_.push_back(t);
+        ++inflight[src];
+        scheduled.insert(item.block_id);
+    }
+    for (std::list<int64_t>::iterator it = pending_.begin(); it != pending_.end();) {
+        if (scheduled.find(*it) != scheduled.end()) {
+            it = pending_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void RecoverSimulator::Progress(int32_t now, Result* result) {
+    std::vector<int32_t> node_transfers(conf_.node_num, 0);
+    std::map<std::string, int32_t> rack_transfers;
+    for (std::list<Transfer>::iterator it = transfers_.begin(); it != transfers_.end(); ++it) {
+        ++node_transfers[it->src];
+        ++node_transfers[it->dest];
+        if (Rack(it->src) != Rack(it->dest)) {
+            ++rack_transfers[Rack(it->src)];
+            ++rack_transfers[Rack(it->dest)];
+        }
+    }
+    for (int32_t n = 0; n < conf_.node_num; ++n) {
+        result->max_node_transfers = std::max(result->max_node_transfers, node_transfers[n]);
+    }
+    for (std::list<Transfer>::iterator it = transfers_.begin(); it != transfers_.end();) {
+        int64_t rate = std::min(conf_.node_capacity / node_transfers[it->src],
+                                conf_.node_capacity / node_transfers[it->dest]);
+        if (Rack(it->src) != Rack(it->dest)) {
+            rate = std::min(rate, conf_.rack_capacity / rack_transfers[Rack(it->src)]);
+            rate = std::min(rate, conf_.rack_capacity / rack_transfers[Rack(it->dest)]);
+        }
+        it->left -= rate;
+        RecoverItem& block = blocks_[it->block_id];
+        if (it->left <= 0) {
+            block.replica.insert(it->dest);
+            if (static_cast<int32_t>(block.replica.size()) < conf_.expect_replica) {
+                pending_.push_back(block.block_id);
+            }
+            it = transfers_.erase(it);
+        } else if (now - it->start >= conf_.recover_timeout) {
+            ++result->timeouts;
+            pending_.push_back(block.block_id);
+            it = transfers_.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+RecoverSimulator::Result RecoverSimulator::Run(int32_t max_time) {
+    Result result = {-1, -1, 0, 0};
+    for (int32_t now = 0; now < max_time; ++now) {
+        if (result.hi_redundancy_time == -1 && HiDone()) {
+            result.hi_redundancy_time = now;
+        }
+        if (pending_.empty() && transfers_.empty()) {
+            result.full_redundancy_time = now;
+            break;
+        }
+        Schedule(now);
+        Progress(now, &result);
+    }
+    return result;
+}
+
+/// A node of a 3 replica cluster is lost, a few blocks were also on a second failed node
+void BuildLostNode(RecoverSimulator* sim, int32_t node_num, int32_t block_num, int32_t hi_num) {
+    for (int32_t i = 0; i < block_num; ++i) {
+        std::set<int32_t> replica;
+        int32_t live = i < hi_num ? 1 : 2;
+        while (static_cast<int32_t>(replica.size()) < live) {
+            replica.insert(sim->Random() % node_num);
+        }
+        sim->AddBlock(replica);
+    }
+}
+
+RecoverSimulator::Config DefaultConfig() {
+    RecoverSimulator::Config conf;
+    conf.node_num = 40;
+    conf.rack_num = 4;
+    conf.block_size = 256 * kMB;
+    conf.expect_replica = 3;
+    conf.node_capacity = 100 * kMB;
+    conf.rack_capacity = 1000 * kMB;
+    conf.recover_size = 10;
+    conf.recover_timeout = 180;
+    return conf;
+}
+
+}
+
+class RecoverPlannerTest : public ::testing::Test {
+};
+
+TEST_F(RecoverPlannerTest, SortByRedundancy) {
+    std::vector<RecoverItem> items(3);
+    items[0].block_id = 1;
+    items[0].replica.insert(1);
+    items[0].replica.insert(2);
+    items[1].block_id = 2;
+    items[1].replica.insert(3);
+    items[2].block_id = 3;
+    items[2].replica.insert(4);
+    items[2].replica.insert(5);
+    RecoverPlanner::SortByRedundancy(items.begin(), items.end());
+    ASSERT_EQ(items[0].block_id, 2);
+    ASSERT_EQ(items[1].block_id, 1);
+    ASSERT_EQ(items[2].block_id, 3);
+}
+
+TEST_F(RecoverPlannerTest, NodeBudget) {
+    // 100 bytes/s and a 2 seconds burst, so a node can take 2 blocks of 100 bytes
+    RecoverPlanner planner(100, 0);
+    std::vector<RecoverPlanner::Node> candidates;
+    candidates.push_back(RecoverPlanner::Node(2, "r1", 0.1));
+    candidates.push_back(RecoverPlanner::Node(3, "r1", 0.5));
+    RecoverPlanner::Node src(1, "r0", 0.0);
+    std::vector<int32_t> dests;
+    ASSERT_TRUE(planner.Plan(src, 100, candidates, 5, 0, &dests));
+    ASSERT_EQ(dests.size(), 2U);
+    ASSERT_EQ(dests[0], 2);
+    dests.clear();
+    // C2 was charged, C3 has more budget now
+    ASSERT_TRUE(planner.Plan(src, 100, candidates, 5, 0, &dests));
+    ASSERT_EQ(dests[0], 3);
+    dests.clear();
+    ASSERT_FALSE(planner.HasBudget(src, 0));
+    ASSERT_FALSE(planner.Plan(src, 100, candidates, 5, 0, &dests));
+    // Refilled after one second
+    ASSERT_TRUE(planner.HasBudget(src, 1000000));
+    ASSERT_TRUE(planner.Plan(src, 100, candidates, 5, 1000000, &dests));
+}
+
+TEST_F(RecoverPlannerTest, RackBudget) {
+    RecoverPlanner planner(0, 100);
+    std::vector<RecoverPlanner::Node> candidates;
+    candidates.push_back(RecoverPlanner::Node(2, "r1", 0.0));
+    RecoverPlanner::Node src(1, "r0", 0.0);
+    std::vector<int32_t> dests;
+    ASSERT_TRUE(planner.Plan(src, 300, candidates, 5, 0, &dests));
+    dests.clear();
+    ASSERT_FALSE(planner.Plan(src, 300, candidates, 5, 0, &dests));
+    // Same rack transfers don't use the rack budget
+    candidates.push_back(RecoverPlanner::Node(3, "r0", 0.9));
+    ASSERT_TRUE(planner.Plan(src, 300, candidates, 5, 0, &dests));
+    ASSERT_EQ(dests.size(), 1U);
+    ASSERT_EQ(dests[0], 3);
+}
+
+TEST_F(RecoverPlannerTest, TimeToFullRedundancy) {
+    RecoverSimulator::Config conf = DefaultConfig();
+    RecoverSimulator greedy(conf, false);
+    BuildLostNode(&greedy, conf.node_num, 2000, 100);
+    RecoverSimulator::Result greedy_result = greedy.Run(36000);
+
+    RecoverSimulator planned(conf, true);
+    BuildLostNode(&planned, conf.node_num, 2000, 100);
+    RecoverSimulator::Result planned_result = planned.Run(36000);
+
+    printf("greedy: full redundancy %ds, hi %ds, max transfers per node %d, timeouts %d\n",
+           greedy_result.full_redundancy_time, greedy_result.hi_redundancy_time,
+           greedy_result.max_node_transfers, greedy_result.timeouts);
+    printf("planner: full redundancy %ds, hi %ds, max transfers per node %d, timeouts %d\n",
+           planned_result.full_redundancy_time, planned_result.hi_redundancy_time,
+           planned_result.max_node_transfers, planned_result.timeouts);
+    ASSERT_NE(planned_result.full_redundancy_time, -1);
+    ASSERT_NE(greedy_result.full_redundancy_time, -1);
+    // Budgets cost little total throughput, but single replica blocks are fixed much sooner
+    ASSERT_LE(planned_result.full_redundancy_time, greedy_result.full_redundancy_time * 11 / 10);
+    ASSERT_LT(planned_result.hi_redundancy_time, greedy_result.hi_redundancy_time);
+    ASSERT_LT(planned_result.max_node_transfers, greedy_result.max_node_transfers);
+    ASSERT_EQ(planned_result.timeouts, 0);
+}
+
+}
+}
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
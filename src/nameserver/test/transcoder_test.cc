@@ -0,0 +1,169 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "nameserver/transcoder.h"
+
+#include <vector>
+
+#include <gtest/gtest.h>
+
+namespace baidu {
+namespace bfs {
+
+namespace {
+
+const int64_t kMB = 1024 * 1024;
+const int64_t kAge = 3600;
+const int64_t kNow = 1000000;
+
+/// A closed 3 replica file of one block, created at ctime
+FileInfo ClosedFile(int64_t block_id, int64_t size, int64_t ctime) {
+    FileInfo info;
+    info.set_entry_id(block_id + 100);
+    info.set_name("f");
+    info.set_type(0644);
+    info.set_version(1);
+    info.set_size(size);
+    info.set_replicas(3);
+    info.set_ctime(ctime);
+    info.add_blocks(block_id);
+    return info;
+}
+
+TranscodeTask MakeTask(int64_t block_id, int32_t source) {
+    TranscodeTask task;
+    task.file_info = ClosedFile(block_id, 100 * kMB, 0);
+    task.block_id = block_id;
+    task.group_id = block_id * 10;
+    task.ec.set_data_num(6);
+    task.ec.set_parity_num(3);
+    task.ec.set_cell_size(kMB);
+    task.source = source;
+    for (int32_t i = 0; i < 9; i++) {
+        task.units.push_back(i);
+    }
+    task.state = kTranscodeQueued;
+    task.start_time = kNow;
+    return task;
+}
+
+}
+
+class TranscoderTest : public ::testing::Test {
+};
+
+TEST_F(TranscoderTest, IsCold) {
+    Transcoder transcoder(kAge, 64 * kMB, 10);
+    FileInfo cold = ClosedFile(1, 64 * kMB, kNow - kAge);
+    ASSERT_TRUE(transcoder.IsCold(cold, kNow));
+
+    FileInfo young = cold;
+    young.set_ctime(kNow - kAge + 1);
+    ASSERT_FALSE(transcoder.IsCold(young, kNow));
+    FileInfo small = cold;
+    small.set_size(64 * kMB - 1);
+    ASSERT_FALSE(transcoder.IsCold(small, kNow));
+    FileInfo writing = cold;
+    writing.set_version(-1);
+    ASSERT_FALSE(transcoder.IsCold(writing, kNow));
+    FileInfo single = cold;
+    single.set_replicas(1);
+    ASSERT_FALSE(transcoder.IsCold(single, kNow));
+    FileInfo coded = cold;
+    coded.mutable_ec()->set_data_num(6);
+    ASSERT_FALSE(transcoder.IsCold(coded, kNow));
+    FileInfo dir = cold;
+    dir.set_type((1 << 9) | 0755);
+    ASSERT_FALSE(transcoder.IsCold(dir, kNow));
+
+    Transcoder disabled(0, 0, 10);
+    ASSERT_FALSE(disabled.IsCold(cold, kNow));
+}
+
+TEST_F(TranscoderTest, Lifecycle) {
+    Transcoder transcoder(kAge, 0, 2);
+    ASSERT_EQ(transcoder.Available(), 2);
+    ASSERT_TRUE(transcoder.Add(MakeTask(1, 7)));
+    ASSERT_FALSE(transcoder.Add(MakeTask(1, 8)));
+    ASSERT_TRUE(transcoder.Add(MakeTask(2, 8)));
+    ASSERT_EQ(transcoder.Available(), 0);
+
+    // Only the source gets a task, and only once
+    std::vector<TranscodeTask> tasks;
+    transcoder.TakeTasks(9, &tasks);
+    ASSERT_TRUE(tasks.empty());
+    transcoder.TakeTasks(7, &tasks);
+    ASSERT_EQ(tasks.size(), 1U);
+    ASSERT_EQ(tasks[0].block_id, 1);
+    tasks.clear();
+    transcoder.TakeTasks(7, &tasks);
+    ASSERT_TRUE(tasks.empty());
+
+    TranscodeTask failed;
+    ASSERT_FALSE(transcoder.Report(2, 20, true, &failed));  // not running yet
+    ASSERT_FALSE(transcoder.Report(1, 20, true, &failed));  // other group
+    ASSERT_TRUE(transcoder.Report(1, 10, true, &failed));
+    transcoder.GetWritten(&tasks);
+    ASSERT_EQ(tasks.size(), 1U);
+    ASSERT_EQ(tasks[0].group_id, 10);
+
+    Transcoder::Stats stats;
+    transcoder.GetStats(&stats);
+    ASSERT_EQ(stats.queued, 1);
+    ASSERT_EQ(stats.running, 0);
+    ASSERT_EQ(stats.written, 1);
+
+    transcoder.Finish(1, true);
+    ASSERT_EQ(transcoder.Available(), 1);
+    transcoder.GetStats(&stats);
+    ASSERT_EQ(stats.done, 1);
+    ASSERT_EQ(stats.done_bytes, 100 * kMB);
+    // 300MB of replicas become 100MB of data units and three 17MB parity units
+    ASSERT_EQ(stats.saved_bytes, 149 * kMB);
+}
+
+TEST_F(TranscoderTest, FailAndExpire) {
+    Transcoder transcoder(kAge, 0, 10);
+    ASSERT_TRUE(transcoder.Add(MakeTask(1, 7)));
+    ASSERT_TRUE(transcoder.Add(MakeTask(2, 7)));
+    std::vector<TranscodeTask> tasks;
+    transcoder.TakeTasks(7, &tasks);
+    ASSERT_EQ(tasks.size(), 2U);
+
+    TranscodeTask failed;
+    ASSERT_TRUE(transcoder.Report(1, 10, false, &failed));
+    ASSERT_EQ(failed.group_id, 10);
+    ASSERT_EQ(failed.units.size(), 9U);
+
+    std::vector<TranscodeTask> expired;
+    transcoder.RemoveExpired(kNow + 10, 10, &expired);
+    ASSERT_EQ(expired.size(), 1U);
+    ASSERT_EQ(expired[0].block_id, 2);
+    ASSERT_EQ(transcoder.Available(), 10);
+
+    Transcoder::Stats stats;
+    transcoder.GetStats(&stats);
+    ASSERT_EQ(stats.failed, 2);
+    ASSERT_EQ(stats.done, 0);
+}
+
+TEST_F(TranscoderTest, SavedBytes) {
+    EcLayout ec;
+    ec.set_data_num(6);
+    ec.set_parity_num(3);
+    ec.set_cell_size(100);
+    // One full stripe and 250 bytes, parity units are 200 bytes each
+    ASSERT_EQ(Transcoder::SavedBytes(850, 3, ec), 850 * 3 - 850 - 600);
+    ASSERT_EQ(Transcoder::SavedBytes(0, 3, ec), 0);
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,146 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "nameserver/transcoder.h"
+
+#include <common/logging.h>
+
+#include "ec/ec_layout.h"
+
+namespace baidu {
+namespace bfs {
+
+Transcoder::Transcoder(int64_t min_age, int64_t min_size, int32_t max_tasks)
+    : min_age_(min_age), min_size_(min_size), max_tasks_(max_tasks),
+      done_(0), failed_(0), done_bytes_(0), saved_bytes_(0) {
+}
+
+bool Transcoder::IsCold(const FileInfo& file_info, int64_t now) const {
+    if (min_age_ <= 0 || (file_info.type() & (1 << 9))) {
+        return false;
+    }
+    // Version is -1 while the file is written
+    return !file_info.has_ec() && file_info.blocks_size() == 1 && file_info.version() >= 0
+           && file_info.replicas() > 1 && file_info.size() >= min_size_
+           && file_info.ctime() + min_age_ <= now;
+}
+
+int32_t Transcoder::Available() const {
+    MutexLock lock(&mu_);
+    return max_tasks_ - static_cast<int32_t>(tasks_.size());
+}
+
+bool Transcoder::Add(const TranscodeTask& task) {
+    MutexLock lock(&mu_);
+    if (tasks_.find(task.block_id) != tasks_.end()) {
+        return false;
+    }
+    TranscodeTask& t = tasks_[task.block_id];
+    t = task;
+    t.state = kTranscodeQueued;
+    return true;
+}
+
+void Transcoder::TakeTasks(int32_t cs_id, std::vector<TranscodeTask>* tasks) {
+    MutexLock lock(&mu_);
+    std::map<int64_t, TranscodeTask>::iterator it = tasks_.begin();
+    for (; it != tasks_.end(); ++it) {
+        if (it->second.state == kTranscodeQueued && it->second.source == cs_id) {
+            it->second.state = kTranscodeRunning;
+            tasks->push_back(it->second);
+        }
+    }
+}
+
+bool Transcoder::Report(int64_t block_id, int64_t group_id, bool ok, TranscodeTask* task) {
+    MutexLock lock(&mu_);
+    std::map<int64_t, TranscodeTask>::iterator it = tasks_.find(block_id);
+    if (it == tasks_.end() || it->second.group_id != group_id
+        || it->second.state != kTranscodeRunning) {
+        return false;
+    }
+    if (ok) {
+        it->second.state = kTranscodeWritten;
+    } else {
+        *task = it->second;
+        tasks_.erase(it);
+        ++failed_;
+    }
+    return true;
+}
+
+void Transcoder::GetWritten(std::vector<TranscodeTask>* tasks) const {
+    MutexLock lock(&mu_);
+    std::map<int64_t, TranscodeTask>::const_iterator it = tasks_.begin();
+    for (; it != tasks_.end(); ++it) {
+        if (it->second.state == kTranscodeWritten) {
+            tasks->push_back(it->second);
+        }
+    }
+}
+
+void Transcoder::RemoveExpired(int64_t now, int64_t timeout,
+                               std::vector<TranscodeTask>* expired) {
+    MutexLock lock(&mu_);
+    std::map<int64_t, TranscodeTask>::iterator it = tasks_.begin();
+    while (it != tasks_.end()) {
+        if (it->second.start_time + timeout <= now) {
+            LOG(INFO, "Transcode #%ld timeout in state %d", it->first, it->second.state);
+            expired->push_back(it->second);
+            tasks_.erase(it++);
+            ++failed_;
+        } else {
+            ++it;
+        }
+    }
+}
+
+void Transcoder::Finish(int64_t block_id, bool ok) {
+    MutexLock lock(&mu_);
+    std::map<int64_t, TranscodeTask>::iterator it = tasks_.find(block_id);
+    if (it == tasks_.end()) {
+        return;
+    }
+    if (ok) {
+        ++done_;
+        const FileInfo& file_info = it->second.file_info;
+        done_bytes_ += file_info.size();
+        saved_bytes_ += SavedBytes(file_info.size(), file_info.replicas(), it->second.ec);
+    } else {
+        ++failed_;
+    }
+    tasks_.erase(it);
+}
+
+void Transcoder::GetStats(Stats* stats) const {
+    MutexLock lock(&mu_);
+    stats->queued = stats->running = stats->written = 0;
+    std::map<int64_t, TranscodeTask>::const_iterator it = tasks_.begin();
+    for (; it != tasks_.end(); ++it) {
+        if (it->second.state == kTranscodeQueued) {
+            ++stats->queued;
+        } else if (it->second.state == kTranscodeRunning) {
+            ++stats->running;
+        } else {
+            ++stats->written;
+        }
+    }
+    stats->done = done_;
+    stats->failed = failed_;
+    stats->done_bytes = done_bytes_;
+    stats->saved_bytes = saved_bytes_;
+}
+
+int64_t Transcoder::SavedBytes(int64_t size, int32_t replicas, const EcLayout& ec) {
+    int64_t ec_bytes = 0;
+    for (int32_t i = 0; i < ec.data_num() + ec.parity_num(); i++) {
+        ec_bytes += EcUnitSize(size, ec.data_num(), ec.cell_size(), i);
+    }
+    return size * replicas - ec_bytes;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -0,0 +1,89 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef BFS_TRANSCODER_H_
+#define BFS_TRANSCODER_H_
+
+#include <stdint.h>
+#include <map>
+#include <vector>
+
+#include <common/mutex.h>
+
+#include "proto/file.pb.h"
+
+namespace baidu {
+namespace bfs {
+
+enum TranscodeState {
+    kTranscodeQueued = 0,   ///< waiting for the source's block report
+    kTranscodeRunning = 1,  ///< the source writes the units
+    kTranscodeWritten = 2,  ///< units are written, the layout is swapped once they are reported
+};
+
+/// Re-encoding of the single replicated block of a cold file into an erasure coded group
+struct TranscodeTask {
+    FileInfo file_info;             ///< as scanned, with name and parent_entry_id
+    int64_t block_id;               ///< the only block of file_info
+    int64_t group_id;
+    EcLayout ec;
+    int32_t source;                 ///< chunkserver holding a replica of block_id
+    std::vector<int32_t> units;     ///< chunkserver of every unit
+    TranscodeState state;
+    int64_t start_time;             ///< seconds, when the task was queued
+};
+
+/// Picks cold files and keeps track of the transcode tasks in flight. Thread safe.
+class Transcoder {
+public:
+    struct Stats {
+        int32_t queued;
+        int32_t running;
+        int32_t written;
+        int64_t done;
+        int64_t failed;
+        int64_t done_bytes;         ///< file bytes transcoded
+        int64_t saved_bytes;        ///< raw capacity freed
+    };
+    /// Closed files at least min_age seconds old and min_size bytes long are cold,
+    /// at most max_tasks of them are transcoded at a time
+    Transcoder(int64_t min_age, int64_t min_size, int32_t max_tasks);
+    /// A closed replicated file of one block, not changed for min_age before now
+    bool IsCold(const FileInfo& file_info, int64_t now) const;
+    /// Free slots for new tasks
+    int32_t Available() const;
+    /// False if the block is transcoded already
+    bool Add(const TranscodeTask& task);
+    /// Queued tasks of source cs_id, which are running from now on
+    void TakeTasks(int32_t cs_id, std::vector<TranscodeTask>* tasks);
+    /// The source finished writing block_id's units to group_id, failed tasks go to task
+    /// and are dropped. False if no such task is running.
+    bool Report(int64_t block_id, int64_t group_id, bool ok, TranscodeTask* task);
+    /// Tasks with units written, ready for the layout swap
+    void GetWritten(std::vector<TranscodeTask>* tasks) const;
+    /// Drop the tasks started timeout seconds before now
+    void RemoveExpired(int64_t now, int64_t timeout, std::vector<TranscodeTask>* expired);
+    /// Drop a task once its layout is swapped or given up
+    void Finish(int64_t block_id, bool ok);
+    void GetStats(Stats* stats) const;
+    /// Raw bytes of a file of size in replicas, less its erasure coded form
+    static int64_t SavedBytes(int64_t size, int32_t replicas, const EcLayout& ec);
+private:
+    int64_t min_age_;
+    int64_t min_size_;
+    int32_t max_tasks_;
+    mutable Mutex mu_;
+    std::map<int64_t, TranscodeTask> tasks_;    ///< by block_id
+    int64_t done_;
+    int64_t failed_;
+    int64_t done_bytes_;
+    int64_t saved_bytes_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  //BFS_TRANSCODER_H_
+
+/* vim: set expandtab ts=4 sw=4 sts=4 tw=100: */
@@ -29,12 +29,57 @@ namespace bfs {
 
 const char* StrError(int error_code);
 
+/// What Sync waits for on every replica. Close always waits for the block files
+/// to be written, and for disk with kWriteToDisk.
+enum WriteDurability {
+    kWriteToMemory = 0,     // data is in chunkserver buffers
+    kWriteToPageCache = 1,  // data is written to the block files
+    kWriteToDisk = 2        // data is fdatasynced
+};
+
+/// Where replicas keep the data of a file
+enum StoragePolicy {
+    kStoreOnDisk = 0,       // written to block files before close returns
+    kStoreInMemory = 1,     // chunkserver memory only, lost on chunkserver restart
+    kStoreLazyPersist = 2   // memory first, written to block files in background
+};
+
+/// Which media replicas of a file are placed on, for chunkservers with store paths
+/// tagged [ssd]. Blocks of kTierDefault files start on hdd and are moved to ssd
+/// and back by how often they are read, the others stay where they are placed.
+enum TierPolicy {
+    kTierDefault = 0,
+    kTierAllHdd = 1,
+    kTierOneSsd = 2,    // the first replica on ssd, the others on hdd
+    kTierAllSsd = 3
+};
+
 struct WriteOptions {
     int flush_timeout;  // in ms, <= 0 means do not timeout, == 0 means do not wait
     int sync_timeout;   // in ms, <= 0 means do not timeout, == 0 means do not wait
     int close_timeout;  // in ms, <= 0 means do not timeout, == 0 means do not wait
     int replica;
-    WriteOptions() : flush_timeout(-1), sync_timeout(-1), close_timeout(-1), replica(-1) {}
+    int64_t expected_size;  // expected file size in bytes, lets chunkservers preallocate, 0 for unknown
+    WriteDurability durability;
+    /// For small appends followed by Sync, like a write-ahead log: every Write is sent
+    /// at once, and Sync returns when a majority of replicas acked the data
+    bool wal_mode;
+    StoragePolicy storage_policy;
+    TierPolicy tier_policy;
+    /// Reed-Solomon code the file instead of replicating it: ec_data_num data blocks
+    /// and ec_parity_num parity blocks, 0 for a replicated file
+    int ec_data_num;
+    int ec_parity_num;
+    /// Bytes written to a block before the file goes on in a new one,
+    /// 0 for the sdk_block_size flag. Erasure coded files have one group.
+    int64_t block_size;
+    /// Stripe the file round robin over this many replicated blocks, written and
+    /// read in parallel, 0 or 1 for no striping. Units are sdk_stripe_unit_size bytes.
+    int stripe_width;
+    WriteOptions() : flush_timeout(-1), sync_timeout(-1), close_timeout(-1), replica(-1),
+                     expected_size(0), durability(kWriteToMemory), wal_mode(false),
+                     storage_policy(kStoreOnDisk), tier_policy(kTierDefault),
+                     ec_data_num(0), ec_parity_num(0), block_size(0), stripe_width(0) {}
 };
 
 struct ReadOptions {
@@ -95,7 +140,8 @@ public:
     virtual int32_t Stat(const char* path, BfsFileInfo* fileinfo) = 0;
     /// GetFileSize: get real file size
     virtual int32_t GetFileSize(const char* path, int64_t* file_size) = 0;
-    /// Open file for read or write, flags: O_WRONLY or O_RDONLY
+    /// Open file for read or write, flags: O_WRONLY or O_RDONLY.
+    /// O_WRONLY | O_APPEND writes after the end of an existing replicated file.
     virtual int32_t OpenFile(const char* path, int32_t flags, File** file,
                              const ReadOptions& options) = 0;
     virtual int32_t OpenFile(const char* path, int32_t flags, File** file,
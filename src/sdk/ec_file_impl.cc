@@ -0,0 +1,559 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+#include "ec_file_impl.h"
+
+#include <fcntl.h>
+#include <string.h>
+
+#include <gflags/gflags.h>
+
+#include <boost/bind.hpp>
+#include <common/logging.h>
+#include <common/timer.h>
+
+#include "proto/status_code.pb.h"
+#include "rpc/rpc_client.h"
+#include "rpc/nameserver_client.h"
+#include "ec/ec_layout.h"
+
+#include "fs_impl.h"
+
+DECLARE_int32(sdk_createblock_retry);
+DECLARE_int32(sdk_write_retry_times);
+
+namespace baidu {
+namespace bfs {
+
+/// Stripes sent to the units but not acked yet
+const int32_t kEcMaxInflightStripes = 8;
+
+EcFileImpl::EcFileImpl(FSImpl* fs, RpcClient* rpc_client, const std::string& name,
+                       int32_t flags, const EcLayout& ec, const WriteOptions& options)
+  : fs_(fs), rpc_client_(rpc_client), name_(name), open_flags_(flags), ec_(ec),
+    codec_(ec.data_num(), ec.parity_num()), unit_num_(ec.data_num() + ec.parity_num()),
+    group_id_(-1), replica_num_(1), stubs_(unit_num_, static_cast<ChunkServer_Stub*>(NULL)),
+    write_offset_(0), unit_offset_(0), last_seq_(-1), inflight_(0), bg_error_(false),
+    w_options_(options), bad_units_(unit_num_, false), unit_replica_(unit_num_, 0),
+    file_size_(0), read_offset_(0), closed_(false), write_cv_(&mu_) {
+    thread_pool_ = fs->thread_pool_;
+}
+
+EcFileImpl::EcFileImpl(FSImpl* fs, RpcClient* rpc_client, const std::string& name,
+                       int32_t flags, const EcLayout& ec, const ReadOptions& options)
+  : fs_(fs), rpc_client_(rpc_client), name_(name), open_flags_(flags), ec_(ec),
+    codec_(ec.data_num(), ec.parity_num()), unit_num_(ec.data_num() + ec.parity_num()),
+    group_id_(-1), replica_num_(1), stubs_(unit_num_, static_cast<ChunkServer_Stub*>(NULL)),
+    write_offset_(0), unit_offset_(0), last_seq_(-1), inflight_(0), bg_error_(false),
+    w_options_(WriteOptions()), bad_units_(unit_num_, false), unit_replica_(unit_num_, 0),
+    file_size_(0), read_offset_(0), closed_(false), write_cv_(&mu_) {
+    thread_pool_ = fs->thread_pool_;
+}
+
+EcFileImpl::~EcFileImpl() {
+    if (!closed_) {
+        Close();
+    }
+    for (size_t i = 0; i < stubs_.size(); i++) {
+        delete stubs_[i];
+    }
+    std::map<std::string, ChunkServer_Stub*>::iterator it;
+    for (it = read_stubs_.begin(); it != read_stubs_.end(); ++it) {
+        delete it->second;
+    }
+}
+
+int32_t EcFileImpl::AddBlock() {
+    mu_.AssertHeld();
+    AddBlockRequest request;
+    AddBlockResponse response;
+    request.set_sequence_id(0);
+    request.set_file_name(name_);
+    request.set_client_address(fs_->local_host_name_);
+    if (w_options_.tier_policy != kTierDefault) {
+        request.set_media_policy(static_cast<MediaPolicy>(w_options_.tier_policy));
+    }
+    bool ret = fs_->nameserver_client_->SendRequest(&NameServer_Stub::AddBlock,
+                                                    &request, &response, 15, 1);
+    if (!ret || !response.has_block() || response.block().chains_size() == 0
+        || response.block().chains_size() % unit_num_ != 0) {
+        LOG(WARNING, "Nameserver AddBlock fail: %s, ret= %d, status= %s",
+            name_.c_str(), ret, StatusCode_Name(response.status()).c_str());
+        if (!ret) {
+            return TIMEOUT;
+        } else {
+            return GetErrorCode(response.status());
+        }
+    }
+    const LocatedBlock& block = response.block();
+    replica_num_ = block.chains_size() / unit_num_;
+    chains_.clear();
+    for (int32_t i = 0; i < block.chains_size(); i++) {
+        chains_.push_back(block.chains(i).address());
+    }
+    bool has_media = block.chains_media_size() == block.chains_size();
+    for (int32_t u = 0; u < unit_num_; u++) {
+        delete stubs_[u];
+        stubs_[u] = NULL;
+        const std::string& addr = chains_[u * replica_num_];
+        rpc_client_->GetStub(addr, &stubs_[u]);
+        // Every unit is a block of its own, not chained to the others
+        WriteBlockRequest create_request;
+        WriteBlockResponse create_response;
+        create_request.set_sequence_id(common::timer::get_micros());
+        create_request.set_block_id(block.block_id() + u);
+        create_request.set_databuf("", 0);
+        create_request.set_offset(0);
+        create_request.set_is_last(false);
+        create_request.set_packet_seq(0);
+        if (w_options_.expected_size > 0) {
+            create_request.set_expected_size(EcUnitSize(w_options_.expected_size,
+                                                        ec_.data_num(), ec_.cell_size(), u));
+        }
+        if (w_options_.storage_policy != kStoreOnDisk) {
+            create_request.set_storage_class(static_cast<StorageClass>(w_options_.storage_policy));
+        }
+        for (int32_t r = 0; r < replica_num_; r++) {
+            if (replica_num_ > 1) {
+                create_request.add_chunkservers(chains_[u * replica_num_ + r]);
+            }
+            if (has_media) {
+                create_request.add_replica_media(block.chains_media(u * replica_num_ + r));
+            }
+        }
+        ret = rpc_client_->SendRequest(stubs_[u], &ChunkServer_Stub::WriteBlock,
+                                       &create_request, &create_response, 25, 1);
+        if (!ret || create_response.status() != kOK) {
+            LOG(WARNING, "Chunkserver AddBlock fail: %s unit %d on %s ret=%d status= %s",
+                name_.c_str(), u, addr.c_str(), ret,
+                StatusCode_Name(create_response.status()).c_str());
+            if (!ret) {
+                return TIMEOUT;
+            } else {
+                return GetErrorCode(create_response.status());
+            }
+        }
+    }
+    group_id_ = block.block_id();
+    last_seq_ = 0;
+    return OK;
+}
+
+int32_t EcFileImpl::Write(const char* buf, int32_t len) {
+    common::timer::AutoTimer at(100, "EcWrite", name_.c_str());
+    MutexLock lock(&mu_, "EcWrite", 1000);
+    if (!(open_flags_ & O_WRONLY) || closed_) {
+        return BAD_PARAMETER;
+    } else if (bg_error_) {
+        return TIMEOUT;
+    }
+    if (group_id_ < 0) {
+        int32_t ret = OK;
+        for (int i = 0; i < FLAGS_sdk_createblock_retry; i++) {
+            ret = AddBlock();
+            if (ret == OK) {
+                break;
+            }
+            sleep(10);
+        }
+        if (ret != OK) {
+            LOG(WARNING, "AddBlock fail for %s\n", name_.c_str());
+            return ret;
+        }
+    }
+    int64_t stripe_size = static_cast<int64_t>(ec_.data_num()) * ec_.cell_size();
+    int32_t w = 0;
+    while (w < len) {
+        int32_t n = std::min(static_cast<int64_t>(len - w),
+                             stripe_size - static_cast<int64_t>(stripe_buf_.size()));
+        stripe_buf_.append(buf + w, n);
+        w += n;
+        if (static_cast<int64_t>(stripe_buf_.size()) == stripe_size) {
+            if (!WaitInflight((kEcMaxInflightStripes - 1) * unit_num_)) {
+                return TIMEOUT;
+            }
+            SendStripe(false);
+        }
+    }
+    write_offset_ += w;
+    return w;
+}
+
+void EcFileImpl::SendStripe(bool is_last) {
+    mu_.AssertHeld();
+    int32_t data_num = ec_.data_num();
+    int64_t cell_size = ec_.cell_size();
+    int64_t len = stripe_buf_.size();
+    // Parity cells are as long as the first data cell, a partial stripe is padded with zeros
+    int64_t parity_len = std::min(len, cell_size);
+    stripe_buf_.resize(data_num * cell_size, '\0');
+    std::vector<std::string> parity(ec_.parity_num(), std::string(parity_len, '\0'));
+    if (parity_len > 0 && ec_.parity_num() > 0) {
+        std::vector<const char*> data;
+        std::vector<char*> out;
+        for (int32_t i = 0; i < data_num; i++) {
+            data.push_back(stripe_buf_.data() + i * cell_size);
+        }
+        for (int32_t i = 0; i < ec_.parity_num(); i++) {
+            out.push_back(&parity[i][0]);
+        }
+        codec_.Encode(&data[0], &out[0], parity_len);
+    }
+    ++last_seq_;
+    for (int32_t u = 0; u < unit_num_; u++) {
+        WriteBlockRequest* request = new WriteBlockRequest;
+        request->set_sequence_id(common::timer::get_micros());
+        request->set_block_id(group_id_ + u);
+        if (u < data_num) {
+            int64_t cell_len = std::max<int64_t>(0, std::min(len - u * cell_size, cell_size));
+            request->set_databuf(stripe_buf_.data() + u * cell_size, cell_len);
+        } else {
+            request->set_databuf(parity[u - data_num]);
+        }
+        request->set_offset(unit_offset_);
+        request->set_is_last(is_last);
+        request->set_packet_seq(last_seq_);
+        for (int32_t r = 0; replica_num_ > 1 && r < replica_num_; r++) {
+            request->add_chunkservers(chains_[u * replica_num_ + r]);
+        }
+        if (is_last && w_options_.durability == kWriteToDisk) {
+            request->set_durability(static_cast<Durability>(w_options_.durability));
+        }
+        ++inflight_;
+        SendUnitPacket(request, FLAGS_sdk_write_retry_times);
+    }
+    unit_offset_ += parity_len;
+    stripe_buf_.clear();
+}
+
+void EcFileImpl::SendUnitPacket(const WriteBlockRequest* request, int32_t retry_times) {
+    WriteBlockResponse* response = new WriteBlockResponse;
+    boost::function<void (const WriteBlockRequest*, WriteBlockResponse*, bool, int)> callback
+        = boost::bind(&EcFileImpl::WriteUnitCallback, this, _1, _2, _3, _4, retry_times);
+    rpc_client_->AsyncRequest(stubs_[request->block_id() - group_id_],
+                              &ChunkServer_Stub::WriteBlock,
+                              request, response, callback, 60, 1);
+}
+
+void EcFileImpl::WriteUnitCallback(const WriteBlockRequest* request,
+                                   WriteBlockResponse* response,
+                                   bool failed, int error,
+                                   int32_t retry_times) {
+    if (failed || response->status() != kOK) {
+        // There are no degraded writes, every unit has to take the packet
+        LOG(INFO, "EcWrite %s #%ld seq:%d, offset:%ld, len:%lu failed, error: %d status: %s",
+            name_.c_str(), request->block_id(), request->packet_seq(), request->offset(),
+            request->databuf().size(), error, StatusCode_Name(response->status()).c_str());
+        delete response;
+        MutexLock lock(&mu_, "EcWriteCallback retry", 1000);
+        if (!bg_error_ && retry_times > 1) {
+            thread_pool_->DelayTask(1000, boost::bind(&EcFileImpl::SendUnitPacket, this,
+                                                      request, retry_times - 1));
+            return;
+        }
+        LOG(WARNING, "EcWrite %s #%ld seq:%d error", name_.c_str(),
+            request->block_id(), request->packet_seq());
+        bg_error_ = true;
+    } else {
+        delete response;
+    }
+    delete request;
+    MutexLock lock(&mu_, "EcWriteCallback", 1000);
+    --inflight_;
+    write_cv_.Broadcast();
+}
+
+bool EcFileImpl::WaitInflight(int32_t max_inflight) {
+    mu_.AssertHeld();
+    while (inflight_ > max_inflight && !bg_error_) {
+        write_cv_.TimeWait(100, "EcWaitInflight");
+    }
+    return !bg_error_;
+}
+
+int32_t EcFileImpl::Flush() {
+    // Not implement
+    return 0;
+}
+
+int32_t EcFileImpl::Sync() {
+    common::timer::AutoTimer at(50, "EcSync", name_.c_str());
+    if (open_flags_ != O_WRONLY) {
+        return BAD_PARAMETER;
+    }
+    MutexLock lock(&mu_, "EcSync", 1000);
+    int64_t start = common::timer::get_micros();
+    while (inflight_ > 0 && !bg_error_) {
+        if (w_options_.sync_timeout >= 0
+            && (common::timer::get_micros() - start) / 1000 >= w_options_.sync_timeout) {
+            return TIMEOUT;
+        }
+        write_cv_.TimeWait(100, "EcSync wait");
+    }
+    return bg_error_ ? TIMEOUT : OK;
+}
+
+int32_t EcFileImpl::Close() {
+    common::timer::AutoTimer at(500, "EcClose", name_.c_str());
+    MutexLock lock(&mu_, "EcClose", 1000);
+    if (closed_) {
+        return OK;
+    }
+    closed_ = true;
+    if (group_id_ < 0 || !(open_flags_ & O_WRONLY)) {
+        return OK;
+    }
+    if (!bg_error_) {
+        SendStripe(true);
+    }
+    // Retries hold a pointer to this file, so wait for them even after an error
+    while (inflight_ > 0) {
+        write_cv_.TimeWait(1000, "EcClose wait");
+    }
+    FinishBlockRequest request;
+    FinishBlockResponse response;
+    request.set_sequence_id(0);
+    request.set_file_name(name_);
+    request.set_block_id(group_id_);
+    request.set_block_version(last_seq_);
+    request.set_block_size(write_offset_);
+    request.set_close_with_error(bg_error_);
+    bool rpc_ret = fs_->nameserver_client_->SendRequest(&NameServer_Stub::FinishBlock,
+                                                        &request, &response, 15, 1);
+    if (!(rpc_ret && response.status() == kOK)) {
+        LOG(WARNING, "Close file %s fail, finish report returns %d, status: %s",
+            name_.c_str(), rpc_ret, StatusCode_Name(response.status()).c_str());
+        if (!rpc_ret) {
+            return TIMEOUT;
+        } else {
+            return GetErrorCode(response.status());
+        }
+    }
+    if (bg_error_) {
+        LOG(WARNING, "Close file %s fail", name_.c_str());
+        return TIMEOUT;
+    }
+    return OK;
+}
+
+int64_t EcFileImpl::Seek(int64_t offset, int32_t whence) {
+    if (open_flags_ != O_RDONLY) {
+        if (offset == 0 && whence == SEEK_CUR) {
+            MutexLock lock(&mu_);
+            return write_offset_;
+        }
+        return BAD_PARAMETER;
+    }
+    MutexLock lock(&read_offset_mu_);
+    if (whence == SEEK_SET) {
+        read_offset_ = offset;
+    } else if (whence == SEEK_CUR) {
+        read_offset_ += offset;
+    } else {
+        return BAD_PARAMETER;
+    }
+    return read_offset_;
+}
+
+int32_t EcFileImpl::Read(char* buf, int32_t read_len) {
+    if (open_flags_ != O_RDONLY) {
+        return BAD_PARAMETER;
+    }
+    MutexLock lock(&read_offset_mu_);
+    int32_t ret = Pread(buf, read_len, read_offset_, true);
+    if (ret >= 0) {
+        read_offset_ += ret;
+    }
+    return ret;
+}
+
+int32_t EcFileImpl::Pread(char* buf, int32_t read_len, int64_t offset, bool reada) {
+    if (read_len <= 0 || buf == NULL || offset < 0) {
+        LOG(WARNING, "Pread(%s, %ld, %d), bad parameters!", name_.c_str(), offset, read_len);
+        return BAD_PARAMETER;
+    }
+    if (offset >= file_size_) {
+        return 0;
+    }
+    read_len = std::min(static_cast<int64_t>(read_len), file_size_ - offset);
+    // One task per cell, all cells of the read go out in parallel
+    std::vector<ReadTask> tasks;
+    for (int64_t done = 0; done < read_len; ) {
+        ReadTask task;
+        EcLocate(offset + done, ec_.data_num(), ec_.cell_size(), &task.unit, &task.offset);
+        task.len = std::min(read_len - done, ec_.cell_size() - task.offset % ec_.cell_size());
+        task.buf = buf + done;
+        task.ok = false;
+        tasks.push_back(task);
+        done += task.len;
+    }
+    ReadUnits(&tasks);
+    for (size_t i = 0; i < tasks.size(); i++) {
+        if (!tasks[i].ok && !ReplicaRead(tasks[i]) && !DegradedRead(tasks[i])) {
+            LOG(WARNING, "Pread %s unit %d offset %ld fail, too many units lost",
+                name_.c_str(), tasks[i].unit, tasks[i].offset);
+            return TIMEOUT;
+        }
+    }
+    return read_len;
+}
+
+/// Unit reads of one Pread which are sent but not answered yet
+struct EcFileImpl::ReadBatch {
+    Mutex mu;
+    CondVar cv;
+    int32_t inflight;
+    std::vector<ReadTask>* tasks;
+    ReadBatch(std::vector<ReadTask>* t) : cv(&mu), inflight(0), tasks(t) {}
+};
+
+void EcFileImpl::ReadUnits(std::vector<ReadTask>* tasks) {
+    ReadBatch batch(tasks);
+    for (size_t i = 0; i < tasks->size(); i++) {
+        ReadTask& task = (*tasks)[i];
+        int64_t unit_len = std::max<int64_t>(0, std::min(task.len,
+                                                        units_[task.unit].block_size() - task.offset));
+        memset(task.buf + unit_len, 0, task.len - unit_len);
+        if (unit_len == 0) {
+            task.ok = true;
+            continue;
+        }
+        ChunkServer_Stub* stub = UnitStub(task.unit);
+        if (stub == NULL) {
+            task.ok = false;
+            continue;
+        }
+        ReadBlockRequest* request = new ReadBlockRequest;
+        ReadBlockResponse* response = new ReadBlockResponse;
+        request->set_sequence_id(common::timer::get_micros());
+        request->set_block_id(units_[task.unit].block_id());
+        request->set_offset(task.offset);
+        request->set_read_len(unit_len);
+        {
+            MutexLock lock(&batch.mu);
+            ++batch.inflight;
+        }
+        boost::function<void (const ReadBlockRequest*, ReadBlockResponse*, bool, int)> callback
+            = boost::bind(&EcFileImpl::ReadUnitCallback, this, _1, _2, _3, _4, &batch, i);
+        rpc_client_->AsyncRequest(stub, &ChunkServer_Stub::ReadBlock,
+                                  request, response, callback, 15, 3);
+    }
+    MutexLock lock(&batch.mu);
+    while (batch.inflight > 0) {
+        batch.cv.Wait();
+    }
+}
+
+void EcFileImpl::ReadUnitCallback(const ReadBlockRequest* request,
+                                  ReadBlockResponse* response,
+                                  bool failed, int error,
+                                  ReadBatch* batch, int32_t index) {
+    ReadTask& task = (*batch->tasks)[index];
+    const std::string& databuf = response->databuf();
+    bool ok = !failed && response->status() == kOK
+              && static_cast<int32_t>(databuf.size()) == request->read_len();
+    if (ok) {
+        memcpy(task.buf, databuf.data(), databuf.size());
+    } else {
+        LOG(INFO, "Read %s unit %d #%ld fail, error: %d status: %s", name_.c_str(), task.unit,
+            request->block_id(), error, StatusCode_Name(response->status()).c_str());
+        MutexLock lock(&mu_);
+        bad_units_[task.unit] = true;
+    }
+    MutexLock lock(&batch->mu);
+    task.ok = ok;
+    --batch->inflight;
+    batch->cv.Signal();
+    delete request;
+    delete response;
+}
+
+bool EcFileImpl::ReplicaRead(const ReadTask& task) {
+    std::vector<ReadTask> tasks(1, task);
+    while (true) {
+        {
+            MutexLock lock(&mu_);
+            int32_t unit = task.unit;
+            // Another task of the unit may have moved on to a good replica already
+            if (bad_units_[unit]) {
+                if (unit_replica_[unit] + 1 >= units_[unit].chains_size()) {
+                    return false;
+                }
+                ++unit_replica_[unit];
+                bad_units_[unit] = false;
+            }
+        }
+        tasks[0].ok = false;
+        ReadUnits(&tasks);
+        if (tasks[0].ok) {
+            return true;
+        }
+    }
+}
+
+bool EcFileImpl::DegradedRead(const ReadTask& lost) {
+    if (ec_.parity_num() == 0) {
+        return false;
+    }
+    int32_t data_num = ec_.data_num();
+    std::vector<std::string> units(unit_num_, std::string(lost.len, '\0'));
+    std::vector<bool> alive(unit_num_, false);
+    int32_t got = 0;
+    int32_t next = 0;
+    // Read data_num of the other units, more if some of them fail too
+    while (got < data_num) {
+        std::vector<ReadTask> tasks;
+        for (; next < unit_num_ && got + static_cast<int32_t>(tasks.size()) < data_num; next++) {
+            MutexLock lock(&mu_);
+            if (next != lost.unit && !bad_units_[next]) {
+                ReadTask task = {next, lost.offset, lost.len, &units[next][0], false};
+                tasks.push_back(task);
+            }
+        }
+        if (tasks.empty()) {
+            return false;
+        }
+        ReadUnits(&tasks);
+        for (size_t i = 0; i < tasks.size(); i++) {
+            if (tasks[i].ok) {
+                alive[tasks[i].unit] = true;
+                ++got;
+            }
+        }
+    }
+    std::vector<int32_t> erased;
+    std::vector<char*> ptrs;
+    for (int32_t u = 0; u < unit_num_; u++) {
+        if (!alive[u]) {
+            erased.push_back(u);
+        }
+        ptrs.push_back(&units[u][0]);
+    }
+    if (!codec_.Decode(&ptrs[0], erased, lost.len)) {
+        return false;
+    }
+    memcpy(lost.buf, ptrs[lost.unit], lost.len);
+    return true;
+}
+
+ChunkServer_Stub* EcFileImpl::UnitStub(int32_t unit) {
+    MutexLock lock(&mu_);
+    if (bad_units_[unit]) {
+        return NULL;
+    }
+    if (units_[unit].chains_size() <= unit_replica_[unit]) {
+        bad_units_[unit] = true;
+        return NULL;
+    }
+    const std::string& addr = units_[unit].chains(unit_replica_[unit]).address();
+    ChunkServer_Stub*& stub = read_stubs_[addr];
+    if (stub == NULL && !rpc_client_->GetStub(addr, &stub)) {
+        bad_units_[unit] = true;
+        return NULL;
+    }
+    return stub;
+}
+
+} // namespace bfs
+} // namespace baidu
@@ -0,0 +1,120 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+
+#ifndef  BFS_SDK_EC_FILE_IMPL_H_
+#define  BFS_SDK_EC_FILE_IMPL_H_
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include <common/mutex.h>
+#include <common/thread_pool.h>
+
+#include "proto/nameserver.pb.h"
+#include "proto/chunkserver.pb.h"
+#include "ec/rs_codec.h"
+
+#include "bfs.h"
+
+namespace baidu {
+namespace bfs {
+
+class FSImpl;
+class RpcClient;
+
+/// A Reed-Solomon coded file, see ec/ec_layout.h. Writes go out a stripe at a time,
+/// one packet to every unit, so all units share packet seqs and the block version.
+/// Reads of a lost unit are rebuilt from data_num of the others.
+/// A striped file is a group without parity units whose units are replica chains,
+/// reads of a unit go to its other replicas instead.
+class EcFileImpl : public File {
+public:
+    EcFileImpl(FSImpl* fs, RpcClient* rpc_client, const std::string& name,
+               int32_t flags, const EcLayout& ec, const WriteOptions& options);
+    EcFileImpl(FSImpl* fs, RpcClient* rpc_client, const std::string& name,
+               int32_t flags, const EcLayout& ec, const ReadOptions& options);
+    ~EcFileImpl();
+    int32_t Pread(char* buf, int32_t read_size, int64_t offset, bool reada = false);
+    int64_t Seek(int64_t offset, int32_t whence);
+    int32_t Read(char* buf, int32_t read_size);
+    int32_t Write(const char* buf, int32_t write_size);
+    int32_t Flush();
+    /// Waits for the full stripes, a partial stripe is only written by Close
+    int32_t Sync();
+    int32_t Close();
+    friend class FSImpl;
+private:
+    int32_t AddBlock();
+    /// Encode the buffered stripe and send one packet to every unit
+    void SendStripe(bool is_last);
+    void SendUnitPacket(const WriteBlockRequest* request, int32_t retry_times);
+    void WriteUnitCallback(const WriteBlockRequest* request,
+                           WriteBlockResponse* response,
+                           bool failed, int error,
+                           int32_t retry_times);
+    /// Wait until at most max_inflight packets are unacked
+    bool WaitInflight(int32_t max_inflight);
+
+    struct ReadTask {
+        int32_t unit;
+        int64_t offset;
+        int64_t len;
+        char* buf;
+        bool ok;
+    };
+    struct ReadBatch;
+    /// Read all tasks in parallel, ranges past the end of a unit read as zeros
+    void ReadUnits(std::vector<ReadTask>* tasks);
+    void ReadUnitCallback(const ReadBlockRequest* request,
+                          ReadBlockResponse* response,
+                          bool failed, int error,
+                          ReadBatch* batch, int32_t index);
+    /// Rebuild the range of a lost unit from data_num of the others
+    bool DegradedRead(const ReadTask& task);
+    /// Read the range again from the other replicas of the unit
+    bool ReplicaRead(const ReadTask& task);
+    ChunkServer_Stub* UnitStub(int32_t unit);
+private:
+    FSImpl* fs_;
+    RpcClient* rpc_client_;
+    ThreadPool* thread_pool_;
+    std::string name_;
+    int32_t open_flags_;
+    const EcLayout ec_;
+    RsCodec codec_;
+    int32_t unit_num_;
+
+    /// for write
+    int64_t group_id_;                  ///< block id of unit 0, -1 before AddBlock
+    int32_t replica_num_;               ///< chain length of every unit
+    std::vector<std::string> chains_;   ///< replicas of every unit in turn
+    std::vector<ChunkServer_Stub*> stubs_;  ///< one per unit
+    std::string stripe_buf_;            ///< data of the stripe not sent yet
+    int64_t write_offset_;              ///< file size written so far
+    int64_t unit_offset_;               ///< size of every unit sent so far
+    int32_t last_seq_;
+    int32_t inflight_;                  ///< packets sent but not acked
+    bool bg_error_;
+    const WriteOptions w_options_;
+
+    /// for read
+    std::vector<LocatedBlock> units_;   ///< located blocks of the units
+    std::vector<bool> bad_units_;
+    std::vector<int32_t> unit_replica_; ///< replica of every unit to read from
+    std::map<std::string, ChunkServer_Stub*> read_stubs_;   ///< by address
+    int64_t file_size_;
+    int64_t read_offset_;
+    Mutex read_offset_mu_;
+
+    bool closed_;
+    Mutex mu_;
+    CondVar write_cv_;
+};
+
+} // namespace bfs
+} // namespace baidu
+
+#endif  // BFS_SDK_EC_FILE_IMPL_H_
@@ -20,6 +20,7 @@ DECLARE_int32(sdk_file_reada_len);
 DECLARE_string(sdk_write_mode);
 DECLARE_int32(sdk_createblock_retry);
 DECLARE_int32(sdk_write_retry_times);
+DECLARE_int32(sdk_block_size);
 
 
 namespace baidu {
@@ -28,7 +29,7 @@ namespace bfs {
 WriteBuffer::WriteBuffer(int32_t seq, int32_t buf_size, int64_t block_id, int64_t offset)
     : buf_size_(buf_size), data_size_(0),
       block_id_(block_id), offset_(offset),
-      seq_id_(seq), is_last_(false), refs_(0) {
+      seq_id_(seq), is_last_(false), is_sync_(false), refs_(0) {
     buf_= new char[buf_size];
 }
 WriteBuffer::~WriteBuffer() {
@@ -62,6 +63,12 @@ void WriteBuffer::SetLast() {
 bool WriteBuffer::IsLast() const {
     return is_last_;
 }
+void WriteBuffer::SetSync() {
+    is_sync_ = true;
+}
+bool WriteBuffer::IsSync() const {
+    return is_sync_;
+}
 int64_t WriteBuffer::offset() const {
     return offset_;
 }
@@ -86,13 +93,15 @@ FileImpl::FileImpl(FSImpl* fs, RpcClient* rpc_client,
                    const std::string& name, int32_t flags, const WriteOptions& options)
   : fs_(fs), rpc_client_(rpc_client), name_(name),
     open_flags_(flags), write_offset_(0), block_for_write_(NULL),
-    write_buf_(NULL), last_seq_(-1), back_writing_(0),
+    write_buf_(NULL), last_seq_(-1), version_base_(0), back_writing_(0),
     w_options_(options),
-    chunkserver_(NULL), last_chunkserver_index_(-1),
+    block_limit_(options.block_size > 0 ? options.block_size
+                                        : FLAGS_sdk_block_size * 1024LL * 1024),
+    chunkserver_(NULL), read_block_id_(-1), last_chunkserver_index_(-1),
     read_offset_(0), reada_buffer_(NULL),
     reada_buf_len_(0), reada_base_(0), sequential_ratio_(0),
     last_read_offset_(-1), r_options_(ReadOptions()), closed_(false), synced_(false),
-    sync_signal_(&mu_), bg_error_(false) {
+    durable_offset_(0), sync_signal_(&mu_), bg_error_(false) {
         thread_pool_ = fs->thread_pool_;
 }
 
@@ -100,13 +109,13 @@ FileImpl::FileImpl(FSImpl* fs, RpcClient* rpc_client,
                    const std::string& name, int32_t flags, const ReadOptions& options)
   : fs_(fs), rpc_client_(rpc_client), name_(name),
     open_flags_(flags), write_offset_(0), block_for_write_(NULL),
-    write_buf_(NULL), last_seq_(-1), back_writing_(0),
-    w_options_(WriteOptions()),
-    chunkserver_(NULL), last_chunkserver_index_(-1),
+    write_buf_(NULL), last_seq_(-1), version_base_(0), back_writing_(0),
+    w_options_(WriteOptions()), block_limit_(0),
+    chunkserver_(NULL), read_block_id_(-1), last_chunkserver_index_(-1),
     read_offset_(0), reada_buffer_(NULL),
     reada_buf_len_(0), reada_base_(0), sequential_ratio_(0),
     last_read_offset_(-1), r_options_(options), closed_(false), synced_(false),
-    sync_signal_(&mu_), bg_error_(false) {
+    durable_offset_(0), sync_signal_(&mu_), bg_error_(false) {
         thread_pool_ = fs->thread_pool_;
 }
 
@@ -126,11 +135,6 @@ FileImpl::~FileImpl () {
         delete it->second;
         it->second = NULL;
     }
-    std::set<ChunkServer_Stub*>::iterator bad_cs_it;
-    for (bad_cs_it = bad_chunkservers_.begin();
-            bad_cs_it != bad_chunkservers_.end(); ++bad_cs_it) {
-        delete *bad_cs_it;
-    }
 }
 
 int32_t FileImpl::Pread(char* buf, int32_t read_len, int64_t offset, bool reada) {
@@ -158,25 +162,62 @@ int32_t FileImpl::Pread(char* buf, int32_t read_len, int64_t offset, bool reada)
         }
     }
 
+    int32_t done = 0;
+    while (true) {
+        int64_t block_end = -1;
+        int32_t ret = PreadBlock(buf + done, read_len - done, offset + done, reada, &block_end);
+        if (ret < 0) {
+            return done > 0 ? done : ret;
+        }
+        done += ret;
+        // Go on in the next block only if this one was read to its end
+        if (done == read_len || block_end != offset + done) {
+            break;
+        }
+    }
+    return done;
+}
+
+int32_t FileImpl::PreadBlock(char* buf, int32_t read_len, int64_t offset, bool reada,
+                             int64_t* block_end) {
+    bool located = false;
+    {
+        MutexLock lock(&mu_, "Pread FindBlock", 1000);
+        located = located_blocks_.blocks_.empty() || located_blocks_.FindBlock(offset) >= 0;
+    }
+    if (!located) {
+        int32_t ret = LocateBlocks(offset);
+        if (ret != OK) {
+            return ret;
+        }
+    }
+
     LocatedBlock lcblock;
     ChunkServer_Stub* chunk_server = NULL;
     std::string cs_addr;
     int64_t block_id;
     {
         MutexLock lock(&mu_, "Pread GetStub", 1000);
-        if (located_blocks_.blocks_.empty()) {
+        int32_t index = located_blocks_.FindBlock(offset);
+        if (index < 0) {
             return 0;
-        } else if (located_blocks_.blocks_[0].chains_size() == 0) {
-            if (located_blocks_.blocks_[0].block_size() == 0) {
+        } else if (located_blocks_.blocks_[index].chains_size() == 0) {
+            if (located_blocks_.blocks_[index].block_size() == 0) {
                 return 0;
             } else {
                 LOG(WARNING, "No located chunkserver of block #%ld",
-                    located_blocks_.blocks_[0].block_id());
+                    located_blocks_.blocks_[index].block_id());
                 return TIMEOUT;
             }
         }
-        lcblock.CopyFrom(located_blocks_.blocks_[0]);
-        if (last_chunkserver_index_ == -1 || !chunkserver_) {
+        lcblock.CopyFrom(located_blocks_.blocks_[index]);
+        if (index + 1 < static_cast<int32_t>(located_blocks_.blocks_.size())
+            || located_blocks_.more_blocks_) {
+            *block_end = lcblock.offset() + lcblock.block_size();
+        }
+        if (last_chunkserver_index_ == -1 || !chunkserver_
+            || read_block_id_ != lcblock.block_id()) {
+            last_chunkserver_index_ = -1;
             const std::string& local_host_name = fs_->local_host_name_;
             for (int i = 0; i < lcblock.chains_size(); i++) {
                 std::string addr = lcblock.chains(i).address();
@@ -192,23 +233,30 @@ int32_t FileImpl::Pread(char* buf, int32_t read_len, int64_t offset, bool reada)
                 cs_addr = lcblock.chains(server_index).address();
                 last_chunkserver_index_ = server_index;
             }
-            fs_->rpc_client_->GetStub(cs_addr, &chunkserver_);
+            chunkserver_ = ReadStub(cs_addr);
+            read_block_id_ = lcblock.block_id();
         }
         chunk_server = chunkserver_;
         block_id = lcblock.block_id();
     }
+    if (*block_end >= 0) {
+        read_len = std::min<int64_t>(read_len, *block_end - offset);
+    }
 
     ReadBlockRequest request;
     ReadBlockResponse response;
     request.set_sequence_id(common::timer::get_micros());
     request.set_block_id(block_id);
-    request.set_offset(offset);
+    request.set_offset(offset - lcblock.offset());
     int32_t rlen = read_len;
     if (sequential_ratio_ > 2
         && reada
         && read_len < FLAGS_sdk_file_reada_len) {
         rlen = std::min(static_cast<int64_t>(FLAGS_sdk_file_reada_len),
                         static_cast<int64_t>(sequential_ratio_) * read_len);
+        if (*block_end >= 0) {
+            rlen = std::min<int64_t>(rlen, *block_end - offset);
+        }
         LOG(DEBUG, "Pread(%s, %ld, %d) sequential_ratio_: %d, readahead to %d",
             name_.c_str(), offset, read_len, sequential_ratio_, rlen);
     }
@@ -228,8 +276,7 @@ int32_t FileImpl::Pread(char* buf, int32_t read_len, int64_t offset, bool reada)
                 if (chunk_server != chunkserver_) {
                     chunk_server = chunkserver_;
                 } else {
-                    bad_chunkservers_.insert(chunk_server);
-                    fs_->rpc_client_->GetStub(cs_addr, &chunk_server);
+                    chunk_server = ReadStub(cs_addr);
                     chunkserver_ = chunk_server;
                 }
             }
@@ -267,6 +314,39 @@ int32_t FileImpl::Pread(char* buf, int32_t read_len, int64_t offset, bool reada)
     return ret_len;
 }
 
+int32_t FileImpl::LocateBlocks(int64_t offset) {
+    FileLocationRequest request;
+    FileLocationResponse response;
+    request.set_file_name(name_);
+    request.set_sequence_id(0);
+    request.set_offset(offset);
+    bool ret = fs_->nameserver_client_->SendRequest(&NameServer_Stub::GetFileLocation,
+                                                    &request, &response, 15, 1);
+    if (!ret || response.status() != kOK) {
+        LOG(WARNING, "Locate %s at %ld fail, ret= %d, status= %s",
+            name_.c_str(), offset, ret, StatusCode_Name(response.status()).c_str());
+        if (!ret) {
+            return TIMEOUT;
+        } else {
+            return GetErrorCode(response.status());
+        }
+    }
+    MutexLock lock(&mu_, "LocateBlocks", 1000);
+    located_blocks_.blocks_.clear();
+    located_blocks_.CopyFrom(response.blocks());
+    located_blocks_.more_blocks_ = response.more_blocks();
+    return OK;
+}
+
+ChunkServer_Stub* FileImpl::ReadStub(const std::string& addr) {
+    mu_.AssertHeld();
+    ChunkServer_Stub*& stub = chunkservers_[addr];
+    if (stub == NULL) {
+        rpc_client_->GetStub(addr, &stub);
+    }
+    return stub;
+}
+
 int64_t FileImpl::Seek(int64_t offset, int32_t whence) {
     //printf("Seek[%s:%d:%ld]\n", _name.c_str(), whence, offset);
     if (open_flags_ != O_RDONLY) {
@@ -308,6 +388,14 @@ int32_t FileImpl::AddBlock() {
     request.set_file_name(name_);
     const std::string& local_host_name = fs_->local_host_name_;
     request.set_client_address(local_host_name);
+    if (w_options_.tier_policy != kTierDefault) {
+        request.set_media_policy(static_cast<MediaPolicy>(w_options_.tier_policy));
+    }
+    if (block_for_write_) {
+        request.set_prev_block_id(block_for_write_->block_id());
+        request.set_prev_block_size(block_for_write_->block_size());
+        request.set_prev_block_version(version_base_ + last_seq_);
+    }
     bool ret = fs_->nameserver_client_->SendRequest(&NameServer_Stub::AddBlock,
                                                     &request, &response, 15, 1);
     if (!ret || !response.has_block()) {
@@ -319,11 +407,25 @@ int32_t FileImpl::AddBlock() {
             return GetErrorCode(response.status());
         }
     }
-    block_for_write_ = new LocatedBlock(response.block());
+    LocatedBlock* block = new LocatedBlock(response.block());
+    int32_t open_ret = OpenBlock(block, -1);
+    if (open_ret != OK) {
+        delete block;
+        return open_ret;
+    }
+    delete block_for_write_;
+    block_for_write_ = block;
+    last_seq_ = 0;
+    version_base_ = 0;
+    return OK;
+}
+
+int32_t FileImpl::OpenBlock(LocatedBlock* block, int64_t append_version) {
+    mu_.AssertHeld();
     int cs_size = FLAGS_sdk_write_mode == "chains" ? 1 :
-                                            block_for_write_->chains_size();
+                                            block->chains_size();
     for (int i = 0; i < cs_size; i++) {
-        const std::string& addr = block_for_write_->chains(i).address();
+        const std::string& addr = block->chains(i).address();
         rpc_client_->GetStub(addr, &chunkservers_[addr]);
         write_windows_[addr] = new common::SlidingWindow<int>(100,
                                boost::bind(&FileImpl::OnWriteCommit, _1, _2));
@@ -331,34 +433,52 @@ int32_t FileImpl::AddBlock() {
         WriteBlockRequest create_request;
         int64_t seq = common::timer::get_micros();
         create_request.set_sequence_id(seq);
-        create_request.set_block_id(block_for_write_->block_id());
+        create_request.set_block_id(block->block_id());
         create_request.set_databuf("", 0);
-        create_request.set_offset(0);
         create_request.set_is_last(false);
         create_request.set_packet_seq(0);
+        if (append_version >= 0) {
+            create_request.set_offset(block->block_size());
+            create_request.set_append_version(append_version);
+        } else {
+            create_request.set_offset(0);
+        }
+        if (w_options_.expected_size > 0 && append_version < 0) {
+            create_request.set_expected_size(w_options_.expected_size);
+        }
+        if (w_options_.storage_policy != kStoreOnDisk) {
+            create_request.set_storage_class(
+                static_cast<StorageClass>(w_options_.storage_policy));
+        }
         WriteBlockResponse create_response;
+        bool has_media = block->chains_media_size() == block->chains_size();
         if (FLAGS_sdk_write_mode == "chains") {
-            for (int i = 0; i < block_for_write_->chains_size(); i++) {
-                const std::string& cs_addr = block_for_write_->chains(i).address();
+            for (int i = 0; i < block->chains_size(); i++) {
+                const std::string& cs_addr = block->chains(i).address();
                 create_request.add_chunkservers(cs_addr);
+                if (has_media) {
+                    create_request.add_replica_media(block->chains_media(i));
+                }
             }
+        } else if (has_media) {
+            create_request.add_replica_media(block->chains_media(i));
         }
         bool ret = rpc_client_->SendRequest(chunkservers_[addr],
                                             &ChunkServer_Stub::WriteBlock,
                                             &create_request, &create_response,
                                             25, 1);
         if (!ret || create_response.status() != 0) {
-            LOG(WARNING, "Chunkserver AddBlock fail: %s ret=%d status= %s",
+            LOG(WARNING, "Chunkserver %s block fail: %s ret=%d status= %s",
+                append_version < 0 ? "AddBlock" : "ReopenBlock",
                 name_.c_str(), ret, StatusCode_Name(create_response.status()).c_str());
             for (int j = 0; j <= i; j++) {
-                const std::string& cs_addr = block_for_write_->chains(j).address();
+                const std::string& cs_addr = block->chains(j).address();
                 delete write_windows_[cs_addr];
                 delete chunkservers_[cs_addr];
             }
             write_windows_.clear();
             chunkservers_.clear();
-            delete block_for_write_;
-            block_for_write_ = NULL;
+            cs_errors_.clear();
             if (!ret) {
                 return TIMEOUT;
             } else {
@@ -367,9 +487,79 @@ int32_t FileImpl::AddBlock() {
         }
         write_windows_[addr]->Add(0, 0);
     }
-    last_seq_ = 0;
     return OK;
 }
+
+int32_t FileImpl::ReopenBlock() {
+    mu_.AssertHeld();
+    // Only the last block of a file opened for append is kept without stubs
+    if (!block_for_write_ || block_for_write_->chains_size() == 0
+        || (block_limit_ > 0 && block_for_write_->block_size() >= block_limit_)) {
+        return BAD_PARAMETER;
+    }
+    int32_t ret = OpenBlock(block_for_write_, version_base_);
+    if (ret != OK) {
+        LOG(INFO, "Reopen #%ld of %s fail, append in a new block",
+            block_for_write_->block_id(), name_.c_str());
+        block_for_write_->clear_chains();
+        return ret;
+    }
+    LOG(INFO, "Reopen #%ld V%ld %ld of %s for append", block_for_write_->block_id(),
+        version_base_, block_for_write_->block_size(), name_.c_str());
+    return OK;
+}
+
+int32_t FileImpl::NextBlock() {
+    mu_.AssertHeld();
+    // A block kept from the open for append is sealed already
+    if (block_for_write_ && !chunkservers_.empty()) {
+        SealBlock();
+        if (bg_error_) {
+            return TIMEOUT;
+        }
+        std::map<std::string, common::SlidingWindow<int>* >::iterator w_it;
+        for (w_it = write_windows_.begin(); w_it != write_windows_.end(); ++w_it) {
+            delete w_it->second;
+        }
+        write_windows_.clear();
+        std::map<std::string, ChunkServer_Stub*>::iterator it;
+        for (it = chunkservers_.begin(); it != chunkservers_.end(); ++it) {
+            delete it->second;
+        }
+        chunkservers_.clear();
+        cs_errors_.clear();
+    }
+    int32_t ret = OK;
+    for (int i = 0; i < FLAGS_sdk_createblock_retry; i++) {
+        ret = AddBlock();
+        if (ret == kOK) break;
+        sleep(10);
+    }
+    return ret;
+}
+
+void FileImpl::SealBlock() {
+    mu_.AssertHeld();
+    if (!write_buf_) {
+        write_buf_ = new WriteBuffer(++last_seq_, 32, block_for_write_->block_id(),
+                                     block_for_write_->block_size());
+    }
+    write_buf_->SetLast();
+    if (w_options_.durability == kWriteToDisk) {
+        write_buf_->SetSync();
+    }
+    StartWrite();
+
+    int wait_time = 0;
+    while (back_writing_) {
+        bool finish = sync_signal_.TimeWait(1000, (name_ + " Seal wait").c_str());
+        if (!finish && ++wait_time > 30 && (wait_time %10 == 0)) {
+            LOG(WARNING, "Seal block timeout %d s, %s back_writing_= %d, finish = %d",
+            wait_time, name_.c_str(), back_writing_, finish);
+        }
+    }
+}
+
 int32_t FileImpl::Write(const char* buf, int32_t len) {
     common::timer::AutoTimer at(100, "Write", name_.c_str());
 
@@ -388,11 +578,9 @@ int32_t FileImpl::Write(const char* buf, int32_t len) {
         // Add block
         MutexLock lock(&mu_, "Write AddBlock", 1000);
         if (chunkservers_.empty()) {
-            int ret = 0;
-            for (int i = 0; i < FLAGS_sdk_createblock_retry; i++) {
-                ret = AddBlock();
-                if (ret == kOK) break;
-                sleep(10);
+            int ret = ReopenBlock();
+            if (ret != OK) {
+                ret = NextBlock();
             }
             if (ret != kOK) {
                 LOG(WARNING, "AddBlock fail for %s\n", name_.c_str());
@@ -406,9 +594,32 @@ int32_t FileImpl::Write(const char* buf, int32_t len) {
     while (w < len) {
         MutexLock lock(&mu_, "WriteInternal", 1000);
         if (write_buf_ == NULL) {
-            write_buf_ = new WriteBuffer(++last_seq_, 256*1024,
+            int64_t block_left = block_limit_ - block_for_write_->block_size();
+            if (block_limit_ > 0 && block_left <= 0) {
+                // The block is full, seal it without waiting for this Write itself
+                common::atomic_dec(&back_writing_);
+                int32_t ret = NextBlock();
+                common::atomic_inc(&back_writing_);
+                if (ret != kOK) {
+                    LOG(WARNING, "Roll over to a new block fail for %s\n", name_.c_str());
+                    bg_error_ = true;
+                    common::atomic_add64(&write_offset_, w);
+                    common::atomic_dec(&back_writing_);
+                    return ret;
+                }
+                block_left = block_limit_;
+            }
+            // In wal mode the buffer fits the write exactly, so it's sent at once
+            int32_t buf_size = w_options_.wal_mode ? std::min(len - w, 256*1024) : 256*1024;
+            if (block_limit_ > 0) {
+                buf_size = std::min<int64_t>(buf_size, block_left);
+            }
+            write_buf_ = new WriteBuffer(++last_seq_, buf_size,
                                          block_for_write_->block_id(),
                                          block_for_write_->block_size());
+            if (w_options_.wal_mode && w_options_.durability != kWriteToMemory) {
+                write_buf_->SetSync();
+            }
         }
         if ( (len - w) < write_buf_->Available()) {
             write_buf_->Append(buf+w, len-w);
@@ -500,6 +711,9 @@ void FileImpl::BackgroundWriteInternal() {
             request->set_offset(offset);
             request->set_is_last(buffer->IsLast());
             request->set_packet_seq(buffer->Sequence());
+            if (buffer->IsSync()) {
+                request->set_durability(static_cast<Durability>(w_options_.durability));
+            }
             //request->add_desc("start");
             //request->add_timestamp(common::timer::get_micros());
             if (FLAGS_sdk_write_mode == "chains") {
@@ -664,6 +878,10 @@ void FileImpl::WriteBlockCallbackInternal(const WriteBlockRequest* request,
 
     {
         MutexLock lock(&mu_, "WriteBlockCallback", 1000);
+        if (w_options_.wal_mode) {
+            // Sync may be waiting for a majority of the replicas
+            sync_signal_.Broadcast();
+        }
         if (write_queue_.empty() || bg_error_) {
             common::atomic_dec(&back_writing_);    // for AsyncRequest
             if (back_writing_ == 0) {
@@ -687,7 +905,7 @@ int32_t FileImpl::Flush() {
 }
 int32_t FileImpl::Sync() {
     common::timer::AutoTimer at(50, "Sync", name_.c_str());
-    if (open_flags_ != O_WRONLY) {
+    if (!(open_flags_ & O_WRONLY)) {
         return BAD_PARAMETER;
     }
     MutexLock lock(&mu_, "Sync", 1000);
@@ -695,19 +913,42 @@ int32_t FileImpl::Sync() {
     if (write_buf_ && write_buf_->Size()) {
         StartWrite();
     }
-    int wait_time = 0;
-    while (back_writing_ && !bg_error_ &&
-           (w_options_.sync_timeout < 0 || wait_time < w_options_.sync_timeout)) {
-        bool finish = sync_signal_.TimeWait(100, "Sync wait");
-        wait_time += 100;
-        if (wait_time >= 30000 && (wait_time % 10000 == 0)) {
-            LOG(WARNING, "Sync w_options_.sync_timeout %d ms, %s back_writing_= %d, finish= %d",
-                wait_time, name_.c_str(), back_writing_, finish);
+    if (w_options_.wal_mode && !write_windows_.empty()) {
+        int32_t ret = WaitMajorityAck(last_seq_);
+        if (ret != OK) {
+            return ret;
         }
     }
-    if (bg_error_ || back_writing_) {
-        return TIMEOUT;
+    bool durable = w_options_.wal_mode || w_options_.durability == kWriteToMemory
+                   || !block_for_write_ || sync_offset == durable_offset_;
+    int wait_time = 0;
+    while (!w_options_.wal_mode) {
+        while (back_writing_ && !bg_error_ &&
+               (w_options_.sync_timeout < 0 || wait_time < w_options_.sync_timeout)) {
+            bool finish = sync_signal_.TimeWait(100, "Sync wait");
+            wait_time += 100;
+            if (wait_time >= 30000 && (wait_time % 10000 == 0)) {
+                LOG(WARNING, "Sync w_options_.sync_timeout %d ms, %s back_writing_= %d, finish= %d",
+                    wait_time, name_.c_str(), back_writing_, finish);
+            }
+        }
+        if (bg_error_ || back_writing_) {
+            return TIMEOUT;
+        }
+        if (durable) {
+            break;
+        }
+        // All data is acked, so replicas got it in order. An empty sync
+        // packet asks them to make it durable before acking.
+        if (!write_buf_) {
+            write_buf_ = new WriteBuffer(++last_seq_, 32, block_for_write_->block_id(),
+                                         block_for_write_->block_size());
+        }
+        write_buf_->SetSync();
+        StartWrite();
+        durable = true;
     }
+    durable_offset_ = sync_offset;
     if (block_for_write_ && !bg_error_ && sync_offset && !synced_) {
         SyncBlockRequest request;
         SyncBlockResponse response;
@@ -731,6 +972,32 @@ int32_t FileImpl::Sync() {
     return OK;
 }
 
+int32_t FileImpl::WaitMajorityAck(int32_t seq) {
+    mu_.AssertHeld();
+    // In chains mode the only window is the head's, which acks for the whole chain
+    int32_t majority = write_windows_.size() / 2 + 1;
+    int64_t start = common::timer::get_micros();
+    while (!bg_error_) {
+        int32_t acked = 0;
+        std::map<std::string, common::SlidingWindow<int>* >::iterator it;
+        for (it = write_windows_.begin(); it != write_windows_.end(); ++it) {
+            if (it->second->GetBaseOffset() > seq) {
+                acked++;
+            }
+        }
+        if (acked >= majority) {
+            return OK;
+        }
+        int64_t wait_time = (common::timer::get_micros() - start) / 1000;
+        if (w_options_.sync_timeout >= 0 && wait_time >= w_options_.sync_timeout) {
+            LOG(WARNING, "Sync %s timeout, seq %d acked by %d replicas", name_.c_str(), seq, acked);
+            return TIMEOUT;
+        }
+        sync_signal_.TimeWait(100, "Sync wait majority");
+    }
+    return TIMEOUT;
+}
+
 int32_t FileImpl::Close() {
     common::timer::AutoTimer at(500, "Close", name_.c_str());
     MutexLock lock(&mu_, "Close", 1000);
@@ -739,26 +1006,13 @@ int32_t FileImpl::Close() {
     if (block_for_write_ && (open_flags_ & O_WRONLY)) {
         need_report_finish = true;
         block_id = block_for_write_->block_id();
-        if (!write_buf_) {
-            write_buf_ = new WriteBuffer(++last_seq_, 32, block_id,
-                                         block_for_write_->block_size());
-        }
-        write_buf_->SetLast();
-        StartWrite();
-
-        //common::timer::AutoTimer at(1, "LastWrite", _name.c_str());
-        int wait_time = 0;
-        while (back_writing_) {
-            bool finish = sync_signal_.TimeWait(1000, (name_ + " Close wait").c_str());
-            if (!finish && ++wait_time > 30 && (wait_time %10 == 0)) {
-                LOG(WARNING, "Close timeout %d s, %s back_writing_= %d, finish = %d",
-                wait_time, name_.c_str(), back_writing_, finish);
-            }
+        // No stubs left if rolling over to a new block failed after sealing this one
+        if (!chunkservers_.empty()) {
+            SealBlock();
         }
         delete block_for_write_;
         block_for_write_ = NULL;
     }
-    delete chunkserver_;
     chunkserver_ = NULL;
     LOG(DEBUG, "File %s closed", name_.c_str());
     closed_ = true;
@@ -773,7 +1027,7 @@ int32_t FileImpl::Close() {
         request.set_sequence_id(0);
         request.set_file_name(name_);
         request.set_block_id(block_id);
-        request.set_block_version(last_seq_);
+        request.set_block_version(version_base_ + last_seq_);
         request.set_block_size(write_offset_);
         request.set_close_with_error(bg_error_);
         bool rpc_ret = fs_->nameserver_client_->SendRequest(&NameServer_Stub::FinishBlock,
@@ -38,6 +38,9 @@ public:
     void Clear();
     void SetLast();
     bool IsLast() const;
+    /// Replicas make data up to this buffer durable before acking it
+    void SetSync();
+    bool IsSync() const;
     int64_t offset() const;
     int64_t block_id() const;
     void AddRefBy(int counter);
@@ -51,6 +54,7 @@ private:
     int64_t offset_;
     int32_t seq_id_;
     bool    is_last_;
+    bool    is_sync_;
     volatile int refs_;
 };
 
@@ -60,11 +64,27 @@ class RpcClient;
 struct LocatedBlocks {
     int64_t file_length_;
     std::vector<LocatedBlock> blocks_;
+    bool more_blocks_;                  ///< the file goes on after blocks_
+    LocatedBlocks() : file_length_(0), more_blocks_(false) {}
     void CopyFrom(const ::google::protobuf::RepeatedPtrField<LocatedBlock>& blocks) {
         for (int i = 0; i < blocks.size(); i++) {
             blocks_.push_back(blocks.Get(i));
         }
     }
+    /// Index of the block holding offset, -1 if it's not located
+    int32_t FindBlock(int64_t offset) const {
+        for (size_t i = 0; i < blocks_.size(); i++) {
+            if (i + 1 < blocks_.size() && offset >= blocks_[i + 1].offset()) {
+                continue;
+            }
+            if (offset < blocks_[i].offset() || (i + 1 == blocks_.size() && more_blocks_
+                    && offset >= blocks_[i].offset() + blocks_[i].block_size())) {
+                return -1;
+            }
+            return i;
+        }
+        return -1;
+    }
 };
 
 class FileImpl : public File, public boost::enable_shared_from_this<FileImpl> {
@@ -107,7 +127,18 @@ public:
     friend class FSImpl;
 private:
     int32_t AddBlock();
+    /// Open block on its chunkservers, a sealed block of append_version is reopened
+    /// for append if it is not negative
+    int32_t OpenBlock(LocatedBlock* block, int64_t append_version);
+    /// Reopen the last block of a file opened for append
+    int32_t ReopenBlock();
+    /// Seal the block written so far if any, and go on in a new one
+    int32_t NextBlock();
+    /// Send the last packet of the block and wait for all packets
+    void SealBlock();
     bool CheckWriteWindows();
+    /// Wait until a majority of replicas acked all packets up to seq
+    int32_t WaitMajorityAck(int32_t seq);
     void BackgroundWriteInternal();
     void WriteBlockCallbackInternal(const WriteBlockRequest* request,
                             WriteBlockResponse* response,
@@ -117,6 +148,13 @@ private:
                             std::string cs_addr);
     void DelayWriteChunkInternal(WriteBuffer* buffer, const WriteBlockRequest* request,
                                 int retry_times, std::string cs_addr);
+    /// Read from the block holding offset, block_end is set to the end of a block
+    /// the read may go on after, or -1 for the last one
+    int32_t PreadBlock(char* buf, int32_t read_len, int64_t offset, bool reada,
+                       int64_t* block_end);
+    /// Locate the blocks of the file from the one holding offset on
+    int32_t LocateBlocks(int64_t offset);
+    ChunkServer_Stub* ReadStub(const std::string& addr);
 private:
     FSImpl* fs_;                        ///< 文件系统
     RpcClient* rpc_client_;             ///< RpcClient
@@ -129,17 +167,19 @@ private:
     LocatedBlock* block_for_write_;     ///< 正在写的block
     WriteBuffer* write_buf_;            ///< 本地写缓冲
     int32_t last_seq_;                  ///< last sequence number
+    int64_t version_base_;              ///< version of a reopened block, plus last_seq_
     std::map<std::string, common::SlidingWindow<int>* > write_windows_;
     std::priority_queue<WriteBuffer*, std::vector<WriteBuffer*>, WriteBufferCmp>
         write_queue_;                   ///< Write buffer list
     volatile int back_writing_;         ///< Async write running backgroud
     const WriteOptions w_options_;
+    int64_t block_limit_;               ///< bytes per block, 0 for a single block
 
     /// for read
     LocatedBlocks located_blocks_;      ///< block meta for read
-    ChunkServer_Stub* chunkserver_;     ///< located chunkserver
+    ChunkServer_Stub* chunkserver_;     ///< located chunkserver, owned by chunkservers_
     std::map<std::string, ChunkServer_Stub*> chunkservers_; ///< located chunkservers
-    std::set<ChunkServer_Stub*> bad_chunkservers_;
+    int64_t read_block_id_;             ///< block chunkserver_ was picked for
     int32_t last_chunkserver_index_;
     int64_t read_offset_;               ///< 读取的偏移
     Mutex read_offset_mu_;
@@ -152,6 +192,7 @@ private:
 
     bool closed_;                       ///< 是否关闭
     bool synced_;                     ///< 是否调用过sync
+    int64_t durable_offset_;          ///< data before it has w_options_.durability
     Mutex   mu_;
     CondVar sync_signal_;               ///< _sync_var
     bool bg_error_;                     ///< background write error
@@ -18,15 +18,27 @@
 #include "rpc/rpc_client.h"
 #include "rpc/nameserver_client.h"
 
+#include "ec_file_impl.h"
 #include "file_impl.h"
 #include "file_impl_wrapper.h"
 
 DECLARE_int32(sdk_thread_num);
+DECLARE_int32(sdk_ec_cell_size);
+DECLARE_int32(sdk_stripe_unit_size);
 DECLARE_string(nameserver_nodes);
 
 namespace baidu {
 namespace bfs {
 
+/// A striped file is written and read as a group with no parity units
+static EcLayout StripeGroup(const StripeLayout& stripe) {
+    EcLayout ec;
+    ec.set_data_num(stripe.width());
+    ec.set_parity_num(0);
+    ec.set_cell_size(stripe.unit_size());
+    return ec;
+}
+
 int32_t GetErrorCode(StatusCode stat) {
     if (stat < 100) {
         if (stat == 0) {
@@ -215,6 +227,7 @@ int32_t FSImpl::GetFileSize(const char* path, int64_t* file_size) {
     FileLocationResponse response;
     request.set_file_name(path);
     request.set_sequence_id(0);
+    request.set_block_num(0);
     bool ret = nameserver_client_->SendRequest(&NameServer_Stub::GetFileLocation,
         &request, &response, 15, 1);
     if (!ret || response.status() != kOK) {
@@ -274,6 +287,7 @@ int32_t FSImpl::GetFileLocation(const std::string& path,
     FileLocationResponse response;
     request.set_file_name(path);
     request.set_sequence_id(0);
+    request.set_block_num(0);
     bool ret = nameserver_client_->SendRequest(&NameServer_Stub::GetFileLocation,
                                                &request, &response, 15, 1);
     if (!ret || response.status() != kOK) {
@@ -314,6 +328,16 @@ int32_t FSImpl::OpenFile(const char* path, int32_t flags, int32_t mode,
     request.set_flags(flags);
     request.set_mode(mode&0777);
     request.set_replica_num(options.replica);
+    if (options.ec_data_num > 0) {
+        EcLayout* ec = request.mutable_ec();
+        ec->set_data_num(options.ec_data_num);
+        ec->set_parity_num(options.ec_parity_num);
+        ec->set_cell_size(FLAGS_sdk_ec_cell_size);
+    } else if (options.stripe_width > 1) {
+        StripeLayout* stripe = request.mutable_stripe();
+        stripe->set_width(options.stripe_width);
+        stripe->set_unit_size(FLAGS_sdk_stripe_unit_size);
+    }
     bool rpc_ret = nameserver_client_->SendRequest(&NameServer_Stub::CreateFile,
         &request, &response, 15, 1);
     if (!rpc_ret || response.status() != kOK) {
@@ -324,6 +348,20 @@ int32_t FSImpl::OpenFile(const char* path, int32_t flags, int32_t mode,
         } else {
             ret = GetErrorCode(response.status());
         }
+    } else if (request.has_ec()) {
+        *file = new EcFileImpl(this, rpc_client_, path, flags, request.ec(), options);
+    } else if (request.has_stripe()) {
+        *file = new EcFileImpl(this, rpc_client_, path, flags,
+                               StripeGroup(request.stripe()), options);
+    } else if (response.has_last_block()) {
+        // Appends go on in the last block, or after it if it can't be reopened
+        FileImpl* f = new FileImpl(this, rpc_client_, path, flags, options);
+        f->block_for_write_ = new LocatedBlock(response.last_block());
+        f->version_base_ = response.last_block_version();
+        f->last_seq_ = 0;
+        f->write_offset_ = response.file_size();
+        f->durable_offset_ = response.file_size();
+        *file = new FileImplWrapper(f);
     } else {
         *file = new FileImplWrapper(this, rpc_client_, path, flags, options);
     }
@@ -343,9 +381,24 @@ int32_t FSImpl::OpenFile(const char* path, int32_t flags, File** file, const Rea
     request.set_sequence_id(0);
     bool rpc_ret = nameserver_client_->SendRequest(&NameServer_Stub::GetFileLocation,
         &request, &response, 15, 1);
-    if (rpc_ret && response.status() == kOK) {
+    if (rpc_ret && response.status() == kOK && (response.has_ec() || response.has_stripe())) {
+        EcLayout ec = response.has_ec() ? response.ec() : StripeGroup(response.stripe());
+        EcFileImpl* f = new EcFileImpl(this, rpc_client_, path, flags, ec, options);
+        f->units_.assign(response.blocks().begin(), response.blocks().end());
+        // A group is only allocated by the first write
+        if (!f->units_.empty() && static_cast<int32_t>(f->units_.size()) != f->unit_num_) {
+            LOG(WARNING, "OpenFile %s has %lu of %d units\n", path, f->units_.size(), f->unit_num_);
+            delete f;
+            return GetErrorCode(kNsNotFound);
+        }
+        for (int32_t i = 0; !f->units_.empty() && i < ec.data_num(); i++) {
+            f->file_size_ += f->units_[i].block_size();
+        }
+        *file = f;
+    } else if (rpc_ret && response.status() == kOK) {
         FileImpl* f = new FileImpl(this, rpc_client_, path, flags, options);
         f->located_blocks_.CopyFrom(response.blocks());
+        f->located_blocks_.more_blocks_ = response.more_blocks();
         *file = new FileImplWrapper(f);
     } else {
         LOG(WARNING, "OpenFile return %d, %s\n", ret, StatusCode_Name(response.status()).c_str());
@@ -26,6 +26,7 @@ int32_t GetErrorCode(baidu::bfs::StatusCode stat);
 class FSImpl : public FS {
 public:
     friend class FileImpl;
+    friend class EcFileImpl;
     FSImpl();
     ~FSImpl();
     bool ConnectNameServer(const char* nameserver);
@@ -0,0 +1,329 @@
+// Copyright (c) 2016, Baidu.com, Inc. All Rights Reserved
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+//
+
+#include "sdk/file_impl.h"
+
+#include <fcntl.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <common/atomic.h>
+#include <sofa/pbrpc/pbrpc.h>
+#include <gtest/gtest.h>
+
+#include "proto/nameserver.pb.h"
+#include "proto/chunkserver.pb.h"
+#include "ec/ec_layout.h"
+#include "ec/rs_codec.h"
+#include "sdk/bfs.h"
+
+namespace baidu {
+namespace bfs {
+
+namespace {
+
+const char* kServerAddr = "127.0.0.1:8829";
+/// A chunkserver which lost all its blocks
+const char* kLostAddr = "127.0.0.1:8830";
+
+/// A file of blocks kept in memory, located a page of blocks at a time,
+/// and files with a layout located as a whole
+class FakeNameServer : public NameServer {
+public:
+    FakeNameServer(const std::vector<std::string>* blocks, int32_t page)
+        : blocks_(blocks), page_(page), locate_num_(0) {}
+    void AddFile(const std::string& name, const FileLocationResponse& location) {
+        files_[name] = location;
+    }
+    virtual void GetFileLocation(::google::protobuf::RpcController* controller,
+                                 const FileLocationRequest* request,
+                                 FileLocationResponse* response,
+                                 ::google::protobuf::Closure* done) {
+        common::atomic_inc(&locate_num_);
+        std::map<std::string, FileLocationResponse>::iterator it =
+            files_.find(request->file_name());
+        if (it != files_.end()) {
+            response->CopyFrom(it->second);
+            done->Run();
+            return;
+        }
+        int32_t block_num = page_;
+        if (request->block_num() > 0 && request->block_num() < block_num) {
+            block_num = request->block_num();
+        }
+        int64_t offset = 0;
+        for (size_t i = 0; i < blocks_->size(); i++) {
+            int64_t size = (*blocks_)[i].size();
+            if (request->offset() < offset + size || i + 1 == blocks_->size()) {
+                if (response->blocks_size() == block_num) {
+                    response->set_more_blocks(true);
+                    break;
+                }
+                LocatedBlock* block = response->add_blocks();
+                block->set_block_id(i);
+                block->set_offset(offset);
+                block->set_block_size(size);
+                block->add_chains()->set_address(kServerAddr);
+            }
+            offset += size;
+        }
+        response->set_status(kOK);
+        done->Run();
+    }
+    int LocateNum() const {
+        return locate_num_;
+    }
+private:
+    const std::vector<std::string>* blocks_;
+    int32_t page_;
+    volatile int locate_num_;
+    std::map<std::string, FileLocationResponse> files_;
+};
+
+class FakeChunkServer : public ChunkServer {
+public:
+    void AddBlock(int64_t block_id, const std::string& data) {
+        blocks_[block_id] = data;
+    }
+    virtual void ReadBlock(::google::protobuf::RpcController* controller,
+                           const ReadBlockRequest* request,
+                           ReadBlockResponse* response,
+                           ::google::protobuf::Closure* done) {
+        std::map<int64_t, std::string>::iterator it = blocks_.find(request->block_id());
+        if (it == blocks_.end()) {
+            response->set_status(kCsNotFound);
+        } else {
+            const std::string& data = it->second;
+            int64_t offset = std::min<int64_t>(request->offset(), data.size());
+            response->set_databuf(data.substr(offset, request->read_len()));
+            response->set_status(kOK);
+        }
+        done->Run();
+    }
+private:
+    std::map<int64_t, std::string> blocks_;
+};
+
+} // namespace
+
+class FileImplTest : public ::testing::Test {
+protected:
+    static void SetUpTestCase() {
+        blocks_.push_back("0123456789");
+        blocks_.push_back("abcdefghij");
+        blocks_.push_back("ABCDEF");
+        nameserver_ = new FakeNameServer(&blocks_, 2);
+        chunkserver_ = new FakeChunkServer;
+        for (size_t i = 0; i < blocks_.size(); i++) {
+            chunkserver_->AddBlock(i, blocks_[i]);
+        }
+        lost_chunkserver_ = new FakeChunkServer;
+        sofa::pbrpc::RpcServerOptions options;
+        server_ = new sofa::pbrpc::RpcServer(options);
+        ASSERT_TRUE(server_->RegisterService(nameserver_, false));
+        ASSERT_TRUE(server_->RegisterService(chunkserver_, false));
+        ASSERT_TRUE(server_->Start(kServerAddr));
+        lost_server_ = new sofa::pbrpc::RpcServer(options);
+        ASSERT_TRUE(lost_server_->RegisterService(lost_chunkserver_, false));
+        ASSERT_TRUE(lost_server_->Start(kLostAddr));
+        ASSERT_TRUE(FS::OpenFileSystem(kServerAddr, &fs_, FSOptions()));
+    }
+    static void TearDownTestCase() {
+        delete fs_;
+        server_->Stop();
+        lost_server_->Stop();
+        delete server_;
+        delete lost_server_;
+        delete chunkserver_;
+        delete lost_chunkserver_;
+        delete nameserver_;
+    }
+    /// A file of one group from group_id laid out as ec, unit i on the chunkservers of
+    /// chains[i]. A striped file is a group with no parity.
+    static void AddGroupFile(const std::string& name, const std::string& data,
+                             int64_t group_id, const EcLayout& ec, bool striped,
+                             const std::vector<std::vector<std::string> >& chains) {
+        int32_t data_num = ec.data_num();
+        int32_t unit_num = data_num + ec.parity_num();
+        int64_t unit_len = EcUnitSize(data.size(), data_num, ec.cell_size(), 0);
+        std::vector<std::string> units(unit_num, std::string(unit_len, '\0'));
+        for (size_t offset = 0; offset < data.size(); offset++) {
+            int32_t unit = 0;
+            int64_t unit_offset = 0;
+            EcLocate(offset, data_num, ec.cell_size(), &unit, &unit_offset);
+            units[unit][unit_offset] = data[offset];
+        }
+        if (ec.parity_num() > 0) {
+            std::vector<const char*> data_units;
+            std::vector<char*> parity_units;
+            for (int32_t i = 0; i < unit_num; i++) {
+                if (i < data_num) {
+                    data_units.push_back(units[i].data());
+                } else {
+                    parity_units.push_back(&units[i][0]);
+                }
+            }
+            RsCodec(data_num, ec.parity_num()).Encode(&data_units[0], &parity_units[0],
+                                                       unit_len);
+        }
+        FileLocationResponse location;
+        location.set_status(kOK);
+        if (striped) {
+            location.mutable_stripe()->set_width(data_num);
+            location.mutable_stripe()->set_unit_size(ec.cell_size());
+        } else {
+            location.mutable_ec()->CopyFrom(ec);
+        }
+        for (int32_t i = 0; i < unit_num; i++) {
+            units[i].resize(EcUnitSize(data.size(), data_num, ec.cell_size(), i));
+            LocatedBlock* block = location.add_blocks();
+            block->set_block_id(group_id + i);
+            block->set_block_size(units[i].size());
+            for (size_t j = 0; j < chains[i].size(); j++) {
+                block->add_chains()->set_address(chains[i][j]);
+            }
+            chunkserver_->AddBlock(group_id + i, units[i]);
+        }
+        nameserver_->AddFile(name, location);
+    }
+    std::string Pread(File* file, int32_t len, int64_t offset) {
+        std::string buf(len, '\0');
+        int32_t ret = file->Pread(&buf[0], len, offset);
+        return ret < 0 ? "" : buf.substr(0, ret);
+    }
+    static std::vector<std::string> blocks_;
+    static FakeNameServer* nameserver_;
+    static FakeChunkServer* chunkserver_;
+    static FakeChunkServer* lost_chunkserver_;
+    static sofa::pbrpc::RpcServer* server_;
+    static sofa::pbrpc::RpcServer* lost_server_;
+    static FS* fs_;
+};
+
+std::vector<std::string> FileImplTest::blocks_;
+FakeNameServer* FileImplTest::nameserver_ = NULL;
+FakeChunkServer* FileImplTest::chunkserver_ = NULL;
+FakeChunkServer* FileImplTest::lost_chunkserver_ = NULL;
+sofa::pbrpc::RpcServer* FileImplTest::server_ = NULL;
+sofa::pbrpc::RpcServer* FileImplTest::lost_server_ = NULL;
+FS* FileImplTest::fs_ = NULL;
+
+TEST_F(FileImplTest, FindBlock) {
+    LocatedBlocks located;
+    ASSERT_EQ(-1, located.FindBlock(0));
+    for (int i = 0; i < 2; i++) {
+        LocatedBlock block;
+        block.set_block_id(i + 1);
+        block.set_offset(100 + i * 10);
+        block.set_block_size(10);
+        located.blocks_.push_back(block);
+    }
+    ASSERT_EQ(-1, located.FindBlock(99));
+    ASSERT_EQ(0, located.FindBlock(100));
+    ASSERT_EQ(0, located.FindBlock(109));
+    ASSERT_EQ(1, located.FindBlock(110));
+    // The last block of the file takes whatever was written after it was located
+    ASSERT_EQ(1, located.FindBlock(125));
+    located.more_blocks_ = true;
+    ASSERT_EQ(1, located.FindBlock(119));
+    ASSERT_EQ(-1, located.FindBlock(120));
+}
+
+TEST_F(FileImplTest, PreadAcrossBlocks) {
+    File* file = NULL;
+    ASSERT_EQ(OK, fs_->OpenFile("/pread", O_RDONLY, &file, ReadOptions()));
+    int locate_num = nameserver_->LocateNum();
+    ASSERT_EQ("56789abcde", Pread(file, 10, 5));
+    ASSERT_EQ(locate_num, nameserver_->LocateNum());
+    // The third block was not in the first page of blocks
+    ASSERT_EQ("fghijABCD", Pread(file, 9, 15));
+    ASSERT_EQ(locate_num + 1, nameserver_->LocateNum());
+    ASSERT_EQ("0123456789abcdefghijABCDEF", Pread(file, 100, 0));
+    ASSERT_EQ("EF", Pread(file, 100, 24));
+    ASSERT_EQ("", Pread(file, 100, 26));
+    delete file;
+}
+
+TEST_F(FileImplTest, ReadAcrossBlocks) {
+    File* file = NULL;
+    ASSERT_EQ(OK, fs_->OpenFile("/read", O_RDONLY, &file, ReadOptions()));
+    std::string data;
+    char buf[7];
+    int32_t ret = 0;
+    while ((ret = file->Read(buf, sizeof(buf))) > 0) {
+        data.append(buf, ret);
+    }
+    ASSERT_EQ(0, ret);
+    ASSERT_EQ("0123456789abcdefghijABCDEF", data);
+    delete file;
+}
+
+TEST_F(FileImplTest, StripedReplicaRead) {
+    const std::string data = "0123456789abcdefghijABCDEF";
+    // Unit 0 is read from its second replica, the first one lost it
+    std::vector<std::vector<std::string> > chains(2);
+    chains[0].push_back(kLostAddr);
+    chains[0].push_back(kServerAddr);
+    chains[1].push_back(kServerAddr);
+    EcLayout stripe;
+    stripe.set_data_num(2);
+    stripe.set_parity_num(0);
+    stripe.set_cell_size(4);
+    AddGroupFile("/stripe", data, 10, stripe, true, chains);
+    File* file = NULL;
+    ASSERT_EQ(OK, fs_->OpenFile("/stripe", O_RDONLY, &file, ReadOptions()));
+    ASSERT_EQ(data, Pread(file, 100, 0));
+    ASSERT_EQ("3456789a", Pread(file, 8, 3));
+    ASSERT_EQ("EF", Pread(file, 100, 24));
+    delete file;
+
+    // No replica of unit 1 left, and no parity to rebuild it from
+    chains[1][0] = kLostAddr;
+    AddGroupFile("/lost_stripe", data, 20, stripe, true, chains);
+    ASSERT_EQ(OK, fs_->OpenFile("/lost_stripe", O_RDONLY, &file, ReadOptions()));
+    ASSERT_EQ("0123", Pread(file, 4, 0));
+    std::string buf(8, '\0');
+    ASSERT_EQ(TIMEOUT, file->Pread(&buf[0], 8, 0));
+    delete file;
+}
+
+TEST_F(FileImplTest, EcDegradedRead) {
+    const std::string data = "0123456789abcdefghijABCDEFGHIJklmnopqrstKLMNOPQRST!";
+    EcLayout ec;
+    ec.set_data_num(3);
+    ec.set_parity_num(2);
+    ec.set_cell_size(8);
+    // Data unit 0 and parity unit 3 are lost, they are rebuilt from the other three
+    std::vector<std::vector<std::string> > chains(5, std::vector<std::string>(1, kServerAddr));
+    chains[0][0] = kLostAddr;
+    chains[3][0] = kLostAddr;
+    AddGroupFile("/ec", data, 30, ec, false, chains);
+    File* file = NULL;
+    ASSERT_EQ(OK, fs_->OpenFile("/ec", O_RDONLY, &file, ReadOptions()));
+    ASSERT_EQ(data, Pread(file, 100, 0));
+    ASSERT_EQ("34567", Pread(file, 5, 3));
+    // Only unit 0 has data in the last stripe, the others are read as zeros
+    ASSERT_EQ(data.substr(45), Pread(file, 100, 45));
+    delete file;
+
+    // A third lost unit is more than the parity can make up for
+    chains[4][0] = kLostAddr;
+    AddGroupFile("/lost_ec", data, 40, ec, false, chains);
+    ASSERT_EQ(OK, fs_->OpenFile("/lost_ec", O_RDONLY, &file, ReadOptions()));
+    ASSERT_EQ("89abcdef", Pread(file, 8, 8));
+    std::string buf(16, '\0');
+    ASSERT_EQ(TIMEOUT, file->Pread(&buf[0], 16, 0));
+    delete file;
+}
+
+} // namespace bfs
+} // namespace baidu
+
+int main(int argc, char** argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
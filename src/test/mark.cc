@@ -23,6 +23,7 @@ DEFINE_int32(seed, 301, "random seed");
 DEFINE_int64(file_size, 1024, "file size in KB");
 DEFINE_string(folder, "test", "write data to which folder");
 DEFINE_bool(break_on_failure, true, "exit when error occurs");
+DEFINE_int32(stripe_width, 0, "put files striped over this many blocks, 0 for no striping");
 
 namespace baidu {
 namespace bfs {
@@ -74,7 +75,9 @@ bool Mark::FinishPut(File* file, int thread_id) {
 
 void Mark::Put(const std::string& filename, const std::string& base, int thread_id) {
     File* file;
-    if (OK != fs_->OpenFile(filename.c_str(), O_WRONLY | O_TRUNC, 664, &file, WriteOptions())) {
+    WriteOptions options;
+    options.stripe_width = FLAGS_stripe_width;
+    if (OK != fs_->OpenFile(filename.c_str(), O_WRONLY | O_TRUNC, 664, &file, options)) {
         if (FLAGS_break_on_failure) {
             std::cerr << "OpenFile failed " << filename << std::endl;
             exit(EXIT_FAILURE);
@@ -102,6 +105,7 @@ void Mark::Put(const std::string& filename, const std::string& base, int thread_
             }
         }
         len += write_len;
+        byte_counter_.Add(write_len);
     }
     if (!FinishPut(file, thread_id)) {
         if (FLAGS_break_on_failure) {
@@ -172,6 +176,7 @@ void Mark::Read(const std::string& filename, const std::string& base, int thread
             }
         }
         bytes += len;
+        byte_counter_.Add(len);
     }
     BfsFileInfo info;
     fs_->Stat(filename.c_str(), &info);
@@ -238,10 +243,12 @@ void Mark::ReadWrapper(int thread_id) {
 
 void Mark::PrintStat() {
     std::cout << "Put\t" << put_counter_.Get() << "\tDel\t" << del_counter_.Get()
-              << "\tRead\t" << read_counter_.Get() << "\tAll\t" << all_counter_.Get() << std::endl;
+              << "\tRead\t" << read_counter_.Get() << "\tAll\t" << all_counter_.Get()
+              << "\tMB/s\t" << (byte_counter_.Get() >> 20) << std::endl;
     put_counter_.Set(0);
     del_counter_.Set(0);
     read_counter_.Set(0);
+    byte_counter_.Set(0);
     thread_pool_->DelayTask(1000, boost::bind(&Mark::PrintStat, this));
 }
 
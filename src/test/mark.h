@@ -32,6 +32,7 @@ private:
     common::Counter del_counter_;
     common::Counter read_counter_;
     common::Counter all_counter_;
+    common::Counter byte_counter_;      ///< bytes put or read in the last second
     common::ThreadPool* thread_pool_;
     Random** rand_;
     int64_t file_size_;
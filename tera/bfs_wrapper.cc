@@ -18,35 +18,35 @@ DECLARE_string(nameserver_nodes);
 DECLARE_string(bfs_log);
 DECLARE_int32(bfs_log_size);
 DECLARE_int32(bfs_log_limit);
+DECLARE_string(tera_wal_suffix);
 
 namespace baidu {
 namespace bfs {
 
 int32_t BfsFile::Write(const char* buf, int32_t len) {
-    common::timer::AutoTimer ac;
+    common::timer::AutoTimer ac(10, "Write", _name.c_str());
     int ret = _file->Write(buf, len);
-    LOG(INFO, "Write(%s, len: %d) return %d use %.3f ms",
-        _name.c_str(), len, ret, ac.TimeUsed() / 1000.0);
     if (ret != len) {
-        LOG(INFO, "Write(%s, len: %d) return %d",
+        LOG(WARNING, "Write(%s, len: %d) return %d",
             _name.c_str(), len, ret);
     }
     return ret;
 }
 
 int32_t BfsFile::Flush() {
-    common::timer::AutoTimer ac;
+    common::timer::AutoTimer ac(10, "Flush", _name.c_str());
     int ret = _file->Flush();
-    LOG(INFO, "Flush(%s) return %d use %.3f ms",
-            _name.c_str(), ret, ac.TimeUsed() / 1000.0);
+    if (ret != 0) {
+        LOG(WARNING, "Flush(%s) return %d", _name.c_str(), ret);
+    }
     return ret;
 }
 int32_t BfsFile::Sync() {
-    LOG(INFO, "Sync(%s) start", _name.c_str());
-    common::timer::AutoTimer ac;
+    common::timer::AutoTimer ac(50, "Sync", _name.c_str());
     int ret = _file->Sync();
-    LOG(INFO, "Sync(%s) return %d usd %.3f ms",
-            _name.c_str(), ret, ac.TimeUsed() / 1000.0);
+    if (ret != 0) {
+        LOG(WARNING, "Sync(%s) return %d", _name.c_str(), ret);
+    }
     return ret;
 }
 int32_t BfsFile::Read(char* buf, int32_t len) {
@@ -206,7 +206,13 @@ leveldb::DfsFile* BfsImpl::OpenFile(const std::string& filename, int32_t flags)
     bfs::File* file = NULL;
     int ret = -1;
     if (leveldb::WRONLY == flags) {
-        ret = _fs->OpenFile(filename.c_str(), O_WRONLY, &file, WriteOptions());
+        WriteOptions options;
+        const std::string& suffix = FLAGS_tera_wal_suffix;
+        if (!suffix.empty() && filename.size() >= suffix.size()
+            && filename.compare(filename.size() - suffix.size(), suffix.size(), suffix) == 0) {
+            options.wal_mode = true;
+        }
+        ret = _fs->OpenFile(filename.c_str(), O_WRONLY, &file, options);
     } else {
         ret = _fs->OpenFile(filename.c_str(), O_RDONLY, &file, ReadOptions());
     }